@@ -0,0 +1,1182 @@
+/*
+ * bench.c - Micro-benchmarks for the tree data structures
+ *
+ * Build and run with `make bench`. Every benchmark builds its own synthetic
+ * tree so results do not depend on animals.dat.
+ *
+ * Usage: ./run_bench [name] [nodes]
+ *   name  - run only the benchmark with this name (default: all)
+ *   nodes - approximate tree size (default: 1000000)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "lab5.h"
+
+static int bench_failed;  /* a bench found a limit broken */
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Build a complete tree of n nodes (n odd) with either allocator.
+ * Nodes are created in BFS order, the same pattern load_tree follows.
+ */
+static Node *build_tree(int n, NodeArena *arena) {
+    Node **nodes = malloc(n * sizeof(Node *));
+    char text[64];
+    for (int i = 0; i < n; i++) {
+        int isQuestion = 2 * i + 2 < n;
+        if (isQuestion) {
+            snprintf(text, sizeof(text), "Does it have property number %d?", i);
+        } else {
+            snprintf(text, sizeof(text), "Animal %d", i);
+        }
+        if (arena != NULL) {
+            nodes[i] = isQuestion ? arena_question_node(arena, text) : arena_animal_node(arena, text);
+        } else {
+            nodes[i] = isQuestion ? create_question_node(text) : create_animal_node(text);
+        }
+    }
+    for (int i = 0; 2 * i + 2 < n; i++) {
+        nodes[i]->yes = nodes[2 * i + 1];
+        nodes[i]->no = nodes[2 * i + 2];
+    }
+    Node *root = nodes[0];
+    free(nodes);
+    return root;
+}
+
+/* Arena vs malloc: build (load pattern) and teardown */
+static void bench_arena(int n) {
+    printf("arena: %d nodes\n", n);
+
+    double t0 = now_sec();
+    Node *root = build_tree(n, NULL);
+    double t1 = now_sec();
+    free_tree(root);
+    double t2 = now_sec();
+    printf("  malloc build  %8.3f s   free_tree      %8.3f s\n", t1 - t0, t2 - t1);
+
+    NodeArena arena;
+    arena_init(&arena);
+    t0 = now_sec();
+    root = build_tree(n, &arena);
+    t1 = now_sec();
+    arena_release(&arena);
+    t2 = now_sec();
+    printf("  arena build   %8.3f s   arena_release  %8.3f s\n", t1 - t0, t2 - t1);
+
+    /* Real load paths: VERSION 1 records into the arena, VERSION 2 mapped.
+     * g_arena takes ownership; the local arena stays empty for replace_tree. */
+    arena_init(&g_arena);
+    g_root = build_tree(n, &g_arena);
+    save_tree_v1("bench.dat");
+    save_tree("bench2.dat");
+    t0 = now_sec();
+    load_tree("bench.dat");
+    t1 = now_sec();
+    replace_tree(NULL, &arena);
+    t2 = now_sec();
+    printf("  load_tree v1  %8.3f s   drop tree      %8.3f s\n", t1 - t0, t2 - t1);
+    t0 = now_sec();
+    load_tree("bench2.dat");
+    t1 = now_sec();
+    replace_tree(NULL, &arena);
+    t2 = now_sec();
+    printf("  load_tree v2  %8.3f s   drop tree      %8.3f s\n", t1 - t0, t2 - t1);
+    remove("bench.dat");
+    remove("bench2.dat");
+}
+
+/* Pointer tree vs flat struct-of-arrays: traversal, count and integrity */
+static void bench_flat(int n) {
+    printf("flat: %d nodes\n", n);
+    NodeArena arena;
+    arena_init(&arena);
+    Node *root = build_tree(n, &arena);
+    FlatTree ft;
+    flat_from_tree(&ft, root);
+
+    /* Random answer sequences, long enough to reach a leaf */
+    enum { GAMES = 1000000, DEPTH = 64 };
+    uint8_t *answers = malloc(GAMES * DEPTH);
+    srand(312);
+    for (int i = 0; i < GAMES * DEPTH; i++) answers[i] = rand() & 1;
+
+    double t0 = now_sec();
+    size_t sink = 0;
+    for (int g = 0; g < GAMES; g++) {
+        Node *node = root;
+        const uint8_t *a = answers + (size_t)g * DEPTH;
+        for (int k = 0; node->isQuestion; k++) node = a[k] ? node->yes : node->no;
+        sink += (size_t)node->text[0];
+    }
+    double t1 = now_sec();
+    for (int g = 0; g < GAMES; g++) {
+        sink += ft.text[flat_traverse(&ft, answers + (size_t)g * DEPTH, DEPTH)];
+    }
+    double t2 = now_sec();
+    printf("  traverse x%d  pointer %8.3f s   flat %8.3f s\n", GAMES, t1 - t0, t2 - t1);
+
+    t0 = now_sec();
+    sink += count_nodes(root);
+    t1 = now_sec();
+    sink += flat_count_nodes(&ft, 0);
+    t2 = now_sec();
+    printf("  count_nodes        pointer %8.3f s   flat %8.3f s\n", t1 - t0, t2 - t1);
+
+    g_root = root;
+    t0 = now_sec();
+    sink += check_integrity();
+    t1 = now_sec();
+    sink += flat_check_integrity(&ft);
+    t2 = now_sec();
+    printf("  check_integrity    pointer %8.3f s   flat %8.3f s\n", t1 - t0, t2 - t1);
+    printf("  (checksum %zu)\n", sink);
+
+    g_root = NULL;
+    free(answers);
+    flat_free(&ft);
+    arena_release(&arena);
+}
+
+/* The malloc-per-element linked queue that Queue used to be */
+typedef struct LinkedItem {
+    Node *treeNode;
+    int id;
+    struct LinkedItem *next;
+} LinkedItem;
+
+static size_t bfs_linked(Node *root) {
+    LinkedItem *front = malloc(sizeof(LinkedItem)), *rear = front;
+    front->treeNode = root;
+    front->id = 0;
+    front->next = NULL;
+    size_t visited = 0;
+    while (front != NULL) {
+        LinkedItem *item = front;
+        Node *node = item->treeNode;
+        front = item->next;
+        if (front == NULL) rear = NULL;
+        free(item);
+        visited++;
+        Node *kids[2] = {node->yes, node->no};
+        for (int k = 0; k < 2; k++) {
+            if (kids[k] == NULL) continue;
+            LinkedItem *add = malloc(sizeof(LinkedItem));
+            add->treeNode = kids[k];
+            add->id = (int)visited;
+            add->next = NULL;
+            if (rear == NULL) front = add; else rear->next = add;
+            rear = add;
+        }
+    }
+    return visited;
+}
+
+static size_t bfs_ring(Queue *q, Node *root) {
+    q_clear(q);
+    q_enqueue(q, root, 0);
+    size_t visited = 0;
+    Node *node;
+    int id;
+    while (q_dequeue(q, &node, &id)) {
+        visited++;
+        if (node->yes != NULL) q_enqueue(q, node->yes, (int)visited);
+        if (node->no != NULL) q_enqueue(q, node->no, (int)visited);
+    }
+    return visited;
+}
+
+/* One full BFS pass, as in save_tree/check_integrity */
+static void bench_queue(int n) {
+    printf("queue: %d nodes\n", n);
+    NodeArena arena;
+    arena_init(&arena);
+    Node *root = build_tree(n, &arena);
+
+    double t0 = now_sec();
+    size_t a = bfs_linked(root);
+    double t1 = now_sec();
+    Queue q;
+    q_init(&q);
+    size_t b = bfs_ring(&q, root);
+    double t2 = now_sec();
+    size_t c = bfs_ring(&q, root);  // second pass reuses the grown buffer
+    double t3 = now_sec();
+    printf("  linked %8.3f s   ring %8.3f s   ring (reused) %8.3f s   [%zu/%zu/%zu]\n",
+           t1 - t0, t2 - t1, t3 - t2, a, b, c);
+
+    q_free(&q);
+    arena_release(&arena);
+}
+
+static long file_size(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) return 0;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+/* save_tree with the attribute index stored, as with --index */
+static int save_tree_indexed(const char *filename) {
+    save_set_index(1);
+    int ok = save_tree(filename);
+    save_set_index(0);
+    return ok;
+}
+
+/* save_tree throughput */
+static void bench_save(int n) {
+    printf("save: %d nodes (loads use up to %ld cpus)\n", n, sysconf(_SC_NPROCESSORS_ONLN));
+    NodeArena arena;
+    arena_init(&arena);
+
+    int (*savers[4])(const char *) = {save_tree_v1, save_tree, save_tree_indexed, save_tree_v3};
+    const char *names[4] = {"save_tree_v1", "save_tree   ", "  +index    ", "save_tree_v3"};
+    for (int i = 0; i < 4; i++) {
+        g_root = build_tree(n, &arena);
+        double t0 = now_sec();
+        int ok = savers[i]("bench.dat");
+        double t1 = now_sec();
+        double mb = file_size("bench.dat") / 1e6;
+        printf("  %s  %8.3f s   %7.1f MB   %.0f MB/s%s\n", names[i], t1 - t0, mb, mb / (t1 - t0),
+               ok ? "" : "   (FAILED)");
+        g_root = NULL;
+        arena_release(&arena);
+        // Loading replaces g_arena's tree, index included
+        t0 = now_sec();
+        ok = load_tree("bench.dat");
+        t1 = now_sec();
+        printf("    load_tree   %8.3f s%s\n", t1 - t0, ok ? "" : "   (FAILED)");
+        NodeArena empty;
+        arena_init(&empty);
+        replace_tree(NULL, &empty);
+    }
+
+    // Every save is synced and renamed into place; kept generations add a
+    // hard link and a rename each
+    g_root = build_tree(n, &arena);
+    for (int keep = 0; keep <= SAVE_GENERATIONS_DEFAULT; keep += SAVE_GENERATIONS_DEFAULT) {
+        save_set_generations(keep);
+        double t0 = now_sec();
+        for (int r = 0; r < 3; r++) save_tree("bench.dat");
+        double t1 = now_sec();
+        printf("  save_tree, %d generations kept  %8.3f s\n", keep, (t1 - t0) / 3);
+    }
+    save_set_generations(0);
+    g_root = NULL;
+    arena_release(&arena);
+    remove("bench.dat");
+    remove("bench.dat.1");
+    remove("bench.dat.2");
+}
+
+/* The separately chained hash table that Hash used to be */
+typedef struct ChainEntry {
+    char *key;
+    int id;
+    struct ChainEntry *next;
+} ChainEntry;
+
+typedef struct {
+    ChainEntry **buckets;
+    int nbuckets;
+} ChainHash;
+
+static unsigned djb2(const char *s) {
+    unsigned hash = 5381;
+    for (size_t i = 0; i < strlen(s); i++) hash = ((hash << 5) + hash) + (unsigned char)s[i];
+    return hash;
+}
+
+static void chain_put(ChainHash *h, const char *key, int id) {
+    int idx = djb2(key) % h->nbuckets;
+    for (ChainEntry *e = h->buckets[idx]; e != NULL; e = e->next) {
+        if (!strcmp(e->key, key)) return;
+    }
+    ChainEntry *e = malloc(sizeof(ChainEntry));
+    e->key = strdup(key);
+    e->id = id;
+    e->next = h->buckets[idx];
+    h->buckets[idx] = e;
+}
+
+static int chain_contains(const ChainHash *h, const char *key) {
+    for (ChainEntry *e = h->buckets[djb2(key) % h->nbuckets]; e != NULL; e = e->next) {
+        if (!strcmp(e->key, key)) return 1;
+    }
+    return 0;
+}
+
+static void chain_free(ChainHash *h) {
+    for (int i = 0; i < h->nbuckets; i++) {
+        ChainEntry *e = h->buckets[i];
+        while (e != NULL) {
+            ChainEntry *next = e->next;
+            free(e->key);
+            free(e);
+            e = next;
+        }
+    }
+    free(h->buckets);
+}
+
+static char **make_keys(int n) {
+    char **keys = malloc(n * sizeof(char *));
+    char text[64];
+    for (int i = 0; i < n; i++) {
+        snprintf(text, sizeof(text), "does_it_have_property_number_%d", i);
+        keys[i] = strdup(text);
+    }
+    return keys;
+}
+
+/* Random lookup order, so neither table benefits from keys that were
+ * allocated back to back in insertion order */
+static int *shuffled(int n) {
+    int *order = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) order[i] = i;
+    srand(312);
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)(((unsigned long)rand() * RAND_MAX + rand()) % (i + 1));
+        int t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+    return order;
+}
+
+static void free_keys(char **keys, int n) {
+    for (int i = 0; i < n; i++) free(keys[i]);
+    free(keys);
+}
+
+static void bench_chain(char **keys, int n, int nbuckets) {
+    ChainHash ch = {calloc(nbuckets, sizeof(ChainEntry *)), nbuckets};
+    int *order = shuffled(n);
+    double t0 = now_sec();
+    for (int i = 0; i < n; i++) chain_put(&ch, keys[i], i);
+    double t1 = now_sec();
+    int found = 0;
+    for (int i = 0; i < n; i++) found += chain_contains(&ch, keys[order[i]]);
+    double t2 = now_sec();
+    printf("  chained (%7d buckets)  put %8.3f s   get %8.3f s   [%d]\n",
+           nbuckets, t1 - t0, t2 - t1, found);
+    chain_free(&ch);
+    free(order);
+}
+
+/* Question-like strings of varied length, as learned from players */
+static char **make_questions(int n) {
+    static const char *parts[] = {
+        "Does it", " live in water", " have fur", " eat other animals", " fly",
+        " have more than four legs", " live on a farm", " make a sound at night",
+        " climb trees", " have stripes", " lay eggs", " live in cold places"
+    };
+    char **qs = malloc(n * sizeof(char *));
+    char text[512];
+    srand(312);
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(strcpy(text, parts[0]));
+        int words = 1 + rand() % 6;
+        for (int w = 0; w < words; w++) {
+            const char *p = parts[1 + rand() % 11];
+            strcpy(text + len, p);
+            len += strlen(p);
+            if (w + 1 < words) { strcpy(text + len, " and"); len += 4; }
+        }
+        len += sprintf(text + len, " (%d)?", i);
+        qs[i] = strdup(text);
+    }
+    return qs;
+}
+
+/* Key hashing throughput: seeded wyhash-style h_hash64 vs djb2 */
+static void bench_hashing(int n) {
+    char **qs = make_questions(n);
+    size_t *lens = malloc(n * sizeof(size_t));
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) bytes += lens[i] = strlen(qs[i]);
+    printf("hashing: %d questions, %.1f bytes avg\n", n, (double)bytes / n);
+
+    uint64_t sink = 0;
+    double t0 = now_sec();
+    for (int rep = 0; rep < 10; rep++)
+        for (int i = 0; i < n; i++) sink += djb2(qs[i]);
+    double t1 = now_sec();
+    for (int rep = 0; rep < 10; rep++)
+        for (int i = 0; i < n; i++) sink += h_hash64(qs[i], lens[i], HASH_SEED);
+    double t2 = now_sec();
+    double mb = 10.0 * bytes / 1e6;
+    printf("  djb2     %8.3f s   %6.0f MB/s\n", t1 - t0, mb / (t1 - t0));
+    printf("  h_hash64 %8.3f s   %6.0f MB/s   (checksum %llu)\n", t2 - t1, mb / (t2 - t1),
+           (unsigned long long)sink);
+    free(lens);
+    free_keys(qs, n);
+}
+
+/* The old branchy, malloc-per-call canonicalize */
+static char *canon_legacy(const char *s) {
+    size_t len = strlen(s);
+    char *result = malloc(len + 1);
+    int j = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 'A' && c <= 'Z') result[j++] = (char)(c + ('a' - 'A'));
+        else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) result[j++] = (char)c;
+        else if (c == ' ') result[j++] = '_';
+    }
+    result[j] = '\0';
+    return result;
+}
+
+/* canonicalize: legacy vs table + SSE2 into malloc, stack and scratch buffers */
+static void bench_canon(int n) {
+    char **qs = make_questions(n);
+    size_t *lens = malloc(n * sizeof(size_t));
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) bytes += lens[i] = strlen(qs[i]);
+    printf("canon: %d questions, %.1f bytes avg\n", n, (double)bytes / n);
+
+    uint64_t sink = 0;
+    char out[512];
+    double t0 = now_sec();
+    for (int i = 0; i < n; i++) { char *c = canon_legacy(qs[i]); sink += c[0]; free(c); }
+    double t1 = now_sec();
+    for (int i = 0; i < n; i++) { char *c = canonicalize(qs[i]); sink += c[0]; free(c); }
+    double t2 = now_sec();
+    for (int i = 0; i < n; i++) sink += canonicalize_into(qs[i], lens[i], out);
+    double t3 = now_sec();
+    for (int i = 0; i < n; i++) sink += canonicalize_tmp(qs[i])[0];
+    double t4 = now_sec();
+    double mb = (double)bytes / 1e6;
+    printf("  legacy malloc      %8.3f s   %6.0f MB/s\n", t1 - t0, mb / (t1 - t0));
+    printf("  canonicalize       %8.3f s   %6.0f MB/s\n", t2 - t1, mb / (t2 - t1));
+    printf("  canonicalize_into  %8.3f s   %6.0f MB/s\n", t3 - t2, mb / (t3 - t2));
+    printf("  canonicalize_tmp   %8.3f s   %6.0f MB/s   (checksum %llu)\n", t4 - t3,
+           mb / (t4 - t3), (unsigned long long)sink);
+    free(lens);
+    free_keys(qs, n);
+}
+
+/* Tree-walk baseline for a conjunctive query: visit every leaf, carrying
+ * which required terms were answered the right way and whether an
+ * excluded term matched on the way down.
+ */
+static size_t walk_query(Node *root, const AttrTerm *terms, int nterms) {
+    typedef struct { Node *node; unsigned got; int hit; } W;
+    unsigned need = 0;
+    for (int t = 0; t < nterms; t++) if (!terms[t].exclude) need |= 1u << t;
+    size_t cap = 64, top = 0, matches = 0;
+    W *stack = malloc(cap * sizeof(W));
+    stack[top++] = (W){root, 0, 0};
+    while (top > 0) {
+        W w = stack[--top];
+        if (!w.node->isQuestion) {
+            matches += (w.got == need && !w.hit);
+            continue;
+        }
+        if (top + 2 > cap) stack = realloc(stack, (cap *= 2) * sizeof(W));
+        for (int side = 0; side < 2; side++) {
+            W c = {side ? w.node->yes : w.node->no, w.got, w.hit};
+            for (int t = 0; t < nterms; t++) {
+                if (strcmp(terms[t].question, w.node->text) != 0 || terms[t].answer != side) continue;
+                if (terms[t].exclude) c.hit = 1; else c.got |= 1u << t;
+            }
+            stack[top++] = c;
+        }
+    }
+    free(stack);
+    return matches;
+}
+
+/* Attribute index: bulk build, then conjunctive queries vs a tree walk */
+static void bench_index(int n) {
+    printf("index: %d nodes\n", n);
+    NodeArena arena;
+    arena_init(&arena);
+    Node *root = build_tree(n, &arena);
+
+    AttrIndex ix = {0};
+    double t0 = now_sec();
+    ai_build(&ix, root);
+    double t1 = now_sec();
+    printf("  ai_build      %8.3f s   (%d questions, %d animals)\n",
+           t1 - t0, ix.nquestions, ix.nanimals);
+
+    /* property 0 = yes, property 1 = no, NOT property 4 = yes (BFS numbering) */
+    AttrTerm terms[] = {
+        {"Does it have property number 0?", 1, 0},
+        {"Does it have property number 1?", 0, 0},
+        {"Does it have property number 4?", 1, 1},
+    };
+    enum { REPS = 1000 };
+    Bitmap res;
+    bm_init(&res);
+    t0 = now_sec();
+    for (int r = 0; r < REPS; r++) ai_query(&ix, terms, 3, &res);
+    t1 = now_sec();
+    size_t walked = walk_query(root, terms, 3);
+    double t2 = now_sec();
+    printf("  query         %8.1f us   tree walk %8.1f us   [%llu / %zu matches]\n",
+           (t1 - t0) / REPS * 1e6, (t2 - t1) * 1e6,
+           (unsigned long long)bm_cardinality(&res), walked);
+
+    ai_free(&ix);
+
+    /* Startup to first query: saved index mapped in place vs a re-index */
+    arena_init(&g_arena);
+    g_root = build_tree(n, &g_arena);
+    save_tree("bench.dat");
+    save_tree_v1("bench2.dat");
+    const char *files[2] = {"bench.dat", "bench2.dat"};
+    const char *labels[2] = {"v2 + index", "v1 rebuild"};
+    for (int f = 0; f < 2; f++) {
+        t0 = now_sec();
+        load_tree(files[f]);
+        ai_query(&g_index, terms, 3, &res);
+        t1 = now_sec();
+        printf("  load+query %-10s %8.3f s   [%llu matches]\n", labels[f], t1 - t0,
+               (unsigned long long)bm_cardinality(&res));
+    }
+    replace_tree(NULL, &arena);
+
+    bm_free(&res);
+    arena_release(&arena);
+}
+
+static void bench_swiss(char **keys, int n, int nbuckets) {
+    Hash h;
+    h_init(&h, nbuckets);
+    int *order = shuffled(n);
+    double t0 = now_sec();
+    for (int i = 0; i < n; i++) h_put(&h, keys[i], i);
+    double t1 = now_sec();
+    int found = 0;
+    for (int i = 0; i < n; i++) found += h_contains(&h, keys[order[i]], order[i]);
+    double t2 = now_sec();
+    int missing = 0;
+    for (int i = 0; i < n; i++) missing += !h_contains(&h, "does_it_have_no_property", i);
+    double t3 = now_sec();
+    printf("  swiss   (%7d -> %7d)  put %8.3f s   get %8.3f s   [%d]   miss %8.3f s\n",
+           nbuckets, h.nslots, t1 - t0, t2 - t1, found, t3 - t2);
+    (void)missing;
+    free(order);
+    h_free(&h);
+}
+
+/* Open-addressing Hash vs the old chained table */
+static void bench_hash(int n) {
+    printf("hash: %d keys\n", n);
+    char **keys = make_keys(n);
+
+    /* g_index used 31 fixed buckets; only feasible for small key counts */
+    bench_chain(keys, n < 20000 ? n : 20000, 31);
+    bench_chain(keys, n, n);
+
+    bench_swiss(keys, n, 31);
+    // Presized to hold n keys under the 7/8 load limit, like the chained row
+    bench_swiss(keys, n, n / 7 * 8 + 8);
+    free_keys(keys, n);
+}
+
+/* Optimizer on a complete tree whose leaf popularity follows Zipf's law:
+ * rebuild time and expected questions per game before and after
+ */
+static void bench_optimize(int n) {
+    printf("optimize: %d nodes\n", n);
+    NodeArena arena;
+    arena_init(&arena);
+    Node *root = build_tree(n, &arena);
+    // Leaves in random order get visits ~ 1e6 / rank
+    Node **leaves = malloc((n / 2 + 1) * sizeof(Node *));
+    Node **stack = malloc(n * sizeof(Node *));
+    int nleaves = 0, top = 0;
+    stack[top++] = root;
+    while (top > 0) {
+        Node *node = stack[--top];
+        if (node->isQuestion) {
+            stack[top++] = node->no;
+            stack[top++] = node->yes;
+        } else {
+            leaves[nleaves++] = node;
+        }
+    }
+    srand(312);
+    for (int i = nleaves - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        Node *tmp = leaves[i];
+        leaves[i] = leaves[j];
+        leaves[j] = tmp;
+    }
+    for (int i = 0; i < nleaves; i++) {
+        leaves[i]->visits = (uint32_t)(1000000 / (i + 1));
+    }
+    double e0 = expected_questions(root);
+    double t0 = now_sec();
+    Node *opt = opt_rebuild(root, &arena);
+    double t1 = now_sec();
+    printf("  rebuild %8.3f s   expected questions %.3f -> %.3f   (root paths only)\n",
+           t1 - t0, e0, opt ? expected_questions(opt) : e0);
+
+    // Treat every bottom question as a lesson that was also asked about
+    // the animals learn_neighbours names, with random answers
+    typedef struct { Node *node; int depth; int answer; } Step;
+    Step *steps = malloc(n * sizeof(Step));
+    FrameStack path = {malloc(64 * sizeof(Frame)), 0, 64};
+    top = 0;
+    steps[top++] = (Step){root, 0, 0};
+    while (top > 0) {
+        Step st = steps[--top];
+        if (st.depth > 0) {
+            path.frames[st.depth - 1].answeredYes = st.answer;
+        }
+        if (!st.node->isQuestion) {
+            continue;
+        }
+        path.frames[st.depth].node = st.node;
+        if (!st.node->yes->isQuestion) {
+            Node *others[LEARN_ASK_MAX];
+            path.size = st.depth;
+            int k = learn_neighbours(&path, others, LEARN_ASK_MAX);
+            for (int j = 0; j < k; j++) {
+                answers_add(&g_answers, others[j]->text, st.node->text, rand() & 1);
+            }
+            continue;
+        }
+        steps[top++] = (Step){st.node->no, st.depth + 1, 0};
+        steps[top++] = (Step){st.node->yes, st.depth + 1, 1};
+    }
+    int recorded = g_answers.count;
+    t0 = now_sec();
+    opt = opt_rebuild(root, &arena);
+    t1 = now_sec();
+    printf("  rebuild %8.3f s   expected questions %.3f -> %.3f   (%d answers recorded)\n",
+           t1 - t0, e0, opt ? expected_questions(opt) : e0, recorded);
+    answers_clear(&g_answers);
+    free(path.frames);
+    free(steps);
+    free(leaves);
+    free(stack);
+    arena_release(&arena);
+}
+
+/* Headless games through the Session API: random play that always
+ * confirms the guess, then play that teaches a new animal every game
+ */
+static void bench_session(int n) {
+    printf("session: %d nodes\n", n);
+    arena_init(&g_arena);
+    g_root = build_tree(n, &g_arena);
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    es_init(&g_undo);
+    es_init(&g_redo);
+
+    enum { GAMES = 2000000, TAUGHT = 200000, BITS = 1 << 20 };
+    uint8_t *bits = malloc(BITS);
+    srand(312);
+    for (int i = 0; i < BITS; i++) bits[i] = rand() & 1;
+
+    Session s;
+    size_t answers = 0;
+    double t0 = now_sec();
+    for (int g = 0; g < GAMES; g++) {
+        session_start(&s);
+        while (s.state == SESSION_ASK) {
+            session_answer(&s, bits[answers++ & (BITS - 1)]);
+        }
+        session_answer(&s, 1);
+        session_end(&s);
+    }
+    double t1 = now_sec();
+    printf("  play    %8.3f s   %8.2f M games/s   %.1f answers/game\n",
+           t1 - t0, GAMES / (t1 - t0) / 1e6, (double)answers / GAMES);
+
+    char name[32], question[64];
+    t0 = now_sec();
+    for (int g = 0; g < TAUGHT; g++) {
+        session_start(&s);
+        while (s.state == SESSION_ASK) {
+            session_answer(&s, bits[answers++ & (BITS - 1)]);
+        }
+        session_answer(&s, 0);
+        snprintf(name, sizeof(name), "Taught %d", g);
+        snprintf(question, sizeof(question), "Does it have taught trait %d?", g);
+        session_teach(&s, name, question, 1, NULL);
+        session_end(&s);
+    }
+    t1 = now_sec();
+    printf("  teach   %8.3f s   %8.2f M games/s   [%d nodes, depth %d]\n",
+           t1 - t0, TAUGHT / (t1 - t0) / 1e6, g_stats.nodes, g_stats.height);
+
+    free(bits);
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    NodeArena empty;
+    arena_init(&empty);
+    replace_tree(NULL, &empty);
+}
+
+static int readers_stop;
+
+/* One reader thread: play games with random answers until told to stop */
+static void *reader_games(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    long games = 0;
+    Session s;
+    while (!__atomic_load_n(&readers_stop, __ATOMIC_RELAXED)) {
+        session_start(&s);
+        while (s.state == SESSION_ASK) {
+            seed = seed * 1103515245 + 12345;
+            session_answer(&s, (seed >> 16) & 1);
+        }
+        session_end(&s);
+        games++;
+    }
+    return (void *)(uintptr_t)games;
+}
+
+/* Readers play while this thread, the single writer, keeps teaching and
+ * undoing, so splits are published and retired nodes reclaimed under
+ * load. Games per second should grow with the number of reader threads
+ * up to the core count.
+ */
+static void bench_readers(int n) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("readers: %d nodes, %ld cpus\n", n, cpus);
+    arena_init(&g_arena);
+    g_root = build_tree(n, &g_arena);
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    es_init(&g_undo);
+    es_init(&g_redo);
+
+    enum { MAX_READERS = 64 };
+    pthread_t threads[MAX_READERS];
+    char name[32], question[64];
+    unsigned seed = 99;
+    int lesson = 0;
+    for (long t = 1; t <= cpus * 2 && t <= MAX_READERS; t *= 2) {
+        __atomic_store_n(&readers_stop, 0, __ATOMIC_RELAXED);
+        for (long i = 0; i < t; i++) {
+            pthread_create(&threads[i], NULL, reader_games, (void *)(uintptr_t)(i + 1));
+        }
+        long edits = 0;
+        double t0 = now_sec();
+        while (now_sec() - t0 < 1.0) {
+            Session s;
+            session_start(&s);
+            while (s.state == SESSION_ASK) {
+                seed = seed * 1103515245 + 12345;
+                session_answer(&s, (seed >> 16) & 1);
+            }
+            session_answer(&s, 0);
+            snprintf(name, sizeof(name), "Reader animal %d", lesson);
+            snprintf(question, sizeof(question), "Does it have reader trait %d?", lesson++);
+            session_teach(&s, name, question, 1, NULL);
+            session_end(&s);
+            if (lesson % 2 == 0) {
+                undo_last_edit();  // dropped by the next lesson, then reclaimed
+            }
+            edits++;
+        }
+        __atomic_store_n(&readers_stop, 1, __ATOMIC_RELAXED);
+        long games = 0;
+        for (long i = 0; i < t; i++) {
+            void *g;
+            pthread_join(threads[i], &g);
+            games += (long)(uintptr_t)g;
+        }
+        double t1 = now_sec();
+        printf("  %2ld readers %8.2f M games/s   %6ld edits   %5d retired nodes pending\n",
+               t, games / (t1 - t0) / 1e6, edits, epoch_pending());
+    }
+
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    NodeArena empty;
+    arena_init(&empty);
+    replace_tree(NULL, &empty);
+}
+
+/* Many clients play at once against the socket server. Every client
+ * answers each prompt as soon as it arrives; a guess is confirmed and a
+ * new game started, so the server mostly serves plays.
+ */
+static void bench_server(int n) {
+    enum { CLIENTS = 8000, ROUNDS = 400000 };
+    const char *path = "bench_server.sock";
+    printf("server: %d nodes, %d clients\n", n, CLIENTS);
+    arena_init(&g_arena);
+    g_root = build_tree(n, &g_arena);
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    es_init(&g_undo);
+    es_init(&g_redo);
+
+    if (!server_start(path, 0)) {
+        return;
+    }
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int ep = epoll_create1(0);
+    int *fds = malloc(CLIENTS * sizeof(int));
+    int clients = 0;
+    for (; clients < CLIENTS; clients++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            if (fd >= 0) close(fd);
+            break;  // out of descriptors
+        }
+        struct epoll_event ev = {EPOLLIN, {.u32 = (uint32_t)clients}};
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        fds[clients] = fd;
+    }
+
+    struct epoll_event events[256];
+    char buf[512];
+    long replies = 0, games = 0;
+    unsigned seed = 1;
+    double t0 = now_sec();
+    while (replies < ROUNDS) {
+        int k = epoll_wait(ep, events, 256, 1000);
+        if (k <= 0) break;
+        for (int i = 0; i < k; i++) {
+            int fd = fds[events[i].data.u32];
+            ssize_t got = read(fd, buf, sizeof(buf) - 1);
+            if (got <= 0) continue;
+            buf[got] = '\0';
+            // One outstanding request per client, so one reply per read
+            replies++;
+            const char *req;
+            if (buf[0] == 'A') {
+                seed = seed * 1103515245 + 12345;
+                req = (seed >> 16) & 1 ? "y\n" : "n\n";
+            } else if (buf[0] == 'G') {
+                req = "y\n";
+            } else {
+                req = "NEW\n";
+                games++;
+            }
+            if (write(fd, req, strlen(req)) < 0) break;
+        }
+    }
+    double t1 = now_sec();
+    printf("  serve   %8.3f s   %8.2f k replies/s   %ld games   [%d sessions]\n",
+           t1 - t0, replies / (t1 - t0) / 1e3, games, server_sessions());
+
+    for (int i = 0; i < clients; i++) close(fds[i]);
+    close(ep);
+    free(fds);
+    server_stop();
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    NodeArena empty;
+    arena_init(&empty);
+    replace_tree(NULL, &empty);
+}
+
+static long max_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/* Degenerate chain of n nodes: every question has a leaf on one side and
+ * the rest of the chain on the other (yesSpine picks the side).
+ */
+static Node *build_chain(int n, int yesSpine) {
+    Node *root = create_animal_node("Animal 0");
+    for (int i = 1; i + 1 < n; i += 2) {
+        Node *q = create_question_node("Is it deeper?");
+        Node *leaf = create_animal_node("Animal");
+        q->yes = yesSpine ? root : leaf;
+        q->no = yesSpine ? leaf : root;
+        root = q;
+    }
+    return root;
+}
+
+/* Tree walks over chains n/2 levels deep: time and peak memory must stay
+ * flat (the recursive walks used to overflow the stack at ~100k levels)
+ */
+static void bench_deep(int n) {
+    printf("deep: %d nodes, chain depth %d\n", n, n / 2);
+    for (int side = 1; side >= 0; side--) {
+        Node *root = build_chain(n, side);
+        long rss0 = max_rss_kb();
+        double t0 = now_sec();
+        int count = count_nodes(root);
+        double t1 = now_sec();
+        long rss1 = max_rss_kb();
+        TreeStats st = {0, 0, 0, 0, NULL, 0};
+        stats_recount(&st, root);
+        double t2 = now_sec();
+        long rss2 = max_rss_kb();
+        free_tree(root);
+        double t3 = now_sec();
+        printf("  %s spine  count %8.3f s [%d]   stats %8.3f s [height %d]   free %8.3f s\n",
+               side ? "yes" : "no ", t1 - t0, count, t2 - t1, st.height, t3 - t2);
+        // stats keeps one leavesAt counter per level, so it grows with depth
+        printf("            peak RSS growth  count %ld KB   stats %ld KB\n", rss1 - rss0, rss2 - rss1);
+        stats_free(&st);
+    }
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(int n);
+} Bench;
+
+/* A long-running learner under the default journal budget: the first
+ * rounds keep every lesson until the journal is full, the rest undo each
+ * lesson so the next one drops it. Peak resident memory must stay flat in
+ * the second half, as compaction, freed nodes and index rebuilds let the
+ * same memory be reused; growth over 5% fails the bench.
+ */
+static void bench_journal(int n) {
+    enum { ROUNDS = 10, PER_ROUND = 100000 };
+    printf("journal: %d nodes, budget %zu KB\n", n, journal_budget() >> 10);
+    arena_init(&g_arena);
+    g_root = build_tree(n, &g_arena);
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    es_init(&g_undo);
+    es_init(&g_redo);
+
+    char name[32], question[64];
+    unsigned seed = 7;
+    int lesson = 0;
+    long rssHalf = 0;
+    double t0 = now_sec();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < PER_ROUND; i++) {
+            Session s;
+            session_start(&s);
+            while (s.state == SESSION_ASK) {
+                seed = seed * 1103515245 + 12345;
+                session_answer(&s, (seed >> 16) & 1);
+            }
+            session_answer(&s, 0);
+            snprintf(name, sizeof(name), "Journal %d", lesson % 1000);
+            snprintf(question, sizeof(question), "Journal trait %d?", lesson++ % 1000);
+            session_teach(&s, name, question, 1, NULL);
+            session_end(&s);
+            if (r >= 2) {
+                undo_last_edit();
+            }
+        }
+        printf("  %7d lessons  %7d nodes  undo %6d  journal %6zu KB  rss %7ld KB\n",
+               lesson, g_stats.nodes, g_undo.size, (g_undo.bytes + g_redo.bytes) >> 10,
+               max_rss_kb());
+        if (r == ROUNDS / 2 - 1) {
+            rssHalf = max_rss_kb();
+        }
+    }
+    double t1 = now_sec();
+    printf("  total   %8.3f s   %8.2f k lessons/s\n", t1 - t0, lesson / (t1 - t0) / 1e3);
+    long grown = max_rss_kb() - rssHalf;
+    int flat = grown <= rssHalf / 20;
+    printf("  rss growth in the last %d rounds  %ld KB%s\n", ROUNDS - ROUNDS / 2, grown,
+           flat ? "" : "   (FAILED)");
+    bench_failed |= !flat;
+
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    NodeArena empty;
+    arena_init(&empty);
+    replace_tree(NULL, &empty);
+}
+
+/* Teach count lessons at random leaves */
+static void teach_random(int count, unsigned *seed, int *lesson) {
+    char name[32], question[64];
+    for (int i = 0; i < count; i++) {
+        Session s;
+        session_start(&s);
+        while (s.state == SESSION_ASK) {
+            *seed = *seed * 1103515245 + 12345;
+            session_answer(&s, (*seed >> 16) & 1);
+        }
+        session_answer(&s, 0);
+        snprintf(name, sizeof(name), "Logged %d", *lesson);
+        snprintf(question, sizeof(question), "Logged trait %d?", (*lesson)++);
+        session_teach(&s, name, question, 1, NULL);
+        session_end(&s);
+    }
+}
+
+/* Persisting lessons: a full snapshot per lesson against one log record,
+ * either left to group commit or synced one by one, a checkpoint written
+ * in the background while lessons go on, and the cost of replaying the
+ * log on load.
+ */
+static void bench_wal(int n) {
+    enum { LESSONS = 20000, SYNCED = 200 };
+    printf("wal: %d nodes\n", n);
+    arena_init(&g_arena);
+    g_root = build_tree(n, &g_arena);
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    es_init(&g_undo);
+    es_init(&g_redo);
+    unsigned seed = 11;
+    int lesson = 0;
+
+    double t0 = now_sec();
+    if (!wal_open("bench_wal.dat") || !wal_checkpoint_wait()) {
+        printf("  could not open bench_wal.dat\n");
+        return;
+    }
+    double t1 = now_sec();
+    printf("  snapshot (one save_tree per lesson)  %10.3f ms\n", (t1 - t0) * 1e3);
+
+    t0 = now_sec();
+    teach_random(LESSONS, &seed, &lesson);
+    wal_sync();
+    t1 = now_sec();
+    uint64_t bytes = wal_size() - 16;
+    printf("  logged, group commit    %8.2f us/lesson  %5.1f bytes/lesson\n",
+           (t1 - t0) / LESSONS * 1e6, (double)bytes / LESSONS);
+
+    t0 = now_sec();
+    for (int i = 0; i < SYNCED; i++) {
+        teach_random(1, &seed, &lesson);
+        wal_sync();
+    }
+    t1 = now_sec();
+    printf("  logged, synced each     %8.2f us/lesson\n", (t1 - t0) / SYNCED * 1e6);
+
+    // Saving after each game writes only what the game changed
+    t0 = now_sec();
+    for (int i = 0; i < SYNCED; i++) {
+        teach_random(1, &seed, &lesson);
+        wal_save();
+    }
+    t1 = now_sec();
+    printf("  lesson + wal_save       %8.3f ms/save\n", (t1 - t0) / SYNCED * 1e3);
+
+    // Undo and redo name the split by its path from the root
+    t0 = now_sec();
+    for (int i = 0; i < SYNCED; i++) {
+        undo_last_edit();
+        redo_last_edit();
+    }
+    wal_sync();
+    t1 = now_sec();
+    printf("  undo + redo, logged     %8.2f us/pair\n", (t1 - t0) / SYNCED * 1e6);
+
+    // A background checkpoint only stops the writer for the fork
+    t0 = now_sec();
+    wal_checkpoint_start();
+    t1 = now_sec();
+    int during = 0;
+    while (wal_checkpoint_poll(NULL) == SAVE_RUNNING) {
+        teach_random(100, &seed, &lesson);
+        during += 100;
+    }
+    double t2 = now_sec();
+    printf("  background snapshot     %8.3f ms stalled, %d lessons taught in %.3f ms\n",
+           (t1 - t0) * 1e3, during, (t2 - t1) * 1e3);
+
+    t0 = now_sec();
+    load_tree("bench_wal.dat");
+    t1 = now_sec();
+    printf("  load + replay %d records %8.3f ms  (%d nodes)\n", lesson, (t1 - t0) * 1e3,
+           g_stats.nodes);
+
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    NodeArena empty;
+    arena_init(&empty);
+    replace_tree(NULL, &empty);
+    remove("bench_wal.dat");
+    remove("bench_wal.dat.wal");
+}
+
+/* File checksums: crc32c against memcpy of the same bytes, and checking a
+ * saved file with and without loading it
+ */
+static void bench_crc(int n) {
+    size_t len = (size_t)n * 64;
+    printf("crc: %.1f MB\n", len / 1e6);
+    char *src = malloc(len), *dst = malloc(len);
+    for (size_t i = 0; i < len; i++) src[i] = (char)(i * 131 + (i >> 9));
+    memcpy(dst, src, len);  // fault the pages in first
+
+    double t0 = now_sec();
+    memcpy(dst, src, len);
+    double t1 = now_sec();
+    uint32_t crc = crc32c(0, dst, len);  // also keeps the memcpy
+    double t2 = now_sec();
+    printf("  memcpy   %8.3f s   %6.0f MB/s\n", t1 - t0, len / 1e6 / (t1 - t0));
+    printf("  crc32c   %8.3f s   %6.0f MB/s   (crc %08x)\n", t2 - t1, len / 1e6 / (t2 - t1), crc);
+    free(src);
+    free(dst);
+
+    NodeArena arena;
+    arena_init(&arena);
+    g_root = build_tree(n, &arena);
+    save_tree("bench.dat");
+    g_root = NULL;
+    arena_release(&arena);
+    t0 = now_sec();
+    verify_tree_file("bench.dat");
+    t1 = now_sec();
+    load_tree("bench.dat");
+    t2 = now_sec();
+    printf("  --verify %8.3f s   load_tree %8.3f s\n", t1 - t0, t2 - t1);
+    NodeArena empty;
+    arena_init(&empty);
+    replace_tree(NULL, &empty);
+    remove("bench.dat");
+}
+
+static const Bench benches[] = {
+    {"arena", bench_arena},
+    {"flat", bench_flat},
+    {"queue", bench_queue},
+    {"save", bench_save},
+    {"hash", bench_hash},
+    {"hashing", bench_hashing},
+    {"canon", bench_canon},
+    {"index", bench_index},
+    {"deep", bench_deep},
+    {"optimize", bench_optimize},
+    {"session", bench_session},
+    {"readers", bench_readers},
+    {"journal", bench_journal},
+    {"server", bench_server},
+    {"wal", bench_wal},
+    {"crc", bench_crc},
+};
+
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    const char *only = argc > 1 ? argv[1] : NULL;
+    int n = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (n < 3) n = 3;
+    if (n % 2 == 0) n++;  // complete trees with two children per question
+    save_set_generations(0);  // bench_save measures what generations cost
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (only == NULL || strcmp(only, "all") == 0 || strcmp(only, benches[i].name) == 0) {
+            benches[i].run(n);
+        }
+    }
+    return bench_failed;
+}
@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "lab5.h"
+
+/* ========== Compressed Bitmap (roaring-style) ========== */
+
+/* ---- word-level helpers for bitset containers ---- */
+
+static uint32_t bm_words_popcount(const uint64_t *w) {
+    uint32_t card = 0;
+    for (int i = 0; i < BM_WORDS; i++) {
+        card += (uint32_t)__builtin_popcountll(w[i]);
+    }
+    return card;
+}
+
+static void bm_words_and(uint64_t *out, const uint64_t *a, const uint64_t *b) {
+#ifdef __SSE2__
+    for (int i = 0; i < BM_WORDS; i += 2) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(va, vb));
+    }
+#else
+    for (int i = 0; i < BM_WORDS; i++) {
+        out[i] = a[i] & b[i];
+    }
+#endif
+}
+
+static void bm_words_andnot(uint64_t *out, const uint64_t *a, const uint64_t *b) {
+#ifdef __SSE2__
+    for (int i = 0; i < BM_WORDS; i += 2) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        // _mm_andnot_si128(x, y) is ~x & y
+        _mm_storeu_si128((__m128i *)(out + i), _mm_andnot_si128(vb, va));
+    }
+#else
+    for (int i = 0; i < BM_WORDS; i++) {
+        out[i] = a[i] & ~b[i];
+    }
+#endif
+}
+
+static void bm_words_or(uint64_t *out, const uint64_t *a, const uint64_t *b) {
+#ifdef __SSE2__
+    for (int i = 0; i < BM_WORDS; i += 2) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(va, vb));
+    }
+#else
+    for (int i = 0; i < BM_WORDS; i++) {
+        out[i] = a[i] | b[i];
+    }
+#endif
+}
+
+/* Set bits [start, end) of a bitset container */
+static void bm_words_set_range(uint64_t *w, uint32_t start, uint32_t end) {
+    uint32_t first = start >> 6, last = (end - 1) >> 6;
+    uint64_t firstMask = ~0ull << (start & 63);
+    uint64_t lastMask = ~0ull >> (63 - ((end - 1) & 63));
+    if (first == last) {
+        w[first] |= firstMask & lastMask;
+        return;
+    }
+    w[first] |= firstMask;
+    for (uint32_t i = first + 1; i < last; i++) {
+        w[i] = ~0ull;
+    }
+    w[last] |= lastMask;
+}
+
+/* Write the set bits of a bitset container as sorted 16-bit values */
+static uint32_t bm_words_extract(const uint64_t *w, uint16_t *out) {
+    uint32_t n = 0;
+    for (int i = 0; i < BM_WORDS; i++) {
+        uint64_t bits = w[i];
+        while (bits) {
+            out[n++] = (uint16_t)(i * 64 + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+    return n;
+}
+
+/* ---- container management ---- */
+
+static void bm_container_free(BmContainer *c) {
+    free(c->data);
+    c->data = NULL;
+}
+
+/* Index of the container for key, or -(insertion point) - 1 */
+static int bm_find(const Bitmap *b, uint16_t key) {
+    int lo = 0, hi = b->n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        uint16_t k = b->cs[mid].key;
+        if (k == key) {
+            return mid;
+        }
+        if (k < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -lo - 1;
+}
+
+/* Open an empty array container for key at position pos */
+static BmContainer *bm_insert(Bitmap *b, int pos, uint16_t key) {
+    if (b->n == b->cap) {
+        int newCap = b->cap ? b->cap * 2 : 4;
+        BmContainer *grown = realloc(b->cs, newCap * sizeof(BmContainer));
+        if (grown == NULL) {
+            return NULL;
+        }
+        b->cs = grown;
+        b->cap = newCap;
+    }
+    memmove(&b->cs[pos + 1], &b->cs[pos], (b->n - pos) * sizeof(BmContainer));
+    b->n++;
+    BmContainer *c = &b->cs[pos];
+    memset(c, 0, sizeof(*c));
+    c->key = key;
+    return c;
+}
+
+/* Take ownership of a finished container, appending it in key order;
+ * empty containers are dropped.
+ */
+static int bm_append(Bitmap *b, BmContainer *c) {
+    if (c->card == 0) {
+        bm_container_free(c);
+        return 1;
+    }
+    BmContainer *slot = bm_insert(b, b->n, c->key);
+    if (slot == NULL) {
+        bm_container_free(c);
+        return 0;
+    }
+    *slot = *c;
+    return 1;
+}
+
+static void bm_remove_at(Bitmap *b, int pos) {
+    bm_container_free(&b->cs[pos]);
+    memmove(&b->cs[pos], &b->cs[pos + 1], (b->n - pos - 1) * sizeof(BmContainer));
+    b->n--;
+}
+
+static int bm_array_to_bitset(BmContainer *c) {
+    uint64_t *w = calloc(BM_WORDS, sizeof(uint64_t));
+    if (w == NULL) {
+        return 0;
+    }
+    const uint16_t *vals = c->data;
+    for (uint32_t i = 0; i < c->card; i++) {
+        w[vals[i] >> 6] |= 1ull << (vals[i] & 63);
+    }
+    free(c->data);
+    c->data = w;
+    c->isBitset = 1;
+    c->cap = 0;
+    return 1;
+}
+
+/* Turn a sparse bitset container back into an array. On allocation
+ * failure the bitset is kept, which is still a valid container.
+ */
+static void bm_shrink(BmContainer *c) {
+    if (!c->isBitset || c->card > BM_ARRAY_MAX || c->card == 0) {
+        return;
+    }
+    uint16_t *vals = malloc(c->card * sizeof(uint16_t));
+    if (vals == NULL) {
+        return;
+    }
+    bm_words_extract(c->data, vals);
+    free(c->data);
+    c->data = vals;
+    c->isBitset = 0;
+    c->cap = c->card;
+}
+
+static int bm_container_copy(BmContainer *r, const BmContainer *c) {
+    *r = *c;
+    size_t bytes = c->isBitset ? BM_WORDS * sizeof(uint64_t) : c->card * sizeof(uint16_t);
+    r->data = malloc(bytes ? bytes : 1);
+    if (r->data == NULL) {
+        return 0;
+    }
+    memcpy(r->data, c->data, bytes);
+    r->cap = c->isBitset ? 0 : c->card;
+    return 1;
+}
+
+/* Merge two sorted value arrays into out (room for na + nb) */
+static uint32_t bm_array_union(const uint16_t *a, uint32_t na,
+                               const uint16_t *b, uint32_t nb, uint16_t *out) {
+    uint32_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            out[n++] = a[i++];
+        } else if (b[j] < a[i]) {
+            out[n++] = b[j++];
+        } else {
+            out[n++] = a[i++];
+            j++;
+        }
+    }
+    while (i < na) {
+        out[n++] = a[i++];
+    }
+    while (j < nb) {
+        out[n++] = b[j++];
+    }
+    return n;
+}
+
+/* ---- container operations; each fills a fresh result container r ---- */
+
+static int bm_container_and(BmContainer *r, const BmContainer *a, const BmContainer *b) {
+    memset(r, 0, sizeof(*r));
+    r->key = a->key;
+    if (a->isBitset && b->isBitset) {
+        uint64_t *w = malloc(BM_WORDS * sizeof(uint64_t));
+        if (w == NULL) {
+            return 0;
+        }
+        bm_words_and(w, a->data, b->data);
+        r->data = w;
+        r->isBitset = 1;
+        r->card = bm_words_popcount(w);
+        bm_shrink(r);
+        return 1;
+    }
+    // At least one side is an array: the result is a subset of it
+    if (a->isBitset) {
+        const BmContainer *t = a;
+        a = b;
+        b = t;
+    }
+    const uint16_t *av = a->data;
+    uint16_t *out = malloc((a->card ? a->card : 1) * sizeof(uint16_t));
+    if (out == NULL) {
+        return 0;
+    }
+    uint32_t n = 0;
+    if (b->isBitset) {
+        const uint64_t *w = b->data;
+        for (uint32_t i = 0; i < a->card; i++) {
+            out[n] = av[i];
+            n += (w[av[i] >> 6] >> (av[i] & 63)) & 1;
+        }
+    } else {
+        const uint16_t *bv = b->data;
+        uint32_t i = 0, j = 0;
+        while (i < a->card && j < b->card) {
+            if (av[i] < bv[j]) {
+                i++;
+            } else if (bv[j] < av[i]) {
+                j++;
+            } else {
+                out[n++] = av[i++];
+                j++;
+            }
+        }
+    }
+    r->data = out;
+    r->card = n;
+    r->cap = a->card;
+    return 1;
+}
+
+static int bm_container_andnot(BmContainer *r, const BmContainer *a, const BmContainer *b) {
+    memset(r, 0, sizeof(*r));
+    r->key = a->key;
+    if (a->isBitset) {
+        uint64_t *w = malloc(BM_WORDS * sizeof(uint64_t));
+        if (w == NULL) {
+            return 0;
+        }
+        if (b->isBitset) {
+            bm_words_andnot(w, a->data, b->data);
+        } else {
+            memcpy(w, a->data, BM_WORDS * sizeof(uint64_t));
+            const uint16_t *bv = b->data;
+            for (uint32_t j = 0; j < b->card; j++) {
+                w[bv[j] >> 6] &= ~(1ull << (bv[j] & 63));
+            }
+        }
+        r->data = w;
+        r->isBitset = 1;
+        r->card = bm_words_popcount(w);
+        bm_shrink(r);
+        return 1;
+    }
+    const uint16_t *av = a->data;
+    uint16_t *out = malloc((a->card ? a->card : 1) * sizeof(uint16_t));
+    if (out == NULL) {
+        return 0;
+    }
+    uint32_t n = 0;
+    if (b->isBitset) {
+        const uint64_t *w = b->data;
+        for (uint32_t i = 0; i < a->card; i++) {
+            out[n] = av[i];
+            n += !((w[av[i] >> 6] >> (av[i] & 63)) & 1);
+        }
+    } else {
+        const uint16_t *bv = b->data;
+        uint32_t i = 0, j = 0;
+        while (i < a->card) {
+            while (j < b->card && bv[j] < av[i]) {
+                j++;
+            }
+            if (j == b->card || bv[j] != av[i]) {
+                out[n++] = av[i];
+            }
+            i++;
+        }
+    }
+    r->data = out;
+    r->card = n;
+    r->cap = a->card;
+    return 1;
+}
+
+static int bm_container_or(BmContainer *r, const BmContainer *a, const BmContainer *b) {
+    memset(r, 0, sizeof(*r));
+    r->key = a->key;
+    if (!a->isBitset && !b->isBitset && a->card + b->card <= BM_ARRAY_MAX) {
+        uint16_t *out = malloc((a->card + b->card) * sizeof(uint16_t));
+        if (out == NULL) {
+            return 0;
+        }
+        r->card = bm_array_union(a->data, a->card, b->data, b->card, out);
+        r->data = out;
+        r->cap = a->card + b->card;
+        return 1;
+    }
+    uint64_t *w = calloc(BM_WORDS, sizeof(uint64_t));
+    if (w == NULL) {
+        return 0;
+    }
+    if (a->isBitset && b->isBitset) {
+        bm_words_or(w, a->data, b->data);
+    } else {
+        const BmContainer *sides[2] = {a, b};
+        for (int s = 0; s < 2; s++) {
+            const BmContainer *c = sides[s];
+            if (c->isBitset) {
+                bm_words_or(w, w, c->data);
+            } else {
+                const uint16_t *v = c->data;
+                for (uint32_t i = 0; i < c->card; i++) {
+                    w[v[i] >> 6] |= 1ull << (v[i] & 63);
+                }
+            }
+        }
+    }
+    r->data = w;
+    r->isBitset = 1;
+    r->card = bm_words_popcount(w);
+    return 1;
+}
+
+/* ---- public API ---- */
+
+void bm_init(Bitmap *b) {
+    b->cs = NULL;
+    b->n = 0;
+    b->cap = 0;
+}
+
+void bm_clear(Bitmap *b) {
+    for (int i = 0; i < b->n; i++) {
+        bm_container_free(&b->cs[i]);
+    }
+    b->n = 0;
+}
+
+void bm_free(Bitmap *b) {
+    bm_clear(b);
+    free(b->cs);
+    bm_init(b);
+}
+
+int bm_add(Bitmap *b, uint32_t x) {
+    uint16_t key = (uint16_t)(x >> 16), low = (uint16_t)x;
+    int pos = bm_find(b, key);
+    BmContainer *c = pos >= 0 ? &b->cs[pos] : bm_insert(b, -pos - 1, key);
+    if (c == NULL) {
+        return 0;
+    }
+    if (!c->isBitset) {
+        uint16_t *vals = c->data;
+        uint32_t lo = 0, hi = c->card;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) >> 1;
+            if (vals[mid] < low) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < c->card && vals[lo] == low) {
+            return 1; // already present
+        }
+        if (c->card < BM_ARRAY_MAX) {
+            if (c->card == c->cap) {
+                uint32_t newCap = c->cap ? c->cap * 2 : 4;
+                if (newCap > BM_ARRAY_MAX) {
+                    newCap = BM_ARRAY_MAX;
+                }
+                uint16_t *grown = realloc(c->data, newCap * sizeof(uint16_t));
+                if (grown == NULL) {
+                    return 0;
+                }
+                c->data = vals = grown;
+                c->cap = newCap;
+            }
+            memmove(&vals[lo + 1], &vals[lo], (c->card - lo) * sizeof(uint16_t));
+            vals[lo] = low;
+            c->card++;
+            return 1;
+        }
+        // A full array becomes a bitset
+        if (!bm_array_to_bitset(c)) {
+            return 0;
+        }
+    }
+    uint64_t *w = c->data;
+    uint64_t bit = 1ull << (low & 63);
+    if (!(w[low >> 6] & bit)) {
+        w[low >> 6] |= bit;
+        c->card++;
+    }
+    return 1;
+}
+
+int bm_remove(Bitmap *b, uint32_t x) {
+    uint16_t low = (uint16_t)x;
+    int pos = bm_find(b, (uint16_t)(x >> 16));
+    if (pos < 0) {
+        return 0;
+    }
+    BmContainer *c = &b->cs[pos];
+    if (c->isBitset) {
+        uint64_t *w = c->data;
+        uint64_t bit = 1ull << (low & 63);
+        if (!(w[low >> 6] & bit)) {
+            return 0;
+        }
+        w[low >> 6] &= ~bit;
+        c->card--;
+        bm_shrink(c);
+    } else {
+        uint16_t *vals = c->data;
+        uint32_t lo = 0, hi = c->card;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) >> 1;
+            if (vals[mid] < low) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == c->card || vals[lo] != low) {
+            return 0;
+        }
+        memmove(&vals[lo], &vals[lo + 1], (c->card - lo - 1) * sizeof(uint16_t));
+        c->card--;
+    }
+    if (c->card == 0) {
+        bm_remove_at(b, pos);
+    }
+    return 1;
+}
+
+int bm_contains(const Bitmap *b, uint32_t x) {
+    uint16_t low = (uint16_t)x;
+    int pos = bm_find(b, (uint16_t)(x >> 16));
+    if (pos < 0) {
+        return 0;
+    }
+    const BmContainer *c = &b->cs[pos];
+    if (c->isBitset) {
+        const uint64_t *w = c->data;
+        return (w[low >> 6] >> (low & 63)) & 1;
+    }
+    const uint16_t *vals = c->data;
+    uint32_t lo = 0, hi = c->card;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) >> 1;
+        if (vals[mid] < low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < c->card && vals[lo] == low;
+}
+
+/* Add every value in [lo, hi). Subtrees of a DFS-numbered tree cover
+ * contiguous id ranges, so this is how the index is bulk-built: a range
+ * costs one container write per 65536 ids instead of one add per id.
+ */
+int bm_add_range(Bitmap *b, uint32_t lo, uint32_t hi) {
+    uint16_t range[BM_ARRAY_MAX];
+    while (lo < hi) {
+        uint16_t key = (uint16_t)(lo >> 16);
+        uint32_t base = (uint32_t)key << 16;
+        uint32_t start = lo - base;
+        uint32_t end = (hi - base > 65536) ? 65536 : hi - base;
+        uint32_t len = end - start;
+        lo = base + end;
+
+        int pos = bm_find(b, key);
+        BmContainer *c = pos >= 0 ? &b->cs[pos] : bm_insert(b, -pos - 1, key);
+        if (c == NULL) {
+            return 0;
+        }
+        if (!c->isBitset && c->card + len <= BM_ARRAY_MAX) {
+            for (uint32_t i = 0; i < len; i++) {
+                range[i] = (uint16_t)(start + i);
+            }
+            uint32_t room = c->card + len;
+            uint16_t *merged = malloc(room * sizeof(uint16_t));
+            if (merged == NULL) {
+                return 0;
+            }
+            c->card = bm_array_union(c->data, c->card, range, len, merged);
+            free(c->data);
+            c->data = merged;
+            c->cap = room;
+            continue;
+        }
+        if (!c->isBitset && !bm_array_to_bitset(c)) {
+            return 0;
+        }
+        bm_words_set_range(c->data, start, end);
+        c->card = bm_words_popcount(c->data);
+    }
+    return 1;
+}
+
+uint64_t bm_cardinality(const Bitmap *b) {
+    uint64_t card = 0;
+    for (int i = 0; i < b->n; i++) {
+        card += b->cs[i].card;
+    }
+    return card;
+}
+
+int bm_copy(Bitmap *dst, const Bitmap *src) {
+    bm_clear(dst);
+    for (int i = 0; i < src->n; i++) {
+        BmContainer r;
+        if (!bm_container_copy(&r, &src->cs[i]) || !bm_append(dst, &r)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* out = a AND b. out must not alias a or b. Returns 1 on success. */
+int bm_and(Bitmap *out, const Bitmap *a, const Bitmap *b) {
+    bm_clear(out);
+    int i = 0, j = 0;
+    while (i < a->n && j < b->n) {
+        if (a->cs[i].key < b->cs[j].key) {
+            i++;
+        } else if (b->cs[j].key < a->cs[i].key) {
+            j++;
+        } else {
+            BmContainer r;
+            if (!bm_container_and(&r, &a->cs[i++], &b->cs[j++]) || !bm_append(out, &r)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* out = a AND NOT b. out must not alias a or b. */
+int bm_andnot(Bitmap *out, const Bitmap *a, const Bitmap *b) {
+    bm_clear(out);
+    int j = 0;
+    for (int i = 0; i < a->n; i++) {
+        while (j < b->n && b->cs[j].key < a->cs[i].key) {
+            j++;
+        }
+        BmContainer r;
+        int ok = (j < b->n && b->cs[j].key == a->cs[i].key)
+                     ? bm_container_andnot(&r, &a->cs[i], &b->cs[j])
+                     : bm_container_copy(&r, &a->cs[i]);
+        if (!ok || !bm_append(out, &r)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* out = a OR b. out must not alias a or b. */
+int bm_or(Bitmap *out, const Bitmap *a, const Bitmap *b) {
+    bm_clear(out);
+    int i = 0, j = 0;
+    while (i < a->n || j < b->n) {
+        BmContainer r;
+        int ok;
+        if (j == b->n || (i < a->n && a->cs[i].key < b->cs[j].key)) {
+            ok = bm_container_copy(&r, &a->cs[i++]);
+        } else if (i == a->n || b->cs[j].key < a->cs[i].key) {
+            ok = bm_container_copy(&r, &b->cs[j++]);
+        } else {
+            ok = bm_container_or(&r, &a->cs[i++], &b->cs[j++]);
+        }
+        if (!ok || !bm_append(out, &r)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Write up to max values in increasing order; returns how many were written */
+size_t bm_to_array(const Bitmap *b, uint32_t *out, size_t max) {
+    size_t n = 0;
+    for (int i = 0; i < b->n && n < max; i++) {
+        const BmContainer *c = &b->cs[i];
+        uint32_t base = (uint32_t)c->key << 16;
+        if (c->isBitset) {
+            const uint64_t *w = c->data;
+            for (int k = 0; k < BM_WORDS && n < max; k++) {
+                uint64_t bits = w[k];
+                while (bits && n < max) {
+                    out[n++] = base + (uint32_t)(k * 64 + __builtin_ctzll(bits));
+                    bits &= bits - 1;
+                }
+            }
+            continue;
+        }
+        const uint16_t *vals = c->data;
+        for (uint32_t k = 0; k < c->card && n < max; k++) {
+            out[n++] = base + vals[k];
+        }
+    }
+    return n;
+}
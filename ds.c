@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "lab5.h"
 
 /* ========== Node Functions ========== */
@@ -29,8 +35,10 @@ Node *create_question_node(const char *question) {
         free(initialNode);            // avoid memory leak
         return NULL;
     }
-    // Mark this node as a question (non-leaf)
+    // Mark this node as a question (non-leaf) owned by the malloc heap
     initialNode->isQuestion = 1;
+    initialNode->flags = 0;
+    initialNode->visits = 0;
     // Initialize child pointers to NULL; children will be assigned later
     initialNode->yes = NULL;
     initialNode->no = NULL;
@@ -58,49 +66,343 @@ Node *create_animal_node(const char *animal) {
         free(initialNode);
         return NULL;
     }
-    // Mark this node as a leaf (not a question)
+    // Mark this node as a leaf (not a question) owned by the malloc heap
     initialNode->isQuestion = 0;
+    initialNode->flags = 0;
+    initialNode->visits = 0;
     // Leaves have no children
     initialNode->yes = NULL;
     initialNode->no = NULL;
     return initialNode;
 }
 
-/* TODO 3: Implement free_tree (recursive)
- * - This is one of the few recursive functions allowed
- * - Base case: if node is NULL, return
- * - Recursively free left subtree (yes)
- * - Recursively free right subtree (no)
- * - Free the text string
- * - Free the node itself
- * IMPORTANT: Free children before freeing the parent!
+/* TODO 3: Implement free_tree
+ * - Free every node of the tree and its text string
+ * - Free children before (or without ever revisiting) the parent
+ * 
+ * No recursion and no stack: whenever the current node has a yes child,
+ * rotate that child up (it becomes the parent, the old node its no child).
+ * Once the current node has no yes child it is freed and the walk moves on
+ * to its no child. Every rotation puts one node on the final no-chain, so
+ * the whole tree is freed in O(n) time and O(1) extra memory however deep
+ * it is.
  */
 void free_tree(Node *node) {
-    // If node is NULL there's nothing to free (base case)
-    if (node == NULL) {
+    // Arena trees are dropped as a whole by arena_release()
+    if (node == NULL || (node->flags & NODE_ARENA)) {
         return;
     }
-    // Recursively free the 'yes' subtree first
-    free_tree(node->yes); 
-    // Then recursively free the 'no' subtree
-    free_tree(node->no); 
-    // Free the string owned by this node
-    free(node->text);
-    // Finally free the node itself
-    free(node);
-} 
+    while (node != NULL) {
+        Node *yes = node->yes;
+        if (yes != NULL && (yes->flags & NODE_ARENA)) {
+            // Arena subtrees belong to their arena: detach without touching them
+            node->yes = NULL;
+            continue;
+        }
+        if (yes != NULL) {
+            // Rotate right: yes becomes the parent of node
+            node->yes = yes->no;
+            yes->no = node;
+            node = yes;
+            continue;
+        }
+        Node *next = node->no;
+        if (next != NULL && (next->flags & NODE_ARENA)) {
+            next = NULL;
+        }
+        // Free the string owned by this node, then the node itself
+        free(node->text);
+        free(node);
+        node = next;
+    }
+}
 
-/* TODO 4: Implement count_nodes (recursive)
- * - Base case: if root is NULL, return 0
- * - Return 1 + count of left subtree + count of right subtree
+/* TODO 4: Implement count_nodes
+ * - If root is NULL, return 0
+ * - Otherwise count root plus every node in both subtrees
+ * 
+ * Iterative: walk down yes children and keep the pending no subtrees on an
+ * explicit stack. A no child that is a leaf is counted on the spot, so
+ * chains (the usual shape of a deep learned tree) use O(1) stack.
+ * The tree is only read, never modified.
  */
 int count_nodes(Node *root) {
-    // Base case: empty subtree contributes 0 to the count
     if (root == NULL) {
         return 0;
     }
-    // Count this node (1) plus nodes in both subtrees (recursive)
-    return 1 + count_nodes(root->yes) + count_nodes(root->no);
+    int cap = 64, top = 0, total = 0;
+    Node **stack = malloc(cap * sizeof(Node *));
+    if (stack == NULL) {
+        return -1;
+    }
+    stack[top++] = root;
+    while (top > 0) {
+        Node *node = stack[--top];
+        while (node != NULL) {
+            total++;
+            Node *no = node->no;
+            if (no != NULL && no->yes == NULL && no->no == NULL) {
+                total++; // leaf: nothing left to visit below it
+            } else if (no != NULL) {
+                if (top == cap) {
+                    cap *= 2;
+                    Node **grown = realloc(stack, cap * sizeof(Node *));
+                    if (grown == NULL) {
+                        free(stack);
+                        return -1;
+                    }
+                    stack = grown;
+                }
+                stack[top++] = no;
+            }
+            node = node->yes;
+        }
+    }
+    free(stack);
+    return total;
+}
+
+/* ========== Node Arena ========== */
+
+/* Allocate a new block able to hold at least cap payload bytes */
+static ArenaBlock *arena_block_new(size_t cap) {
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + cap);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->next = NULL;
+    b->used = 0;
+    b->cap = cap;
+    return b;
+}
+
+void arena_init(NodeArena *a) {
+    if (a == NULL) {
+        return;
+    }
+    a->slabs = NULL;
+    a->text = NULL;
+    a->nodes = 0;
+    a->map = NULL;
+    a->mapLen = 0;
+    a->freeNodes = NULL;
+    a->freeText = NULL;
+}
+
+/* Bytes a string of length len takes in a text block. Never less than a
+ * pointer, so every freed string can hold its free-list link.
+ */
+static size_t arena_text_size(size_t len) {
+    return len + 1 < sizeof(char *) ? sizeof(char *) : len + 1;
+}
+
+/* Copy len bytes of s into the current string block (plus terminator).
+ * Strings larger than a block get a dedicated block so the bump pointer
+ * of the shared block is not wasted.
+ */
+char *arena_strndup(NodeArena *a, const char *s, size_t len) {
+    if (a == NULL || s == NULL) {
+        return NULL;
+    }
+    size_t need = arena_text_size(len);
+    if (need < ARENA_TEXT_CLASSES && a->freeText != NULL && a->freeText[need] != NULL) {
+        // Reuse a freed string of exactly this size
+        char *dst = a->freeText[need];
+        memcpy(&a->freeText[need], dst, sizeof(char *));
+        memcpy(dst, s, len);
+        dst[len] = '\0';
+        return dst;
+    }
+    ArenaBlock *b = a->text;
+    if (b == NULL || b->cap - b->used < need) {
+        if (need > ARENA_TEXT_BLOCK / 4) {
+            // Oversized string: own block, linked behind the current one
+            ArenaBlock *big = arena_block_new(need);
+            if (big == NULL) {
+                return NULL;
+            }
+            if (b == NULL) {
+                a->text = big;
+            } else {
+                big->next = b->next;
+                b->next = big;
+            }
+            big->used = need;
+            memcpy(big->data, s, len);
+            big->data[len] = '\0';
+            return big->data;
+        }
+        b = arena_block_new(ARENA_TEXT_BLOCK);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->next = a->text;
+        a->text = b;
+    }
+    char *dst = b->data + b->used;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    b->used += need;
+    return dst;
+}
+
+/* Hand out the next Node slot, starting a new slab when the current one is full */
+static Node *arena_node(NodeArena *a, const char *text, int isQuestion) {
+    if (a == NULL || text == NULL) {
+        return NULL;
+    }
+    char *copy;
+    Node *n = a->freeNodes;
+    if (n != NULL) {
+        copy = arena_strndup(a, text, strlen(text));
+        if (copy == NULL) {
+            return NULL;
+        }
+        a->freeNodes = n->yes;
+        goto fill;
+    }
+    ArenaBlock *slab = a->slabs;
+    if (slab == NULL || slab->used == slab->cap) {
+        slab = malloc(sizeof(ArenaBlock) + ARENA_SLAB_NODES * sizeof(Node));
+        if (slab == NULL) {
+            return NULL;
+        }
+        // For slabs, used/cap count Node slots rather than bytes
+        slab->used = 0;
+        slab->cap = ARENA_SLAB_NODES;
+        slab->next = a->slabs;
+        a->slabs = slab;
+    }
+    copy = arena_strndup(a, text, strlen(text));
+    if (copy == NULL) {
+        return NULL;
+    }
+    n = (Node *)slab->data + slab->used++;
+fill:
+    n->text = copy;
+    n->yes = NULL;
+    n->no = NULL;
+    n->isQuestion = isQuestion;
+    n->flags = NODE_ARENA;
+    n->visits = 0;
+    a->nodes++;
+    return n;
+}
+
+/* Reserve n contiguous, uninitialized Node slots in a slab of their own.
+ * Used by loaders that know the node count up front.
+ */
+Node *arena_node_block(NodeArena *a, size_t n) {
+    if (a == NULL || n == 0) {
+        return NULL;
+    }
+    ArenaBlock *slab = malloc(sizeof(ArenaBlock) + n * sizeof(Node));
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->used = n;
+    slab->cap = n;
+    // Link behind the current slab so arena_node keeps filling that one
+    if (a->slabs == NULL) {
+        slab->next = NULL;
+        a->slabs = slab;
+    } else {
+        slab->next = a->slabs->next;
+        a->slabs->next = slab;
+    }
+    a->nodes += n;
+    return (Node *)slab->data;
+}
+
+/* Make the arena own a file mapping; it is unmapped by arena_release() */
+void arena_adopt_mapping(NodeArena *a, void *map, size_t len) {
+    if (a == NULL) {
+        return;
+    }
+    if (a->map != NULL) {
+        munmap(a->map, a->mapLen);
+    }
+    a->map = map;
+    a->mapLen = len;
+}
+
+/* Move the string blocks of from into a, leaving from without text.
+ * Lets threads fill private arenas that end up owned by one tree.
+ */
+void arena_adopt_text(NodeArena *a, NodeArena *from) {
+    if (a == NULL || from == NULL || from->text == NULL) {
+        return;
+    }
+    ArenaBlock *last = from->text;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    if (a->text == NULL) {
+        a->text = from->text;
+    } else {
+        // Behind a's current block, which keeps taking new strings
+        last->next = a->text->next;
+        a->text->next = from->text;
+    }
+    from->text = NULL;
+}
+
+/* Give a node detached for good back to the arena. Its slot is handed out
+ * again before new slabs are touched, and its text (unless it lives in the
+ * file mapping or is longer than the size classes) before string blocks
+ * are bumped.
+ */
+void arena_free_node(NodeArena *a, Node *n) {
+    if (a == NULL || n == NULL) {
+        return;
+    }
+    char *text = n->text;
+    int mapped = a->map != NULL && text >= (char *)a->map && text < (char *)a->map + a->mapLen;
+    if (text != NULL && !mapped) {
+        size_t size = arena_text_size(strlen(text));
+        if (a->freeText == NULL && size < ARENA_TEXT_CLASSES) {
+            a->freeText = calloc(ARENA_TEXT_CLASSES, sizeof(char *));
+        }
+        if (a->freeText != NULL && size < ARENA_TEXT_CLASSES) {
+            memcpy(text, &a->freeText[size], sizeof(char *));
+            a->freeText[size] = text;
+        }
+    }
+    n->text = NULL;
+    n->no = NULL;
+    n->yes = a->freeNodes;
+    a->freeNodes = n;
+    a->nodes--;
+}
+
+Node *arena_question_node(NodeArena *a, const char *question) {
+    return arena_node(a, question, 1);
+}
+
+Node *arena_animal_node(NodeArena *a, const char *animal) {
+    return arena_node(a, animal, 0);
+}
+
+/* Drop every node and string of the arena: O(number of slabs/blocks) */
+void arena_release(NodeArena *a) {
+    if (a == NULL) {
+        return;
+    }
+    epoch_forget_arena(a);
+    ArenaBlock *lists[2] = {a->slabs, a->text};
+    for (int i = 0; i < 2; i++) {
+        ArenaBlock *b = lists[i];
+        while (b != NULL) {
+            ArenaBlock *next = b->next;
+            free(b);
+            b = next;
+        }
+    }
+    if (a->map != NULL) {
+        munmap(a->map, a->mapLen);
+    }
+    free(a->freeText);
+    arena_init(a);
 }
 
 /* ========== Frame Stack (for iterative tree traversal) ========== */
@@ -209,6 +511,7 @@ void es_init(EditStack *s) {
     s->edits = malloc(16 * sizeof(Edit));
     s->capacity = 16;
     s->size = 0;
+    s->bytes = 0;
 }
 
 /* TODO 11: Implement es_push
@@ -229,6 +532,7 @@ void es_push(EditStack *s, Edit e) {
     // Append the edit and increment size
     s->edits[s->size] = e;
     s->size = s->size + 1;
+    s->bytes += edit_cost(&e);
 }
 
 /* TODO 12: Implement es_pop
@@ -242,6 +546,7 @@ Edit es_pop(EditStack *s) {
     }
     // Decrement size and return the last pushed edit
     s->size = s->size - 1;
+    s->bytes -= edit_cost(&s->edits[s->size]);
     return s->edits[s->size];
 }
 
@@ -266,6 +571,7 @@ void es_clear(EditStack *s) {
         return;
     }
     s->size = 0;
+    s->bytes = 0;
 }
 void es_free(EditStack *s) {
     if(s == NULL) {return;}
@@ -273,92 +579,117 @@ void es_free(EditStack *s) {
     s->edits = NULL;
     s->size = 0;
     s->capacity = 0;
+    s->bytes = 0;
 }
 void free_edit_stack(EditStack *s) {
     es_free(s);
 }
 
+/* Memory an edit accounts for in the journal: the record itself plus the
+ * nodes it alone can keep alive (the split's two nodes once undone, or a
+ * whole tree for a rebuild).
+ */
+size_t edit_cost(const Edit *e) {
+    size_t held = e->type == EDIT_REBUILD ? (size_t)e->treeNodes : 2;
+    return sizeof(Edit) + held * sizeof(Node);
+}
+
+/* Remove the k oldest edits (the bottom of the stack) */
+void es_drop_oldest(EditStack *s, int k) {
+    if (s == NULL || k <= 0) {
+        return;
+    }
+    if (k > s->size) {
+        k = s->size;
+    }
+    for (int i = 0; i < k; i++) {
+        s->bytes -= edit_cost(&s->edits[i]);
+    }
+    memmove(s->edits, s->edits + k, (s->size - k) * sizeof(Edit));
+    s->size -= k;
+}
+
 /* ========== Queue (for BFS traversal) ========== */
 
 /* TODO 15: Implement q_init
- * - Set front and rear to NULL
- * - Set size to 0
+ * - Start with an empty ring (the buffer is allocated on first enqueue)
+ * - Set head and size to 0
  */
 void q_init(Queue *q) {
-    // Initialize queue pointers and size
+    // Initialize ring buffer fields
     if (q == NULL) {
         return;
     }
-    q->front = NULL;
-    q->rear = NULL;
+    q->items = NULL;
+    q->head = 0;
     q->size = 0;
+    q->capacity = 0;
+}
+
+/* Double the ring (16 slots at first), unwrapping the elements so the
+ * front lands at index 0 of the new buffer. Returns 0 on allocation failure.
+ */
+static int q_grow(Queue *q) {
+    int newCapacity = q->capacity ? 2 * q->capacity : 16;
+    QueueNode *items = malloc(newCapacity * sizeof(QueueNode));
+    if (items == NULL) {
+        return 0;
+    }
+    // Copy [head, end) then the wrapped part [0, head)
+    int first = q->capacity - q->head;
+    if (first > q->size) {
+        first = q->size;
+    }
+    if (q->size > 0) {
+        memcpy(items, q->items + q->head, first * sizeof(QueueNode));
+        memcpy(items + first, q->items, (q->size - first) * sizeof(QueueNode));
+    }
+    free(q->items);
+    q->items = items;
+    q->head = 0;
+    q->capacity = newCapacity;
+    return 1;
 }
 
 /* TODO 16: Implement q_enqueue
- * - Allocate a new QueueNode
- * - Set its treeNode and id fields
- * - Set its next pointer to NULL
- * - If queue is empty (rear == NULL):
- *   - Set both front and rear to the new node
- * - Otherwise:
- *   - Link rear->next to the new node
- *   - Update rear to point to the new node
+ * - Grow the ring if it is full
+ * - Store treeNode and id in the slot after the last element
  * - Increment size
+ * - Return 1, or 0 if the ring could not grow (nothing is added)
  */
-void q_enqueue(Queue *q, Node *node, int id) {
-    // Enqueue a new QueueNode at the tail of the list
+int q_enqueue(Queue *q, Node *node, int id) {
+    // Append at the tail slot of the ring
     if (q == NULL) {
-        return;
+        return 0;
     }
-    QueueNode *new = malloc(sizeof(QueueNode));
-    new->treeNode = node; // store pointer to the tree node
-    new->id = id;         // store the supplied id (used during mapping)
-    new->next = NULL;     // new tail has no next
-    // If queue empty, both front and rear point to new node
-    if (q->rear == NULL) {
-        q->front = new;
-        q->rear = new;
-    } else {
-        // Otherwise append after rear and update rear
-        q->rear->next = new;
-        q->rear = new;
+    if (q->size == q->capacity && !q_grow(q)) {
+        return 0; // allocation failure: the caller must give up
     }
-    // Increment size counter
+    int tail = (q->head + q->size) & (q->capacity - 1);
+    q->items[tail].treeNode = node; // store pointer to the tree node
+    q->items[tail].id = id;         // store the supplied id (used during mapping)
     q->size = q->size + 1;
+    return 1;
 }
 
 /* TODO 17: Implement q_dequeue
- * - If queue is empty (front == NULL), return 0
- * - Save the front node's data to output parameters (*node, *id)
- * - Save front in a temp variable
- * - Move front to front->next
- * - If front is now NULL, set rear to NULL too
- * - Free the temp node
+ * - If queue is empty, return 0
+ * - Save the front element's data to output parameters (*node, *id)
+ * - Advance head (wrapping with the capacity mask)
  * - Decrement size
  * - Return 1
  */
 int q_dequeue(Queue *q, Node **node, int *id) {
-    // Dequeue from the head of the queue and return its data
-    if (q == NULL) {
-        return 0; // invalid queue
-    }
-    // Empty queue -> nothing to dequeue
-    if (q->front == NULL) {
-        return 0;
+    // Dequeue from the head of the ring and return its data
+    if (q == NULL || q->size == 0) {
+        return 0; // invalid or empty queue
     }
     // Return values to caller via out parameters
-    *node = q->front->treeNode;
-    *id = q->front->id;
-    // Remove the front node from the list
-    QueueNode *temp = q->front;
-    q->front = q->front->next;
-    // If queue is now empty, clear rear pointer
-    if (q->front == NULL) {
-        q->rear = NULL;
-    }
-    free(temp);           // free removed QueueNode
-    q->size = q->size - 1; // decrement size
-    return 1;             // success
+    *node = q->items[q->head].treeNode;
+    *id = q->items[q->head].id;
+    q->head = (q->head + 1) & (q->capacity - 1);
+    q->size = q->size - 1;
+    return 1; // success
 }
 
 /* TODO 18: Implement q_empty
@@ -371,24 +702,170 @@ int q_empty(Queue *q) {
     return 0;
 }
 
+/* Drop all elements but keep the buffer for the next pass */
+void q_clear(Queue *q) {
+    if (q == NULL) {
+        return;
+    }
+    q->head = 0;
+    q->size = 0;
+}
+
 /* TODO 19: Implement q_free
- * - Dequeue all remaining nodes
- * - Use a loop with q_dequeue until queue is empty
+ * - Free the ring buffer and reset to the empty state
  */
 void q_free(Queue *q) {
-    // Remove and free all remaining QueueNodes
     if (q == NULL) {
         return;
     }
-    Node *dummyNode;
-    int dummyId;
-    while (!q_empty(q)) {
-        q_dequeue(q, &dummyNode, &dummyId); // q_dequeue frees nodes internally
+    free(q->items);
+    q_init(q);
+}
+
+/* ========== Parallel jobs ========== */
+
+static int g_jobSerial;  /* run every job on the calling thread */
+
+/* With serial set, job_threads() says 1 and run_jobs() starts no threads.
+ * A child forked from a threaded process sets it: only the forking thread
+ * lives on in the child, and it must not start others.
+ */
+void job_set_serial(int serial) {
+    g_jobSerial = serial;
+}
+
+/* One thread per online CPU, at most JOB_MAX_THREADS and at most pieces */
+int job_threads(uint64_t pieces) {
+    if (g_jobSerial) {
+        return 1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus < 1 ? 1 : cpus > JOB_MAX_THREADS ? JOB_MAX_THREADS : (int)cpus;
+    return pieces < (uint64_t)n ? (int)(pieces ? pieces : 1) : n;
+}
+
+/* Run fn on each of n (at most JOB_MAX_THREADS) jobs of size bytes, in
+ * parallel. Job 0 runs on this thread; so does any job whose thread fails
+ * to start, and every job when job_set_serial is on.
+ */
+void run_jobs(void *(*fn)(void *), void *jobs, size_t size, int n) {
+    pthread_t threads[JOB_MAX_THREADS];
+    int started[JOB_MAX_THREADS] = {0};
+    for (int t = 1; t < n && !g_jobSerial; t++) {
+        started[t] = pthread_create(&threads[t], NULL, fn, (char *)jobs + t * size) == 0;
+    }
+    for (int t = 0; t < n; t++) {
+        if (!started[t]) {
+            fn((char *)jobs + t * size);
+        }
+    }
+    for (int t = 1; t < n; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
     }
 }
 
 /* ========== Hash Table ========== */
 
+/* Canonical form of every byte: lowercase letters and digits map to
+ * themselves, uppercase to lowercase, space to '_', anything else to 0
+ * (dropped).
+ */
+static const unsigned char canon_map[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x5f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* Canonicalize len bytes of s into out, which must hold len + 1 bytes (the
+ * canonical form is never longer than its input). Returns the canonical
+ * length. Runs of 16 bytes that contain only letters, digits and spaces
+ * are converted with SSE2 in one step; other runs go through canon_map.
+ */
+size_t canonicalize_into(const char *s, size_t len, char *out) {
+    const unsigned char *in = (const unsigned char *)s;
+    size_t i = 0, j = 0;
+#ifdef __SSE2__
+    const __m128i upperLo = _mm_set1_epi8('A' - 1), upperHi = _mm_set1_epi8('Z' + 1);
+    const __m128i lowerLo = _mm_set1_epi8('a' - 1), lowerHi = _mm_set1_epi8('z' + 1);
+    const __m128i digitLo = _mm_set1_epi8('0' - 1), digitHi = _mm_set1_epi8('9' + 1);
+    const __m128i space = _mm_set1_epi8(' '), underscore = _mm_set1_epi8('_');
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        // Signed compares: bytes >= 0x80 fall in no class and force the slow path
+        __m128i isUpper = _mm_and_si128(_mm_cmpgt_epi8(v, upperLo), _mm_cmplt_epi8(v, upperHi));
+        __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(v, lowerLo), _mm_cmplt_epi8(v, lowerHi));
+        __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(v, digitLo), _mm_cmplt_epi8(v, digitHi));
+        __m128i isSpace = _mm_cmpeq_epi8(v, space);
+        __m128i keep = _mm_or_si128(_mm_or_si128(isUpper, isLower), _mm_or_si128(isDigit, isSpace));
+        if (_mm_movemask_epi8(keep) != 0xFFFF) {
+            break;  // punctuation or non-ASCII ahead: finish with the table
+        }
+        v = _mm_or_si128(v, _mm_and_si128(isUpper, caseBit));
+        v = _mm_or_si128(_mm_andnot_si128(isSpace, v), _mm_and_si128(isSpace, underscore));
+        _mm_storeu_si128((__m128i *)(out + j), v);
+        i += 16;
+        j += 16;
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char c = canon_map[in[i]];
+        out[j] = (char)c;
+        j += (c != 0);  // branch-free drop of unmapped characters
+    }
+    out[j] = '\0';
+    return j;
+}
+
+/* Canonicalize into a per-thread scratch buffer that is reused across
+ * calls, so bulk work does not touch the allocator once the buffer is big
+ * enough. The result is valid until the next call on the same thread.
+ */
+static __thread char *scratch = NULL;
+static __thread size_t scratchCap = 0;
+
+const char *canonicalize_tmp(const char *s) {
+    size_t len = strlen(s);
+    if (len + 1 > scratchCap) {
+        size_t newCap = scratchCap ? scratchCap : 256;
+        while (newCap < len + 1) {
+            newCap *= 2;
+        }
+        char *grown = realloc(scratch, newCap);
+        if (grown == NULL) {
+            return NULL;
+        }
+        scratch = grown;
+        scratchCap = newCap;
+    }
+    canonicalize_into(s, len, scratch);
+    return scratch;
+}
+
+/* Free the calling thread's canonicalize_tmp buffer; threads that use it
+ * call this before they exit.
+ */
+void canonicalize_tmp_release(void) {
+    free(scratch);
+    scratch = NULL;
+    scratchCap = 0;
+}
+
 /* TODO 20: Implement canonicalize
  * Convert a string to canonical form for hashing:
  * - Convert to lowercase
@@ -397,15 +874,8 @@ void q_free(Queue *q) {
  * - Remove punctuation
  * Example: "Does it meow?" -> "does_it_meow"
  * 
- * Steps:
- * - Allocate result buffer (strlen(s) + 1)
- * - Iterate through input string
- * - For each character:
- *   - If alphanumeric: add lowercase version to result
- *   - If whitespace: add underscore
- *   - Otherwise: skip it
- * - Null-terminate result
- * - Return the new string
+ * Returns a new heap string; canonicalize_into/canonicalize_tmp are the
+ * allocation-free variants.
  */
 char *canonicalize(const char *s) {
     // Allocate a result buffer at most as long as the input (plus terminator)
@@ -414,143 +884,297 @@ char *canonicalize(const char *s) {
     if (result == NULL) {
         return NULL; // allocation failed
     }
-    int j = 0;
-    for (size_t i = 0; i < len; i++) {
-        unsigned char c = (unsigned char)s[i];
-        // If uppercase letter, convert to lowercase
-        if (c >= 'A' && c <= 'Z') {
-            result[j++] = (char)(c + ('a' - 'A'));
+    canonicalize_into(s, len, result);
+    return result;
+}
+
+/* ---- wyhash-style 64-bit hash ----
+ * Reads the key 8 or 16 bytes at a time and folds it with 64x64->128-bit
+ * multiplies, so one pass over the bytes is all it costs. The length and
+ * a seed are mixed into the result.
+ */
+static const uint64_t wyp[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_r8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wy_r4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t h_hash64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    uint64_t a, b;
+    seed ^= wy_mix(seed ^ wyp[0], wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping 4-byte reads from each end cover 4..16 bytes
+            size_t mid = (len >> 3) << 2;
+            a = (wy_r4(p) << 32) | wy_r4(p + mid);
+            b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
         }
-        // Accept lowercase letters and digits unchanged
-        else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
-            result[j++] = (char)c;
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // Three independent lanes keep the multipliers busy on long keys
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_r8(p) ^ wyp[1], wy_r8(p + 8) ^ seed);
+                see1 = wy_mix(wy_r8(p + 16) ^ wyp[2], wy_r8(p + 24) ^ see1);
+                see2 = wy_mix(wy_r8(p + 32) ^ wyp[3], wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
         }
-        // Replace whitespace with underscore to keep tokens readable
-        else if (c == ' ') {
-            result[j++] = '_';
+        while (i > 16) {
+            seed = wy_mix(wy_r8(p) ^ wyp[1], wy_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
         }
-        // Silently skip all other punctuation characters
+        // Last 16 bytes, overlapping what was already consumed
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
     }
-    // Null-terminate the canonical string
-    result[j] = '\0';
-    return result;
+    __uint128_t r = (__uint128_t)(a ^ wyp[1]) * (b ^ seed);
+    return wy_mix((uint64_t)r ^ wyp[0] ^ len, (uint64_t)(r >> 64) ^ wyp[1]);
 }
 
-/* TODO 21: Implement h_hash (djb2 algorithm)
- * unsigned hash = 5381;
- * For each character c in the string:
- *   hash = ((hash << 5) + hash) + c;  // hash * 33 + c
- * Return hash
+/* TODO 21: Implement h_hash
+ * 32-bit form of the table hash: h_hash64 of the key with HASH_SEED.
+ * (djb2 evaluated strlen(s) on every iteration, which made it O(len^2).)
  */
 unsigned h_hash(const char *s) {
-    //start with 5381
-    unsigned int hash = 5381;
-    // Iterate over each byte of the string and update hash = hash * 33 + c
-    for (size_t i = 0; i < strlen(s); i++) {
-        hash = ((hash << 5) + hash) + (unsigned char)s[i];
+    return (unsigned)h_hash64(s, strlen(s), HASH_SEED);
+}
+
+/* Match mask of the control bytes in the group at ctrl equal to b:
+ * bit i is set when ctrl[i] == b.
+ */
+static inline unsigned h_group_match(const int8_t *ctrl, int8_t b) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b)));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < HASH_GROUP; i++) {
+        if (ctrl[i] == b) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/* Find the slot holding key, or -1. The probe sequence visits groups
+ * g, g+1, g+3, g+6, ... which covers every group of a power-of-two table;
+ * a group with an empty slot ends the search since keys are never removed.
+ */
+static int h_find(const Hash *h, const char *key, uint64_t hash) {
+    if (h->nslots == 0) {
+        return -1;
+    }
+    int8_t h2 = (int8_t)(hash & 0x7f);
+    uint64_t groupMask = (uint64_t)(h->nslots / HASH_GROUP) - 1;
+    uint64_t g = (hash >> 7) & groupMask;
+    for (unsigned step = 1; ; step++) {
+        const int8_t *ctrl = h->ctrl + g * HASH_GROUP;
+        unsigned match = h_group_match(ctrl, h2);
+        while (match) {
+            int slot = (int)(g * HASH_GROUP) + __builtin_ctz(match);
+            // The cached full hash rules out nearly every tag collision
+            // before the key string is touched
+            if (h->slots[slot].hash == hash && !strcmp(h->slots[slot].key, key)) {
+                return slot;
+            }
+            match &= match - 1;
+        }
+        if (h_group_match(ctrl, HASH_EMPTY)) {
+            return -1;
+        }
+        g = (g + step) & groupMask;
+    }
+}
+
+/* First empty slot on the probe sequence of hash (the table is never full) */
+static int h_find_empty(const Hash *h, uint64_t hash) {
+    uint64_t groupMask = (uint64_t)(h->nslots / HASH_GROUP) - 1;
+    uint64_t g = (hash >> 7) & groupMask;
+    for (unsigned step = 1; ; step++) {
+        unsigned empty = h_group_match(h->ctrl + g * HASH_GROUP, HASH_EMPTY);
+        if (empty) {
+            return (int)(g * HASH_GROUP) + __builtin_ctz(empty);
+        }
+        g = (g + step) & groupMask;
+    }
+}
+
+/* Allocate nslots empty slots (nslots is a power of two >= HASH_GROUP) */
+static int h_alloc(Hash *h, int nslots) {
+    // Control bytes are loaded 16 at a time, so keep them 16-byte aligned
+    void *ctrlMem = NULL;
+    if (posix_memalign(&ctrlMem, HASH_GROUP, nslots) != 0) {
+        return 0;
+    }
+    int8_t *ctrl = ctrlMem;
+    Entry *slots = malloc(nslots * sizeof(Entry));
+    if (ctrl == NULL || slots == NULL) {
+        free(ctrl);
+        free(slots);
+        return 0;
+    }
+    memset(ctrl, HASH_EMPTY, nslots);
+    h->ctrl = ctrl;
+    h->slots = slots;
+    h->nslots = nslots;
+    return 1;
+}
+
+/* Double the table and reinsert every entry, reusing the cached hashes */
+static int h_grow(Hash *h) {
+    Hash bigger = *h;
+    if (!h_alloc(&bigger, h->nslots ? 2 * h->nslots : HASH_GROUP)) {
+        return 0;
     }
-    return hash;
+    for (int i = 0; i < h->nslots; i++) {
+        if (h->ctrl[i] != HASH_EMPTY) {
+            uint64_t hash = h->slots[i].hash;
+            int slot = h_find_empty(&bigger, hash);
+            bigger.ctrl[slot] = (int8_t)(hash & 0x7f);
+            bigger.slots[slot] = h->slots[i];
+        }
+    }
+    free(h->ctrl);
+    free(h->slots);
+    *h = bigger;
+    return 1;
 }
 
 /* TODO 22: Implement h_init
- * - Allocate buckets array using calloc (initializes to NULL)
- * - Set nbuckets field
+ * - Round nbuckets up to a power of two (at least one group)
+ * - Allocate control bytes (all HASH_EMPTY) and the slot array
  * - Set size to 0
  */
 void h_init(Hash *h, int nbuckets) {
     if (h == NULL) {
         return;
     }
-    // Allocate array of bucket pointers and zero-initialize them
-    h->buckets = calloc(nbuckets, sizeof(Entry *));
-    h->nbuckets = nbuckets;
+    int nslots = HASH_GROUP;
+    while (nslots < nbuckets) {
+        nslots *= 2;
+    }
+    h->ctrl = NULL;
+    h->slots = NULL;
+    h->nslots = 0;
     h->size = 0; // no entries yet
+    h_alloc(h, nslots);
+}
+
+/* Where vals keeps its ids: inside the entry until they outgrow it */
+static inline int *id_data(const IdList *vals) {
+    return vals->capacity > ID_INLINE ? vals->ids : (int *)vals->inl;
+}
+
+/* Index of the first id in vals that is >= id */
+static int id_lower_bound(const IdList *vals, int id) {
+    const int *ids = id_data(vals);
+    int lo = 0, hi = vals->count;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
 /* TODO 23: Implement h_put
  * Add animalId to the list for the given key
  * 
  * Steps:
- * 1. Compute bucket index: idx = h_hash(key) % nbuckets
- * 2. Search the chain at buckets[idx] for an entry with matching key
- * 3. If found:
- *    - Check if animalId already exists in the vals list
- *    - If yes, return 0 (no change) 
- *    - If no, add animalId to vals.ids array (resize if needed), return 1
- * 4. If not found:
- *    - Create new Entry with strdup(key)
- *    - Initialize vals with initial capacity (e.g., 4)
+ * 1. Look the key up by its hash
+ * 2. If found:
+ *    - Binary search the sorted vals list for animalId
+ *    - If present, return 0 (no change) 
+ *    - If not, insert it in order (resize if needed), return 1
+ * 3. If not found:
+ *    - Grow the table if it would pass 7/8 full
+ *    - Store strdup(key) in the first empty slot of the probe sequence
+ *    - Initialize vals inline (ID_INLINE ids fit in the entry)
  *    - Add animalId as first element
- *    - Insert at head of chain (buckets[idx])
  *    - Increment h->size
  *    - Return 1
  */
 int h_put(Hash *h, const char *key, int animalId) {
-    // Compute the bucket index using the hash of the key
-    int idx = h_hash(key) % h->nbuckets;
-
-    // Walk the chain to see if the key already exists
-    Entry *current = h->buckets[idx];
-    while (current != NULL) {
-        if (!strcmp(current->key, key)) {
-            // Key found; check if animalId already present
-            for (int i = 0; i < current->vals.count; i++) {
-                if (current->vals.ids[i] == animalId) {
-                    return 0; // no change needed
-                }
+    uint64_t hash = h_hash64(key, strlen(key), HASH_SEED);
+    int slot = h_find(h, key, hash);
+    if (slot >= 0) {
+        Entry *current = &h->slots[slot];
+        // Key found; ids are kept sorted, so find animalId's position
+        int pos = id_lower_bound(&current->vals, animalId);
+        if (pos < current->vals.count && id_data(&current->vals)[pos] == animalId) {
+            return 0; // no change needed
+        }
+        // Need to insert animalId into the existing vals array; grow if full
+        if (current->vals.capacity == current->vals.count) {
+            int newCapacity = 2 * current->vals.capacity;
+            int *grown;
+            if (current->vals.capacity > ID_INLINE) {
+                grown = realloc(current->vals.ids, newCapacity * sizeof(int));
+            } else if ((grown = malloc(newCapacity * sizeof(int))) != NULL) {
+                // Leaving the entry: move the inline ids out to the heap
+                memcpy(grown, current->vals.inl, current->vals.count * sizeof(int));
             }
-            // Need to append animalId to existing vals array; grow if full
-            if (current->vals.capacity == current->vals.count) {
-                int newCapacity;
-                if (current->vals.capacity == 0) {
-                    newCapacity = 4;
-                    current->vals.capacity = 4;
-                } else {
-                    newCapacity = 2 * current->vals.capacity;
-                }
-                current->vals.ids = realloc(current->vals.ids, newCapacity * sizeof(int));
-                if (current->vals.ids == NULL) {
-                    return 0; // allocation failure
-                }
-                current->vals.capacity = newCapacity;
+            if (grown == NULL) {
+                return 0; // allocation failure
             }
-
-            // Append id and update count
-            current->vals.ids[current->vals.count] = animalId;
-            current->vals.count++;
-            return 1; // inserted into existing entry
+            current->vals.ids = grown;
+            current->vals.capacity = newCapacity;
         }
-        current = current->next;
+        // Shift the larger ids up (nothing to move for the usual increasing ids)
+        int *ids = id_data(&current->vals);
+        memmove(&ids[pos + 1], &ids[pos], (current->vals.count - pos) * sizeof(int));
+        ids[pos] = animalId;
+        current->vals.count++;
+        return 1; // inserted into existing entry
     }
 
-    // Key not found: create a new Entry and insert at head of bucket chain
-    Entry *newE = malloc(sizeof(Entry));
-    if (newE == NULL) {
+    // Key not found: make room (load factor 7/8) and claim an empty slot
+    if ((long)(h->size + 1) * 8 > (long)h->nslots * 7 && !h_grow(h)) {
         return 0; // allocation failure
     }
-    h->size++; // one more distinct key in the table
-    newE->key = strdup(key); // copy the key string
-    if (newE->key == NULL) {
-        free(newE);
-        h->size--;
-        return 0;
-    }
-    // Initialize the value list with a small capacity
-    newE->vals.capacity = 4;
-    newE->vals.ids = malloc(newE->vals.capacity * sizeof(int));
-    if (newE->vals.ids == NULL) {
-        free(newE->key);
-        free(newE);
-        h->size--;
+    Entry newE;
+    newE.key = strdup(key); // copy the key string
+    if (newE.key == NULL) {
         return 0;
     }
-    // Store the single id and set count
-    newE->vals.ids[0] = animalId;
-    newE->vals.count = 1;
-    // Insert new entry at head of the chain
-    Entry *oldHead = h->buckets[idx];
-    h->buckets[idx] = newE;
-    newE->next = oldHead;
+    newE.hash = hash;       // cached for lookups and for every future resize
+    // Most keys map to a single id, so the list starts inside the entry
+    newE.vals.capacity = ID_INLINE;
+    newE.vals.inl[0] = animalId;
+    newE.vals.count = 1;
+    slot = h_find_empty(h, hash);
+    h->ctrl[slot] = (int8_t)(hash & 0x7f);
+    h->slots[slot] = newE;
+    h->size++; // one more distinct key in the table
     return 1; // success
 }
 
@@ -558,88 +1182,62 @@ int h_put(Hash *h, const char *key, int animalId) {
  * Check if the hash table contains the given key-animalId pair
  * 
  * Steps:
- * 1. Compute bucket index
- * 2. Search the chain for matching key
- * 3. If found, search vals.ids array for animalId
- * 4. Return 1 if found, 0 otherwise
+ * 1. Look the key up by its hash
+ * 2. If found, binary search the sorted vals.ids array for animalId
+ * 3. Return 1 if found, 0 otherwise
  */
 int h_contains(const Hash *h, const char *key, int animalId) {
-    // Locate bucket by hashing the key
-    int idx = h_hash(key) % h->nbuckets;
-    Entry *current = h->buckets[idx];
-    while (current != NULL) {
-        if (!strcmp(current->key, key)) {
-            // Found the key; search its id list
-            for (int i = 0; i < current->vals.count; i++) {
-                if (current->vals.ids[i] == animalId) {
-                    return 1; // pair exists
-                }
-            }
-        }
-        current = current->next;
+    int slot = h_find(h, key, h_hash64(key, strlen(key), HASH_SEED));
+    if (slot < 0) {
+        return 0; // not found
     }
-    return 0; // not found
+    // Found the key; binary search its sorted id list
+    const IdList *vals = &h->slots[slot].vals;
+    int pos = id_lower_bound(vals, animalId);
+    return pos < vals->count && id_data(vals)[pos] == animalId;
 }
 
 /* TODO 25: Implement h_get_ids
- * Return pointer to the ids array for the given key
+ * Return pointer to the ids array for the given key (not a copy)
  * Set *outCount to the number of ids
  * Return NULL if key not found
- * 
- * Steps:
- * 1. Compute bucket index
- * 2. Search chain for matching key
- * 3. If found:
- *    - Set *outCount = vals.count
- *    - Return vals.ids
- * 4. If not found:
- *    - Set *outCount = 0
- *    - Return NULL
  */
 int *h_get_ids(const Hash *h, const char *key, int *outCount) {
     // Return the ids array and its count for the given key
-    int idx = h_hash(key) % h->nbuckets;
-    Entry *current = h->buckets[idx];
-    while (current != NULL) {
-        if (!strcmp(current->key, key)) {
-            *outCount = current->vals.count;
-            return current->vals.ids; // caller must not free this
-        }
-        current = current->next;
+    int slot = h_find(h, key, h_hash64(key, strlen(key), HASH_SEED));
+    if (slot < 0) {
+        // Key not present
+        *outCount = 0;
+        return NULL;
     }
-    // Key not present
-    *outCount = 0;
-    return NULL;
+    *outCount = h->slots[slot].vals.count;
+    // Inline ids live in the slot: valid until the next h_put on this table
+    return id_data(&h->slots[slot].vals);
 }
 
 /* TODO 26: Implement h_free
  * Free all memory associated with the hash table
  * 
  * Steps:
- * - For each bucket:
- *   - Traverse the chain
- *   - For each entry:
- *     - Free the key string
- *     - Free the vals.ids array
- *     - Free the entry itself
- * - Free the buckets array
- * - Set buckets to NULL, size to 0
+ * - For each occupied slot:
+ *   - Free the key string
+ *   - Free the vals.ids array once it has left the entry
+ * - Free the control bytes and slot array
+ * - Reset to an empty table
  */
 void h_free(Hash *h) {
-    // Free all entries in all buckets
-    for (int i = 0; i < h->nbuckets; i++) {
-        Entry *current = h->buckets[i];
-        while (current != NULL) {
-            Entry *next = current->next;
-            free(current->key);       // free key string
-            free(current->vals.ids);  // free ids array
-            free(current);            // free Entry struct
-            current = next;
+    for (int i = 0; i < h->nslots; i++) {
+        if (h->ctrl[i] != HASH_EMPTY) {
+            free(h->slots[i].key);       // free key string
+            if (h->slots[i].vals.capacity > ID_INLINE) {
+                free(h->slots[i].vals.ids);  // free ids array
+            }
         }
     }
-
-    // Free the bucket array and reset state
-    free(h->buckets);
-    h->buckets = NULL;
+    free(h->ctrl);
+    free(h->slots);
+    h->ctrl = NULL;
+    h->slots = NULL;
+    h->nslots = 0;
     h->size = 0;
 }
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE  /* syscall */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include "lab5.h"
+
+/* ========== Epoch-Based Reclamation ==========
+ *
+ * Readers are session calls and server requests. A reader pins the
+ * global epoch on entry and unpins it before it returns; in between it
+ * may hold pointers to any node it has walked past, including nodes an
+ * undo detaches meanwhile. The writer retires detached nodes into the
+ * limbo list of the current epoch and frees them two epoch advances
+ * later, by which time every reader that could have seen them is done.
+ * Pins are short, so a game nobody is playing never holds memory back;
+ * games check their place in the tree again when they go on (session.c).
+ *
+ * A pin may be released on another thread than the one that took it, so
+ * each thread keeps two counters per epoch bucket: pins it took and pins
+ * it released. Only the owning thread writes its counters, with plain
+ * stores; live readers in a bucket are the sum of pins minus the sum of
+ * releases. The writer orders itself
+ * against readers with one membarrier() per advance instead of a fence
+ * on every pin.
+ */
+
+#define EPOCH_BUCKETS 3
+
+typedef struct EpochRecord {
+    uint64_t started[EPOCH_BUCKETS];
+    uint64_t ended[EPOCH_BUCKETS];
+    struct EpochRecord *next;
+    int inUse;                          /* owned by a live thread */
+} __attribute__((aligned(64))) EpochRecord;  // own cache line per thread
+
+typedef struct {
+    Node *node;
+    NodeArena *arena;   /* NULL for malloc'd nodes */
+} Retired;
+
+typedef struct {
+    Retired *items;
+    int size;
+    int capacity;
+} Limbo;
+
+static unsigned g_epoch;                /* written by the writer only */
+static EpochRecord *g_records;          /* every thread that ever pinned */
+static pthread_mutex_t g_recordLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_recordKey;
+static pthread_once_t g_recordOnce = PTHREAD_ONCE_INIT;
+static int g_noReclaim;                 /* a reader could not be tracked */
+static Limbo g_limbo[EPOCH_BUCKETS];    /* writer only */
+static int g_barrier = -1;              /* membarrier command, 0 = none */
+
+static __thread EpochRecord *self;
+
+/* ---- reader records ---- */
+
+static void record_release(void *rec) {
+    // Counts stay valid: a thread started later takes the record over
+    __atomic_store_n(&((EpochRecord *)rec)->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void record_key_init(void) {
+    pthread_key_create(&g_recordKey, record_release);
+}
+
+/* This thread's record, reusing one left behind by an exited thread */
+static EpochRecord *record_get(void) {
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&g_recordOnce, record_key_init);
+    pthread_mutex_lock(&g_recordLock);
+    EpochRecord *rec = g_records;
+    while (rec != NULL && __atomic_load_n(&rec->inUse, __ATOMIC_ACQUIRE)) {
+        rec = rec->next;
+    }
+    if (rec == NULL) {
+        rec = aligned_alloc(64, sizeof(EpochRecord));
+        if (rec != NULL) {
+            memset(rec, 0, sizeof(*rec));
+            rec->next = g_records;
+            g_records = rec;
+        }
+    }
+    if (rec != NULL) {
+        rec->inUse = 1;
+        pthread_setspecific(g_recordKey, rec);
+    }
+    pthread_mutex_unlock(&g_recordLock);
+    self = rec;
+    return rec;
+}
+
+/* Pin the current epoch for one reader; returns the epoch to unpin. Plain
+ * loads and stores only: no lock and no read-modify-write.
+ */
+unsigned epoch_pin(void) {
+    unsigned e = __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE);
+    EpochRecord *rec = record_get();
+    if (rec == NULL) {
+        __atomic_store_n(&g_noReclaim, 1, __ATOMIC_RELAXED);
+        return e;
+    }
+    uint64_t *slot = &rec->started[e % EPOCH_BUCKETS];
+    __atomic_store_n(slot, *slot + 1, __ATOMIC_RELAXED);
+    // Keep the compiler from hoisting tree loads above the pin; the CPU
+    // side is handled by the writer's membarrier
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return e;
+}
+
+/* Release a pin taken at epoch e, on any thread */
+void epoch_unpin(unsigned e) {
+    EpochRecord *rec = record_get();
+    if (rec == NULL) {
+        return;
+    }
+    uint64_t *slot = &rec->ended[e % EPOCH_BUCKETS];
+    // Release: the reader's loads from the tree happen before it counts as done
+    __atomic_store_n(slot, *slot + 1, __ATOMIC_RELEASE);
+}
+
+/* ---- writer side ---- */
+
+/* Make every reader's earlier pin visible before the counters are read */
+static int epoch_barrier(void) {
+    if (g_barrier < 0) {
+        g_barrier = 0;
+        if (syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0) {
+            g_barrier = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+        } else if (syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0) > 0) {
+            g_barrier = MEMBARRIER_CMD_GLOBAL;
+        }
+    }
+    return g_barrier != 0 && syscall(SYS_membarrier, g_barrier, 0, 0) == 0;
+}
+
+/* Pins in bucket b that have not been released */
+static uint64_t epoch_live(int b) {
+    uint64_t started = 0, ended = 0;
+    pthread_mutex_lock(&g_recordLock);
+    // Releases first: a pin counted as released then also shows as taken
+    for (EpochRecord *r = g_records; r != NULL; r = r->next) {
+        ended += __atomic_load_n(&r->ended[b], __ATOMIC_ACQUIRE);
+    }
+    for (EpochRecord *r = g_records; r != NULL; r = r->next) {
+        started += __atomic_load_n(&r->started[b], __ATOMIC_ACQUIRE);
+    }
+    pthread_mutex_unlock(&g_recordLock);
+    return started - ended;
+}
+
+static void retired_free(Retired *r) {
+    if (r->arena != NULL) {
+        arena_free_node(r->arena, r->node);
+    } else {
+        free(r->node->text);
+        free(r->node);
+    }
+}
+
+/* Retire a node that is no longer reachable from g_root or any edit. It
+ * is freed (back to its arena's free list when it has NODE_ARENA set)
+ * once no reader pinned before now is still running. Writer only.
+ * Returns 1 on success; 0 means the node was kept for good.
+ */
+int epoch_retire(Node *node, NodeArena *arena) {
+    Limbo *l = &g_limbo[g_epoch % EPOCH_BUCKETS];
+    if (l->size == l->capacity) {
+        int cap = l->capacity ? l->capacity * 2 : 64;
+        Retired *grown = realloc(l->items, cap * sizeof(Retired));
+        if (grown == NULL) {
+            perror("[epoch_retire] Failed to grow limbo");
+            return 0;
+        }
+        l->items = grown;
+        l->capacity = cap;
+    }
+    l->items[l->size].node = node;
+    l->items[l->size].arena = (node->flags & NODE_ARENA) ? arena : NULL;
+    l->size++;
+    return 1;
+}
+
+/* Advance the epoch if no reader pinned in the previous one is still
+ * running, and free what was retired before it. Writer only. Returns the number
+ * of nodes freed.
+ */
+int epoch_reclaim(void) {
+    if (__atomic_load_n(&g_noReclaim, __ATOMIC_RELAXED) || !epoch_barrier()) {
+        return 0;
+    }
+    unsigned e = g_epoch;
+    int prev = (int)((e + EPOCH_BUCKETS - 1) % EPOCH_BUCKETS);
+    if (epoch_live(prev) != 0) {
+        return 0;
+    }
+    __atomic_store_n(&g_epoch, e + 1, __ATOMIC_RELEASE);
+    // Readers from e - 1 are all done now, those from e - 2 were at the last advance
+    Limbo *l = &g_limbo[prev];
+    int freed = l->size;
+    for (int i = 0; i < l->size; i++) {
+        retired_free(&l->items[i]);
+    }
+    l->size = 0;
+    return freed;
+}
+
+/* Nodes retired but not yet freed */
+int epoch_pending(void) {
+    int n = 0;
+    for (int b = 0; b < EPOCH_BUCKETS; b++) {
+        n += g_limbo[b].size;
+    }
+    return n;
+}
+
+/* Forget retired nodes of an arena that is being released as a whole.
+ * Only valid when no reader can still reach them.
+ */
+void epoch_forget_arena(NodeArena *arena) {
+    for (int b = 0; b < EPOCH_BUCKETS; b++) {
+        Limbo *l = &g_limbo[b];
+        int kept = 0;
+        for (int i = 0; i < l->size; i++) {
+            if (l->items[i].arena != arena) {
+                l->items[kept++] = l->items[i];
+            }
+        }
+        l->size = kept;
+        if (kept == 0) {
+            free(l->items);
+            l->items = NULL;
+            l->capacity = 0;
+        }
+    }
+}
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lab5.h"
+
+/* ========== Flat Tree (struct-of-arrays layout) ========== */
+
+/* Append a NUL-terminated copy of s to the blob, growing it by doubling.
+ * Returns the offset of the copy or FLAT_NIL if the blob would exceed the
+ * 32-bit offset range.
+ */
+static uint32_t flat_add_text(FlatTree *ft, uint64_t *cap, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (ft->blobLen + len > UINT32_MAX) {
+        return FLAT_NIL;
+    }
+    if (ft->blobLen + len > *cap) {
+        uint64_t newCap = *cap ? *cap : 4096;
+        while (newCap < ft->blobLen + len) {
+            newCap *= 2;
+        }
+        char *grown = realloc(ft->blob, newCap);
+        if (grown == NULL) {
+            return FLAT_NIL;
+        }
+        ft->blob = grown;
+        *cap = newCap;
+    }
+    uint32_t off = (uint32_t)ft->blobLen;
+    memcpy(ft->blob + off, s, len);
+    ft->blobLen += len;
+    return off;
+}
+
+#define FLAT_PARALLEL_MIN 65536  /* smaller trees are flattened on one thread */
+#define FLAT_SPLIT_WIDTH 256     /* how wide a level the tree is split at */
+
+/* A subtree hanging from the split level, flattened by one thread. BFS
+ * numbers a level of the whole tree before the next, so each subtree's
+ * nodes at one depth get a run of ids that starts at base[depth].
+ */
+typedef struct {
+    Node *root;
+    uint32_t *width;     /* nodes at each depth of the subtree */
+    uint32_t *base;      /* id of its first node at each depth */
+    uint32_t depth;      /* entries in width and base */
+    uint64_t textBytes;
+    uint64_t blobPos;    /* where its texts start in the blob */
+} FlatPart;
+
+/* What the flattening threads share */
+typedef struct {
+    FlatTree *ft;
+    FlatPart *parts;
+    uint32_t nparts;
+    uint32_t next;       /* next part to hand out */
+    int fill;            /* 0: measure the parts, 1: fill them in */
+    int failed;
+} FlatSplit;
+
+typedef struct {
+    Node *node;
+    uint32_t depth;
+} FlatVisit;
+
+/* Count a part's nodes per depth and its text bytes, depth first */
+static int flat_measure_part(FlatPart *part) {
+    size_t cap = 64, top = 0;
+    uint32_t widthCap = 16;
+    FlatVisit *stack = malloc(cap * sizeof(FlatVisit));
+    part->width = calloc(widthCap, sizeof(uint32_t));
+    if (stack == NULL || part->width == NULL) {
+        free(stack);
+        return 0;
+    }
+    stack[top++] = (FlatVisit){part->root, 0};
+    while (top > 0) {
+        FlatVisit v = stack[--top];
+        if (v.depth == widthCap) {
+            uint32_t *grown = realloc(part->width, 2 * widthCap * sizeof(uint32_t));
+            if (grown == NULL) {
+                free(stack);
+                return 0;
+            }
+            memset(grown + widthCap, 0, widthCap * sizeof(uint32_t));
+            part->width = grown;
+            widthCap *= 2;
+        }
+        if (v.depth >= part->depth) {
+            part->depth = v.depth + 1;
+        }
+        part->width[v.depth]++;
+        part->textBytes += strlen(v.node->text) + 1;
+        if (top + 2 > cap) {
+            FlatVisit *grown = realloc(stack, 2 * cap * sizeof(FlatVisit));
+            if (grown == NULL) {
+                free(stack);
+                return 0;
+            }
+            stack = grown;
+            cap *= 2;
+        }
+        if (v.node->no != NULL) stack[top++] = (FlatVisit){v.node->no, v.depth + 1};
+        if (v.node->yes != NULL) stack[top++] = (FlatVisit){v.node->yes, v.depth + 1};
+    }
+    free(stack);
+    return 1;
+}
+
+/* Fill in a part's nodes at their BFS ids, walking it breadth first */
+static int flat_fill_part(FlatTree *ft, FlatPart *part) {
+    Queue q;
+    q_init(&q);
+    int queued = q_enqueue(&q, part->root, (int)part->base[0]++);
+    uint32_t depth = 0, left = part->width[0];
+    uint64_t pos = part->blobPos;
+    Node *node;
+    int id;
+    while (queued && q_dequeue(&q, &node, &id)) {
+        while (left == 0) {
+            left = part->width[++depth];
+        }
+        left--;
+        uint32_t i = (uint32_t)id;
+        if (node->isQuestion) {
+            // Neighbouring parts may own other bits of the same byte
+            __atomic_fetch_or(&ft->isq[i >> 3], (uint8_t)(1u << (i & 7)), __ATOMIC_RELAXED);
+        }
+        size_t len = strlen(node->text) + 1;
+        memcpy(ft->blob + pos, node->text, len);
+        ft->text[i] = (uint32_t)pos;
+        pos += len;
+        ft->visits[i] = node->visits;
+        ft->yes[i] = FLAT_NIL;
+        ft->no[i] = FLAT_NIL;
+        if (node->yes != NULL) {
+            ft->yes[i] = part->base[depth + 1]++;
+            queued = queued && q_enqueue(&q, node->yes, (int)ft->yes[i]);
+        }
+        if (node->no != NULL) {
+            ft->no[i] = part->base[depth + 1]++;
+            queued = queued && q_enqueue(&q, node->no, (int)ft->no[i]);
+        }
+    }
+    q_free(&q);
+    return queued && pos == part->blobPos + part->textBytes;
+}
+
+static void *flat_worker(void *arg) {
+    FlatSplit *split = *(FlatSplit **)arg;
+    for (;;) {
+        uint32_t s = __atomic_fetch_add(&split->next, 1, __ATOMIC_RELAXED);
+        if (s >= split->nparts) {
+            break;
+        }
+        FlatPart *part = &split->parts[s];
+        if (!(split->fill ? flat_fill_part(split->ft, part) : flat_measure_part(part))) {
+            __atomic_store_n(&split->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* Measure or fill every part on a pool of threads. Returns 0 on failure. */
+static int flat_run_parts(FlatSplit *split, int fill) {
+    FlatSplit *jobs[JOB_MAX_THREADS];
+    int njobs = job_threads(split->nparts);
+    for (int t = 0; t < njobs; t++) {
+        jobs[t] = split;
+    }
+    split->fill = fill;
+    split->next = 0;
+    run_jobs(flat_worker, jobs, sizeof(FlatSplit *), njobs);
+    return !split->failed;
+}
+
+/* flat_from_tree for large trees, with ft's arrays already allocated for n
+ * nodes. The levels above the first one at least FLAT_SPLIT_WIDTH wide are
+ * numbered here; the subtrees below are measured in parallel, given their
+ * id runs and blob ranges, and then filled in parallel. Returns 1 on
+ * success.
+ */
+static int flat_fill_split(FlatTree *ft, Node *root, uint32_t n) {
+    int ok = 0;
+    FlatSplit split;
+    memset(&split, 0, sizeof(split));
+    split.ft = ft;
+    // Level by level into one array, so a node's index is its BFS id
+    size_t cap = 1024, levelStart = 0, levelEnd = 1;
+    Node **order = malloc(cap * sizeof(Node *));
+    if (order == NULL) {
+        return 0;
+    }
+    order[0] = root;
+    while (levelEnd > levelStart && levelEnd - levelStart < FLAT_SPLIT_WIDTH) {
+        size_t end = levelEnd;
+        for (size_t i = levelStart; i < levelEnd; i++) {
+            Node *kids[2] = {order[i]->yes, order[i]->no};
+            uint32_t *ids[2] = {&ft->yes[i], &ft->no[i]};
+            for (int k = 0; k < 2; k++) {
+                *ids[k] = FLAT_NIL;
+                if (kids[k] == NULL) continue;
+                if (end == cap) {
+                    Node **grown = realloc(order, 2 * cap * sizeof(Node *));
+                    if (grown == NULL) goto split_done;
+                    order = grown;
+                    cap *= 2;
+                }
+                *ids[k] = (uint32_t)end;
+                order[end++] = kids[k];
+            }
+        }
+        levelStart = levelEnd;
+        levelEnd = end;
+    }
+
+    split.nparts = (uint32_t)(levelEnd - levelStart);
+    split.parts = calloc(split.nparts ? split.nparts : 1, sizeof(FlatPart));
+    if (split.parts == NULL) {
+        goto split_done;
+    }
+    for (uint32_t s = 0; s < split.nparts; s++) {
+        split.parts[s].root = order[levelStart + s];
+    }
+    if (!flat_run_parts(&split, 0)) {
+        goto split_done;
+    }
+
+    // Hand out id runs depth by depth, and blob ranges part by part
+    uint64_t next = levelStart, blobLen = 0, maxDepth = 0;
+    for (size_t i = 0; i < levelStart; i++) {
+        blobLen += strlen(order[i]->text) + 1;
+    }
+    for (uint32_t s = 0; s < split.nparts; s++) {
+        FlatPart *part = &split.parts[s];
+        if ((part->base = malloc(part->depth * sizeof(uint32_t))) == NULL) {
+            goto split_done;
+        }
+        part->blobPos = blobLen;
+        blobLen += part->textBytes;
+        maxDepth = part->depth > maxDepth ? part->depth : maxDepth;
+    }
+    for (uint32_t d = 0; d < maxDepth; d++) {
+        for (uint32_t s = 0; s < split.nparts; s++) {
+            FlatPart *part = &split.parts[s];
+            if (d < part->depth) {
+                part->base[d] = (uint32_t)next;
+                next += part->width[d];
+            }
+        }
+    }
+    if (next != n || blobLen > UINT32_MAX || (ft->blob = malloc(blobLen ? blobLen : 1)) == NULL) {
+        goto split_done;
+    }
+    ft->blobLen = blobLen;
+
+    uint64_t pos = 0;
+    for (size_t i = 0; i < levelStart; i++) {
+        Node *node = order[i];
+        if (node->isQuestion) {
+            ft->isq[i >> 3] |= (uint8_t)(1u << (i & 7));
+        }
+        size_t len = strlen(node->text) + 1;
+        memcpy(ft->blob + pos, node->text, len);
+        ft->text[i] = (uint32_t)pos;
+        pos += len;
+        ft->visits[i] = node->visits;
+    }
+    ok = flat_run_parts(&split, 1);
+    ft->count = n;
+
+split_done:
+    for (uint32_t s = 0; split.parts != NULL && s < split.nparts; s++) {
+        free(split.parts[s].width);
+        free(split.parts[s].base);
+    }
+    free(split.parts);
+    free(order);
+    return ok;
+}
+
+/* Build a flat copy of the tree rooted at root, numbering nodes in BFS
+ * order so that node 0 is the root and every child has a larger index than
+ * its parent. Large trees are split into subtrees flattened on several
+ * threads (see flat_fill_split). Returns 1 on success, 0 on failure (ft is
+ * left empty).
+ */
+int flat_from_tree(FlatTree *ft, Node *root) {
+    if (ft == NULL) {
+        return 0;
+    }
+    memset(ft, 0, sizeof(*ft));
+    if (root == NULL) {
+        return 1;
+    }
+
+    int n = count_nodes(root);
+    if (n < 0) {
+        return 0;
+    }
+    uint64_t blobCap = 0;
+    ft->yes = malloc(n * sizeof(uint32_t));
+    ft->no = malloc(n * sizeof(uint32_t));
+    ft->text = malloc(n * sizeof(uint32_t));
+    ft->isq = calloc((n + 7) / 8, 1);
+    ft->visits = malloc(n * sizeof(uint32_t));
+    if (!ft->yes || !ft->no || !ft->text || !ft->isq || !ft->visits) {
+        goto flat_error;
+    }
+    if (n >= FLAT_PARALLEL_MIN) {
+        if (!flat_fill_split(ft, root, (uint32_t)n)) {
+            goto flat_error;
+        }
+        return 1;
+    }
+
+    // BFS: a node's children get the next free indices as it is dequeued,
+    // so ids come straight from queue order with no lookup table
+    Queue q;
+    q_init(&q);
+    if (!q_enqueue(&q, root, 0)) {
+        goto flat_error;
+    }
+    uint32_t next = 1;
+    Node *node;
+    int id;
+    while (q_dequeue(&q, &node, &id)) {
+        uint32_t i = (uint32_t)id;
+        if (node->isQuestion) {
+            ft->isq[i >> 3] |= (uint8_t)(1u << (i & 7));
+        }
+        ft->text[i] = flat_add_text(ft, &blobCap, node->text);
+        if (ft->text[i] == FLAT_NIL) {
+            q_free(&q);
+            goto flat_error;
+        }
+        ft->visits[i] = node->visits;
+        ft->yes[i] = FLAT_NIL;
+        ft->no[i] = FLAT_NIL;
+        int queued = 1;
+        if (node->yes != NULL) {
+            ft->yes[i] = next;
+            queued = q_enqueue(&q, node->yes, next++);
+        }
+        if (queued && node->no != NULL) {
+            ft->no[i] = next;
+            queued = q_enqueue(&q, node->no, next++);
+        }
+        if (!queued) {
+            q_free(&q);
+            goto flat_error;
+        }
+    }
+    q_free(&q);
+    ft->count = next;
+    return 1;
+
+flat_error:
+    flat_free(ft);
+    return 0;
+}
+
+void flat_free(FlatTree *ft) {
+    if (ft == NULL) {
+        return;
+    }
+    free(ft->yes);
+    free(ft->no);
+    free(ft->text);
+    free(ft->isq);
+    free(ft->blob);
+    free(ft->visits);
+    memset(ft, 0, sizeof(*ft));
+}
+
+/* Count the nodes of the subtree at index root with an explicit index
+ * stack; the stack never holds more than one pending sibling per level.
+ */
+uint32_t flat_count_nodes(const FlatTree *ft, uint32_t root) {
+    if (ft == NULL || root >= ft->count) {
+        return 0;
+    }
+    uint32_t cap = 64, top = 0, total = 0;
+    uint32_t *stack = malloc(cap * sizeof(uint32_t));
+    if (stack == NULL) {
+        return 0;
+    }
+    stack[top++] = root;
+    while (top > 0) {
+        uint32_t i = stack[--top];
+        // Walk down the yes spine, deferring each no child
+        while (i != FLAT_NIL) {
+            total++;
+            if (ft->no[i] != FLAT_NIL) {
+                if (top == cap) {
+                    cap *= 2;
+                    uint32_t *grown = realloc(stack, cap * sizeof(uint32_t));
+                    if (grown == NULL) {
+                        free(stack);
+                        return 0;
+                    }
+                    stack = grown;
+                }
+                stack[top++] = ft->no[i];
+            }
+            i = ft->yes[i];
+        }
+    }
+    free(stack);
+    return total;
+}
+
+/* Same rules as check_integrity (questions have two children, leaves
+ * none), checked with one linear scan over the arrays. Children must also
+ * point forward and have exactly one parent, which rules out cycles and
+ * shared subtrees in files that were not produced by flat_from_tree.
+ */
+int flat_check_integrity(const FlatTree *ft) {
+    if (ft == NULL || ft->count == 0) {
+        return 1;
+    }
+    uint8_t *hasParent = calloc((ft->count + 7) / 8, 1);
+    if (hasParent == NULL) {
+        return 0;
+    }
+    int valid = 1;
+    for (uint32_t i = 0; i < ft->count && valid; i++) {
+        uint32_t kids[2] = {ft->yes[i], ft->no[i]};
+        if (!flat_is_question(ft, i)) {
+            // Leaf nodes must not have children
+            if (kids[0] != FLAT_NIL || kids[1] != FLAT_NIL) {
+                valid = 0;
+            }
+            continue;
+        }
+        // Question nodes must have both children
+        for (int k = 0; k < 2; k++) {
+            uint32_t c = kids[k];
+            if (c == FLAT_NIL || c <= i || c >= ft->count ||
+                (hasParent[c >> 3] >> (c & 7)) & 1) {
+                valid = 0;
+                break;
+            }
+            hasParent[c >> 3] |= (uint8_t)(1u << (c & 7));
+        }
+    }
+    free(hasParent);
+    return valid;
+}
+
+/* Follow answers (nonzero = yes) from the root. Returns the index of the
+ * leaf reached, or of the question where the answers ran out.
+ */
+uint32_t flat_traverse(const FlatTree *ft, const uint8_t *answers, int nanswers) {
+    if (ft == NULL || ft->count == 0) {
+        return FLAT_NIL;
+    }
+    uint32_t i = 0;
+    for (int k = 0; k < nanswers && flat_is_question(ft, i); k++) {
+        i = answers[k] ? ft->yes[i] : ft->no[i];
+    }
+    return i;
+}
@@ -0,0 +1,822 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lab5.h"
+
+/* ========== Attribute Index ========== */
+
+#define INDEX_MAGIC 0x31584941      /* "AIX1" */
+#define INDEX_PARALLEL_MIN 65536    /* texts per hashing thread, at least */
+
+/* Serialized base, as stored in the SEC_INDEX section of a VERSION 2
+ * file: the header, the key and name slot tables, three range bounds per
+ * question, then the flat node index of every question and animal.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t nquestions;
+    uint32_t nanimals;
+    uint32_t keySlots;
+    uint32_t nameSlots;
+    uint32_t reserved;
+} IndexHeader;
+
+void ai_init(AttrIndex *ix) {
+    memset(ix, 0, sizeof(*ix));
+    h_init(&ix->keys, 64);
+    h_init(&ix->names, 64);
+    bm_init(&ix->live);
+}
+
+void ai_free(AttrIndex *ix) {
+    for (int q = 0; q < ix->nquestions; q++) {
+        bm_free(&ix->yes[q]);
+        bm_free(&ix->no[q]);
+    }
+    free(ix->questions);
+    free(ix->yes);
+    free(ix->no);
+    free(ix->qlive);
+    free(ix->animals);
+    free(ix->baseMem);
+    bm_free(&ix->live);
+    h_free(&ix->keys);
+    h_free(&ix->names);
+    memset(ix, 0, sizeof(*ix));
+}
+
+/* ---- lookups ---- */
+
+/* Iterator over the ids filed under one canonical text: first the base
+ * slot table (ids are only hash matches there), then the learned hash.
+ */
+typedef struct {
+    const IndexSlot *tab;
+    uint32_t mask;
+    uint32_t pos;
+    uint32_t left;     /* slots not probed yet */
+    uint32_t limit;    /* ids in the table are below this */
+    uint64_t hash;
+    const int *ids;
+    int count;
+    int i;
+} IdIter;
+
+static void ai_iter_init(IdIter *it, const IndexSlot *tab, uint32_t mask, uint32_t limit,
+                         const Hash *h, const char *key) {
+    size_t len = strlen(key);
+    it->tab = tab;
+    it->mask = mask;
+    it->limit = limit;
+    it->hash = h_hash64(key, len, HASH_SEED);
+    it->pos = (uint32_t)it->hash & mask;
+    it->left = tab != NULL ? mask + 1 : 0;
+    it->count = 0;
+    it->i = 0;
+    it->ids = h->nslots > 0 ? h_get_ids(h, key, &it->count) : NULL;
+}
+
+/* Returns the next id, or -1 when done */
+static int ai_iter_next(IdIter *it) {
+    while (it->tab != NULL) {
+        const IndexSlot *s = &it->tab[it->pos];
+        if (s->id == 0 || it->left-- == 0) {
+            it->tab = NULL;
+            break;
+        }
+        it->pos = (it->pos + 1) & it->mask;
+        if (s->hash == it->hash && s->id <= it->limit) {
+            return (int)(s->id - 1);
+        }
+    }
+    return it->i < it->count ? it->ids[it->i++] : -1;
+}
+
+/* Find the id of a node through its canonical text; several nodes can
+ * share a wording, so the candidates are matched by pointer.
+ */
+static int ai_lookup(const AttrIndex *ix, int animal, const Node *node) {
+    const char *key = canonicalize_tmp(node->text);
+    if (key == NULL) {
+        return -1;
+    }
+    IdIter it;
+    if (animal) {
+        ai_iter_init(&it, ix->nameTab, ix->nameMask, (uint32_t)ix->nanimals, &ix->names, key);
+    } else {
+        ai_iter_init(&it, ix->keyTab, ix->keyMask, ix->nbase, &ix->keys, key);
+    }
+    Node *const *byId = animal ? ix->animals : ix->questions;
+    int id;
+    while ((id = ai_iter_next(&it)) >= 0) {
+        if (byId[id] == node) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+/* Does text canonicalize to key? */
+static int ai_text_is(const char *text, const char *key) {
+    char small[256];
+    size_t len = strlen(text);
+    char *buf = len < sizeof(small) ? small : malloc(len + 1);
+    if (buf == NULL) {
+        return 0;
+    }
+    canonicalize_into(text, len, buf);
+    int same = strcmp(buf, key) == 0;
+    if (buf != small) {
+        free(buf);
+    }
+    return same;
+}
+
+/* ---- growth for learned questions and animals ---- */
+
+/* Give question node q the next question id. Returns the id or -1. */
+static int ai_add_question(AttrIndex *ix, Node *q) {
+    if (ix->nquestions == ix->qcap) {
+        int newCap = ix->qcap ? ix->qcap * 2 : 64;
+        Node **questions = realloc(ix->questions, newCap * sizeof(Node *));
+        if (questions == NULL) {
+            return -1;
+        }
+        ix->questions = questions;
+        Bitmap *yes = realloc(ix->yes, newCap * sizeof(Bitmap));
+        if (yes == NULL) {
+            return -1;
+        }
+        ix->yes = yes;
+        Bitmap *no = realloc(ix->no, newCap * sizeof(Bitmap));
+        if (no == NULL) {
+            return -1;
+        }
+        ix->no = no;
+        uint8_t *qlive = realloc(ix->qlive, newCap);
+        if (qlive == NULL) {
+            return -1;
+        }
+        ix->qlive = qlive;
+        ix->qcap = newCap;
+    }
+    int id = ix->nquestions;
+    const char *key = canonicalize_tmp(q->text);
+    if (key == NULL || !h_put(&ix->keys, key, id)) {
+        return -1;
+    }
+    ix->questions[id] = q;
+    bm_init(&ix->yes[id]);
+    bm_init(&ix->no[id]);
+    ix->qlive[id] = 1;
+    ix->nquestions++;
+    return id;
+}
+
+/* Give leaf the next animal id. Returns the id or -1. */
+static int ai_add_animal(AttrIndex *ix, Node *leaf) {
+    if (ix->nanimals == ix->acap) {
+        int newCap = ix->acap ? ix->acap * 2 : 64;
+        Node **animals = realloc(ix->animals, newCap * sizeof(Node *));
+        if (animals == NULL) {
+            return -1;
+        }
+        ix->animals = animals;
+        ix->acap = newCap;
+    }
+    int id = ix->nanimals;
+    const char *name = canonicalize_tmp(leaf->text);
+    if (name == NULL || !h_put(&ix->names, name, id)) {
+        return -1;
+    }
+    ix->animals[id] = leaf;
+    ix->nanimals++;
+    return id;
+}
+
+/* A base question's posting lists are still ranges until first written */
+static int ai_is_range(const AttrIndex *ix, int q) {
+    return (uint32_t)q < ix->nbase && ix->yes[q].n == 0;
+}
+
+static int ai_materialize(AttrIndex *ix, int q) {
+    if (!ai_is_range(ix, q)) {
+        return 1;
+    }
+    const uint32_t *r = &ix->ranges[3 * q];
+    return bm_add_range(&ix->yes[q], r[0], r[1]) && bm_add_range(&ix->no[q], r[1], r[2]);
+}
+
+/* ---- bulk builder ---- */
+
+/* The builder walks either a Node tree or a FlatTree through this view;
+ * handles are Node pointers or flat indices.
+ */
+typedef struct {
+    const void *ctx;
+    uintptr_t root;
+    int (*isQuestion)(const void *ctx, uintptr_t n);
+    uintptr_t (*child)(const void *ctx, uintptr_t n, int yes);
+    const char *(*text)(const void *ctx, uintptr_t n);
+} TreeView;
+
+static int node_is_question(const void *ctx, uintptr_t n) {
+    (void)ctx;
+    return ((const Node *)n)->isQuestion;
+}
+
+static uintptr_t node_child(const void *ctx, uintptr_t n, int yes) {
+    (void)ctx;
+    return (uintptr_t)(yes ? ((const Node *)n)->yes : ((const Node *)n)->no);
+}
+
+static const char *node_text(const void *ctx, uintptr_t n) {
+    (void)ctx;
+    return ((const Node *)n)->text;
+}
+
+static int flat_view_is_question(const void *ctx, uintptr_t n) {
+    return flat_is_question(ctx, (uint32_t)n);
+}
+
+static uintptr_t flat_view_child(const void *ctx, uintptr_t n, int yes) {
+    const FlatTree *ft = ctx;
+    return yes ? ft->yes[n] : ft->no[n];
+}
+
+static const char *flat_view_text(const void *ctx, uintptr_t n) {
+    return flat_text(ctx, (uint32_t)n);
+}
+
+/* Questions in DFS pre-order and leaves in DFS order, with each question's
+ * [start, mid, end) animal range. Arrays are grown as the walk goes.
+ */
+typedef struct {
+    uintptr_t *qh;
+    uintptr_t *ah;
+    uint32_t *ranges;
+    uint32_t nq, na;
+    uint32_t qcap, acap;
+} Numbering;
+
+static void numbering_free(Numbering *nb) {
+    free(nb->qh);
+    free(nb->ah);
+    free(nb->ranges);
+    memset(nb, 0, sizeof(*nb));
+}
+
+static int ai_number(const TreeView *tv, Numbering *nb) {
+    typedef struct {
+        uintptr_t node;
+        uint32_t q;
+        int phase;   /* 0 = enter, 1 = yes side done, 2 = no side done */
+    } NumFrame;
+
+    memset(nb, 0, sizeof(*nb));
+    int cap = 64, top = 0;
+    NumFrame *stack = malloc(cap * sizeof(NumFrame));
+    if (stack == NULL) {
+        return 0;
+    }
+    stack[top++] = (NumFrame){tv->root, 0, 0};
+    while (top > 0) {
+        NumFrame *f = &stack[top - 1];
+        if (f->phase == 0 && !tv->isQuestion(tv->ctx, f->node)) {
+            top--;
+            if (nb->na == nb->acap) {
+                nb->acap = nb->acap ? nb->acap * 2 : 1024;
+                uintptr_t *grown = realloc(nb->ah, nb->acap * sizeof(uintptr_t));
+                if (grown == NULL) {
+                    goto number_error;
+                }
+                nb->ah = grown;
+            }
+            nb->ah[nb->na++] = f->node;
+            continue;
+        }
+        if (f->phase == 2) {
+            top--;
+            nb->ranges[3 * f->q + 2] = nb->na;
+            continue;
+        }
+        uintptr_t child;
+        if (f->phase == 0) {
+            if (nb->nq == nb->qcap) {
+                nb->qcap = nb->qcap ? nb->qcap * 2 : 1024;
+                uintptr_t *grown = realloc(nb->qh, nb->qcap * sizeof(uintptr_t));
+                if (grown == NULL) {
+                    goto number_error;
+                }
+                nb->qh = grown;
+                uint32_t *r = realloc(nb->ranges, nb->qcap * 3 * sizeof(uint32_t));
+                if (r == NULL) {
+                    goto number_error;
+                }
+                nb->ranges = r;
+            }
+            f->q = nb->nq++;
+            nb->qh[f->q] = f->node;
+            nb->ranges[3 * f->q] = nb->na;
+            f->phase = 1;
+            child = tv->child(tv->ctx, f->node, 1);
+        } else {
+            nb->ranges[3 * f->q + 1] = nb->na;
+            f->phase = 2;
+            child = tv->child(tv->ctx, f->node, 0);
+        }
+        if (top == cap) {
+            cap *= 2;
+            NumFrame *grown = realloc(stack, cap * sizeof(NumFrame));
+            if (grown == NULL) {
+                goto number_error;
+            }
+            stack = grown;
+        }
+        stack[top++] = (NumFrame){child, 0, 0};
+    }
+    free(stack);
+    return 1;
+
+number_error:
+    free(stack);
+    numbering_free(nb);
+    return 0;
+}
+
+typedef struct {
+    const TreeView *tv;
+    const uintptr_t *handles;
+    uint64_t *hashes;
+    uint32_t lo, hi;
+} HashJob;
+
+/* Hash the canonical text of handles[lo, hi). Uses its own buffer so
+ * worker threads leave nothing behind when they exit.
+ */
+static void *ai_hash_worker(void *arg) {
+    HashJob *job = arg;
+    char *buf = NULL;
+    size_t cap = 0;
+    for (uint32_t i = job->lo; i < job->hi; i++) {
+        const char *text = job->tv->text(job->tv->ctx, job->handles[i]);
+        size_t len = strlen(text);
+        if (len + 1 > cap) {
+            cap = len + 1 > 256 ? len + 1 : 256;
+            free(buf);
+            buf = malloc(cap);
+            if (buf == NULL) {
+                cap = 0;
+                job->hashes[i] = 0;
+                continue;
+            }
+        }
+        size_t clen = canonicalize_into(text, len, buf);
+        job->hashes[i] = h_hash64(buf, clen, HASH_SEED);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Hash n texts, split across threads for large trees (run_jobs, so a
+ * saving child hashes on its own thread)
+ */
+static void ai_hash_all(const TreeView *tv, const uintptr_t *handles, uint32_t n, uint64_t *hashes) {
+    int njobs = job_threads(n / INDEX_PARALLEL_MIN);
+    HashJob jobs[JOB_MAX_THREADS];
+    for (int t = 0; t < njobs; t++) {
+        jobs[t] = (HashJob){tv, handles, hashes,
+                            (uint32_t)((uint64_t)n * t / njobs),
+                            (uint32_t)((uint64_t)n * (t + 1) / njobs)};
+    }
+    run_jobs(ai_hash_worker, jobs, sizeof(HashJob), njobs);
+}
+
+/* Fill an open-addressing table (linear probing, at most half full) */
+static void ai_fill_slots(IndexSlot *tab, uint32_t slots, const uint64_t *hashes, uint32_t n) {
+    uint32_t mask = slots - 1;
+    memset(tab, 0, slots * sizeof(IndexSlot));
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t pos = (uint32_t)hashes[i] & mask;
+        while (tab[pos].id != 0) {
+            pos = (pos + 1) & mask;
+        }
+        tab[pos].hash = hashes[i];
+        tab[pos].id = i + 1;
+    }
+}
+
+static uint32_t ai_slots_for(uint32_t n) {
+    uint32_t slots = 16;
+    while (slots < 2 * (uint64_t)n) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+/* Build the serialized base of the tree behind tv: header, slot tables
+ * and ranges, plus the node arrays when withNodes is set (they are filled
+ * in by the caller). On success *out is one malloc'd block.
+ */
+static int ai_image(const TreeView *tv, int withNodes, Numbering *nb,
+                    void **out, uint64_t *outLen) {
+    if (!ai_number(tv, nb)) {
+        return 0;
+    }
+    IndexHeader hdr = {INDEX_MAGIC, nb->nq, nb->na, ai_slots_for(nb->nq), ai_slots_for(nb->na), 0};
+    uint64_t len = sizeof(hdr) + ((uint64_t)hdr.keySlots + hdr.nameSlots) * sizeof(IndexSlot) +
+                   (uint64_t)nb->nq * 3 * sizeof(uint32_t);
+    if (withNodes) {
+        len += ((uint64_t)nb->nq + nb->na) * sizeof(uint32_t);
+    }
+    char *img = malloc(len);
+    uint64_t *hashes = malloc(((uint64_t)nb->nq + nb->na + 1) * sizeof(uint64_t));
+    if (img == NULL || hashes == NULL) {
+        free(img);
+        free(hashes);
+        numbering_free(nb);
+        return 0;
+    }
+    ai_hash_all(tv, nb->qh, nb->nq, hashes);
+    ai_hash_all(tv, nb->ah, nb->na, hashes + nb->nq);
+
+    memcpy(img, &hdr, sizeof(hdr));
+    IndexSlot *keyTab = (IndexSlot *)(img + sizeof(hdr));
+    IndexSlot *nameTab = keyTab + hdr.keySlots;
+    ai_fill_slots(keyTab, hdr.keySlots, hashes, nb->nq);
+    ai_fill_slots(nameTab, hdr.nameSlots, hashes + nb->nq, nb->na);
+    memcpy(nameTab + hdr.nameSlots, nb->ranges, (size_t)nb->nq * 3 * sizeof(uint32_t));
+    free(hashes);
+    *out = img;
+    *outLen = len;
+    return 1;
+}
+
+/* Point ix at a serialized base (owned or mapped) and allocate the per-id
+ * arrays around it. questions/animals must already be filled in.
+ */
+static int ai_adopt(AttrIndex *ix, const char *img, uint32_t nq, uint32_t na) {
+    const IndexHeader *hdr = (const IndexHeader *)img;
+    ix->keyTab = (const IndexSlot *)(img + sizeof(IndexHeader));
+    ix->nameTab = ix->keyTab + hdr->keySlots;
+    ix->keyMask = hdr->keySlots - 1;
+    ix->nameMask = hdr->nameSlots - 1;
+    ix->ranges = (const uint32_t *)(ix->nameTab + hdr->nameSlots);
+    ix->nbase = nq;
+    ix->nquestions = ix->qcap = (int)nq;
+    ix->nanimals = ix->acap = (int)na;
+    // Zeroed bitmaps are empty, i.e. "still a range"
+    ix->yes = calloc(nq ? nq : 1, sizeof(Bitmap));
+    ix->no = calloc(nq ? nq : 1, sizeof(Bitmap));
+    ix->qlive = malloc(nq ? nq : 1);
+    if (ix->yes == NULL || ix->no == NULL || ix->qlive == NULL) {
+        return 0;
+    }
+    memset(ix->qlive, 1, nq);
+    return bm_add_range(&ix->live, 0, na);
+}
+
+/* Rebuild the index for the tree at root in one pass: number the nodes,
+ * hash their canonical texts in parallel and fill the slot tables. No
+ * posting list is materialized; each is a range until learning writes to
+ * it. Returns 1 on success, 0 on failure (index left empty).
+ */
+int ai_build(AttrIndex *ix, Node *root) {
+    ai_free(ix);
+    ai_init(ix);
+    if (root == NULL) {
+        return 1;
+    }
+    TreeView tv = {NULL, (uintptr_t)root, node_is_question, node_child, node_text};
+    Numbering nb;
+    void *img;
+    uint64_t len;
+    if (!ai_image(&tv, 0, &nb, &img, &len)) {
+        return 0;
+    }
+    ix->baseMem = img;
+    ix->questions = malloc((nb.nq ? nb.nq : 1) * sizeof(Node *));
+    ix->animals = malloc((nb.na ? nb.na : 1) * sizeof(Node *));
+    int ok = ix->questions != NULL && ix->animals != NULL;
+    if (ok) {
+        for (uint32_t i = 0; i < nb.nq; i++) {
+            ix->questions[i] = (Node *)nb.qh[i];
+        }
+        for (uint32_t i = 0; i < nb.na; i++) {
+            ix->animals[i] = (Node *)nb.ah[i];
+        }
+        ok = ai_adopt(ix, img, nb.nq, nb.na);
+    }
+    numbering_free(&nb);
+    if (!ok) {
+        ai_free(ix);
+        ai_init(ix);
+    }
+    return ok;
+}
+
+/* Serialize an index of ft for the SEC_INDEX section; nodes are named by
+ * their flat index. *out is malloc'd. Returns 1 on success.
+ */
+int ai_flat_section(const FlatTree *ft, void **out, uint64_t *outLen) {
+    if (ft->count == 0) {
+        return 0;
+    }
+    TreeView tv = {ft, 0, flat_view_is_question, flat_view_child, flat_view_text};
+    Numbering nb;
+    void *img;
+    if (!ai_image(&tv, 1, &nb, &img, outLen)) {
+        return 0;
+    }
+    uint32_t *nodes = (uint32_t *)((char *)img + *outLen) - (nb.nq + nb.na);
+    for (uint32_t i = 0; i < nb.nq; i++) {
+        nodes[i] = (uint32_t)nb.qh[i];
+    }
+    for (uint32_t i = 0; i < nb.na; i++) {
+        nodes[nb.nq + i] = (uint32_t)nb.ah[i];
+    }
+    numbering_free(&nb);
+    *out = img;
+    return 1;
+}
+
+/* Does a mapped slot table hold exactly n ids, all in 1..n? Its probes
+ * then end at an empty slot, as the table is at least twice that size.
+ */
+static int ai_slots_valid(const IndexSlot *tab, uint32_t slots, uint32_t n) {
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < slots; i++) {
+        if (tab[i].id > n) {
+            return 0;
+        }
+        used += tab[i].id != 0;
+    }
+    return used == n;
+}
+
+/* Use a SEC_INDEX section in place as the base of ix. nodes is the loaded
+ * tree's node block, in the same flat order the section was written with.
+ * The slot tables and ranges stay in the mapping; only the id -> node
+ * arrays are filled in. Returns 1 on success, 0 if the section does not
+ * describe this tree (ix is then left empty).
+ */
+int ai_attach(AttrIndex *ix, const void *section, uint64_t len, Node *nodes, uint32_t count) {
+    const IndexHeader *hdr = section;
+    ai_free(ix);
+    ai_init(ix);
+    if (len < sizeof(IndexHeader) || hdr->magic != INDEX_MAGIC ||
+        hdr->keySlots == 0 || hdr->keySlots < 2 * (uint64_t)hdr->nquestions ||
+        (hdr->keySlots & (hdr->keySlots - 1)) ||
+        hdr->nameSlots == 0 || hdr->nameSlots < 2 * (uint64_t)hdr->nanimals ||
+        (hdr->nameSlots & (hdr->nameSlots - 1)) ||
+        (uint64_t)hdr->nquestions + hdr->nanimals != count) {
+        return 0;
+    }
+    uint32_t nq = hdr->nquestions, na = hdr->nanimals;
+    uint64_t want = sizeof(IndexHeader) + ((uint64_t)hdr->keySlots + hdr->nameSlots) * sizeof(IndexSlot) +
+                    (uint64_t)nq * 4 * sizeof(uint32_t) + (uint64_t)na * sizeof(uint32_t);
+    const IndexSlot *keyTab = (const IndexSlot *)((const char *)section + sizeof(IndexHeader));
+    if (len != want || !ai_slots_valid(keyTab, hdr->keySlots, nq) ||
+        !ai_slots_valid(keyTab + hdr->keySlots, hdr->nameSlots, na)) {
+        return 0;
+    }
+    const uint32_t *ranges = (const uint32_t *)((const char *)section + sizeof(IndexHeader) +
+                             ((uint64_t)hdr->keySlots + hdr->nameSlots) * sizeof(IndexSlot));
+    const uint32_t *qnode = ranges + 3 * (uint64_t)nq;
+    const uint32_t *anode = qnode + nq;
+
+    ix->questions = malloc((nq ? nq : 1) * sizeof(Node *));
+    ix->animals = malloc((na ? na : 1) * sizeof(Node *));
+    if (ix->questions == NULL || ix->animals == NULL) {
+        goto attach_error;
+    }
+    for (uint32_t i = 0; i < nq; i++) {
+        const uint32_t *r = &ranges[3 * i];
+        if (qnode[i] >= count || !nodes[qnode[i]].isQuestion ||
+            !(r[0] < r[1] && r[1] < r[2] && r[2] <= na)) {
+            goto attach_error;
+        }
+        ix->questions[i] = &nodes[qnode[i]];
+    }
+    for (uint32_t i = 0; i < na; i++) {
+        if (anode[i] >= count || nodes[anode[i]].isQuestion) {
+            goto attach_error;
+        }
+        ix->animals[i] = &nodes[anode[i]];
+    }
+    if (!ai_adopt(ix, section, nq, na)) {
+        goto attach_error;
+    }
+    return 1;
+
+attach_error:
+    ai_free(ix);
+    ai_init(ix);
+    return 0;
+}
+
+/* ---- incremental maintenance ---- */
+
+/* Record a learned split: oldLeaf was replaced by newQuestion, whose
+ * children are oldLeaf and newLeaf. path holds the questions asked on the
+ * way down with the player's answers; newLeaf answers them the same way.
+ * Returns 1 on success, 0 on failure.
+ */
+int ai_learn(AttrIndex *ix, const Frame *path, int depth,
+             Node *oldLeaf, Node *newQuestion, Node *newLeaf) {
+    if (ix->keys.nslots == 0) {
+        ai_init(ix);
+    }
+    int o = ai_lookup(ix, 1, oldLeaf);
+    if (o < 0) {
+        // Leaf from a tree that was never indexed: register it now
+        o = ai_add_animal(ix, oldLeaf);
+        if (o < 0 || !bm_add(&ix->live, (uint32_t)o)) {
+            return 0;
+        }
+    }
+    int a = ai_add_animal(ix, newLeaf);
+    if (a < 0 || !bm_add(&ix->live, (uint32_t)a)) {
+        return 0;
+    }
+    for (int k = 0; k < depth; k++) {
+        int q = ai_lookup(ix, 0, path[k].node);
+        if (q < 0) {
+            continue;
+        }
+        Bitmap *side = path[k].answeredYes ? &ix->yes[q] : &ix->no[q];
+        if (!ai_materialize(ix, q) || !bm_add(side, (uint32_t)a)) {
+            return 0;
+        }
+    }
+    int q = ai_add_question(ix, newQuestion);
+    if (q < 0) {
+        return 0;
+    }
+    int yesId = newQuestion->yes == newLeaf ? a : o;
+    int noId = yesId == a ? o : a;
+    return bm_add(&ix->yes[q], (uint32_t)yesId) && bm_add(&ix->no[q], (uint32_t)noId);
+}
+
+/* Undo (live = 0) or redo (live = 1) a split recorded by ai_learn. The
+ * posting lists are left alone; the split's question stops contributing
+ * to queries and its animal drops out of the live set. Returns 0 if the
+ * index does not know the split (it was built since the split was
+ * undone), so a redo must ai_learn it again.
+ */
+int ai_set_split_live(AttrIndex *ix, const Edit *e, int live) {
+    if (ix->keys.nslots == 0) {
+        return 0;
+    }
+    int q = ai_lookup(ix, 0, e->newQuestion);
+    if (q >= 0) {
+        ix->qlive[q] = (uint8_t)live;
+    }
+    int a = ai_lookup(ix, 1, e->newLeaf);
+    if (a >= 0) {
+        if (live) {
+            bm_add(&ix->live, (uint32_t)a);
+        } else {
+            bm_remove(&ix->live, (uint32_t)a);
+        }
+    }
+    return q >= 0 && a >= 0;
+}
+
+/* Drop the node pointers of an undone split before its nodes are freed.
+ * The ids stay allocated but match no node; the split was already out of
+ * the live set.
+ */
+void ai_forget_split(AttrIndex *ix, const Edit *e) {
+    if (ix->keys.nslots == 0) {
+        return;
+    }
+    int q = ai_lookup(ix, 0, e->newQuestion);
+    if (q >= 0) {
+        ix->qlive[q] = 0;
+        ix->questions[q] = NULL;
+    }
+    int a = ai_lookup(ix, 1, e->newLeaf);
+    if (a >= 0) {
+        bm_remove(&ix->live, (uint32_t)a);
+        ix->animals[a] = NULL;
+        ix->forgotten++;
+    }
+}
+
+/* Forgotten ids still take room in the tables and posting lists. Once they
+ * are a quarter of all animal ids, rebuild the index from root, which must
+ * be the whole current tree with no undone splits waiting to be redone. A
+ * rebuild costs O(live ids) and comes after a third as many forgets, so it
+ * is constant work per forget while the index stays within 4/3 of its
+ * compact size. Returns 1 if the index was rebuilt.
+ */
+int ai_compact(AttrIndex *ix, Node *root) {
+    if (ix->forgotten < 1024 || ix->forgotten * 4 < ix->nanimals) {
+        return 0;
+    }
+    return ai_build(ix, root);
+}
+
+/* ---- queries ---- */
+
+/* One side of question q. A base question still held as a range is
+ * expanded into *scratch.
+ */
+static const Bitmap *ai_side(const AttrIndex *ix, int q, int answer, Bitmap *scratch, int *ok) {
+    if (!ai_is_range(ix, q)) {
+        return answer ? &ix->yes[q] : &ix->no[q];
+    }
+    const uint32_t *r = &ix->ranges[3 * q];
+    bm_clear(scratch);
+    *ok = answer ? bm_add_range(scratch, r[0], r[1]) : bm_add_range(scratch, r[1], r[2]);
+    return scratch;
+}
+
+/* Posting list for one term: the term's side of every live question asked
+ * in that wording. Usually a single question, returned without copying
+ * when it is materialized; otherwise built in *scratch (*side and *tmp are
+ * extra work space).
+ */
+static const Bitmap *ai_term_set(const AttrIndex *ix, const AttrTerm *t, Bitmap *scratch,
+                                 Bitmap *side, Bitmap *tmp, int *ok) {
+    static const Bitmap empty = {NULL, 0, 0};
+    const char *canon = canonicalize_tmp(t->question);
+    char *key = canon != NULL ? strdup(canon) : NULL;
+    if (key == NULL) {
+        *ok = 0;
+        return &empty;
+    }
+    IdIter it;
+    ai_iter_init(&it, ix->keyTab, ix->keyMask, ix->nbase, &ix->keys, key);
+    const Bitmap *set = &empty;
+    int q;
+    while ((q = ai_iter_next(&it)) >= 0) {
+        if (!ix->qlive[q] || ((uint32_t)q < ix->nbase && !ai_text_is(ix->questions[q]->text, key))) {
+            continue;  // undone, or only a hash match in the base table
+        }
+        const Bitmap *s = ai_side(ix, q, t->answer, set == &empty ? scratch : side, ok);
+        if (!*ok) {
+            break;
+        }
+        if (set == &empty) {
+            set = s;
+            continue;
+        }
+        if (!(*ok = bm_or(tmp, set, s))) {
+            break;
+        }
+        Bitmap swap = *scratch;
+        *scratch = *tmp;
+        *tmp = swap;
+        set = scratch;
+    }
+    free(key);
+    return *ok ? set : &empty;
+}
+
+/* Conjunctive query: animals in the tree that satisfy every term. Required
+ * terms are intersected first, then excluded terms are subtracted, so the
+ * ANDNOTs run over the smallest set. out must be initialized with bm_init
+ * and receives the animal ids. Returns 1 on success, 0 on failure.
+ */
+int ai_query(const AttrIndex *ix, const AttrTerm *terms, int nterms, Bitmap *out) {
+    Bitmap acc, tmp, scratch, side, scratchTmp;
+    bm_init(&acc);
+    bm_init(&tmp);
+    bm_init(&scratch);
+    bm_init(&side);
+    bm_init(&scratchTmp);
+    int ok = bm_copy(&acc, &ix->live);
+    for (int pass = 0; pass < 2 && ok; pass++) {
+        for (int i = 0; i < nterms && ok && acc.n > 0; i++) {
+            if ((terms[i].exclude != 0) != pass) {
+                continue;
+            }
+            const Bitmap *set = ai_term_set(ix, &terms[i], &scratch, &side, &scratchTmp, &ok);
+            if (!ok) {
+                break;
+            }
+            ok = pass == 0 ? bm_and(&tmp, &acc, set) : bm_andnot(&tmp, &acc, set);
+            Bitmap swap = acc;
+            acc = tmp;
+            tmp = swap;
+        }
+    }
+    bm_free(&tmp);
+    bm_free(&scratch);
+    bm_free(&side);
+    bm_free(&scratchTmp);
+    bm_free(out);
+    if (!ok) {
+        bm_free(&acc);
+        return 0;
+    }
+    *out = acc;
+    return 1;
+}
+
+Node *ai_animal(const AttrIndex *ix, uint32_t id) {
+    return id < (uint32_t)ix->nanimals ? ix->animals[id] : NULL;
+}
@@ -1,22 +1,94 @@
 #ifndef LAB5_H
 #define LAB5_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* ========== Tree Node ========== */
+#define NODE_ARENA 0x1  /* node and its text belong to a NodeArena */
+
 typedef struct Node {
     char *text;
     struct Node *yes;
     struct Node *no;
-    int isQuestion;
+    uint16_t isQuestion;
+    uint16_t flags;   /* NODE_* bits */
+    uint32_t visits;  /* games that reached this node */
 } Node;
 
+/* Players may walk the tree while one writer changes it (see server.c).
+ * A writer links a node in only after it is fully built, with a release
+ * store; readers follow child and root pointers with acquire loads.
+ */
+extern unsigned long g_treeVersion;  /* bumped by every tree_publish */
+
+static inline void tree_publish(Node **slot, Node *node) {
+    __atomic_store_n(slot, node, __ATOMIC_RELEASE);
+    // After the link: a reader that sees the new version sees the new tree
+    __atomic_store_n(&g_treeVersion, g_treeVersion + 1, __ATOMIC_RELEASE);
+}
+
+static inline Node *tree_follow(Node *const *slot) {
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+/* Plain load + store rather than an atomic add: concurrent players can
+ * lose an occasional count but never contend on a locked instruction.
+ */
+static inline void node_count_visit(Node *node, int delta) {
+    uint32_t v = __atomic_load_n(&node->visits, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->visits, v + delta, __ATOMIC_RELAXED);
+}
+
 /* Node constructors */
 Node *create_question_node(const char *question);
 Node *create_animal_node(const char *animal);
 void free_tree(Node *node);
 int count_nodes(Node *root);
 
+/* ========== Node Arena ==========
+ * Nodes are carved out of fixed-size slabs and their text is bump-allocated
+ * from large string blocks, so building a tree costs a handful of mallocs
+ * and dropping it costs one free per slab/block instead of two per node.
+ * free_tree() skips arena nodes and arena_release() drops the whole tree at
+ * once; single nodes detached for good go back through arena_free_node()
+ * onto free lists (slots, and strings by exact size) that later nodes are
+ * taken from first, so a tree that keeps learning and forgetting does not
+ * grow its arena.
+ */
+#define ARENA_SLAB_NODES 4096
+#define ARENA_TEXT_BLOCK (64 * 1024)
+#define ARENA_TEXT_CLASSES 512  /* freed strings up to this size are reused */
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t cap;
+    char data[] __attribute__((aligned(16)));
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *slabs;  /* Node slabs, newest first */
+    ArenaBlock *text;   /* string blocks, newest first */
+    size_t nodes;       /* nodes handed out and not freed */
+    void *map;          /* read-only file mapping the text points into */
+    size_t mapLen;
+    Node *freeNodes;    /* freed slots, linked through ->yes */
+    char **freeText;    /* freeText[size]: freed strings of that many bytes */
+} NodeArena;
+
+void arena_init(NodeArena *a);
+Node *arena_question_node(NodeArena *a, const char *question);
+Node *arena_animal_node(NodeArena *a, const char *animal);
+Node *arena_node_block(NodeArena *a, size_t n);
+char *arena_strndup(NodeArena *a, const char *s, size_t len);
+void arena_adopt_mapping(NodeArena *a, void *map, size_t len);
+void arena_adopt_text(NodeArena *a, NodeArena *from);
+void arena_free_node(NodeArena *a, Node *n);
+void arena_release(NodeArena *a);
+
+extern NodeArena g_arena;
+
 /* ========== Stack for Gameplay ========== */
 typedef struct Frame {
     Node *node;
@@ -37,9 +109,12 @@ void fs_free(FrameStack *s);
 
 /* ========== Edit/Undo/Redo ========== */
 typedef enum {
-    EDIT_INSERT_SPLIT
+    EDIT_INSERT_SPLIT,
+    EDIT_REBUILD      /* whole tree replaced by optimize_tree */
 } EditType;
 
+#define EDIT_PATH_MAX 256  /* deepest split whose path an Edit keeps */
+
 typedef struct {
     EditType type;
     Node *parent;
@@ -47,12 +122,19 @@ typedef struct {
     Node *oldLeaf;
     Node *newQuestion;
     Node *newLeaf;
+    int depth;        /* depth of oldLeaf (root = 0) */
+    Node *oldRoot;    /* EDIT_REBUILD: tree before and after */
+    Node *newRoot;
+    int treeNodes;    /* EDIT_REBUILD: nodes of the larger of the two trees */
+    uint8_t path[EDIT_PATH_MAX / 8];  /* answers from the root to oldLeaf, bit i
+                                         at depth i, if depth <= EDIT_PATH_MAX */
 } Edit;
 
 typedef struct {
     Edit *edits;
     int size;
     int capacity;
+    size_t bytes;     /* edit_cost() of the edits held */
 } EditStack;
 
 void es_init(EditStack *s);
@@ -62,6 +144,8 @@ int es_empty(EditStack *s);
 void es_clear(EditStack *s);
 void es_free(EditStack *s);
 void free_edit_stack(EditStack *s);
+size_t edit_cost(const Edit *e);
+void es_drop_oldest(EditStack *s, int k);
 
 extern EditStack g_undo;
 extern EditStack g_redo;
@@ -70,28 +154,62 @@ extern Node *g_root;
 int undo_last_edit();
 int redo_last_edit();
 
-/* ========== Queue for BFS ========== */
+/* ========== Queue for BFS ==========
+ * Growable ring buffer: capacity is a power of two so wrapping is a mask,
+ * and the buffer doubles when full. q_clear() empties the queue but keeps
+ * the buffer so several BFS passes can share one allocation.
+ */
 typedef struct QueueNode {
     Node *treeNode;
     int id;
-    struct QueueNode *next;
 } QueueNode;
 
 typedef struct {
-    QueueNode *front;
-    QueueNode *rear;
+    QueueNode *items;
+    int head;      /* index of the front element */
     int size;
+    int capacity;  /* 0 or a power of two */
 } Queue;
 
 void q_init(Queue *q);
-void q_enqueue(Queue *q, Node *node, int id);
+int q_enqueue(Queue *q, Node *node, int id);
 int q_dequeue(Queue *q, Node **node, int *id);
 int q_empty(Queue *q);
+void q_clear(Queue *q);
 void q_free(Queue *q);
 
-/* ========== Hash Table ========== */
+/* ========== Parallel jobs ==========
+ * run_jobs() runs a function over an array of job structs, one thread per
+ * job with job 0 on the calling thread. job_threads() says how many jobs
+ * are worth starting for a number of independent pieces of work.
+ * job_set_serial() keeps all of them on the calling thread.
+ */
+#define JOB_MAX_THREADS 16
+
+int job_threads(uint64_t pieces);
+void run_jobs(void *(*fn)(void *), void *jobs, size_t size, int n);
+void job_set_serial(int serial);
+
+/* ========== Hash Table ==========
+ * Open addressing in the style of a Swiss table: one control byte per slot
+ * holds either HASH_EMPTY or the low 7 bits of the key's hash, and slots
+ * are probed a 16-byte group at a time (SSE2 compare + movemask). The table
+ * doubles once it is 7/8 full. A hit still costs three cache misses (control
+ * group, slot, key string), the same as a chained table sized to its keys;
+ * what the layout buys is misses that never leave the control bytes and no
+ * per-key node. The ids h_get_ids returns are valid until the next h_put.
+ */
+#define HASH_GROUP 16
+#define HASH_EMPTY ((int8_t)-128)
+#define HASH_SEED 0x1d8e4e27c47d124full
+
+#define ID_INLINE 2   /* ids stored in the entry itself, no allocation */
+
 typedef struct IdList {
-    int *ids;
+    union {
+        int *ids;    /* sorted ascending, once capacity > ID_INLINE */
+        int inl[ID_INLINE];
+    };
     int count;
     int capacity;
 } IdList;
@@ -99,35 +217,382 @@ typedef struct IdList {
 typedef struct Entry {
     char *key;
     IdList vals;
-    struct Entry *next;
+    uint64_t hash;   /* h_hash64(key), computed once on insert */
 } Entry;
 
 typedef struct {
-    Entry **buckets;
-    int nbuckets;
-    int size;
+    int8_t *ctrl;    /* nslots control bytes */
+    Entry *slots;
+    int nslots;      /* power of two, at least HASH_GROUP */
+    int size;        /* distinct keys */
 } Hash;
 
 extern void h_init(Hash *h, int nbuckets);
 extern unsigned h_hash(const char *s);
+extern uint64_t h_hash64(const void *data, size_t len, uint64_t seed);
 extern int h_put(Hash *h, const char *key, int animalId);
 extern int h_contains(const Hash *h, const char *key, int animalId);
 extern int *h_get_ids(const Hash *h, const char *key, int *outCount);
 extern void h_free(Hash *h);
 extern char *canonicalize(const char *s);
+extern size_t canonicalize_into(const char *s, size_t len, char *out);
+extern const char *canonicalize_tmp(const char *s);
+extern void canonicalize_tmp_release(void);
 extern int get_yes_no(int y, int x, const char *prompt);
 extern char *get_input(int y, int x, const char *prompt);
 
-extern Hash g_index;
+/* ========== Compressed Bitmap ==========
+ * Roaring-style set of 32-bit ids: values are grouped by their high 16
+ * bits into containers kept sorted by key. A container holds its low 16
+ * bits either as a sorted uint16_t array (up to BM_ARRAY_MAX values) or as
+ * a 65536-bit bitset, whichever is smaller. Bitset-vs-bitset AND, ANDNOT
+ * and OR run 128 bits at a time with SSE2.
+ */
+#define BM_ARRAY_MAX 4096
+#define BM_WORDS 1024   /* uint64_t words in a bitset container */
+
+typedef struct {
+    uint16_t key;       /* high 16 bits shared by the container's values */
+    uint16_t isBitset;
+    uint32_t card;
+    uint32_t cap;       /* array capacity in values; 0 for bitsets */
+    void *data;         /* uint16_t[card] or uint64_t[BM_WORDS] */
+} BmContainer;
+
+typedef struct {
+    BmContainer *cs;
+    int n;
+    int cap;
+} Bitmap;
+
+void bm_init(Bitmap *b);
+void bm_clear(Bitmap *b);
+void bm_free(Bitmap *b);
+int bm_add(Bitmap *b, uint32_t x);
+int bm_add_range(Bitmap *b, uint32_t lo, uint32_t hi);
+int bm_remove(Bitmap *b, uint32_t x);
+int bm_contains(const Bitmap *b, uint32_t x);
+uint64_t bm_cardinality(const Bitmap *b);
+int bm_copy(Bitmap *dst, const Bitmap *src);
+int bm_and(Bitmap *out, const Bitmap *a, const Bitmap *b);
+int bm_andnot(Bitmap *out, const Bitmap *a, const Bitmap *b);
+int bm_or(Bitmap *out, const Bitmap *a, const Bitmap *b);
+size_t bm_to_array(const Bitmap *b, uint32_t *out, size_t max);
+
+
+/* ========== Flat Tree ==========
+ * Index-based struct-of-arrays copy of a tree. Node 0 is the root and node
+ * i's children are yes[i]/no[i] (FLAT_NIL for none). Text lives in one blob
+ * of NUL-terminated strings addressed by 32-bit offsets, and the
+ * question/leaf flag is packed one bit per node.
+ */
+#define FLAT_NIL UINT32_MAX
+
+/* Identity of a snapshot for the write-ahead log: the log tagged `tag`
+ * applies from its start, and the log tagged `base` was folded into the
+ * snapshot up to byte `baseLen`, for a crash before the log restarts.
+ */
+typedef struct {
+    uint64_t tag;
+    uint64_t base;
+    uint64_t baseLen;
+} SnapshotTag;
+
+typedef struct {
+    uint32_t count;
+    uint32_t *yes;
+    uint32_t *no;
+    uint32_t *text;     /* offset of each node's text in blob */
+    uint8_t *isq;       /* question bits, (count + 7) / 8 bytes */
+    char *blob;
+    uint64_t blobLen;
+    uint32_t *visits;   /* per-node visit counts; NULL reads as all zero */
+    SnapshotTag tag;    /* written as SEC_TAG when tag.tag != 0 */
+    const void *answers;   /* packed recorded answers (see answers_pack), */
+    uint64_t answersLen;   /* written as SEC_ANSWERS when not NULL */
+} FlatTree;
+
+static inline int flat_is_question(const FlatTree *ft, uint32_t i) {
+    return (ft->isq[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline const char *flat_text(const FlatTree *ft, uint32_t i) {
+    return ft->blob + ft->text[i];
+}
+
+int flat_from_tree(FlatTree *ft, Node *root);
+void flat_free(FlatTree *ft);
+uint32_t flat_count_nodes(const FlatTree *ft, uint32_t root);
+int flat_check_integrity(const FlatTree *ft);
+uint32_t flat_traverse(const FlatTree *ft, const uint8_t *answers, int nanswers);
+int flat_save_tree(const FlatTree *ft, const char *filename);
+int flat_save_compact(const FlatTree *ft, const char *filename);
+
+/* ========== Attribute Index ==========
+ * Inverted index from questions to the animals that answer them. Every
+ * question node gets a question id and every leaf an animal id; question
+ * q's posting lists yes[q]/no[q] are the animals in its yes and no
+ * subtrees.
+ *
+ * The base of the index is built in bulk by ai_build or mapped from a
+ * saved file by ai_attach. It numbers leaves in DFS order, so each base
+ * question's yes and no sets are the id ranges in `ranges`, and canonical
+ * texts are found through open-addressing tables of (hash, id + 1) slots.
+ * A base posting list only becomes a Bitmap when learning adds to it.
+ * Questions and animals learned later get appended ids and are filed in
+ * the keys/names hashes. Undo/redo only flip the live flags of the split's
+ * question and animal, so queries filter through the live set.
+ */
+typedef struct {
+    uint64_t hash;      /* h_hash64 of the canonical text */
+    uint32_t id;        /* question or animal id + 1; 0 marks an empty slot */
+    uint32_t reserved;
+} IndexSlot;
+
+typedef struct {
+    Hash keys;          /* canonical question -> learned question ids */
+    Hash names;         /* canonical animal name -> learned animal ids */
+    Node **questions;   /* question id -> node */
+    Bitmap *yes;        /* question id -> animals below its yes branch */
+    Bitmap *no;
+    uint8_t *qlive;     /* question id still in the tree */
+    int nquestions;
+    int qcap;
+    Node **animals;     /* animal id -> leaf */
+    int nanimals;
+    int acap;
+    Bitmap live;        /* animal ids still in the tree */
+    int forgotten;      /* animal ids dropped by ai_forget_split */
+
+    const IndexSlot *keyTab;   /* base questions by canonical text */
+    const IndexSlot *nameTab;  /* base animals by canonical name */
+    uint32_t keyMask;          /* table sizes - 1 */
+    uint32_t nameMask;
+    const uint32_t *ranges;    /* per base question: yes [r0, r1), no [r1, r2) */
+    uint32_t nbase;            /* base questions */
+    void *baseMem;             /* owned base tables; NULL when mapped */
+} AttrIndex;
+
+typedef struct {
+    const char *question;  /* any spelling; canonicalized for lookup */
+    int answer;            /* 1 = answers yes, 0 = answers no */
+    int exclude;           /* nonzero: drop matching animals (AND NOT) */
+} AttrTerm;
+
+void ai_init(AttrIndex *ix);
+void ai_free(AttrIndex *ix);
+int ai_build(AttrIndex *ix, Node *root);
+int ai_flat_section(const FlatTree *ft, void **out, uint64_t *outLen);
+int ai_attach(AttrIndex *ix, const void *section, uint64_t len, Node *nodes, uint32_t count);
+int ai_learn(AttrIndex *ix, const Frame *path, int depth,
+             Node *oldLeaf, Node *newQuestion, Node *newLeaf);
+int ai_set_split_live(AttrIndex *ix, const Edit *e, int live);
+void ai_forget_split(AttrIndex *ix, const Edit *e);
+int ai_compact(AttrIndex *ix, Node *root);
+int ai_query(const AttrIndex *ix, const AttrTerm *terms, int nterms, Bitmap *out);
+Node *ai_animal(const AttrIndex *ix, uint32_t id);
+
+extern AttrIndex g_index;
 
 /* ========== Persistence ========== */
 int save_tree(const char *filename);
+int save_tree_v1(const char *filename);
+int save_tree_v3(const char *filename);
 int load_tree(const char *filename);
+int verify_tree_file(const char *filename);
+void replace_tree(Node *root, NodeArena *arena);
+int fsync_path(const char *path);
+int fsync_parent(const char *path);
+char *path_with(const char *path, const char *suffix);
+
+#define SAVE_GENERATIONS_DEFAULT 2
+
+void save_set_generations(int n);
+int save_generations(void);
+void save_set_index(int on);
+int save_index(void);
+int save_set_format(int version);
+int save_format(void);
+int rollback_tree(const char *filename, int generation);
+
+typedef enum {
+    SAVE_IDLE,
+    SAVE_RUNNING,
+    SAVE_DONE,      /* reported once, then SAVE_IDLE */
+    SAVE_FAILED
+} SaveState;
+
+int save_tree_start(const char *filename);
+SaveState save_tree_poll(int *percent);
+SaveState save_tree_wait(void);
+
+extern SnapshotTag g_treeTag;  /* of the snapshot g_root was loaded from or checkpointed to */
+
+/* ========== Write-Ahead Log ==========
+ * Lessons, undos and redos are appended to <snapshot>.wal as small records
+ * instead of rewriting the snapshot; load_tree replays the log and
+ * wal_checkpoint folds it into a new snapshot, written in the background
+ * by wal_checkpoint_start. wal_save makes the log durable and folds it
+ * only once it has grown. Writer only, except wal_sync.
+ */
+int wal_open(const char *snapshot);
+void wal_close(void);
+int wal_sync(void);
+int wal_checkpoint(void);
+int wal_save(void);
+int wal_checkpoint_start(void);
+SaveState wal_checkpoint_poll(int *percent);
+int wal_checkpoint_wait(void);
+int wal_replay(const char *snapshot);
+uint64_t wal_size(void);
+void wal_log_split(const Frame *path, int depth, int newYes, const char *animal,
+                   const char *question);
+void wal_log_edit(const Edit *e, int undone);
+void wal_log_rebuild(void);
+void wal_log_answer(const char *animal, const char *question, int yes);
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/* ========== Tree Statistics ==========
+ * Size and shape of g_root, kept current by every change to the tree so
+ * that reading them is O(1): a learned split at depth d turns one leaf at
+ * depth d into a question with two leaves at depth d + 1, and undo/redo
+ * apply or revert exactly that. Only stats_recount walks the tree.
+ */
+typedef struct {
+    int nodes;
+    int leaves;
+    int questions;
+    int height;        /* depth of the deepest leaf; root has depth 0 */
+    int *leavesAt;     /* leavesAt[d] = number of leaves at depth d */
+    int depthCap;
+} TreeStats;
+
+int stats_recount(TreeStats *s, Node *root);
+void stats_split(TreeStats *s, int depth);
+void stats_unsplit(TreeStats *s, int depth);
+void stats_free(TreeStats *s);
+
+extern TreeStats g_stats;
+
+/* ========== Tree Optimizer ==========
+ * Offline rebuild of the question order from play statistics. Each
+ * animal's root path is read as answers to attributes (canonical question
+ * texts), together with the answers recorded for it in g_answers, and the
+ * tree is regrown top-down, ID3 style: every subtree asks the question
+ * that splits its animals, weighted by visits, with the least remaining
+ * entropy. Only questions every animal of the subtree has a known answer
+ * to are asked, so each animal stays reachable by its own answers.
+ * Path answers alone never allow a shorter path: each question on a path
+ * is the only known difference from some other animal. Answers recorded
+ * when a lesson also asks the new question about nearby animals (see
+ * learn_neighbours) are what lets a question move up.
+ * install_tree makes a rebuilt tree current as one undoable edit.
+ */
+typedef struct {
+    char *animal;     /* as the player named it */
+    char *question;
+    int yes;
+} Answer;
+
+/* Answers given for animals beyond their own root paths. Written by the
+ * writer only; saved with the tree and logged to the write-ahead log.
+ */
+typedef struct {
+    Answer *answers;  /* in the order given: a later one overrides */
+    int count;
+    int capacity;
+} AnswerBook;
+
+extern AnswerBook g_answers;
+
+int answers_add(AnswerBook *b, const char *animal, const char *question, int yes);
+void answers_clear(AnswerBook *b);
+void *answers_pack(const AnswerBook *b, uint64_t *outLen);
+int answers_unpack(AnswerBook *b, const void *data, uint64_t len);
+Node *opt_rebuild(Node *root, NodeArena *arena);
+double expected_questions(Node *root);
+int install_tree(Node *newRoot);
+int optimize_tree(double *before, double *after);
 
 /* ========== Utilities ========== */
 int check_integrity();
 void find_shortest_path(const char *animal1, const char *animal2);
 
+/* ========== Game Session ==========
+ * One game against g_root with no UI attached: the caller reads the
+ * prompt, feeds answers and, after a wrong guess, teaches the new animal.
+ * Visit counters, g_undo/g_redo, g_stats and g_index are kept current as
+ * in interactive play. A game holds no epoch pin between calls: each call
+ * first checks that the game's place is still in the tree, and starts
+ * over from the root if a change by another player removed it.
+ */
+typedef enum {
+    SESSION_ASK,     /* prompt is a question */
+    SESSION_GUESS,   /* prompt is the animal being guessed */
+    SESSION_WON,     /* the guess was right */
+    SESSION_LEARN,   /* the guess was wrong: waiting for session_teach */
+    SESSION_OVER     /* taught, ended, or there was no tree */
+} SessionState;
+
+typedef struct {
+    Node *node;        /* current question or guessed leaf */
+    FrameStack path;   /* questions answered so far, root first */
+    SessionState state;
+    unsigned long version;  /* g_treeVersion when node was last seen in the tree */
+} Session;
+
+void session_start(Session *s);
+const char *session_current_prompt(const Session *s);
+SessionState session_answer(Session *s, int yes);
+int session_teach(Session *s, const char *animal, const char *question, int answerYes, Edit *out);
+int learn_split(const FrameStack *path, Node *leaf, const char *animal, const char *question,
+                int answerYes, Edit *out);
+
+#define LEARN_ASK_MAX 3   /* other animals a new question is asked about */
+
+int learn_neighbours(const FrameStack *path, Node **out, int max);
+int learn_answer(const char *animal, const char *question, int yes);
+void session_end(Session *s);
+
+/* ========== Edit Journal ==========
+ * g_undo and g_redo together hold at most the journal budget (edit_cost
+ * bytes). New edits go through journal_record(); when the budget is
+ * exceeded the oldest undo entries are compacted away and the nodes only
+ * they kept alive are retired.
+ */
+#define JOURNAL_BUDGET_DEFAULT ((size_t)8 << 20)
+
+void journal_record(Edit e);
+void journal_set_budget(size_t bytes);
+size_t journal_budget(void);
+void discard_redo(void);
+void retire_tree(Node *root);
+
+/* ========== Epoch-Based Reclamation ==========
+ * Nodes detached for good (undone edits dropped from g_redo) may still be
+ * in use by readers that walked past them. They are retired and freed only
+ * after every reader pinned before the retirement has unpinned. Session
+ * calls pin only while they run, so an idle game holds nothing back.
+ * Readers pin and unpin with plain loads and stores; retire/reclaim are
+ * for the single writer.
+ */
+unsigned epoch_pin(void);
+void epoch_unpin(unsigned e);
+int epoch_retire(Node *node, NodeArena *arena);
+int epoch_reclaim(void);
+int epoch_pending(void);
+void epoch_forget_arena(NodeArena *arena);
+
+/* ========== Game Server ==========
+ * Games served over a UNIX domain socket, one line per message. Worker
+ * threads play any number of sessions concurrently; lessons, undo and
+ * redo are applied one at a time by a single writer thread.
+ */
+int server_start(const char *path, int nworkers);
+void server_stop(void);
+int server_sessions(void);
+int server_run(const char *path, int nworkers);
+
 /* ========== Gameplay ========== */
 void play_game();
 
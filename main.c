@@ -26,11 +26,17 @@
 Node *g_root = NULL;
 
 /* Global undo/redo stacks */
-EditStack g_undo = {NULL, 0, 0};
-EditStack g_redo = {NULL, 0, 0};
+EditStack g_undo = {NULL, 0, 0, 0};
+EditStack g_redo = {NULL, 0, 0, 0};
 
 /* Global attribute index */
-Hash g_index = {NULL, 0, 0};
+AttrIndex g_index = {0};
+
+/* Arena owning the nodes of g_root */
+NodeArena g_arena = {NULL, NULL, 0, NULL, 0, NULL, NULL};
+
+/* Size and shape of g_root, maintained incrementally */
+TreeStats g_stats = {0, 0, 0, 0, NULL, 0};
 
 /* GUI Colors */
 #define COLOR_HEADER 1
@@ -80,7 +86,7 @@ void display_header() {
 void display_menu() {
     int row = LINES - 3;
     attron(COLOR_PAIR(COLOR_HEADER));
-    mvprintw(row, 2, "[P]lay | [V]iew Tree | [U]ndo | [R]edo | [S]ave | [L]oad | [I]ntegrity | [Q]uit");
+    mvprintw(row, 2, "[P]lay | [V]iew | [U]ndo | [R]edo | [S]ave | [L]oad | [I]ntegrity | [O]ptimize | [Q]uit");
     attroff(COLOR_PAIR(COLOR_HEADER));
 }
 
@@ -131,21 +137,58 @@ void initialize_tree() {
     if (g_root != NULL) {
         free_tree(g_root);
     }
+    arena_release(&g_arena);
     
-    Node *water = create_question_node("Does it live in water?");
-    water->yes = create_animal_node("Fish");
-    water->no = create_animal_node("Dog");
+    Node *water = arena_question_node(&g_arena, "Does it live in water?");
+    water->yes = arena_animal_node(&g_arena, "Fish");
+    water->no = arena_animal_node(&g_arena, "Dog");
     g_root = water;
     
-    h_free(&g_index);
-    h_init(&g_index, 31);
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
     
     
 }
 
-int main() {
-    init_gui();
-    
+/* Release everything main() set up */
+static void shutdown_tree() {
+    wal_close();
+    free_tree(g_root);
+    arena_release(&g_arena);
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    ai_free(&g_index);
+    stats_free(&g_stats);
+}
+
+/* Save the edits logged to animals.dat.wal since the last save, or start
+ * saving g_root to animals.dat in the background and log later edits
+ */
+static int save_animals() {
+    return wal_size() > 0 ? wal_save() : wal_open("animals.dat");
+}
+
+/* --server [path]: serve games over a UNIX socket without the ncurses UI.
+ * Starts from animals.dat when it loads, logs every lesson as it is
+ * learned and folds the log into animals.dat on SIGINT/SIGTERM.
+ */
+static int run_server(const char *path) {
+    if (!load_tree("animals.dat")) {
+        initialize_tree();
+    }
+    if (!save_animals()) {
+        fprintf(stderr, "[main] Lessons will not be logged to animals.dat.wal\n");
+    }
+    int ok = server_run(path, 0);
+    if (ok && !wal_checkpoint()) {
+        fprintf(stderr, "[main] Failed to save animals.dat\n");
+        ok = 0;
+    }
+    shutdown_tree();
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
     /* Initialize undo/redo stacks FIRST */
     g_undo.edits = NULL;
     g_undo.size = 0;
@@ -157,17 +200,59 @@ int main() {
     g_redo.capacity = 0;
     es_init(&g_redo);
     
+    // --index: store the attribute index in saved files, for faster loads
+    if (argc > 1 && strcmp(argv[1], "--index") == 0) {
+        save_set_index(1);
+        argv++;
+        argc--;
+    }
+    // --format 3: save compact VERSION 3 files instead of VERSION 2
+    if (argc > 1 && strcmp(argv[1], "--format") == 0) {
+        if (argc < 3 || !save_set_format(atoi(argv[2]))) {
+            fprintf(stderr, "[main] --format takes 2 or 3\n");
+            return 1;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        return run_server(argc > 2 ? argv[2] : "animals.sock");
+    }
+    // --verify [file]: check a saved tree without loading it
+    if (argc > 1 && strcmp(argv[1], "--verify") == 0) {
+        return verify_tree_file(argc > 2 ? argv[2] : "animals.dat") ? 0 : 1;
+    }
+    // --rollback [n]: go back to the tree saved n saves ago
+    if (argc > 1 && strcmp(argv[1], "--rollback") == 0) {
+        return rollback_tree("animals.dat", argc > 2 ? atoi(argv[2]) : 1) ? 0 : 1;
+    }
+    
+    init_gui();
     initialize_tree();
     
     int running = 1;
+    const char *saveStatus = NULL;
     while (running) {
+        int percent;
+        SaveState save = wal_checkpoint_poll(&percent);
+        if (save == SAVE_DONE) {
+            saveStatus = "Tree saved successfully!";
+        } else if (save == SAVE_FAILED) {
+            saveStatus = "Error saving tree!";
+        }
         clear();
         display_header();
         draw_box(2, 1, LINES - 6, COLS - 2, "Game Status");
         display_menu();
         
-        mvprintw(4, 3, "Tree nodes: %d", g_root ? count_nodes(g_root) : 0);
+        mvprintw(4, 3, "Tree nodes: %d (%d animals, %d questions, depth %d)",
+                 g_stats.nodes, g_stats.leaves, g_stats.questions, g_stats.height);
         mvprintw(5, 3, "Undo stack: %d | Redo stack: %d", g_undo.size, g_redo.size);
+        if (save == SAVE_RUNNING) {
+            mvprintw(6, 3, "Saving animals.dat in the background: %d%%", percent);
+        } else if (saveStatus != NULL) {
+            mvprintw(6, 3, "%s", saveStatus);
+        }
         
         if (g_root == NULL) {
             attron(COLOR_PAIR(COLOR_ERROR));
@@ -178,7 +263,10 @@ int main() {
         }
         refresh();
         
+        // Redraw now and then while a save runs, to show its progress
+        timeout(save == SAVE_RUNNING ? 200 : -1);
         int ch = getch();
+        timeout(-1);
         
         switch (tolower(ch)) {
             case 'p':
@@ -207,14 +295,15 @@ int main() {
             case 's':
                 if (g_root == NULL) {
                     show_message("Error: No tree to save! Initialize tree first.", 1);
-                } else if (save_tree("animals.dat")) {
-                    show_message("Tree saved successfully!", 0);
+                } else if (save_animals()) {
+                    // A snapshot being written shows its progress instead
+                    saveStatus = "Tree saved successfully!";
                 } else {
                     show_message("Error saving tree!", 1);
                 }
                 break;
             case 'l':
-                if (load_tree("animals.dat")) {
+                if (load_tree("animals.dat") && save_animals()) {
                     show_message("Tree loaded successfully!", 0);
                 } else {
                     show_message("Error loading tree!", 1);
@@ -229,6 +318,21 @@ int main() {
                     show_message("Tree integrity check failed!", 1);
                 }
                 break;
+            case 'o': {
+                double before, after;
+                char msg[96];
+                if (g_root == NULL) {
+                    show_message("Error: No tree to optimize! Initialize tree first.", 1);
+                } else if (optimize_tree(&before, &after)) {
+                    snprintf(msg, sizeof(msg), "Tree optimized: %.2f -> %.2f questions per game (undo restores it)",
+                             before, after);
+                    show_message(msg, 0);
+                } else {
+                    snprintf(msg, sizeof(msg), "Tree already optimal: %.2f questions per game", before);
+                    show_message(msg, 1);
+                }
+                break;
+            }
             case 'q':
                 running = 0;
                 break;
@@ -236,10 +340,7 @@ int main() {
     }
     
     endwin();
-    free_tree(g_root);
-    free_edit_stack(&g_undo);
-    free_edit_stack(&g_redo);
-    h_free(&g_index);
+    shutdown_tree();
     
     return 0;
 }
@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "lab5.h"
+
+extern Node *g_root;
+extern EditStack g_undo;
+extern EditStack g_redo;
+extern AttrIndex g_index;
+extern NodeArena g_arena;
+
+/* ========== Tree Optimizer ========== */
+
+/* Answers recorded beyond the root paths (see learn_answer) */
+AnswerBook g_answers = {NULL, 0, 0};
+
+/* Record animal's answer to question. Returns 1 on success. */
+int answers_add(AnswerBook *b, const char *animal, const char *question, int yes) {
+    if (b->count == b->capacity) {
+        int newCap = b->capacity ? b->capacity * 2 : 16;
+        Answer *grown = realloc(b->answers, newCap * sizeof(Answer));
+        if (grown == NULL) {
+            return 0;
+        }
+        b->answers = grown;
+        b->capacity = newCap;
+    }
+    Answer a = {strdup(animal), strdup(question), yes != 0};
+    if (a.animal == NULL || a.question == NULL) {
+        free(a.animal);
+        free(a.question);
+        return 0;
+    }
+    b->answers[b->count++] = a;
+    return 1;
+}
+
+void answers_clear(AnswerBook *b) {
+    for (int i = 0; i < b->count; i++) {
+        free(b->answers[i].animal);
+        free(b->answers[i].question);
+    }
+    free(b->answers);
+    memset(b, 0, sizeof(*b));
+}
+
+/* Serialize b as stored in SEC_ANSWERS: uint32_t count, then per answer
+ * uint8_t yes, uint32_t len + animal, uint32_t len + question. Returns a
+ * malloc'd buffer, or NULL if b is empty or memory runs out.
+ */
+void *answers_pack(const AnswerBook *b, uint64_t *outLen) {
+    uint64_t len = 4;
+    for (int i = 0; i < b->count; i++) {
+        len += 9 + strlen(b->answers[i].animal) + strlen(b->answers[i].question);
+    }
+    char *buf = b->count > 0 ? malloc(len) : NULL;
+    if (buf == NULL) {
+        return NULL;
+    }
+    uint32_t count = (uint32_t)b->count;
+    memcpy(buf, &count, 4);
+    char *p = buf + 4;
+    for (int i = 0; i < b->count; i++) {
+        const char *texts[2] = {b->answers[i].animal, b->answers[i].question};
+        *p++ = (char)b->answers[i].yes;
+        for (int k = 0; k < 2; k++) {
+            uint32_t n = (uint32_t)strlen(texts[k]);
+            memcpy(p, &n, 4);
+            memcpy(p + 4, texts[k], n);
+            p += 4 + n;
+        }
+    }
+    *outLen = len;
+    return buf;
+}
+
+/* Append the answers packed in data to b. Returns 0, leaving b as it
+ * was, if data is not a whole answers_pack image.
+ */
+int answers_unpack(AnswerBook *b, const void *data, uint64_t len) {
+    const char *p = data, *end = p + len;
+    uint32_t count;
+    int before = b->count;
+    if (len < 4) {
+        return 0;
+    }
+    memcpy(&count, p, 4);
+    p += 4;
+    for (uint32_t i = 0; i < count; i++) {
+        char *texts[2] = {NULL, NULL};
+        if (end - p < 1) goto unpack_error;
+        int yes = *p++ != 0;
+        for (int k = 0; k < 2; k++) {
+            uint32_t n;
+            if (end - p < 4) break;
+            memcpy(&n, p, 4);
+            if ((uint64_t)(end - p - 4) < n) break;
+            texts[k] = strndup(p + 4, n);
+            p += 4 + n;
+        }
+        int ok = texts[0] != NULL && texts[1] != NULL && answers_add(b, texts[0], texts[1], yes);
+        free(texts[0]);
+        free(texts[1]);
+        if (!ok) goto unpack_error;
+    }
+    if (p == end) {
+        return 1;
+    }
+
+unpack_error:
+    while (b->count > before) {
+        b->count--;
+        free(b->answers[b->count].animal);
+        free(b->answers[b->count].question);
+    }
+    return 0;
+}
+
+/* Every leaf's root path is read as a list of attribute answers, keyed by
+ * the canonical question text: a wording asked in several branches is one
+ * attribute. Paths are stored back to back (CSR), sorted by question id.
+ */
+typedef struct {
+    Node **leaves;       /* animal -> leaf of the current tree */
+    int nanimals;
+    int acap;
+    uint32_t *start;     /* animal a's answers are [start[a], start[a + 1]) */
+    uint32_t *qid;
+    uint8_t *ans;
+    uint32_t nanswers;
+    uint32_t anscap;
+    const char **qtext;  /* question id -> wording used for new nodes */
+    int nquestions;
+    int qcap;
+} Attributes;
+
+/* A subtree still to be built: animals perm[lo, hi) go below *slot */
+typedef struct {
+    int lo, hi;
+    Node **slot;
+} OptTask;
+
+static void attrs_free(Attributes *at) {
+    free(at->leaves);
+    free(at->start);
+    free(at->qid);
+    free(at->ans);
+    free(at->qtext);
+    memset(at, 0, sizeof(*at));
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Append leaf with the answers on its path (pathQ/pathA, root first).
+ * A question asked twice on one path keeps its deepest answer.
+ */
+static int attrs_add_leaf(Attributes *at, Node *leaf, const uint32_t *pathQ,
+                          const uint8_t *pathA, int depth, uint64_t *sortBuf) {
+    if (at->nanimals + 1 >= at->acap) {
+        int newCap = at->acap ? at->acap * 2 : 64;
+        Node **leaves = realloc(at->leaves, newCap * sizeof(Node *));
+        if (leaves == NULL) {
+            return 0;
+        }
+        at->leaves = leaves;
+        uint32_t *start = realloc(at->start, (newCap + 1) * sizeof(uint32_t));
+        if (start == NULL) {
+            return 0;
+        }
+        at->start = start;
+        at->acap = newCap;
+    }
+    if (at->nanswers + (uint32_t)depth > at->anscap) {
+        uint32_t newCap = at->anscap ? at->anscap : 256;
+        while (newCap < at->nanswers + (uint32_t)depth) {
+            newCap *= 2;
+        }
+        uint32_t *qid = realloc(at->qid, newCap * sizeof(uint32_t));
+        if (qid == NULL) {
+            return 0;
+        }
+        at->qid = qid;
+        uint8_t *ans = realloc(at->ans, newCap);
+        if (ans == NULL) {
+            return 0;
+        }
+        at->ans = ans;
+        at->anscap = newCap;
+    }
+    for (int d = 0; d < depth; d++) {
+        sortBuf[d] = (uint64_t)pathQ[d] << 32 | (uint32_t)d;
+    }
+    qsort(sortBuf, depth, sizeof(uint64_t), cmp_u64);
+    int a = at->nanimals++;
+    at->leaves[a] = leaf;
+    at->start[a] = at->nanswers;
+    for (int k = 0; k < depth; k++) {
+        // Sorted by (question, depth): the last of a run is the deepest
+        if (k + 1 < depth && sortBuf[k + 1] >> 32 == sortBuf[k] >> 32) {
+            continue;
+        }
+        at->qid[at->nanswers] = (uint32_t)(sortBuf[k] >> 32);
+        at->ans[at->nanswers++] = pathA[(uint32_t)sortBuf[k]];
+    }
+    at->start[a + 1] = at->nanswers;
+    return 1;
+}
+
+/* Question id for node's wording, interning it on first sight; -1 on failure */
+static int attrs_question(Attributes *at, Hash *keys, Node *node) {
+    const char *key = canonicalize_tmp(node->text);
+    if (key == NULL) {
+        return -1;
+    }
+    int count = 0;
+    int *ids = h_get_ids(keys, key, &count);
+    if (count > 0) {
+        return ids[0];
+    }
+    if (at->nquestions == at->qcap) {
+        int newCap = at->qcap ? at->qcap * 2 : 64;
+        const char **qtext = realloc(at->qtext, newCap * sizeof(char *));
+        if (qtext == NULL) {
+            return -1;
+        }
+        at->qtext = qtext;
+        at->qcap = newCap;
+    }
+    if (!h_put(keys, key, at->nquestions)) {
+        return -1;
+    }
+    at->qtext[at->nquestions] = node->text;
+    return at->nquestions++;
+}
+
+/* Append (q, yes) to the answer arrays being rebuilt in qid and ans */
+static int attrs_push(uint32_t **qid, uint8_t **ans, uint32_t *len, uint32_t *cap,
+                      uint32_t q, uint8_t yes) {
+    if (*len == *cap) {
+        uint32_t newCap = *cap ? *cap * 2 : 256;
+        uint32_t *qg = realloc(*qid, newCap * sizeof(uint32_t));
+        if (qg == NULL) {
+            return 0;
+        }
+        *qid = qg;
+        uint8_t *ag = realloc(*ans, newCap);
+        if (ag == NULL) {
+            return 0;
+        }
+        *ans = ag;
+        *cap = newCap;
+    }
+    (*qid)[*len] = q;
+    (*ans)[(*len)++] = yes;
+    return 1;
+}
+
+/* Merge the answers recorded in book into every animal's list. Only
+ * wordings asked somewhere in the tree count, so the question of an undone
+ * lesson drops out with it. An answer on the animal's own path wins over
+ * a recorded one, and a later recorded answer over an earlier one.
+ * Returns 1 on success.
+ */
+static int attrs_add_recorded(Attributes *at, Hash *keys, const AnswerBook *book) {
+    if (book->count == 0 || at->nanimals == 0) {
+        return 1;
+    }
+    Hash names;
+    h_init(&names, book->count);
+    uint64_t *extra = malloc(book->count * sizeof(uint64_t));  // q << 32 | book index
+    uint32_t *qid = NULL;
+    uint8_t *ans = NULL;
+    uint32_t len = 0, cap = 0;
+    int ok = 0;
+    if (extra == NULL) {
+        goto recorded_done;
+    }
+    for (int i = 0; i < book->count; i++) {
+        const char *key = canonicalize_tmp(book->answers[i].animal);
+        if (key == NULL || !h_put(&names, key, i)) {
+            goto recorded_done;
+        }
+    }
+    for (int a = 0; a < at->nanimals; a++) {
+        uint32_t lo = at->start[a], hi = at->start[a + 1];
+        at->start[a] = len;
+        int count = 0, n = 0;
+        const char *name = canonicalize_tmp(at->leaves[a]->text);
+        int *ids = name != NULL ? h_get_ids(&names, name, &count) : NULL;
+        for (int k = 0; k < count; k++) {
+            const char *key = canonicalize_tmp(book->answers[ids[k]].question);
+            int found = 0;
+            int *q = key != NULL ? h_get_ids(keys, key, &found) : NULL;
+            if (found > 0) {
+                extra[n++] = (uint64_t)q[0] << 32 | (uint32_t)ids[k];
+            }
+        }
+        // Sorted by (question, book order): the last of a run is the latest
+        qsort(extra, n, sizeof(uint64_t), cmp_u64);
+        int e = 0;
+        while (lo < hi || e < n) {
+            uint32_t eq = e < n ? (uint32_t)(extra[e] >> 32) : UINT32_MAX;
+            if (e + 1 < n && (uint32_t)(extra[e + 1] >> 32) == eq) {
+                e++;
+                continue;
+            }
+            int pushed;
+            if (lo < hi && at->qid[lo] <= eq) {
+                pushed = attrs_push(&qid, &ans, &len, &cap, at->qid[lo], at->ans[lo]);
+                e += lo < hi && at->qid[lo] == eq;  // the path's answer wins
+                lo++;
+            } else {
+                uint8_t yes = (uint8_t)book->answers[(uint32_t)extra[e]].yes;
+                pushed = attrs_push(&qid, &ans, &len, &cap, eq, yes);
+                e++;
+            }
+            if (!pushed) {
+                goto recorded_done;
+            }
+        }
+    }
+    at->start[at->nanimals] = len;
+    free(at->qid);
+    free(at->ans);
+    at->qid = qid;
+    at->ans = ans;
+    at->nanswers = len;
+    at->anscap = cap;
+    qid = NULL;
+    ans = NULL;
+    ok = 1;
+
+recorded_done:
+    free(extra);
+    free(qid);
+    free(ans);
+    h_free(&names);
+    return ok;
+}
+
+/* Collect every leaf of root with its path answers, using an explicit
+ * (node, depth, answer) stack, then add the recorded ones. Returns 1 on
+ * success.
+ */
+static int attrs_collect(Attributes *at, Node *root) {
+    typedef struct {
+        Node *node;
+        int depth;
+        uint8_t answer;  /* answer to the parent's question */
+    } PathFrame;
+
+    memset(at, 0, sizeof(*at));
+    Hash keys;
+    h_init(&keys, 64);
+    int cap = 64, top = 0, pathCap = 64, ok = 0;
+    PathFrame *stack = malloc(cap * sizeof(PathFrame));
+    uint32_t *pathQ = malloc(pathCap * sizeof(uint32_t));
+    uint8_t *pathA = malloc(pathCap);
+    uint64_t *sortBuf = malloc(pathCap * sizeof(uint64_t));
+    if (!stack || !pathQ || !pathA || !sortBuf) {
+        goto collect_done;
+    }
+    stack[top++] = (PathFrame){root, 0, 0};
+    while (top > 0) {
+        PathFrame f = stack[--top];
+        if (f.depth >= pathCap) {
+            pathCap *= 2;
+            uint32_t *q = realloc(pathQ, pathCap * sizeof(uint32_t));
+            if (q == NULL) goto collect_done;
+            pathQ = q;
+            uint8_t *a = realloc(pathA, pathCap);
+            if (a == NULL) goto collect_done;
+            pathA = a;
+            uint64_t *sb = realloc(sortBuf, pathCap * sizeof(uint64_t));
+            if (sb == NULL) goto collect_done;
+            sortBuf = sb;
+        }
+        // Entries deeper than f.depth belong to a finished sibling subtree
+        if (f.depth > 0) {
+            pathA[f.depth - 1] = f.answer;
+        }
+        if (!f.node->isQuestion) {
+            if (!attrs_add_leaf(at, f.node, pathQ, pathA, f.depth, sortBuf)) {
+                goto collect_done;
+            }
+            continue;
+        }
+        int q = attrs_question(at, &keys, f.node);
+        if (q < 0) {
+            goto collect_done;
+        }
+        pathQ[f.depth] = (uint32_t)q;
+        if (top + 2 > cap) {
+            cap *= 2;
+            PathFrame *grown = realloc(stack, cap * sizeof(PathFrame));
+            if (grown == NULL) goto collect_done;
+            stack = grown;
+        }
+        stack[top++] = (PathFrame){f.node->no, f.depth + 1, 0};
+        stack[top++] = (PathFrame){f.node->yes, f.depth + 1, 1};
+    }
+    ok = attrs_add_recorded(at, &keys, &g_answers);
+
+collect_done:
+    free(stack);
+    free(pathQ);
+    free(pathA);
+    free(sortBuf);
+    h_free(&keys);
+    if (!ok) {
+        attrs_free(at);
+    }
+    return ok;
+}
+
+/* Answer of animal a to question q: 1 yes, 0 no, -1 unknown */
+static int attrs_answer(const Attributes *at, int a, uint32_t q) {
+    uint32_t lo = at->start[a], hi = at->start[a + 1];
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (at->qid[mid] < q) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < at->start[a + 1] && at->qid[lo] == q ? at->ans[lo] : -1;
+}
+
+/* Weight of an animal: games that ended at its leaf, plus one so animals
+ * nobody has played yet still count.
+ */
+static double leaf_weight(const Node *leaf) {
+    return (double)leaf->visits + 1.0;
+}
+
+/* W * H for a set with total weight W and sum of w log2 w equal to L: the
+ * entropy bound on the questions needed to tell its members apart.
+ */
+static double split_cost(double w, double l) {
+    return w > 0 ? w * log2(w) - l : 0;
+}
+
+/* Per-question tallies over one subproblem */
+typedef struct {
+    int *cyes, *cno;
+    double *wyes, *wno;  /* weights answering yes / no */
+    double *lyes, *lno;  /* sums of w log2 w */
+    int *stamp;          /* task that last touched the question */
+    uint32_t *touched;
+} Tally;
+
+static int tally_init(Tally *t, int nq) {
+    size_t n = nq > 0 ? (size_t)nq : 1;
+    t->cyes = malloc(n * sizeof(int));
+    t->cno = malloc(n * sizeof(int));
+    t->wyes = malloc(n * sizeof(double));
+    t->wno = malloc(n * sizeof(double));
+    t->lyes = malloc(n * sizeof(double));
+    t->lno = malloc(n * sizeof(double));
+    t->stamp = malloc(n * sizeof(int));
+    t->touched = malloc(n * sizeof(uint32_t));
+    if (!t->cyes || !t->cno || !t->wyes || !t->wno || !t->lyes || !t->lno ||
+        !t->stamp || !t->touched) {
+        return 0;
+    }
+    for (size_t q = 0; q < n; q++) {
+        t->stamp[q] = -1;
+    }
+    return 1;
+}
+
+static void tally_free(Tally *t) {
+    free(t->cyes);
+    free(t->cno);
+    free(t->wyes);
+    free(t->wno);
+    free(t->lyes);
+    free(t->lno);
+    free(t->stamp);
+    free(t->touched);
+}
+
+/* Pick the question that best splits animals perm[lo, hi): among questions
+ * every one of them has a known answer to, with at least one yes and one
+ * no, the one whose two children have the smallest total entropy cost.
+ * A question some animal was never asked is skipped: placing it on a
+ * guessed side could leave it where its true answers never lead. The
+ * question at the animals' lowest common ancestor always qualifies.
+ * Returns the question id or -1 if no question separates the animals.
+ */
+static int choose_question(const Attributes *at, Tally *t, const int *perm, int lo, int hi,
+                           int taskId) {
+    int ntouched = 0;
+    for (int i = lo; i < hi; i++) {
+        int a = perm[i];
+        double w = leaf_weight(at->leaves[a]);
+        double wl = w * log2(w);
+        for (uint32_t k = at->start[a]; k < at->start[a + 1]; k++) {
+            uint32_t q = at->qid[k];
+            if (t->stamp[q] != taskId) {
+                t->stamp[q] = taskId;
+                t->cyes[q] = t->cno[q] = 0;
+                t->wyes[q] = t->wno[q] = t->lyes[q] = t->lno[q] = 0;
+                t->touched[ntouched++] = q;
+            }
+            if (at->ans[k]) {
+                t->cyes[q]++;
+                t->wyes[q] += w;
+                t->lyes[q] += wl;
+            } else {
+                t->cno[q]++;
+                t->wno[q] += w;
+                t->lno[q] += wl;
+            }
+        }
+    }
+
+    int best = -1;
+    double bestCost = 0;
+    for (int i = 0; i < ntouched; i++) {
+        uint32_t q = t->touched[i];
+        if (t->cyes[q] == 0 || t->cno[q] == 0 || t->cyes[q] + t->cno[q] != hi - lo) {
+            continue;  // does not split this set, or not by known answers
+        }
+        double cost = split_cost(t->wyes[q], t->lyes[q]) + split_cost(t->wno[q], t->lno[q]);
+        if (best < 0 || cost < bestCost - 1e-9) {
+            best = (int)q;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+/* Build an optimized copy of the tree at root in arena. Leaves are new
+ * nodes with the same text and visits; questions reuse the wordings of
+ * the old tree. The old tree is not modified. Returns the new root or
+ * NULL on failure (some nodes may already have been taken from the arena).
+ */
+Node *opt_rebuild(Node *root, NodeArena *arena) {
+    if (root == NULL) {
+        return NULL;
+    }
+    Attributes at;
+    if (!attrs_collect(&at, root)) {
+        return NULL;
+    }
+    Tally t;
+    memset(&t, 0, sizeof(t));
+    Node *newRoot = NULL;
+    int cap = 64, top = 0, taskId = 0, ok = 0;
+    OptTask *stack = malloc(cap * sizeof(OptTask));
+    int *perm = malloc(at.nanimals * sizeof(int));
+    if (!stack || !perm || !tally_init(&t, at.nquestions)) {
+        goto rebuild_done;
+    }
+    for (int a = 0; a < at.nanimals; a++) {
+        perm[a] = a;
+    }
+    stack[top++] = (OptTask){0, at.nanimals, &newRoot};
+
+    while (top > 0) {
+        OptTask task = stack[--top];
+        if (task.hi - task.lo == 1) {
+            Node *old = at.leaves[perm[task.lo]];
+            Node *leaf = arena_animal_node(arena, old->text);
+            if (leaf == NULL) {
+                goto rebuild_done;
+            }
+            leaf->visits = old->visits;
+            *task.slot = leaf;
+            continue;
+        }
+
+        int q = choose_question(&at, &t, perm, task.lo, task.hi, taskId++);
+        if (q < 0) {
+            goto rebuild_done;  // two animals share every known answer
+        }
+        Node *qn = arena_question_node(arena, at.qtext[q]);
+        if (qn == NULL) {
+            goto rebuild_done;
+        }
+        if (top + 2 > cap) {
+            cap *= 2;
+            OptTask *grown = realloc(stack, cap * sizeof(OptTask));
+            if (grown == NULL) {
+                goto rebuild_done;
+            }
+            stack = grown;
+        }
+        // Partition in place: yes animals first
+        uint64_t visits = 0;
+        int mid = task.lo;
+        for (int i = task.lo; i < task.hi; i++) {
+            int a = perm[i];
+            visits += at.leaves[a]->visits;
+            if (attrs_answer(&at, a, (uint32_t)q) == 1) {
+                perm[i] = perm[mid];
+                perm[mid++] = a;
+            }
+        }
+        qn->visits = visits > UINT32_MAX ? UINT32_MAX : (uint32_t)visits;
+        *task.slot = qn;
+        stack[top++] = (OptTask){mid, task.hi, &qn->no};
+        stack[top++] = (OptTask){task.lo, mid, &qn->yes};
+    }
+    ok = 1;
+
+rebuild_done:
+    free(stack);
+    free(perm);
+    tally_free(&t);
+    attrs_free(&at);
+    return ok ? newRoot : NULL;
+}
+
+/* Expected number of questions per game: leaf depths weighted like the
+ * optimizer weighs animals. Iterative, with an explicit (node, depth) stack.
+ */
+double expected_questions(Node *root) {
+    typedef struct {
+        Node *node;
+        int depth;
+    } DepthFrame;
+
+    if (root == NULL) {
+        return 0;
+    }
+    int cap = 64, top = 0;
+    DepthFrame *stack = malloc(cap * sizeof(DepthFrame));
+    if (stack == NULL) {
+        return -1;
+    }
+    double total = 0, weight = 0;
+    stack[top++] = (DepthFrame){root, 0};
+    while (top > 0) {
+        DepthFrame f = stack[--top];
+        if (!f.node->isQuestion) {
+            total += leaf_weight(f.node) * f.depth;
+            weight += leaf_weight(f.node);
+            continue;
+        }
+        if (top + 2 > cap) {
+            cap *= 2;
+            DepthFrame *grown = realloc(stack, cap * sizeof(DepthFrame));
+            if (grown == NULL) {
+                free(stack);
+                return -1;
+            }
+            stack = grown;
+        }
+        stack[top++] = (DepthFrame){f.node->no, f.depth + 1};
+        stack[top++] = (DepthFrame){f.node->yes, f.depth + 1};
+    }
+    free(stack);
+    return total / weight;
+}
+
+/* Make newRoot, a tree built in g_arena from g_root's animals, the
+ * current tree and record the swap as one undoable EDIT_REBUILD.
+ * Returns 1 on success.
+ */
+int install_tree(Node *newRoot) {
+    if (newRoot == NULL) {
+        return 0;
+    }
+    int oldNodes = g_stats.nodes;
+    Edit e = {.type = EDIT_REBUILD, .wasYesChild = -1, .oldRoot = g_root, .newRoot = newRoot};
+    tree_publish(&g_root, newRoot);
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    e.treeNodes = oldNodes > g_stats.nodes ? oldNodes : g_stats.nodes;
+    journal_record(e);
+    // A rebuild is not worth a record: fold the log instead
+    wal_log_rebuild();
+    return 1;
+}
+
+/* Rebuild g_root so that popular animals are reached with fewer questions,
+ * and record it as one undoable EDIT_REBUILD. The new tree is only
+ * installed if it lowers the expected number of questions; before/after
+ * (if not NULL) receive that number for the old and the kept tree.
+ * Returns 1 if the tree was replaced, 0 otherwise.
+ */
+int optimize_tree(double *before, double *after) {
+    double oldCost = expected_questions(g_root);
+    double newCost = oldCost;
+    int replaced = 0;
+    Node *newRoot = g_root != NULL ? opt_rebuild(g_root, &g_arena) : NULL;
+    if (newRoot != NULL) {
+        newCost = expected_questions(newRoot);
+    }
+    if (newRoot != NULL && newCost >= 0 && newCost < oldCost - 1e-9) {
+        replaced = install_tree(newRoot);
+    } else {
+        // Never published: nobody but this function has seen it
+        retire_tree(newRoot);
+        newCost = oldCost;
+    }
+    if (before != NULL) *before = oldCost;
+    if (after != NULL) *after = newCost;
+    return replaced;
+}
@@ -1,19 +1,545 @@
+#define _GNU_SOURCE  /* close_range */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include "lab5.h"
 
 extern Node *g_root;
+extern AttrIndex g_index;
+
+SnapshotTag g_treeTag = {0, 0, 0};
 
 #define MAGIC 0x41544C35  /* "ATL5" */
 #define VERSION 1
+#define VERSION_MAPPED 2
+#define VERSION_COMPACT 3
 #define MAX_TEXT_LEN 10000
+#define V3_CHUNK_NODES 65536  /* nodes per independently decodable chunk */
+
+/* VERSION 2 layout: a header and section directory followed by the
+ * sections, each starting on an 8-byte boundary. The node sections are the
+ * arrays of a FlatTree, so a read-only mapping of the file can be used in
+ * place. Loaders skip section types they do not know.
+ *
+ * VERSION 3 uses the same directory for a compact encoding that has to be
+ * decoded: children are implied by BFS order and the question bits, texts
+ * are front-coded, and numbers are varints. Large trees are cut into
+ * chunks of V3_CHUNK_NODES nodes whose streams start afresh, so the loader
+ * can decode them on several threads.
+ *
+ * Both end with SEC_CRC: a CRC-32C of every CRC_CHUNK_BYTES of the file
+ * before it, so a torn or bit-flipped file is refused before it is used.
+ * The header says so too: V2_CHECKSUMMED in the high half of nsections
+ * makes SEC_CRC required, so a damaged directory entry cannot turn the
+ * checks off. The marker has many bits set, and a file with any other
+ * high half is refused, so one flipped bit cannot clear it either.
+ */
+enum {
+    SEC_YES = 1,      /* uint32_t[count], FLAT_NIL for no child */
+    SEC_NO = 2,       /* uint32_t[count] */
+    SEC_TEXT = 3,     /* uint32_t[count] offsets into SEC_STRINGS */
+    SEC_SHAPE = 4,    /* question bits, (count + 7) / 8 bytes */
+    SEC_STRINGS = 5,  /* NUL-terminated node texts */
+    SEC_INDEX = 6,    /* optional attribute index (see ai_flat_section) */
+    SEC_VISITS = 7,   /* optional uint32_t[count] visit counters */
+    SEC_TAG = 8,      /* optional SnapshotTag for the write-ahead log (see wal.c) */
+    SEC_QTEXT = 9,    /* VERSION 3: question texts in BFS order (see TextCoder) */
+    SEC_ATEXT = 10,   /* VERSION 3: animal texts in BFS order */
+    SEC_VARVISITS = 11,  /* VERSION 3: optional varint visit counters */
+    SEC_CHUNKS = 12,  /* VERSION 3: uint32_t chunk nodes, uint32_t 0, V3Chunk[] */
+    SEC_CRC = 13,     /* uint32_t chunk bytes, uint32_t 0, uint32_t crc32c[] */
+    SEC_ANSWERS = 14, /* optional recorded answers (see answers_pack) */
+};
+
+#define V2_MAX_SECTIONS 64
+#define V2_SECTIONS_MASK 0xFFFFu
+#define V2_CHECKSUMMED 0x43520000u  /* "RC" over nsections: SEC_CRC is required */
+#define CRC_CHUNK_BYTES ((uint64_t)1 << 20)
 
 typedef struct {
-    Node *node;
-    int id;
-} NodeMapping;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t nsections;  /* sections, | V2_CHECKSUMMED */
+} V2Header;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t length;
+} V2Section;
+
+/* Where a VERSION 3 chunk starts in each stream, in bytes from the
+ * start of SEC_QTEXT, SEC_ATEXT and SEC_VARVISITS.
+ */
+typedef struct {
+    uint64_t qOff;
+    uint64_t aOff;
+    uint64_t vOff;
+} V3Chunk;
+
+#define OUT_BUF_SIZE (1 << 20)
+
+/* Output buffer: records are assembled in one large buffer and handed to
+ * the FILE in big writes instead of several tiny fwrite calls per node.
+ */
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t used;
+    int failed;
+    uint64_t written;   /* bytes handed to fp so far */
+    uint64_t total;     /* expected file size, 0 if unknown */
+    const char *path;   /* file being saved */
+    char *tmp;          /* what is written until it replaces path */
+} OutBuf;
+
+/* A background save's progress pipe (see save_tree_start), -1 if none */
+static int g_progressFd = -1;
+
+/* Earlier versions of a saved file kept as <file>.1 (the newest) and up */
+static int g_generations = SAVE_GENERATIONS_DEFAULT;
+
+/* Whether VERSION 2 saves carry the attribute index (see save_set_index) */
+static int g_saveIndex;
+
+/* The version save_tree writes (see save_set_format) */
+static int g_saveFormat = 2;
+
+/* Start saving to filename. The data goes to filename.tmp, and ob_close
+ * puts it in place only once all of it is on disk, so a crash mid-save
+ * leaves the previous file intact.
+ */
+static int ob_open(OutBuf *ob, const char *filename, const char *who) {
+    ob->used = 0;
+    ob->failed = 0;
+    ob->written = 0;
+    ob->total = 0;
+    ob->buf = NULL;
+    ob->path = filename;
+    ob->tmp = path_with(filename, ".tmp");
+    ob->fp = ob->tmp != NULL ? fopen(ob->tmp, "wb") : NULL;
+    if (ob->fp == NULL) {
+        fprintf(stderr, "[%s] Failed to open file: ", who);
+        perror(filename);
+        free(ob->tmp);
+        return 0;
+    }
+    // The stdio buffer would only add a copy on top of ours
+    setvbuf(ob->fp, NULL, _IONBF, 0);
+    ob->buf = malloc(OUT_BUF_SIZE);
+    if (ob->buf == NULL) {
+        fclose(ob->fp);
+        ob->fp = NULL;
+        unlink(ob->tmp);
+        free(ob->tmp);
+        return 0;
+    }
+    return 1;
+}
+
+/* Tell the process that started a background save how far it has got */
+static void ob_progress(OutBuf *ob, size_t len) {
+    uint64_t before = ob->written;
+    ob->written += len;
+    if (g_progressFd < 0 || ob->total == 0) {
+        return;
+    }
+    uint8_t pct = (uint8_t)(ob->written >= ob->total ? 100 : ob->written * 100 / ob->total);
+    if (pct != (uint8_t)(before * 100 / ob->total) && write(g_progressFd, &pct, 1) < 0) {
+        g_progressFd = -1;  // nobody is listening
+    }
+}
+
+static void ob_flush(OutBuf *ob) {
+    if (ob->used > 0 && !ob->failed &&
+        fwrite(ob->buf, 1, ob->used, ob->fp) != ob->used) {
+        ob->failed = 1;
+    }
+    ob_progress(ob, ob->used);
+    ob->used = 0;
+}
+
+static void ob_write(OutBuf *ob, const void *data, size_t len) {
+    if (len > OUT_BUF_SIZE - ob->used) {
+        ob_flush(ob);
+        if (len > OUT_BUF_SIZE) {
+            // Larger than the whole buffer: write it straight through
+            if (!ob->failed && fwrite(data, 1, len, ob->fp) != len) {
+                ob->failed = 1;
+            }
+            ob_progress(ob, len);
+            return;
+        }
+    }
+    memcpy(ob->buf + ob->used, data, len);
+    ob->used += len;
+}
+
+#define OB_SLICE ((size_t)8 << 20)  /* bytes per pwritev, so progress keeps moving */
+
+/* Write n buffers back to back after what ob has written, with pwritev
+ * straight from where they are instead of copying them into ob->buf.
+ */
+static void ob_writev(OutBuf *ob, const struct iovec *iov, int n) {
+    ob_flush(ob);
+    int fd = fileno(ob->fp);
+    int k = 0;
+    size_t done = 0;  // bytes of iov[k] already written
+    while (!ob->failed) {
+        while (k < n && done == iov[k].iov_len) {
+            k++;
+            done = 0;
+        }
+        if (k == n) {
+            break;
+        }
+        struct iovec batch[16];
+        int m = 0;
+        size_t bytes = 0;
+        for (int j = k; j < n && m < 16 && bytes < OB_SLICE; j++) {
+            size_t skip = j == k ? done : 0;
+            size_t len = iov[j].iov_len - skip;
+            if (len > OB_SLICE - bytes) len = OB_SLICE - bytes;
+            batch[m].iov_base = (char *)iov[j].iov_base + skip;
+            batch[m++].iov_len = len;
+            bytes += len;
+        }
+        ssize_t w = pwritev(fd, batch, m, (off_t)ob->written);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            ob->failed = 1;
+            break;
+        }
+        ob_progress(ob, (size_t)w);
+        for (size_t left = (size_t)w; left > 0;) {
+            size_t step = iov[k].iov_len - done < left ? iov[k].iov_len - done : left;
+            done += step;
+            left -= step;
+            if (done == iov[k].iov_len) {
+                k++;
+                done = 0;
+            }
+        }
+    }
+}
+
+/* ---- checksums ---- */
+
+static uint64_t crc_chunks(uint64_t bytes) {
+    return (bytes + CRC_CHUNK_BYTES - 1) / CRC_CHUNK_BYTES;
+}
+
+/* Length of the SEC_CRC section for the bytes before it */
+static uint64_t crc_section_len(uint64_t covered) {
+    return 8 + 4 * crc_chunks(covered);
+}
+
+/* One range of checksum chunks, computed by one thread */
+typedef struct {
+    const struct iovec *iov;
+    int niov;
+    uint64_t total;
+    uint32_t *crcs;
+    uint64_t lo;
+    uint64_t hi;
+} CrcJob;
+
+static void *crc_worker(void *arg) {
+    CrcJob *job = arg;
+    for (uint64_t k = job->lo; k < job->hi; k++) {
+        uint64_t from = k * CRC_CHUNK_BYTES;
+        uint64_t to = from + CRC_CHUNK_BYTES < job->total ? from + CRC_CHUNK_BYTES : job->total;
+        uint32_t crc = 0;
+        uint64_t at = 0;  // where iov[i] starts
+        for (int i = 0; i < job->niov && at < to; at += job->iov[i++].iov_len) {
+            uint64_t end = at + job->iov[i].iov_len;
+            if (end <= from) continue;
+            uint64_t a = from > at ? from : at, b = to < end ? to : end;
+            crc = crc32c(crc, (const char *)job->iov[i].iov_base + (a - at), b - a);
+        }
+        job->crcs[k] = crc;
+    }
+    return NULL;
+}
+
+/* CRC-32C of each chunk of the total bytes in iov, on several threads
+ * for large files
+ */
+static void crc_compute(const struct iovec *iov, int niov, uint64_t total, uint32_t *crcs) {
+    uint64_t nchunks = crc_chunks(total);
+    CrcJob jobs[JOB_MAX_THREADS];
+    int njobs = job_threads(nchunks / 16);  // 16 MB or more per thread
+    for (int t = 0; t < njobs; t++) {
+        jobs[t] = (CrcJob){iov, niov, total, crcs, nchunks * t / njobs, nchunks * (t + 1) / njobs};
+    }
+    run_jobs(crc_worker, jobs, sizeof(CrcJob), njobs);
+}
+
+/* Append the SEC_CRC data for the covered bytes already in iov. Returns
+ * the buffer to free once it is written, or NULL if out of memory.
+ */
+static uint32_t *crc_section(struct iovec *iov, int *niov, uint64_t covered) {
+    uint64_t len = crc_section_len(covered);
+    uint32_t *sec = malloc(len);
+    if (sec == NULL) {
+        return NULL;
+    }
+    sec[0] = (uint32_t)CRC_CHUNK_BYTES;
+    sec[1] = 0;
+    crc_compute(iov, *niov, covered, sec + 2);
+    iov[(*niov)++] = (struct iovec){sec, len};
+    return sec;
+}
+
+/* Section count of a VERSION 2 or 3 header, and whether its file has to
+ * carry checksums. Returns 0 if the count or the marker is not one this
+ * reader knows.
+ */
+static int v2_sections(const V2Header *h, uint32_t *nsections, int *checksummed) {
+    uint32_t mark = h->nsections & ~V2_SECTIONS_MASK;
+    *nsections = h->nsections & V2_SECTIONS_MASK;
+    *checksummed = mark == V2_CHECKSUMMED;
+    return (mark == 0 || mark == V2_CHECKSUMMED) && *nsections <= V2_MAX_SECTIONS;
+}
+
+/* Check the SEC_CRC section of a mapped VERSION 2 or 3 file whose
+ * directory has been range-checked. The section has to end the file and
+ * match every chunk before it, and has to be there if required. Returns 1
+ * if the file checks out or has no checksums (*chunks is then 0), 0 if it
+ * is corrupt.
+ */
+static int crc_verify(const char *base, size_t len, const V2Section *dir, uint32_t nsections,
+                      int required, const char *filename, uint64_t *chunks) {
+    *chunks = 0;
+    const V2Section *sec = NULL;
+    for (uint32_t i = 0; i < nsections; i++) {
+        if (dir[i].type == SEC_CRC) sec = &dir[i];
+    }
+    if (sec == NULL && required) {
+        fprintf(stderr, "[load_tree] %s: checksum section missing\n", filename);
+        return 0;
+    }
+    if (sec == NULL) {
+        return 1;  // written before files had checksums
+    }
+    uint32_t chunkBytes = 0;
+    if (sec->length >= 4) memcpy(&chunkBytes, base + sec->offset, 4);
+    if (sec->offset + sec->length != len || sec->length != crc_section_len(sec->offset) ||
+        chunkBytes != CRC_CHUNK_BYTES) {
+        fprintf(stderr, "[load_tree] %s: bad checksum section\n", filename);
+        return 0;
+    }
+    uint64_t n = crc_chunks(sec->offset);
+    uint32_t *crcs = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (crcs == NULL) {
+        return 0;
+    }
+    struct iovec all = {(void *)base, sec->offset};
+    crc_compute(&all, 1, sec->offset, crcs);
+    const char *want = base + sec->offset + 8;
+    int ok = 1;
+    for (uint64_t k = 0; k < n && ok; k++) {
+        if (memcmp(&crcs[k], want + 4 * k, 4) != 0) {
+            uint64_t end = (k + 1) * CRC_CHUNK_BYTES < sec->offset ? (k + 1) * CRC_CHUNK_BYTES
+                                                                   : sec->offset;
+            fprintf(stderr, "[load_tree] %s: checksum mismatch in bytes %llu-%llu\n", filename,
+                    (unsigned long long)(k * CRC_CHUNK_BYTES), (unsigned long long)end - 1);
+            ok = 0;
+        }
+    }
+    free(crcs);
+    *chunks = ok ? n : 0;
+    return ok;
+}
+
+/* Append one VERSION 1 node record */
+static void ob_write_record(OutBuf *ob, int isQuestion, const char *text,
+                            int32_t yesId, int32_t noId) {
+    uint32_t textLen = (uint32_t)strlen(text);
+    uint8_t is_q = (uint8_t)isQuestion;
+    if (textLen + 13 > OUT_BUF_SIZE - ob->used) {
+        ob_flush(ob);
+    }
+    if (textLen + 13 <= OUT_BUF_SIZE) {
+        // Common case: assemble the record in place
+        char *p = ob->buf + ob->used;
+        *p = (char)is_q;
+        memcpy(p + 1, &textLen, 4);
+        memcpy(p + 5, text, textLen);
+        memcpy(p + 5 + textLen, &yesId, 4);
+        memcpy(p + 9 + textLen, &noId, 4);
+        ob->used += textLen + 13;
+        return;
+    }
+    ob_write(ob, &is_q, 1);
+    ob_write(ob, &textLen, 4);
+    ob_write(ob, text, textLen);
+    ob_write(ob, &yesId, 4);
+    ob_write(ob, &noId, 4);
+}
+
+/* Name of generation g of path: path.g */
+static char *generation_path(const char *path, int g) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%d", g);
+    return path_with(path, suffix);
+}
+
+/* Replace path with tmp, whose data is already on disk, keeping the file
+ * it replaces as generation 1 of at most keep: generations 1 to keep - 1
+ * move up one and the one numbered keep, if any, is dropped. The old file
+ * is hard-linked aside first and only renumbered once the rename has
+ * swapped the new file in, so path names a complete file at every moment
+ * and a failed rename leaves every generation as it was. Returns 1 once
+ * the rename is durable.
+ */
+static int replace_keeping(const char *tmp, const char *path, int keep) {
+    char *prev = NULL;
+    if (keep > 0 && access(path, F_OK) == 0) {
+        prev = path_with(path, ".prev");
+        if (prev != NULL) unlink(prev);  // left behind by a crash
+        if (prev == NULL || link(path, prev) != 0) {
+            perror("[save_tree] Could not keep the previous file");
+            free(prev);
+            prev = NULL;
+        }
+    }
+    if (rename(tmp, path) != 0) {
+        perror("[save_tree] Could not replace the saved file");
+        if (prev != NULL) unlink(prev);
+        free(prev);
+        return 0;
+    }
+    if (prev != NULL) {
+        char *older = generation_path(path, keep);
+        for (int g = keep; g > 1 && older != NULL; g--) {
+            char *newer = generation_path(path, g - 1);
+            if (newer != NULL) rename(newer, older);  // missing generations are fine
+            free(older);
+            older = newer;
+        }
+        // older is now generation 1 (or NULL if out of memory)
+        if (older == NULL || rename(prev, older) != 0) {
+            perror("[save_tree] Could not keep the previous file");
+            unlink(prev);
+        }
+        free(older);
+        free(prev);
+    }
+    return fsync_parent(path);
+}
+
+/* Move tmp over path, keeping the replaced file as generation 1 */
+static int save_commit(const char *tmp, const char *path) {
+    return replace_keeping(tmp, path, g_generations);
+}
+
+/* Flush, patch the node count at offset 8 of the header, sync and close,
+ * then move the file into place (see save_commit). Returns 1 if every
+ * step succeeded; on failure the file being replaced is left as it was.
+ */
+static int ob_close(OutBuf *ob, uint32_t nodeCount) {
+    ob_flush(ob);
+    if (!ob->failed &&
+        (fseek(ob->fp, 2 * sizeof(uint32_t), SEEK_SET) != 0 ||
+         fwrite(&nodeCount, sizeof(uint32_t), 1, ob->fp) != 1)) {
+        ob->failed = 1;
+    }
+    // The data must be on disk before the rename can point at it
+    if (!ob->failed && (fflush(ob->fp) != 0 || fdatasync(fileno(ob->fp)) != 0)) {
+        ob->failed = 1;
+    }
+    if (fclose(ob->fp) != 0) ob->failed = 1;
+    if (!ob->failed && !save_commit(ob->tmp, ob->path)) {
+        ob->failed = 1;
+    }
+    if (ob->failed) {
+        unlink(ob->tmp);
+    }
+    free(ob->buf);
+    free(ob->tmp);
+    ob->fp = NULL;
+    ob->buf = NULL;
+    ob->tmp = NULL;
+    return !ob->failed;
+}
+
+/* How many earlier versions each save keeps (0 keeps none) */
+void save_set_generations(int n) {
+    g_generations = n < 0 ? 0 : n;
+}
+
+int save_generations(void) {
+    return g_generations;
+}
+
+/* Store the attribute index in VERSION 2 saves (off by default). It is
+ * rebuilt from the texts on every save and more than doubles the file,
+ * so it only pays off for trees that are loaded far more often than saved.
+ */
+void save_set_index(int on) {
+    g_saveIndex = on != 0;
+}
+
+int save_index(void) {
+    return g_saveIndex;
+}
+
+/* Make save_tree, and with it every background save and checkpoint, write
+ * VERSION 3 (3 for compact files that decode on load) or VERSION 2 (the
+ * default, mapped in place on load). VERSION 1 cannot hold the write-ahead
+ * log's tag, so it is only written by save_tree_v1. Returns 0 for any
+ * other version.
+ */
+int save_set_format(int version) {
+    if (version != 2 && version != 3) {
+        return 0;
+    }
+    g_saveFormat = version;
+    return 1;
+}
+
+int save_format(void) {
+    return g_saveFormat;
+}
+
+/* Put back the file saved generation saves before filename's current
+ * version, undoing bad saves in one rename. The version it replaces
+ * becomes generation 1 and generations 1 to generation - 1 move up one,
+ * so nothing is lost and a rollback can itself be rolled back. The log of
+ * edits made since the restored version is removed. Returns 1 on success.
+ */
+int rollback_tree(const char *filename, int generation) {
+    char *old = generation_path(filename, generation);
+    char *log = path_with(filename, ".wal");
+    int ok = old != NULL && log != NULL && generation > 0;
+    if (ok && access(old, F_OK) != 0) {
+        fprintf(stderr, "[rollback_tree] No generation %d: ", generation);
+        perror(old);
+        ok = 0;
+    }
+    ok = ok && replace_keeping(old, filename, generation);
+    if (ok && unlink(log) != 0 && errno != ENOENT) {
+        perror("[rollback_tree] Could not remove the log");
+        ok = 0;
+    }
+    ok = ok && fsync_parent(filename);
+    free(old);
+    free(log);
+    return ok;
+}
 
 /* TODO 27: Implement save_tree
  * Save the tree to a binary file using BFS traversal
@@ -27,183 +553,1159 @@ typedef struct {
  *   - yesId (4 bytes, -1 if NULL)
  *   - noId (4 bytes, -1 if NULL)
  * 
- * Steps:
- * 1. Return 0 if g_root is NULL
- * 2. Open file for writing binary ("wb")
- * 3. Initialize queue and NodeMapping array
- * 4. Use BFS to assign IDs to all nodes:
- *    - Enqueue root with id=0
- *    - Store mapping[0] = {g_root, 0}
- *    - While queue not empty:
- *      - Dequeue node and id
- *      - If node has yes child: add to mappings, enqueue with new id
- *      - If node has no child: add to mappings, enqueue with new id
- * 5. Write header (magic, version, nodeCount)
- * 6. For each node in mapping order:
- *    - Write isQuestion, textLen, text bytes
- *    - Find yes child's id in mappings (or -1)
- *    - Find no child's id in mappings (or -1)
- *    - Write yesId, noId
- * 7. Clean up and return 1 on success
+ * IDs are BFS positions, so a single pass is enough: when a node is
+ * dequeued its children are given the next two free ids, and those are
+ * exactly the positions at which they will be dequeued and written.
+ * The node count is only known at the end and is patched into the header.
+ */
+int save_tree_v1(const char *filename) {
+    if (g_root == NULL) {
+        return 0;
+    }
+
+    OutBuf ob;
+    if (!ob_open(&ob, filename, "save_tree_v1")) {
+        return 0;
+    }
+
+    // Header with a placeholder count, fixed up by ob_close
+    uint32_t header[3] = {MAGIC, VERSION, 0};
+    ob_write(&ob, header, sizeof(header));
+
+    Queue q;
+    q_init(&q);
+    int queued = q_enqueue(&q, g_root, 0);
+
+    int32_t next = 1;   // next id to hand out
+    Node *node;
+    int id;
+    while (queued && q_dequeue(&q, &node, &id)) {
+        int32_t yesId = -1, noId = -1;
+        if (node->yes != NULL) {
+            yesId = next++;
+            queued = q_enqueue(&q, node->yes, yesId);
+        }
+        if (queued && node->no != NULL) {
+            noId = next++;
+            queued = q_enqueue(&q, node->no, noId);
+        }
+        ob_write_record(&ob, node->isQuestion, node->text, yesId, noId);
+    }
+    q_free(&q);
+    if (!queued) {
+        // A truncated file must not replace the old one
+        fprintf(stderr, "[save_tree_v1] Out of memory for the BFS queue\n");
+        ob.failed = 1;
+    }
+
+    return ob_close(&ob, (uint32_t)next);
+}
+
+/* Save a FlatTree in the VERSION 2 format: the flat arrays are written
+ * as-is, one section each and all in one gathered write, so load_tree can
+ * map them back without parsing.
+ * When save_set_index has asked for it, an attribute index of the tree
+ * follows as SEC_INDEX so loading does not have to re-index; if it cannot
+ * be built the file is written without it.
+ * Visit counters, when the tree has them, are stored as SEC_VISITS, a
+ * snapshot tag, when set, as SEC_TAG, and recorded answers as SEC_ANSWERS.
  */
-int find_id_for_node(NodeMapping *mapping, int count, Node *node) { 
-    // If caller asks for ID of a NULL child, represent as -1 in file format
-    if (node == NULL) {
-        return -1;
+int flat_save_tree(const FlatTree *ft, const char *filename) {
+    if (ft == NULL || ft->count == 0) {
+        return 0;
     }
+    OutBuf ob;
+    if (!ob_open(&ob, filename, "flat_save_tree")) {
+        return 0;
+    }
+
+    void *index = NULL;
+    uint64_t indexLen = 0;
+    int hasIndex = g_saveIndex && ai_flat_section(ft, &index, &indexLen);
 
-    // Linear search through mapping array to find the node's assigned id
-    for (int i = 0; i < count; i++) {
-        if (mapping[i].node == node) {
-            return mapping[i].id;
+    // The five node sections, then whichever optional ones are present
+    uint32_t types[10] = {SEC_YES, SEC_NO, SEC_TEXT, SEC_SHAPE, SEC_STRINGS};
+    const void *data[10] = {ft->yes, ft->no, ft->text, ft->isq, ft->blob};
+    uint64_t lengths[10] = {
+        (uint64_t)ft->count * 4, (uint64_t)ft->count * 4, (uint64_t)ft->count * 4,
+        (ft->count + 7) / 8, ft->blobLen
+    };
+    uint32_t nsections = 5;
+    if (hasIndex) {
+        types[nsections] = SEC_INDEX;
+        data[nsections] = index;
+        lengths[nsections++] = indexLen;
+    }
+    if (ft->visits != NULL) {
+        types[nsections] = SEC_VISITS;
+        data[nsections] = ft->visits;
+        lengths[nsections++] = (uint64_t)ft->count * 4;
+    }
+    if (ft->tag.tag != 0) {
+        types[nsections] = SEC_TAG;
+        data[nsections] = &ft->tag;
+        lengths[nsections++] = sizeof(ft->tag);
+    }
+    if (ft->answers != NULL) {
+        types[nsections] = SEC_ANSWERS;
+        data[nsections] = ft->answers;
+        lengths[nsections++] = ft->answersLen;
+    }
+    types[nsections++] = SEC_CRC;  // last, covering everything else
+    V2Header header = {MAGIC, VERSION_MAPPED, ft->count, nsections | V2_CHECKSUMMED};
+    V2Section dir[10];
+    uint64_t pos = sizeof(header) + nsections * sizeof(V2Section);
+    for (uint32_t i = 0; i < nsections; i++) {
+        pos = (pos + 7) & ~(uint64_t)7;
+        if (types[i] == SEC_CRC) {
+            lengths[i] = crc_section_len(pos);
         }
+        dir[i].type = types[i];
+        dir[i].reserved = 0;
+        dir[i].offset = pos;
+        dir[i].length = lengths[i];
+        pos += lengths[i];
     }
+    ob.total = pos;
 
-    // Not found: return -1 (should not occur if mapping was built correctly)
-    return -1;
+    // One gathered write: the arrays go to the file from where they are
+    static const char zeros[8] = {0};
+    struct iovec iov[2 + 2 * 10];
+    uint32_t *crcs = NULL;
+    int niov = 0;
+    iov[niov++] = (struct iovec){&header, sizeof(header)};
+    iov[niov++] = (struct iovec){dir, nsections * sizeof(V2Section)};
+    pos = sizeof(header) + nsections * sizeof(V2Section);
+    for (uint32_t i = 0; i < nsections; i++) {
+        size_t pad = (size_t)(-pos & 7);
+        iov[niov++] = (struct iovec){(void *)zeros, pad};
+        pos += pad;
+        if (types[i] == SEC_CRC) {
+            crcs = crc_section(iov, &niov, pos);
+        } else {
+            iov[niov++] = (struct iovec){(void *)data[i], lengths[i]};
+        }
+        pos += lengths[i];
+    }
+    if (crcs != NULL) {
+        ob_writev(&ob, iov, niov);
+    } else {
+        ob.failed = 1;
+    }
+    free(crcs);
+    free(index);
+    return ob_close(&ob, ft->count);
 }
 
+/* Save g_root in the format chosen by save_set_format (VERSION 2 unless
+ * asked otherwise) by way of a flat copy of the tree
+ */
 int save_tree(const char *filename) {
+    if (g_saveFormat == 3) {
+        return save_tree_v3(filename);
+    }
     if (g_root == NULL) {
         return 0;
     }
+    FlatTree ft;
+    if (!flat_from_tree(&ft, g_root)) {
+        return 0;
+    }
+    ft.tag = g_treeTag;
+    void *answers = answers_pack(&g_answers, &ft.answersLen);
+    ft.answers = answers;
+    int success = (answers != NULL || g_answers.count == 0) && flat_save_tree(&ft, filename);
+    free(answers);
+    flat_free(&ft);
+    return success;
+}
 
-    FILE* fileptr = NULL;
-    NodeMapping* mapping = NULL;
-    Queue* q = NULL;
-    int success = 0;
+/* ---- background save ---- */
 
-    // Open file for binary writing. Using "wb" truncates/creates the file.
-    fileptr = fopen(filename, "wb");
-    if (fileptr == NULL) {
-        perror("[save_tree] Failed to open file");
-        goto save_error;
+static struct {
+    pid_t pid;          /* the saving child, 0 if none */
+    int progressFd;     /* read end of its progress pipe */
+    int percent;        /* last progress it reported */
+} g_bgSave = {0, -1, 0};
+
+/* fsync a file or directory by name. Returns 1 on success. */
+int fsync_path(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
     }
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
 
-    /* --- First BFS pass: count nodes --- */
-    // First pass: BFS traversal to count nodes so we can allocate mapping array
-    q = malloc(sizeof(Queue));
-    if (q == NULL) {
-        perror("[save_tree] Failed to allocate queue");
-        goto save_error;
+/* fsync the directory holding path, so a rename to path is durable */
+int fsync_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return fsync_path(".");
+    }
+    if (slash == path) {
+        return fsync_path("/");
     }
-    q_init(q);
+    char *dir = strndup(path, (size_t)(slash - path));
+    int ok = dir != NULL && fsync_path(dir);
+    free(dir);
+    return ok;
+}
 
-    Node *currNode = NULL;
-    int tmpId = 0;   // id returned by queue (not used in counting pass)
-    int counted = 0; // total nodes seen
+/* Close what a forked child inherited, except stdio and keep, which ends
+ * up as descriptor 3. Returns the descriptor keep now has.
+ */
+static int close_inherited(int keep) {
+    if (keep != 3) {
+        dup2(keep, 3);
+        keep = 3;
+    }
+    if (close_range(4, ~0U, 0) != 0) {
+        long max = sysconf(_SC_OPEN_MAX);
+        for (long fd = 4; fd < max; fd++) {
+            close((int)fd);
+        }
+    }
+    return keep;
+}
 
-    // Start BFS from root
-    q_enqueue(q, g_root, 0);
-    while (!q_empty(q)) {
-        q_dequeue(q, &currNode, &tmpId);
-        counted++; // increment node count for each dequeued node
+/* Start saving g_root to filename in the background and return at once.
+ * A forked child saves a point-in-time copy of the tree: the kernel shares
+ * its pages copy-on-write, so the caller keeps playing and learning while
+ * the child writes filename.tmp, fsyncs it and renames it over filename.
+ * The child closes the caller's descriptors (client sockets, the server's
+ * epoll set, the log), so a hang-up is never held open by a save, and it
+ * writes on its one thread. Poll with save_tree_poll() or block in
+ * save_tree_wait(). Only one save runs at a time. Returns 1 if the save
+ * was started.
+ */
+int save_tree_start(const char *filename) {
+    if (g_bgSave.pid != 0 || g_root == NULL) {
+        return 0;
+    }
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("[save_tree_start] pipe failed");
+        return 0;
+    }
+    // The child must not write out output buffered before the fork again
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        g_progressFd = close_inherited(fds[1]);
+        job_set_serial(1);
+        _exit(save_tree(filename) ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        perror("[save_tree_start] fork failed");
+        close(fds[0]);
+        return 0;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    g_bgSave.pid = pid;
+    g_bgSave.progressFd = fds[0];
+    g_bgSave.percent = 0;
+    return 1;
+}
 
-        // Enqueue children if present (id placeholder not used in counting)
-        if (currNode->yes != NULL) q_enqueue(q, currNode->yes, 0);
-        if (currNode->no  != NULL) q_enqueue(q, currNode->no,  0);
+/* Collect progress and, once the child has exited, its result */
+static SaveState save_tree_reap(int options) {
+    uint8_t buf[128];
+    ssize_t n;
+    while ((n = read(g_bgSave.progressFd, buf, sizeof(buf))) > 0) {
+        g_bgSave.percent = buf[n - 1];
     }
+    int status = 0;
+    pid_t r;
+    while ((r = waitpid(g_bgSave.pid, &status, options)) < 0 && errno == EINTR) {
+    }
+    if (r == 0) {
+        return SAVE_RUNNING;
+    }
+    close(g_bgSave.progressFd);
+    g_bgSave.progressFd = -1;
+    g_bgSave.pid = 0;
+    return r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? SAVE_DONE : SAVE_FAILED;
+}
 
+/* State of the background save, without blocking. SAVE_DONE or
+ * SAVE_FAILED is reported once, after which the state is SAVE_IDLE.
+ * *percent (if not NULL) receives how much of the file is written.
+ */
+SaveState save_tree_poll(int *percent) {
+    SaveState st = g_bgSave.pid == 0 ? SAVE_IDLE : save_tree_reap(WNOHANG);
+    if (percent != NULL) {
+        *percent = st == SAVE_RUNNING ? g_bgSave.percent : st == SAVE_DONE ? 100 : 0;
+    }
+    return st;
+}
 
-    /* allocate mapping */
-    // Allocate mapping array sized to the node count discovered above
-    mapping = malloc(counted * sizeof(NodeMapping));
-    if (mapping == NULL) {
-        perror("[save_tree] Failed to allocate mapping");
-        goto save_error;
+/* Wait for the background save to end: SAVE_DONE, SAVE_FAILED, or
+ * SAVE_IDLE if none was running.
+ */
+SaveState save_tree_wait(void) {
+    return g_bgSave.pid == 0 ? SAVE_IDLE : save_tree_reap(0);
+}
+
+/* Install root as the new global tree, owned by arena.
+ * The previous tree is dropped in O(slabs): heap-built trees are freed node
+ * by node, arena trees go away with their arena. Undo/redo records and the
+ * attribute index point into the old tree, so they are discarded too; the
+ * caller attaches or builds the new tree's index. So are the answers
+ * recorded for the old tree's animals. g_stats is recounted.
+ * Logging to a write-ahead log stops, since it was for the old tree.
+ */
+void replace_tree(Node *root, NodeArena *arena) {
+    wal_close();
+    ai_free(&g_index);
+    if (g_root != NULL) free_tree(g_root);
+    arena_release(&g_arena);
+    g_arena = *arena;
+    arena_init(arena);
+    g_root = root;
+    memset(&g_treeTag, 0, sizeof(g_treeTag));
+    answers_clear(&g_answers);
+    es_clear(&g_undo);
+    es_clear(&g_redo);
+    stats_recount(&g_stats, g_root);
+}
+
+/* Map a VERSION 2 file and check that its sections describe a FlatTree
+ * lying entirely inside the mapping. On success ft points into *map, which
+ * the caller must munmap, and index/indexLen locate the SEC_INDEX section
+ * (NULL if the file has none). The checksums are verified first; *chunks
+ * is set to how many there were. Returns 1 on success.
+ */
+static int map_v2(const char *filename, void **map, size_t *mapLen, FlatTree *ft,
+                  const void **index, uint64_t *indexLen, uint64_t *chunks) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("[load_tree] Could not open file");
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(V2Header)) {
+        close(fd);
+        return 0;
+    }
+    size_t len = (size_t)st.st_size;
+    char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // the mapping stays valid without the descriptor
+    if (base == MAP_FAILED) {
+        perror("[load_tree] mmap failed");
+        return 0;
     }
 
-    /* Rebuild BFS order */
-    // Second pass: rebuild BFS ordering and record node -> id mapping
-    q_free(q);
-    free(q);
-    q = malloc(sizeof(Queue));
-    if (q == NULL) {
-        perror("[save_tree] Failed to allocate queue (2nd pass)");
-        goto save_error;
+    const V2Header *h = (const V2Header *)base;
+    const V2Section *dir = (const V2Section *)(base + sizeof(V2Header));
+    memset(ft, 0, sizeof(*ft));
+    *index = NULL;
+    *indexLen = 0;
+    uint32_t nsections;
+    int checksummed;
+    if (h->magic != MAGIC || h->version != VERSION_MAPPED ||
+        !v2_sections(h, &nsections, &checksummed) ||
+        sizeof(V2Header) + nsections * sizeof(V2Section) > len) {
+        goto map_error;
+    }
+    for (uint32_t i = 0; i < nsections; i++) {
+        if (dir[i].offset > len || dir[i].length > len - dir[i].offset) goto map_error;
+    }
+    if (!crc_verify(base, len, dir, nsections, checksummed, filename, chunks)) {
+        goto map_error;
+    }
+    uint64_t count = h->count;
+    uint64_t want[6] = {0, count * 4, count * 4, count * 4, (count + 7) / 8, 0};
+    for (uint32_t i = 0; i < nsections; i++) {
+        uint32_t type = dir[i].type;
+        if (dir[i].offset > len || dir[i].length > len - dir[i].offset) goto map_error;
+        if (type == SEC_INDEX && dir[i].offset % 8 == 0) {
+            *index = base + dir[i].offset;
+            *indexLen = dir[i].length;
+            continue;
+        }
+        if (type == SEC_VISITS && dir[i].offset % 8 == 0 && dir[i].length == count * 4) {
+            ft->visits = (uint32_t *)(base + dir[i].offset);
+            continue;
+        }
+        if (type == SEC_TAG && dir[i].length == sizeof(SnapshotTag)) {
+            memcpy(&ft->tag, base + dir[i].offset, sizeof(ft->tag));
+            continue;
+        }
+        if (type == SEC_ANSWERS) {
+            ft->answers = base + dir[i].offset;
+            ft->answersLen = dir[i].length;
+            continue;
+        }
+        if (type < SEC_YES || type > SEC_STRINGS) continue;  // optional section
+        if (dir[i].offset % 8 != 0) goto map_error;
+        if (type != SEC_STRINGS && dir[i].length != want[type]) goto map_error;
+        const char *p = base + dir[i].offset;
+        switch (type) {
+            case SEC_YES: ft->yes = (uint32_t *)p; break;
+            case SEC_NO: ft->no = (uint32_t *)p; break;
+            case SEC_TEXT: ft->text = (uint32_t *)p; break;
+            case SEC_SHAPE: ft->isq = (uint8_t *)p; break;
+            case SEC_STRINGS: ft->blob = (char *)p; ft->blobLen = dir[i].length; break;
+        }
     }
-    q_init(q);
+    if (!ft->yes || !ft->no || !ft->text || !ft->isq || !ft->blob) goto map_error;
+    // Every text offset then names a string terminated inside the section
+    if (count > 0 && (ft->blobLen == 0 || ft->blob[ft->blobLen - 1] != '\0')) goto map_error;
+    ft->count = (uint32_t)count;
+
+    *map = base;
+    *mapLen = len;
+    return 1;
 
-    int nodeCount = counted; // total nodes available
-    int mIdx = 0;            // mapping index currently assigned
+map_error:
+    munmap(base, len);
+    memset(ft, 0, sizeof(*ft));
+    return 0;
+}
 
-    // Seed mapping[0] with root
-    q_enqueue(q, g_root, 0);
-    mapping[0].node = g_root;
-    mapping[0].id = 0;
+#define LINK_MIN_NODES 65536  /* smaller trees are linked on one thread */
 
-    // Perform BFS and assign sequential ids to each newly discovered child
-    while (!q_empty(q)) {
-        int dequeueId = 0;
-        q_dequeue(q, &currNode, &dequeueId);
+/* One range of nodes of a VERSION 2 file to link */
+typedef struct {
+    const FlatTree *ft;
+    Node *nodes;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t first;   /* first child id in the range, FLAT_NIL if none */
+    uint32_t next;    /* one past the last */
+    int failed;
+} LinkJob;
 
-        // If yes-child exists, assign next id and enqueue it
-        if (currNode->yes != NULL) {
-            mIdx++;
-            mapping[mIdx].node = currNode->yes;
-            mapping[mIdx].id = mIdx;
-            q_enqueue(q, currNode->yes, mIdx);
+static void *link_worker(void *arg) {
+    LinkJob *job = arg;
+    const FlatTree *ft = job->ft;
+    Node *nodes = job->nodes;
+    for (uint32_t i = job->lo; i < job->hi; i++) {
+        uint32_t yesId = ft->yes[i], noId = ft->no[i], off = ft->text[i];
+        // Same range checks as the VERSION 1 reader
+        if ((yesId != FLAT_NIL && yesId >= ft->count) ||
+            (noId != FLAT_NIL && noId >= ft->count) || off >= ft->blobLen) {
+            job->failed = 1;
+            return NULL;
+        }
+        // Children are numbered in BFS order: each comes after its parent
+        // and takes the next id, so the nodes form one tree. Questions
+        // need both.
+        if (flat_is_question(ft, i) && (yesId == FLAT_NIL || noId == FLAT_NIL)) {
+            job->failed = 1;
+            return NULL;
+        }
+        uint32_t kids[2] = {yesId, noId};
+        for (int k = 0; k < 2; k++) {
+            if (kids[k] == FLAT_NIL) {
+                continue;
+            }
+            if (job->first == FLAT_NIL) {
+                job->first = job->next = kids[k];
+            }
+            if (kids[k] <= i || kids[k] != job->next++) {
+                job->failed = 1;
+                return NULL;
+            }
         }
+        nodes[i].text = ft->blob + off;
+        nodes[i].yes = yesId == FLAT_NIL ? NULL : &nodes[yesId];
+        nodes[i].no = noId == FLAT_NIL ? NULL : &nodes[noId];
+        nodes[i].isQuestion = flat_is_question(ft, i);
+        nodes[i].flags = NODE_ARENA;
+        // Counters change during play, so they are copied out of the mapping
+        nodes[i].visits = ft->visits != NULL ? ft->visits[i] : 0;
+    }
+    return NULL;
+}
+
+/* Load a VERSION 2 file in place. Node text points straight into the
+ * read-only mapping and all nodes live in one contiguous block, so loading
+ * does no per-node allocation or copying: it is one pass that turns child
+ * indices into pointers, split across threads for large trees. The saved
+ * attribute index is used from the mapping as well; only files without one
+ * are re-indexed.
+ */
+static int load_tree_v2(const char *filename) {
+    void *map;
+    size_t mapLen;
+    FlatTree ft;
+    const void *index;
+    uint64_t indexLen;
+    uint64_t chunks;
+    if (!map_v2(filename, &map, &mapLen, &ft, &index, &indexLen, &chunks)) {
+        return 0;
+    }
+    NodeArena arena;
+    arena_init(&arena);
+    arena_adopt_mapping(&arena, map, mapLen);
+    if (ft.count == 0) {
+        replace_tree(NULL, &arena);
+        g_treeTag = ft.tag;
+        return 1;
+    }
 
-        // If no-child exists, assign next id and enqueue it
-        if (currNode->no != NULL) {
-            mIdx++;
-            mapping[mIdx].node = currNode->no;
-            mapping[mIdx].id = mIdx;
-            q_enqueue(q, currNode->no, mIdx);
+    Node *nodes = arena_node_block(&arena, ft.count);
+    if (nodes == NULL) {
+        arena_release(&arena);
+        return 0;
+    }
+    LinkJob jobs[JOB_MAX_THREADS];
+    int njobs = job_threads(ft.count / LINK_MIN_NODES);
+    for (int t = 0; t < njobs; t++) {
+        jobs[t] = (LinkJob){&ft, nodes,
+                            (uint32_t)((uint64_t)ft.count * t / njobs),
+                            (uint32_t)((uint64_t)ft.count * (t + 1) / njobs),
+                            FLAT_NIL, FLAT_NIL, 0};
+    }
+    run_jobs(link_worker, jobs, sizeof(LinkJob), njobs);
+    // Each range's children must continue where the previous range's end
+    uint32_t expect = 1;
+    for (int t = 0; t < njobs; t++) {
+        if (!jobs[t].failed && jobs[t].first != FLAT_NIL) {
+            jobs[t].failed = jobs[t].first != expect;
+            expect = jobs[t].next;
+        }
+        if (jobs[t].failed) {
+            fprintf(stderr, "[load_tree] %s: the nodes do not form a tree\n", filename);
+            arena_release(&arena);
+            return 0;
         }
     }
+    if (expect != ft.count) {
+        fprintf(stderr, "[load_tree] %s: the nodes do not form a tree\n", filename);
+        arena_release(&arena);
+        return 0;
+    }
+    replace_tree(&nodes[0], &arena);
+    g_treeTag = ft.tag;
+    if (index == NULL || !ai_attach(&g_index, index, indexLen, nodes, ft.count)) {
+        ai_build(&g_index, g_root);
+    }
+    if (ft.answers != NULL && !answers_unpack(&g_answers, ft.answers, ft.answersLen)) {
+        fprintf(stderr, "[load_tree] %s: recorded answers are damaged; loaded without them\n",
+                filename);
+    }
+    return 1;
+}
+
+/* ---- VERSION 3 ---- */
+
+/* Growable byte buffer for building VERSION 3 sections */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} ByteBuf;
 
-    // Sanity check: ensure we assigned exactly nodeCount ids
-    if (mIdx + 1 != nodeCount) {
-        goto save_error;
+static void bb_write(ByteBuf *b, const void *data, size_t len) {
+    if (b->failed) {
+        return;
+    }
+    if (len > b->cap - b->len) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap - b->len < len) cap *= 2;
+        uint8_t *grown = realloc(b->data, cap);
+        if (grown == NULL) {
+            b->failed = 1;
+            return;
+        }
+        b->data = grown;
+        b->cap = cap;
     }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* Append v as a LEB128 varint: 7 bits per byte, low bits first */
+static void bb_varint(ByteBuf *b, uint64_t v) {
+    uint8_t tmp[10];
+    int n = 0;
+    do {
+        tmp[n] = (uint8_t)(v & 0x7F);
+        v >>= 7;
+        if (v != 0) tmp[n] |= 0x80;
+        n++;
+    } while (v != 0);
+    bb_write(b, tmp, n);
+}
 
-    /* --- Write header --- */
-    uint32_t magic_val = MAGIC;
-    uint32_t version_val = VERSION;
-    uint32_t count_val = (uint32_t)nodeCount;
+/* Read a varint at *p, advancing it. Returns 0 if it runs past end. */
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    uint64_t x = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        x |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *v = x;
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    // Write the header: magic, version, and number of nodes
-    if (fwrite(&magic_val, sizeof(uint32_t), 1, fileptr) != 1) { goto save_error; }
-    if (fwrite(&version_val, sizeof(uint32_t), 1, fileptr) != 1) { goto save_error; }
-    if (fwrite(&count_val, sizeof(uint32_t), 1, fileptr) != 1) { goto save_error; }
+/* Text stream of one kind (questions or animals). Each text is a varint
+ * h: odd h repeats the (h >> 1)th distinct text seen so far in the chunk;
+ * even h is a new text sharing its first h >> 1 bytes with the previous
+ * new text of the chunk, followed by the varint length and bytes of the
+ * rest.
+ */
+typedef struct {
+    ByteBuf out;
+    const char **texts;   /* distinct texts so far (in the FlatTree's blob) */
+    uint32_t *slots;      /* open addressing: distinct number + 1, 0 = empty */
+    uint32_t mask;
+    uint32_t distinct;
+    uint32_t first;       /* first distinct text of the current chunk */
+} TextCoder;
 
-    /* --- Write nodes --- */
-    for (int i = 0; i < nodeCount; i++) {
-        Node* node = mapping[i].node;
+/* Room for up to n distinct texts. Returns 0 if out of memory. */
+static int tc_init(TextCoder *tc, uint32_t n) {
+    memset(tc, 0, sizeof(*tc));
+    uint32_t nslots = 16;
+    while (nslots < 2 * (uint64_t)n) nslots *= 2;
+    tc->texts = malloc((n ? n : 1) * sizeof(char *));
+    tc->slots = calloc(nslots, sizeof(uint32_t));
+    tc->mask = nslots - 1;
+    return tc->texts != NULL && tc->slots != NULL;
+}
 
-        // For each mapped node, write its record in BFS order
-        uint8_t is_q = (uint8_t)node->isQuestion;            // 1 byte: question flag
-        uint32_t textLen = (uint32_t)strlen(node->text);    // 4 bytes: text length
+static void tc_free(TextCoder *tc) {
+    free(tc->out.data);
+    free(tc->texts);
+    free(tc->slots);
+}
 
-        // Map child pointers to their assigned IDs (or -1 if NULL)
-        int32_t yesId = find_id_for_node(mapping, nodeCount, node->yes);
-        int32_t noId  = find_id_for_node(mapping, nodeCount, node->no);
+static void tc_put(TextCoder *tc, const char *text) {
+    size_t len = strlen(text);
+    uint32_t i = (uint32_t)h_hash64(text, len, HASH_SEED) & tc->mask;
+    for (; tc->slots[i] != 0; i = (i + 1) & tc->mask) {
+        uint32_t id = tc->slots[i] - 1;
+        if (strcmp(tc->texts[id], text) == 0) {
+            if (id >= tc->first) {
+                bb_varint(&tc->out, (uint64_t)(id - tc->first) << 1 | 1);
+                return;
+            }
+            break;  // seen in an earlier chunk: spelled out again below
+        }
+    }
+    size_t shared = 0;
+    if (tc->distinct > tc->first) {
+        const char *prev = tc->texts[tc->distinct - 1];
+        while (prev[shared] != '\0' && prev[shared] == text[shared]) shared++;
+    }
+    bb_varint(&tc->out, (uint64_t)shared << 1);
+    bb_varint(&tc->out, len - shared);
+    bb_write(&tc->out, text + shared, len - shared);
+    tc->slots[i] = tc->distinct + 1;
+    tc->texts[tc->distinct++] = text;
+}
 
-        // Write flag and text length
-        if (fwrite(&is_q, sizeof(uint8_t), 1, fileptr) != 1) { goto save_error; }
-        if (fwrite(&textLen, sizeof(uint32_t), 1, fileptr) != 1) { goto save_error; }
+/* Save a FlatTree in the VERSION 3 format. The tree must be in BFS order
+ * with two children per question, as flat_from_tree makes it. Trees of
+ * more than one chunk get a SEC_CHUNKS table. Returns 1 on success.
+ */
+int flat_save_compact(const FlatTree *ft, const char *filename) {
+    if (ft == NULL || ft->count == 0) {
+        return 0;
+    }
+    TextCoder coders[2];
+    ByteBuf visits = {NULL, 0, 0, 0};
+    ByteBuf chunks = {NULL, 0, 0, 0};
+    int anyVisits = 0, ok = 0;
+    int ready = tc_init(&coders[0], ft->count);
+    ready &= tc_init(&coders[1], ft->count);
+    if (!ready) {
+        goto compact_done;
+    }
+    uint32_t chunkHeader[2] = {V3_CHUNK_NODES, 0};
+    bb_write(&chunks, chunkHeader, sizeof(chunkHeader));
+    uint32_t next = 1;
+    for (uint32_t i = 0; i < ft->count; i++) {
+        if (i % V3_CHUNK_NODES == 0) {
+            // New chunk: nothing in it may refer back to an earlier one
+            V3Chunk start = {coders[0].out.len, coders[1].out.len, visits.len};
+            bb_write(&chunks, &start, sizeof(start));
+            coders[0].first = coders[0].distinct;
+            coders[1].first = coders[1].distinct;
+        }
+        int isq = flat_is_question(ft, i);
+        // Only shapes whose children follow from BFS order can be stored
+        if (isq ? ft->yes[i] != next || ft->no[i] != next + 1
+                : ft->yes[i] != FLAT_NIL || ft->no[i] != FLAT_NIL) {
+            fprintf(stderr, "[flat_save_compact] Node %u is not in BFS order\n", i);
+            goto compact_done;
+        }
+        next += isq ? 2 : 0;
+        tc_put(&coders[isq ? 0 : 1], flat_text(ft, i));
+        uint32_t v = ft->visits != NULL ? ft->visits[i] : 0;
+        anyVisits |= v != 0;
+        bb_varint(&visits, v);
+    }
+    if (coders[0].out.failed || coders[1].out.failed || visits.failed || chunks.failed) {
+        goto compact_done;
+    }
 
-        // Write text bytes (no null terminator stored in file)
-        if (textLen > 0) {
-            if (fwrite(node->text, sizeof(char), textLen, fileptr) != textLen) { goto save_error; }
+    uint32_t types[8] = {SEC_SHAPE, SEC_QTEXT, SEC_ATEXT};
+    const void *data[8] = {ft->isq, coders[0].out.data, coders[1].out.data};
+    uint64_t lengths[8] = {(ft->count + 7) / 8, coders[0].out.len, coders[1].out.len};
+    uint32_t nsections = 3;
+    if (ft->count > V3_CHUNK_NODES) {
+        types[nsections] = SEC_CHUNKS;
+        data[nsections] = chunks.data;
+        lengths[nsections++] = chunks.len;
+    }
+    if (anyVisits) {
+        types[nsections] = SEC_VARVISITS;
+        data[nsections] = visits.data;
+        lengths[nsections++] = visits.len;
+    }
+    if (ft->tag.tag != 0) {
+        types[nsections] = SEC_TAG;
+        data[nsections] = &ft->tag;
+        lengths[nsections++] = sizeof(ft->tag);
+    }
+    if (ft->answers != NULL) {
+        types[nsections] = SEC_ANSWERS;
+        data[nsections] = ft->answers;
+        lengths[nsections++] = ft->answersLen;
+    }
+    types[nsections++] = SEC_CRC;
+    // Sections are packed back to back: nothing is used in place
+    V2Header header = {MAGIC, VERSION_COMPACT, ft->count, nsections | V2_CHECKSUMMED};
+    V2Section dir[8];
+    uint64_t pos = sizeof(header) + nsections * sizeof(V2Section);
+    for (uint32_t i = 0; i < nsections; i++) {
+        if (types[i] == SEC_CRC) {
+            lengths[i] = crc_section_len(pos);
         }
+        dir[i].type = types[i];
+        dir[i].reserved = 0;
+        dir[i].offset = pos;
+        dir[i].length = lengths[i];
+        pos += lengths[i];
+    }
+    OutBuf ob;
+    if (!ob_open(&ob, filename, "flat_save_compact")) {
+        goto compact_done;
+    }
+    ob.total = pos;
+    struct iovec iov[2 + 8];
+    int niov = 2;
+    iov[0] = (struct iovec){&header, sizeof(header)};
+    iov[1] = (struct iovec){dir, nsections * sizeof(V2Section)};
+    for (uint32_t i = 0; i + 1 < nsections; i++) {
+        iov[niov++] = (struct iovec){(void *)data[i], lengths[i]};
+    }
+    uint32_t *crcs = crc_section(iov, &niov, dir[nsections - 1].offset);
+    if (crcs != NULL) {
+        ob_writev(&ob, iov, niov);
+    } else {
+        ob.failed = 1;
+    }
+    free(crcs);
+    ok = ob_close(&ob, ft->count);
 
-        // Write yesId and noId as 32-bit signed integers
-        if (fwrite(&yesId, sizeof(int32_t), 1, fileptr) != 1) { goto save_error; }
-        if (fwrite(&noId,  sizeof(int32_t), 1, fileptr) != 1) { goto save_error; }
+compact_done:
+    tc_free(&coders[0]);
+    tc_free(&coders[1]);
+    free(visits.data);
+    free(chunks.data);
+    return ok;
+}
+
+/* Save g_root in the compact VERSION 3 format: several times smaller than
+ * VERSION 1 or 2, at the price of decoding every node on load.
+ */
+int save_tree_v3(const char *filename) {
+    if (g_root == NULL) {
+        return 0;
+    }
+    FlatTree ft;
+    if (!flat_from_tree(&ft, g_root)) {
+        return 0;
     }
+    ft.tag = g_treeTag;
+    void *answers = answers_pack(&g_answers, &ft.answersLen);
+    ft.answers = answers;
+    int success = (answers != NULL || g_answers.count == 0) && flat_save_compact(&ft, filename);
+    free(answers);
+    flat_free(&ft);
+    return success;
+}
+
+/* Reads one TextCoder stream back. Distinct texts are kept in pool, so a
+ * repeat or the next front-coded text can be rebuilt from them.
+ */
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    char *pool;
+    size_t poolLen;
+    size_t poolCap;
+    size_t *starts;     /* offset of each distinct text in pool */
+    uint32_t distinct;
+    uint32_t startsCap;
+} TextDecoder;
 
+/* Next text of the stream (NUL-terminated, in td->pool until the next
+ * call), or NULL if the stream is corrupt.
+ */
+static const char *td_next(TextDecoder *td, size_t *len) {
+    uint64_t h, rest;
+    if (!get_varint(&td->p, td->end, &h)) {
+        return NULL;
+    }
+    if (h & 1) {
+        if ((h >> 1) >= td->distinct) return NULL;
+        const char *text = td->pool + td->starts[h >> 1];
+        *len = strlen(text);
+        return text;
+    }
+    size_t shared = (size_t)(h >> 1);
+    size_t prevStart = td->distinct > 0 ? td->starts[td->distinct - 1] : 0;
+    size_t prevLen = td->distinct > 0 ? td->poolLen - 1 - prevStart : 0;
+    if (shared > prevLen || !get_varint(&td->p, td->end, &rest) ||
+        rest > (uint64_t)(td->end - td->p) || shared + rest > MAX_TEXT_LEN) {
+        return NULL;
+    }
+    size_t need = td->poolLen + shared + rest + 1;
+    if (need > td->poolCap) {
+        size_t cap = td->poolCap ? td->poolCap : 4096;
+        while (cap < need) cap *= 2;
+        char *grown = realloc(td->pool, cap);
+        if (grown == NULL) return NULL;
+        td->pool = grown;
+        td->poolCap = cap;
+    }
+    if (td->distinct == td->startsCap) {
+        uint32_t cap = td->startsCap ? td->startsCap * 2 : 1024;
+        size_t *grown = realloc(td->starts, cap * sizeof(size_t));
+        if (grown == NULL) return NULL;
+        td->starts = grown;
+        td->startsCap = cap;
+    }
+    char *text = td->pool + td->poolLen;
+    memmove(text, td->pool + prevStart, shared);
+    memcpy(text + shared, td->p, (size_t)rest);
+    text[shared + rest] = '\0';
+    td->p += rest;
+    td->starts[td->distinct++] = td->poolLen;
+    td->poolLen = need;
+    *len = shared + (size_t)rest;
+    return text;
+}
+
+/* What the threads decoding a VERSION 3 file share */
+typedef struct {
+    const uint8_t *isq;
+    const uint8_t *streams[3];  /* question texts, animal texts, visits (or NULL) */
+    const V3Chunk *starts;      /* nchunks + 1 entries, the last one the stream ends */
+    const uint32_t *firstChild; /* id of the first child of each chunk */
+    uint64_t count;
+    uint32_t chunkNodes;
+    uint32_t nchunks;
+    Node *nodes;
+    uint32_t nextChunk;         /* next chunk to hand out */
+    int failed;
+} V3Load;
+
+/* One decoding thread: its texts go to a private arena */
+typedef struct {
+    V3Load *load;
+    NodeArena arena;
+    TextDecoder texts[2];
+} V3Worker;
+
+/* Decode chunk c into its block of nodes. Returns 0 if it is corrupt. */
+static int v3_decode_chunk(V3Worker *w, uint32_t c) {
+    const V3Load *load = w->load;
+    const V3Chunk *from = &load->starts[c], *to = &load->starts[c + 1];
+    for (int k = 0; k < 2; k++) {
+        // Chunks share no texts, so the decoders start over
+        const uint8_t *base = load->streams[k];
+        w->texts[k].p = base + (k == 0 ? from->qOff : from->aOff);
+        w->texts[k].end = base + (k == 0 ? to->qOff : to->aOff);
+        w->texts[k].poolLen = 0;
+        w->texts[k].distinct = 0;
+    }
+    const uint8_t *visits = NULL, *visitsEnd = NULL;
+    if (load->streams[2] != NULL) {
+        visits = load->streams[2] + from->vOff;
+        visitsEnd = load->streams[2] + to->vOff;
+    }
+    uint64_t lo = (uint64_t)c * load->chunkNodes;
+    uint64_t hi = lo + load->chunkNodes < load->count ? lo + load->chunkNodes : load->count;
+    uint64_t next = load->firstChild[c];
+    Node *nodes = load->nodes;
+    for (uint64_t i = lo; i < hi; i++) {
+        Node *node = &nodes[i];
+        node->isQuestion = (load->isq[i >> 3] >> (i & 7)) & 1;
+        node->flags = NODE_ARENA;
+        node->yes = node->no = NULL;
+        if (node->isQuestion) {
+            node->yes = &nodes[next];
+            node->no = &nodes[next + 1];
+            next += 2;
+        }
+        size_t textLen;
+        const char *text = td_next(&w->texts[node->isQuestion ? 0 : 1], &textLen);
+        if (text == NULL || (node->text = arena_strndup(&w->arena, text, textLen)) == NULL) {
+            return 0;
+        }
+        uint64_t v = 0;
+        if (visits != NULL && !get_varint(&visits, visitsEnd, &v)) return 0;
+        node->visits = (uint32_t)v;
+    }
+    // Each stream has to end exactly where the next chunk starts
+    return w->texts[0].p == w->texts[0].end && w->texts[1].p == w->texts[1].end &&
+           visits == visitsEnd;
+}
+
+static void *v3_worker(void *arg) {
+    V3Worker *w = arg;
+    V3Load *load = w->load;
+    for (;;) {
+        uint32_t c = __atomic_fetch_add(&load->nextChunk, 1, __ATOMIC_RELAXED);
+        if (c >= load->nchunks || __atomic_load_n(&load->failed, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (!v3_decode_chunk(w, c)) {
+            __atomic_store_n(&load->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Check the chunk table (or make the one-chunk table of a file without
+ * SEC_CHUNKS) and find where each chunk's children start. The shape has
+ * to give every node but the root exactly one parent. Returns 0 if the
+ * file is corrupt.
+ */
+static int v3_plan(V3Load *load, const uint8_t *table, uint64_t tableLen,
+                   const uint64_t lengths[3], V3Chunk **startsOut, uint32_t **firstOut) {
+    uint32_t chunkNodes = (uint32_t)load->count;
+    if (table != NULL) {
+        if (tableLen < 8) return 0;
+        memcpy(&chunkNodes, table, sizeof(chunkNodes));
+        if (chunkNodes == 0) return 0;
+    }
+    uint64_t nchunks = (load->count + chunkNodes - 1) / chunkNodes;
+    if (table != NULL && tableLen != 8 + nchunks * sizeof(V3Chunk)) {
+        return 0;
+    }
+    V3Chunk *starts = calloc(nchunks + 1, sizeof(V3Chunk));
+    uint32_t *first = malloc(nchunks * sizeof(uint32_t));
+    if (starts == NULL || first == NULL) {
+        goto plan_error;
+    }
+    if (table != NULL) {
+        memcpy(starts, table + 8, nchunks * sizeof(V3Chunk));
+    }
+    starts[nchunks] = (V3Chunk){lengths[0], lengths[1], lengths[2]};
+    for (uint64_t c = 0; c < nchunks; c++) {
+        if (load->streams[2] == NULL) {
+            starts[c].vOff = 0;
+        }
+        if (starts[c].qOff > starts[c + 1].qOff || starts[c].aOff > starts[c + 1].aOff ||
+            starts[c].vOff > starts[c + 1].vOff) {
+            goto plan_error;
+        }
+    }
+    if (starts[0].qOff != 0 || starts[0].aOff != 0 || starts[0].vOff != 0) {
+        goto plan_error;
+    }
+    uint64_t questions = 0;
+    for (uint64_t c = 0; c < nchunks; c++) {
+        first[c] = (uint32_t)(1 + 2 * questions);
+        uint64_t hi = (c + 1) * chunkNodes < load->count ? (c + 1) * chunkNodes : load->count;
+        for (uint64_t i = c * chunkNodes; i < hi;) {
+            // Whole bytes at a time where the chunk covers them
+            if ((i & 7) == 0 && i + 8 <= hi) {
+                questions += __builtin_popcount(load->isq[i >> 3]);
+                i += 8;
+            } else {
+                questions += (load->isq[i >> 3] >> (i & 7)) & 1;
+                i++;
+            }
+        }
+    }
+    if (1 + 2 * questions != load->count) {
+        goto plan_error;  // children past the end, or nodes no question points to
+    }
+    load->chunkNodes = chunkNodes;
+    load->nchunks = (uint32_t)nchunks;
+    *startsOut = starts;
+    *firstOut = first;
+    return 1;
+
+plan_error:
+    free(starts);
+    free(first);
+    return 0;
+}
+
+/* Load a VERSION 3 file: decode every node into a fresh arena, then index
+ * the tree. Chunks are decoded on up to JOB_MAX_THREADS threads, each
+ * copying texts into its own arena; the arenas are merged into the tree's
+ * afterwards. With checkOnly the file is only checked: checksums, sections
+ * and shape. *chunks is set to the number of checksums verified. Returns 1
+ * on success; the current tree is kept on failure.
+ */
+static int load_tree_v3(const char *filename, int checkOnly, uint64_t *chunks) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("[load_tree] Could not open file");
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(V2Header)) {
+        close(fd);
+        return 0;
+    }
+    size_t len = (size_t)st.st_size;
+    char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("[load_tree] mmap failed");
+        return 0;
+    }
+    // Each chunk's part of the file is read front to back once
+    madvise(base, len, MADV_SEQUENTIAL);
+
+    int success = 0, nworkers = 0;
+    NodeArena arena;
+    arena_init(&arena);
+    V3Worker workers[JOB_MAX_THREADS];
+    V3Load load;
+    memset(&load, 0, sizeof(load));
+    V3Chunk *starts = NULL;
+    uint32_t *firstChild = NULL;
+    const uint8_t *table = NULL;
+    uint64_t tableLen = 0, lengths[3] = {0, 0, 0};
+    const uint8_t *answers = NULL;
+    uint64_t answersLen = 0;
+    SnapshotTag tag = {0, 0, 0};
+    const V2Header *h = (const V2Header *)base;
+    const V2Section *dir = (const V2Section *)(base + sizeof(V2Header));
+    load.count = h->count;
+    uint32_t nsections;
+    int checksummed;
+    if (!v2_sections(h, &nsections, &checksummed) ||
+        sizeof(V2Header) + nsections * sizeof(V2Section) > len) {
+        goto v3_done;
+    }
+    for (uint32_t i = 0; i < nsections; i++) {
+        if (dir[i].offset > len || dir[i].length > len - dir[i].offset) goto v3_done;
+        const uint8_t *p = (const uint8_t *)base + dir[i].offset;
+        switch (dir[i].type) {
+            case SEC_SHAPE:
+                if (dir[i].length != (load.count + 7) / 8) goto v3_done;
+                load.isq = p;
+                break;
+            case SEC_QTEXT:
+            case SEC_ATEXT:
+            case SEC_VARVISITS: {
+                int k = dir[i].type == SEC_QTEXT ? 0 : dir[i].type == SEC_ATEXT ? 1 : 2;
+                load.streams[k] = p;
+                lengths[k] = dir[i].length;
+                break;
+            }
+            case SEC_CHUNKS:
+                table = p;
+                tableLen = dir[i].length;
+                break;
+            case SEC_TAG:
+                if (dir[i].length == sizeof(tag)) memcpy(&tag, p, sizeof(tag));
+                break;
+            case SEC_ANSWERS:
+                answers = p;
+                answersLen = dir[i].length;
+                break;
+        }
+    }
+    if (!crc_verify(base, len, dir, nsections, checksummed, filename, chunks)) {
+        goto v3_done;
+    }
+    if (load.count == 0 && !checkOnly) {
+        replace_tree(NULL, &arena);
+        g_treeTag = tag;
+        success = 1;
+        goto v3_done;
+    }
+    if (load.isq == NULL || load.streams[0] == NULL || load.streams[1] == NULL ||
+        !v3_plan(&load, table, tableLen, lengths, &starts, &firstChild)) {
+        goto v3_done;
+    }
+    if (checkOnly) {
+        success = 1;  // sound as far as can be told without decoding
+        goto v3_done;
+    }
+    load.starts = starts;
+    load.firstChild = firstChild;
+    if ((load.nodes = arena_node_block(&arena, load.count)) == NULL) {
+        goto v3_done;
+    }
+
+    nworkers = job_threads(load.nchunks);
+    for (int t = 0; t < nworkers; t++) {
+        memset(&workers[t], 0, sizeof(workers[t]));
+        workers[t].load = &load;
+        arena_init(&workers[t].arena);
+    }
+    run_jobs(v3_worker, workers, sizeof(V3Worker), nworkers);
+    if (load.failed) {
+        goto v3_done;
+    }
+    for (int t = 0; t < nworkers; t++) {
+        arena_adopt_text(&arena, &workers[t].arena);
+    }
+    replace_tree(&load.nodes[0], &arena);
+    g_treeTag = tag;
+    ai_build(&g_index, g_root);
+    if (answers != NULL && !answers_unpack(&g_answers, answers, answersLen)) {
+        fprintf(stderr, "[load_tree] %s: recorded answers are damaged; loaded without them\n",
+                filename);
+    }
     success = 1;
 
-save_error:
-    if (fileptr != NULL) fclose(fileptr);
-    if (q != NULL) { q_free(q); free(q); }
-    if (mapping != NULL) free(mapping);
+v3_done:
+    if (!success || checkOnly) arena_release(&arena);
+    for (int t = 0; t < nworkers; t++) {
+        arena_release(&workers[t].arena);
+        for (int k = 0; k < 2; k++) {
+            free(workers[t].texts[k].pool);
+            free(workers[t].texts[k].starts);
+        }
+    }
+    free(starts);
+    free(firstChild);
+    munmap(base, len);
     return success;
 }
 
+/* Record that VERSION 1 record parent names child id (-1 for none): the
+ * child must come after it and have no other parent. Returns 1 if so.
+ */
+static int claim_child(uint8_t *hasParent, int32_t id, uint32_t parent) {
+    if (id == -1) {
+        return 1;
+    }
+    uint32_t c = (uint32_t)id;
+    if (id <= (int32_t)parent || ((hasParent[c >> 3] >> (c & 7)) & 1)) {
+        return 0;
+    }
+    hasParent[c >> 3] |= (uint8_t)(1u << (c & 7));
+    return 1;
+}
+
 /* TODO 28: Implement load_tree
  * Load a tree from a binary file and reconstruct the structure
  * 
@@ -240,9 +1742,13 @@ int load_tree(const char *filename) { //gemini helped debug this function.
     Node **nodes = NULL;           // array to store newly created Node pointers
     int32_t *yesIds = NULL;        // array to store yes child IDs (to link later)
     int32_t *noIds = NULL;         // array to store no child IDs (to link later)
+    uint8_t *hasParent = NULL;     // bit per node: some record named it as a child
     char *text_buffer = NULL;      // temporary buffer for reading node text
+    uint32_t textCap = 0;          // allocated size of text_buffer
     uint32_t count = 0;            // number of nodes in the file
     int success = 0;               // success flag: 0 = fail, 1 = success
+    NodeArena arena;               // new tree is built here, swapped in on success
+    arena_init(&arena);
 
     // Open the file for binary reading
     fileptr = fopen(filename, "rb");
@@ -257,6 +1763,21 @@ int load_tree(const char *filename) { //gemini helped debug this function.
     if (fread(&version, sizeof(uint32_t), 1, fileptr) != 1) goto cleanup;
     if (fread(&count, sizeof(uint32_t), 1, fileptr) != 1) goto cleanup;
 
+    // VERSION 2 files are memory-mapped rather than read record by record
+    if (magic == MAGIC && version == VERSION_MAPPED) {
+        fclose(fileptr);
+        fileptr = NULL;
+        success = load_tree_v2(filename);
+        goto cleanup;
+    }
+    if (magic == MAGIC && version == VERSION_COMPACT) {
+        fclose(fileptr);
+        fileptr = NULL;
+        uint64_t chunks;
+        success = load_tree_v3(filename, 0, &chunks);
+        goto cleanup;
+    }
+
     // Verify magic and version match what we saved
     if (magic != MAGIC || version != VERSION) {
         goto cleanup;
@@ -264,8 +1785,7 @@ int load_tree(const char *filename) { //gemini helped debug this function.
 
     // Special case: if the file contains no nodes (empty tree)
     if (count == 0) {
-        if (g_root != NULL) free_tree(g_root); // free old tree if present
-        g_root = NULL;                         // set global to empty
+        replace_tree(NULL, &arena);            // drop old tree, set global to empty
         success = 1;
         goto cleanup;
     }
@@ -275,7 +1795,8 @@ int load_tree(const char *filename) { //gemini helped debug this function.
     nodes = calloc(count, sizeof(Node*));
     yesIds = calloc(count, sizeof(int32_t));
     noIds = calloc(count, sizeof(int32_t));
-    if (!nodes || !yesIds || !noIds) goto cleanup;
+    hasParent = calloc((count + 7) / 8, 1);
+    if (!nodes || !yesIds || !noIds || !hasParent) goto cleanup;
 
     // Read each node record from the file
     for (uint32_t i = 0; i < count; i++) {
@@ -290,9 +1811,13 @@ int load_tree(const char *filename) { //gemini helped debug this function.
         // Validate text length is reasonable
         if (textLen > MAX_TEXT_LEN) goto cleanup;
 
-        // Allocate buffer for the text (add 1 for null terminator we'll add)
-        text_buffer = malloc(textLen + 1);
-        if (text_buffer == NULL) goto cleanup;
+        // Grow the reusable text buffer (add 1 for null terminator we'll add)
+        if (textLen + 1 > textCap) {
+            char *grown = realloc(text_buffer, textLen + 1);
+            if (grown == NULL) goto cleanup;
+            text_buffer = grown;
+            textCap = textLen + 1;
+        }
 
         // Read textLen bytes of the text string from file
         if (fread(text_buffer, sizeof(char), textLen, fileptr) != textLen) goto cleanup;
@@ -308,14 +1833,16 @@ int load_tree(const char *filename) { //gemini helped debug this function.
         if (yesId < -1 || yesId >= (int32_t)count) goto cleanup;
         if (noId < -1 || noId >= (int32_t)count) goto cleanup;
 
-        // Create the Node: if is_q==1 it's a question, else it's an animal (leaf)
-        nodes[i] = is_q ? create_question_node(text_buffer)
-                        : create_animal_node(text_buffer);
-        if (nodes[i] == NULL) goto cleanup;
+        // Children come after their one parent, so the records form a tree:
+        // no cycles for the walks to go around forever. Every walk also
+        // takes a question to have both answers.
+        if (!claim_child(hasParent, yesId, i) || !claim_child(hasParent, noId, i)) goto cleanup;
+        if (is_q && (yesId == -1 || noId == -1)) goto cleanup;
 
-        // Clean up temp buffer for next iteration
-        free(text_buffer);
-        text_buffer = NULL;
+        // Create the Node in the arena: question if is_q==1, else an animal (leaf)
+        nodes[i] = is_q ? arena_question_node(&arena, text_buffer)
+                        : arena_animal_node(&arena, text_buffer);
+        if (nodes[i] == NULL) goto cleanup;
 
         // Store the child IDs for the linking phase (next loop)
         yesIds[i] = yesId;
@@ -332,9 +1859,11 @@ int load_tree(const char *filename) { //gemini helped debug this function.
         if (noIds[i] != -1) nodes[i]->no  = nodes[noIds[i]];
     }
 
-    // Replace the old global tree root with the newly loaded one
-    if (g_root != NULL) free_tree(g_root);
-    g_root = nodes[0]; // node[0] is the root by BFS ordering
+    // Replace the old global tree with the newly loaded one
+    replace_tree(nodes[0], &arena); // node[0] is the root by BFS ordering
+
+    // VERSION 1 files carry no index: rebuild it in one pass over the tree
+    ai_build(&g_index, g_root);
 
     // Mark success so cleanup code doesn't free the newly created nodes
     success = 1;
@@ -349,17 +1878,90 @@ cleanup:
     // Free the ID arrays (always safe to free)
     if (yesIds) free(yesIds);
     if (noIds) free(noIds);
+    free(hasParent);
 
-    // If we failed, free all nodes that were created (success == 0)
-    // This prevents a memory leak on error; on success we keep the nodes
-    if (nodes && !success) {
-        for (uint32_t i = 0; i < count; i++) {
-            if (nodes[i]) free_tree(nodes[i]);
-        }
-    }
+    // If we failed, drop all nodes that were created (success == 0)
+    // On success the arena now belongs to g_arena
+    if (!success) arena_release(&arena);
 
     // Free the node array itself
     if (nodes) free(nodes);
 
+    // Bring the tree up to date with the edits logged since the snapshot
+    if (success) wal_replay(filename);
+
     return success;
 }
+
+/* Scan the records of a VERSION 1 file (header already read) with the
+ * loader's checks, plus that nothing follows the last record
+ */
+static int verify_v1(FILE *fp, uint32_t count) {
+    uint8_t *hasParent = calloc((count + 7) / 8 + 1, 1);
+    if (hasParent == NULL) {
+        return 0;
+    }
+    int ok = 1;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        uint8_t isq;
+        uint32_t textLen;
+        int32_t ids[2];
+        ok = fread(&isq, 1, 1, fp) == 1 && fread(&textLen, 4, 1, fp) == 1 &&
+             textLen <= MAX_TEXT_LEN && fseek(fp, textLen, SEEK_CUR) == 0 &&
+             fread(ids, 4, 2, fp) == 2;
+        for (int k = 0; k < 2 && ok; k++) {
+            ok = ids[k] >= -1 && ids[k] < (int32_t)count && claim_child(hasParent, ids[k], i);
+        }
+    }
+    free(hasParent);
+    return ok && fgetc(fp) == EOF;
+}
+
+/* Check a saved tree file without building a tree from it: the checksums,
+ * sections and shape of VERSION 2 and 3 files, or every record of a
+ * VERSION 1 file, which has no checksums. Prints a one-line verdict.
+ * Returns 1 if the file is sound.
+ */
+int verify_tree_file(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror("[verify_tree_file] Could not open file");
+        return 0;
+    }
+    uint32_t header[3];
+    if (fread(header, sizeof(uint32_t), 3, fp) != 3 || header[0] != MAGIC) {
+        fclose(fp);
+        printf("%s: not a saved tree\n", filename);
+        return 0;
+    }
+    int ok = 0;
+    uint64_t chunks = 0;
+    if (header[1] == VERSION) {
+        ok = verify_v1(fp, header[2]);
+    } else if (header[1] == VERSION_MAPPED) {
+        void *map;
+        size_t mapLen;
+        FlatTree ft;
+        const void *index;
+        uint64_t indexLen;
+        if (map_v2(filename, &map, &mapLen, &ft, &index, &indexLen, &chunks)) {
+            ok = flat_check_integrity(&ft);
+            for (uint32_t i = 0; i < ft.count && ok; i++) {
+                ok = ft.text[i] < ft.blobLen;
+            }
+            munmap(map, mapLen);
+        }
+    } else if (header[1] == VERSION_COMPACT) {
+        ok = load_tree_v3(filename, 1, &chunks);
+    }
+    fclose(fp);
+    if (!ok) {
+        printf("%s: VERSION %u, %u nodes: CORRUPT\n", filename, header[1], header[2]);
+    } else if (chunks == 0) {
+        printf("%s: VERSION %u, %u nodes: OK (no checksums)\n", filename, header[1], header[2]);
+    } else {
+        printf("%s: VERSION %u, %u nodes: OK (%llu checksums)\n", filename, header[1],
+               header[2], (unsigned long long)chunks);
+    }
+    return ok;
+}
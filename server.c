@@ -0,0 +1,493 @@
+#define _GNU_SOURCE  /* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lab5.h"
+
+/* ========== Game Server ========== */
+
+#define SERVER_LINE_MAX 1024    /* longest request line */
+#define SERVER_OUT_MAX 4096     /* replies not yet taken by the client */
+#define SERVER_MAX_WORKERS 64
+#define SERVER_EVENTS 64
+
+/* What a connection needs next after its input was processed */
+enum {
+    CONN_KEEP,     /* wait for more input */
+    CONN_WRITER,   /* a tree change is queued for the writer thread */
+    CONN_CLOSE
+};
+
+typedef struct Conn {
+    int fd;
+    Session game;
+    char in[SERVER_LINE_MAX];
+    size_t inLen;
+    char out[SERVER_OUT_MAX];
+    size_t outLen;
+    char op[SERVER_LINE_MAX];   /* request waiting for the writer */
+    struct Conn *nextOp;        /* writer queue */
+    struct Conn *prev, *next;   /* all open connections */
+} Conn;
+
+static struct {
+    int listenFd;
+    int epfd;
+    int wakeFd;                 /* readable once the server is stopping */
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int nworkers;
+    pthread_t workers[SERVER_MAX_WORKERS];
+    pthread_t writer;
+    int stopping;
+
+    pthread_mutex_t opLock;     /* writer queue */
+    pthread_cond_t opReady;
+    Conn *opHead, *opTail;
+
+    pthread_mutex_t connLock;   /* open connection list */
+    Conn *conns;
+    int nconns;
+} srv = {.listenFd = -1, .epfd = -1, .wakeFd = -1};
+
+/* ---- connection I/O ---- */
+
+/* Send as much buffered output as the socket takes. Returns 0 on error. */
+static int conn_flush(Conn *c) {
+    size_t sent = 0;
+    while (sent < c->outLen) {
+        ssize_t n = send(c->fd, c->out + sent, c->outLen - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return 0;
+        }
+    }
+    memmove(c->out, c->out + sent, c->outLen - sent);
+    c->outLen -= sent;
+    return 1;
+}
+
+/* Queue one reply line. Returns 0 if a client stopped reading replies. */
+static int conn_reply(Conn *c, const char *fmt, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(c->out + c->outLen, SERVER_OUT_MAX - c->outLen, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t)n < SERVER_OUT_MAX - c->outLen) {
+            c->outLen += (size_t)n;
+            return 1;
+        }
+        if (!conn_flush(c)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* Tell the client where its game stands */
+static int conn_reply_state(Conn *c) {
+    switch (c->game.state) {
+        case SESSION_ASK: return conn_reply(c, "ASK %s\n", c->game.node->text);
+        case SESSION_GUESS: return conn_reply(c, "GUESS %s\n", c->game.node->text);
+        case SESSION_WON: return conn_reply(c, "WON\n");
+        case SESSION_LEARN: return conn_reply(c, "LEARN\n");
+        default: return conn_reply(c, "OVER\n");
+    }
+}
+
+/* ---- requests ---- */
+
+/* Does line start with the keyword word (case-insensitive)? */
+static int is_word(const char *line, const char *word) {
+    size_t len = strlen(word);
+    return strncasecmp(line, word, len) == 0 && (line[len] == '\0' || line[len] == ' ');
+}
+
+/* Handle one request line. Plays are served right here, by whichever
+ * worker holds the connection; requests that change the tree are copied
+ * to c->op for the writer.
+ */
+static int conn_request(Conn *c, const char *line) {
+    if (is_word(line, "y") || is_word(line, "yes") || is_word(line, "n") || is_word(line, "no")) {
+        session_answer(&c->game, line[0] == 'y' || line[0] == 'Y');
+        return conn_reply_state(c) ? CONN_KEEP : CONN_CLOSE;
+    }
+    if (is_word(line, "new")) {
+        session_end(&c->game);
+        session_start(&c->game);
+        return conn_reply_state(c) ? CONN_KEEP : CONN_CLOSE;
+    }
+    if (is_word(line, "teach") || is_word(line, "undo") || is_word(line, "redo")) {
+        strcpy(c->op, line);
+        return CONN_WRITER;
+    }
+    if (is_word(line, "quit")) {
+        return CONN_CLOSE;
+    }
+    return conn_reply(c, "ERR unknown request\n") ? CONN_KEEP : CONN_CLOSE;
+}
+
+/* Run the complete lines in c->in, reading more while the socket has
+ * data. Stops early when a request has to go to the writer.
+ */
+static int conn_service(Conn *c) {
+    for (;;) {
+        char *nl = memchr(c->in, '\n', c->inLen);
+        if (nl != NULL) {
+            *nl = '\0';
+            if (nl > c->in && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+            // Pinned per request: the reply may quote the node the game moved to
+            unsigned e = epoch_pin();
+            int r = conn_request(c, c->in);
+            epoch_unpin(e);
+            size_t used = (size_t)(nl + 1 - c->in);
+            memmove(c->in, nl + 1, c->inLen - used);
+            c->inLen -= used;
+            if (r != CONN_KEEP) {
+                return r;
+            }
+            continue;
+        }
+        if (c->inLen == SERVER_LINE_MAX) {
+            conn_reply(c, "ERR line too long\n");
+            return CONN_CLOSE;
+        }
+        ssize_t n = recv(c->fd, c->in + c->inLen, SERVER_LINE_MAX - c->inLen, 0);
+        if (n > 0) {
+            c->inLen += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return CONN_KEEP;
+        } else {
+            return CONN_CLOSE;  // client hung up
+        }
+    }
+}
+
+static void conn_close(Conn *c) {
+    pthread_mutex_lock(&srv.connLock);
+    if (c->prev) c->prev->next = c->next;
+    else srv.conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    srv.nconns--;
+    pthread_mutex_unlock(&srv.connLock);
+    // The client sees the hang-up only once the session is gone
+    epoll_ctl(srv.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    session_end(&c->game);
+    close(c->fd);
+    free(c);
+}
+
+/* Hand the connection back to the workers, or to the writer. Connections
+ * are registered EPOLLONESHOT, so exactly one thread owns a connection
+ * between its event and this call.
+ */
+static void conn_finish(Conn *c, int r) {
+    if (!conn_flush(c)) {
+        r = CONN_CLOSE;
+    }
+    if (r == CONN_CLOSE) {
+        conn_close(c);
+        return;
+    }
+    if (r == CONN_WRITER) {
+        pthread_mutex_lock(&srv.opLock);
+        c->nextOp = NULL;
+        if (srv.opTail) srv.opTail->nextOp = c;
+        else srv.opHead = c;
+        srv.opTail = c;
+        pthread_cond_signal(&srv.opReady);
+        pthread_mutex_unlock(&srv.opLock);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT | (c->outLen > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(srv.epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0) {
+        conn_close(c);
+    }
+}
+
+/* ---- threads ---- */
+
+static void server_accept(void) {
+    for (;;) {
+        int fd = accept4(srv.listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("[server] accept failed");
+            }
+            return;
+        }
+        Conn *c = calloc(1, sizeof(Conn));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        unsigned e = epoch_pin();
+        session_start(&c->game);
+        // The first prompt goes out before the client has asked for anything,
+        // and before any worker can see the connection
+        int greeted = conn_reply_state(c);
+        epoch_unpin(e);
+        if (!greeted || !conn_flush(c)) {
+            session_end(&c->game);
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_mutex_lock(&srv.connLock);
+        c->next = srv.conns;
+        if (srv.conns) srv.conns->prev = c;
+        srv.conns = c;
+        srv.nconns++;
+        pthread_mutex_unlock(&srv.connLock);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT | (c->outLen > 0 ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            conn_close(c);
+        }
+    }
+}
+
+/* Readers: serve plays for whichever connections are ready. Traversals
+ * run concurrently with each other and with the writer, without locks.
+ */
+static void *server_worker(void *arg) {
+    (void)arg;
+    struct epoll_event events[SERVER_EVENTS];
+    while (!__atomic_load_n(&srv.stopping, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(srv.epfd, events, SERVER_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            if (p == &srv.wakeFd) {
+                return NULL;  // left readable so every worker sees it
+            } else if (p == &srv.listenFd) {
+                server_accept();
+            } else {
+                conn_finish(p, conn_service(p));
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Apply one queued tree change; runs only on the writer thread */
+static int server_apply(Conn *c) {
+    if (is_word(c->op, "undo")) {
+        return conn_reply(c, undo_last_edit() ? "OK\n" : "ERR nothing to undo\n");
+    }
+    if (is_word(c->op, "redo")) {
+        return conn_reply(c, redo_last_edit() ? "OK\n" : "ERR nothing to redo\n");
+    }
+    // TEACH <y|n>\t<animal>\t<question>
+    char *answer = c->op + 5;
+    while (*answer == ' ') answer++;
+    char *animal = strchr(answer, '\t');
+    char *question = animal ? strchr(animal + 1, '\t') : NULL;
+    if (question == NULL || animal[1] == '\t' || question[1] == '\0') {
+        return conn_reply(c, "ERR usage: TEACH y|n<TAB>animal<TAB>question\n");
+    }
+    *animal++ = '\0';
+    *question++ = '\0';
+    int yes = answer[0] == 'y' || answer[0] == 'Y';
+    if (!session_teach(&c->game, animal, question, yes, NULL)) {
+        return conn_reply(c, "ERR cannot teach now\n");
+    }
+    return conn_reply_state(c);
+}
+
+/* The single writer: every change to the tree, its index, statistics and
+ * undo history happens on this thread, one request at a time.
+ */
+static void *server_writer(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&srv.opLock);
+        while (srv.opHead == NULL && !srv.stopping) {
+            // Readers pin per request, so retired nodes are soon free to go
+            // even when no further lesson comes to reclaim them
+            if (epoch_pending() > 0) {
+                epoch_reclaim();
+            }
+            if (wal_checkpoint_poll(NULL) != SAVE_RUNNING && epoch_pending() == 0) {
+                pthread_cond_wait(&srv.opReady, &srv.opLock);
+                continue;
+            }
+            // Check on the background checkpoint and retired nodes between lessons
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 100 * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&srv.opReady, &srv.opLock, &until);
+        }
+        Conn *c = srv.opHead;
+        if (c == NULL) {
+            pthread_mutex_unlock(&srv.opLock);
+            canonicalize_tmp_release();
+            return NULL;
+        }
+        srv.opHead = c->nextOp;
+        if (srv.opHead == NULL) srv.opTail = NULL;
+        pthread_mutex_unlock(&srv.opLock);
+
+        int r = server_apply(c) ? CONN_KEEP : CONN_CLOSE;
+        conn_finish(c, r == CONN_KEEP ? conn_service(c) : r);
+    }
+}
+
+/* ---- lifetime ---- */
+
+/* Listen on the UNIX socket at path and serve games on nworkers threads
+ * (0 = one per online CPU) plus the writer thread. Returns 1 once the
+ * server is accepting connections, 0 on failure.
+ */
+int server_start(const char *path, int nworkers) {
+    struct sockaddr_un addr;
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[server_start] Socket path too long\n");
+        return 0;
+    }
+    if (nworkers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (nworkers > SERVER_MAX_WORKERS) {
+        nworkers = SERVER_MAX_WORKERS;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(srv.path, path);
+    srv.stopping = 0;
+    srv.opHead = srv.opTail = NULL;
+    srv.conns = NULL;
+    srv.nconns = 0;
+    pthread_mutex_init(&srv.opLock, NULL);
+    pthread_cond_init(&srv.opReady, NULL);
+    pthread_mutex_init(&srv.connLock, NULL);
+
+    srv.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    srv.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (srv.listenFd < 0 || srv.epfd < 0 || srv.wakeFd < 0) {
+        perror("[server_start] Failed to create descriptors");
+        goto start_error;
+    }
+    unlink(path);  // a stale socket from an earlier run
+    if (bind(srv.listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(srv.listenFd, SOMAXCONN) != 0) {
+        perror("[server_start] Could not listen");
+        goto start_error;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &srv.listenFd;
+    if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listenFd, &ev) != 0) goto start_error;
+    ev.data.ptr = &srv.wakeFd;
+    if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.wakeFd, &ev) != 0) goto start_error;
+
+    if (pthread_create(&srv.writer, NULL, server_writer, NULL) != 0) {
+        goto start_error;
+    }
+    for (srv.nworkers = 0; srv.nworkers < nworkers; srv.nworkers++) {
+        if (pthread_create(&srv.workers[srv.nworkers], NULL, server_worker, NULL) != 0) {
+            server_stop();
+            return 0;
+        }
+    }
+    return 1;
+
+start_error:
+    if (srv.listenFd >= 0) close(srv.listenFd);
+    if (srv.epfd >= 0) close(srv.epfd);
+    if (srv.wakeFd >= 0) close(srv.wakeFd);
+    srv.listenFd = srv.epfd = srv.wakeFd = -1;
+    return 0;
+}
+
+/* Stop all threads, drop every connection and remove the socket */
+void server_stop(void) {
+    if (srv.epfd < 0) {
+        return;
+    }
+    __atomic_store_n(&srv.stopping, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(srv.wakeFd, &one, sizeof(one)) < 0) {
+        perror("[server_stop] Failed to wake workers");
+    }
+    for (int i = 0; i < srv.nworkers; i++) {
+        pthread_join(srv.workers[i], NULL);
+    }
+    pthread_mutex_lock(&srv.opLock);
+    pthread_cond_signal(&srv.opReady);
+    pthread_mutex_unlock(&srv.opLock);
+    pthread_join(srv.writer, NULL);
+
+    // No thread owns a connection any more
+    while (srv.conns != NULL) {
+        conn_close(srv.conns);
+    }
+    close(srv.listenFd);
+    close(srv.epfd);
+    close(srv.wakeFd);
+    unlink(srv.path);
+    srv.listenFd = srv.epfd = srv.wakeFd = -1;
+    srv.nworkers = 0;
+    pthread_mutex_destroy(&srv.opLock);
+    pthread_cond_destroy(&srv.opReady);
+    pthread_mutex_destroy(&srv.connLock);
+}
+
+/* Connections currently open */
+int server_sessions(void) {
+    pthread_mutex_lock(&srv.connLock);
+    int n = srv.nconns;
+    pthread_mutex_unlock(&srv.connLock);
+    return n;
+}
+
+/* Serve until SIGINT or SIGTERM. Returns 1 after a clean shutdown. */
+int server_run(const char *path, int nworkers) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    // Block the signals before the threads start so they inherit the mask
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (!server_start(path, nworkers)) {
+        return 0;
+    }
+    printf("Serving games on %s with %d worker threads\n", path, srv.nworkers);
+    fflush(stdout);
+    int sig;
+    sigwait(&set, &sig);
+    server_stop();
+    return 1;
+}
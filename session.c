@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lab5.h"
+
+extern Node *g_root;
+extern EditStack g_undo;
+extern EditStack g_redo;
+extern AttrIndex g_index;
+extern NodeArena g_arena;
+
+unsigned long g_treeVersion;
+
+/* ========== Game Session ========== */
+
+/* Arrive at node: count the visit and decide what the player sees next */
+static void session_enter(Session *s, Node *node) {
+    s->node = node;
+    node_count_visit(node, 1);
+    s->state = node->isQuestion ? SESSION_ASK : SESSION_GUESS;
+}
+
+/* Walk in at the root of g_root; a missing tree ends the game. The caller
+ * holds an epoch pin.
+ */
+static void session_restart(Session *s) {
+    s->path.size = 0;
+    s->node = NULL;
+    s->state = SESSION_OVER;
+    s->version = __atomic_load_n(&g_treeVersion, __ATOMIC_ACQUIRE);
+    Node *root = tree_follow(&g_root);
+    if (root != NULL) {
+        session_enter(s, root);
+    }
+}
+
+/* Begin a game at the root of g_root. A missing tree ends the game at once. */
+void session_start(Session *s) {
+    fs_init(&s->path);
+    unsigned e = epoch_pin();
+    session_restart(s);
+    epoch_unpin(e);
+}
+
+/* The question being asked, or the name of the animal being guessed.
+ * NULL once the game has no prompt left. The text belongs to the node:
+ * read it under the same epoch pin as the call that moved the game when
+ * a writer may be reclaiming nodes (server.c pins each request).
+ */
+const char *session_current_prompt(const Session *s) {
+    if (s->state != SESSION_ASK && s->state != SESSION_GUESS) {
+        return NULL;
+    }
+    return s->node->text;
+}
+
+/* Is the session's path still the way from g_root to its node? Another
+ * player's lesson or an undo may have changed the tree since it was
+ * walked. Only nodes reached from g_root are read, so the path's own
+ * pointers may be stale. The caller holds an epoch pin.
+ */
+static int session_path_current(const Session *s) {
+    Node *node = tree_follow(&g_root);
+    for (int i = 0; i < s->path.size && node != NULL; i++) {
+        const Frame *f = &s->path.frames[i];
+        if (node != f->node) {
+            return 0;
+        }
+        node = tree_follow(f->answeredYes ? &node->yes : &node->no);
+    }
+    // A node freed and handed out again could sit at the same place
+    return node != NULL && node == s->node && node->isQuestion == (s->state == SESSION_ASK);
+}
+
+/* Called under an epoch pin before a game with a prompt goes on. The game
+ * held no pin since its last call, so its node may have been detached
+ * and even freed: if anything was published since, its path is walked
+ * again from g_root. Returns 1 if the game is where it was, 0 if
+ * it had to start over at the root.
+ */
+static int session_resume(Session *s) {
+    unsigned long version = __atomic_load_n(&g_treeVersion, __ATOMIC_ACQUIRE);
+    if (version == s->version) {
+        return 1;
+    }
+    if (session_path_current(s)) {
+        s->version = version;
+        return 1;
+    }
+    session_restart(s);
+    return 0;
+}
+
+/* Answer the current prompt (nonzero = yes). A question moves down the
+ * tree; a guess either wins or asks to be taught. Answers given in any
+ * other state are ignored, and so is an answer to a prompt that another
+ * player's change has removed: the game starts over at the root instead.
+ * Returns the new state.
+ */
+SessionState session_answer(Session *s, int yes) {
+    if (s->state != SESSION_ASK && s->state != SESSION_GUESS) {
+        return s->state;
+    }
+    unsigned e = epoch_pin();
+    if (!session_resume(s)) {
+        // Answered a prompt that is gone
+    } else if (s->state == SESSION_ASK) {
+        fs_push(&s->path, s->node, yes ? 1 : 0);
+        session_enter(s, tree_follow(yes ? &s->node->yes : &s->node->no));
+    } else {
+        s->state = yes ? SESSION_WON : SESSION_LEARN;
+    }
+    epoch_unpin(e);
+    return s->state;
+}
+
+/* After a wrong guess, learn the player's animal: split the guessed leaf
+ * into question, whose answer for animal is answerYes, with the new
+ * animal and the old leaf below it (see learn_split). Only one thread may
+ * teach (or undo/redo) at a time. Returns 1 on success, 0 if the session
+ * was not waiting to be taught, its leaf is no longer where it was found,
+ * or the nodes could not be created.
+ */
+int session_teach(Session *s, const char *animal, const char *question, int answerYes, Edit *out) {
+    if (s->state != SESSION_LEARN || animal == NULL || question == NULL) {
+        return 0;
+    }
+    unsigned e = epoch_pin();
+    int ok = session_path_current(s) &&
+             learn_split(&s->path, s->node, animal, question, answerYes, out);
+    epoch_unpin(e);
+    if (ok) {
+        s->state = SESSION_OVER;
+    }
+    return ok;
+}
+
+/* Split leaf, reached from g_root by path, into question with animal on
+ * its answerYes side. The split is pushed on g_undo (g_redo is cleared),
+ * g_stats, g_index and the write-ahead log are updated, and the edit is
+ * copied to *out if out is not NULL. The new question is linked in with a
+ * single release store once it is complete, so concurrent players see
+ * either the old leaf or the whole split. Writer only. Returns 1 on
+ * success.
+ */
+int learn_split(const FrameStack *path, Node *leaf, const char *animal, const char *question,
+                int answerYes, Edit *out) {
+    Node *newQuestion = arena_question_node(&g_arena, question);
+    Node *newAnimal = arena_animal_node(&g_arena, animal);
+    if (newQuestion == NULL || newAnimal == NULL) {
+        perror("[learn_split] Failed to create nodes");
+        return 0;
+    }
+    Node *oldAnimal = leaf;
+
+    // The game was about the new animal, so the visit is its
+    node_count_visit(oldAnimal, -1);
+    newQuestion->visits = 1;
+    newAnimal->visits = 1;
+
+    if (answerYes) {
+        newQuestion->yes = newAnimal;
+        newQuestion->no = oldAnimal;
+    } else {
+        newQuestion->yes = oldAnimal;
+        newQuestion->no = newAnimal;
+    }
+
+    Edit e = {0};
+    e.type = EDIT_INSERT_SPLIT;
+    e.parent = NULL;
+    e.wasYesChild = -1;
+    if (path->size > 0) {
+        Frame top = path->frames[path->size - 1];
+        e.parent = top.node;
+        e.wasYesChild = top.answeredYes;
+    }
+    e.oldLeaf = oldAnimal;
+    e.newQuestion = newQuestion;
+    e.newLeaf = newAnimal;
+    e.depth = path->size; // one question asked per level above the leaf
+    // Undo and redo log the split by this path (see wal_log_edit)
+    for (int i = 0; i < path->size && i < EDIT_PATH_MAX; i++) {
+        e.path[i / 8] |= (uint8_t)((path->frames[i].answeredYes ? 1 : 0) << (i % 8));
+    }
+
+    // Attach the new question where the old leaf was
+    if (e.parent == NULL) {
+        tree_publish(&g_root, newQuestion);
+    } else if (e.wasYesChild) {
+        tree_publish(&e.parent->yes, newQuestion);
+    } else {
+        tree_publish(&e.parent->no, newQuestion);
+    }
+
+    stats_split(&g_stats, e.depth);
+    // Index the new animal under every question on its path
+    ai_learn(&g_index, path->frames, path->size, oldAnimal, newQuestion, newAnimal);
+    wal_log_split(path->frames, path->size, answerYes, animal, question);
+    journal_record(e);
+
+    if (out != NULL) {
+        *out = e;
+    }
+    return 1;
+}
+
+/* The animals that a question just taught below path should also be
+ * asked about: whole subtrees beside the path, nearest first, as long as
+ * they fit in max. Once every animal under a question has answered the
+ * new one, the optimizer may ask it there instead. Writer only. Returns
+ * the number of leaves stored in out.
+ */
+int learn_neighbours(const FrameStack *path, Node **out, int max) {
+    Node **stack = malloc((max > 0 ? max : 1) * sizeof(Node *));
+    if (stack == NULL) {
+        return 0;
+    }
+    int n = 0;
+    for (int level = path->size - 1; level >= 0 && n < max; level--) {
+        Frame f = path->frames[level];
+        int found = n, top = 0, fits = 1;
+        stack[top++] = f.answeredYes ? f.node->no : f.node->yes;
+        while (top > 0 && fits) {
+            Node *node = stack[--top];
+            if (!node->isQuestion) {
+                out[found++] = node;
+            } else if (found + top + 2 > max) {
+                fits = 0;  // every stacked subtree holds at least one more leaf
+            } else {
+                stack[top++] = node->no;
+                stack[top++] = node->yes;
+            }
+        }
+        if (!fits) {
+            break;  // only a whole subtree lets the question move up
+        }
+        n = found;
+    }
+    free(stack);
+    return n;
+}
+
+/* Record animal's answer to question beyond its own root path in
+ * g_answers, and log it. Writer only. Returns 1 on success.
+ */
+int learn_answer(const char *animal, const char *question, int yes) {
+    if (animal == NULL || question == NULL) {
+        return 0;
+    }
+    if (!answers_add(&g_answers, animal, question, yes)) {
+        perror("[learn_answer] Failed to record the answer");
+        return 0;
+    }
+    wal_log_answer(animal, question, yes);
+    return 1;
+}
+
+/* Release the session's path; the tree is left as the game made it */
+void session_end(Session *s) {
+    fs_free(&s->path);
+    s->node = NULL;
+    s->state = SESSION_OVER;
+}
+
+/* Retire every node of the tree at root: one side of a rebuild that the
+ * journal dropped. Nothing else refers to them, since the optimizer builds
+ * every node of its tree afresh.
+ */
+void retire_tree(Node *root) {
+    if (root == NULL) {
+        return;
+    }
+    int cap = 64, top = 0;
+    Node **stack = malloc(cap * sizeof(Node *));
+    if (stack == NULL) {
+        return;  // left allocated until the arena is released
+    }
+    stack[top++] = root;
+    while (top > 0) {
+        Node *n = stack[--top];
+        if (n->isQuestion) {
+            if (top + 2 > cap) {
+                cap *= 2;
+                Node **grown = realloc(stack, cap * sizeof(Node *));
+                if (grown == NULL) {
+                    break;
+                }
+                stack = grown;
+            }
+            stack[top++] = n->yes;
+            stack[top++] = n->no;
+        }
+        epoch_retire(n, &g_arena);
+    }
+    free(stack);
+}
+
+/* ========== Edit Journal ========== */
+
+static size_t g_journalBudget = JOURNAL_BUDGET_DEFAULT;
+
+/* Drop the oldest undo entries until the journal is back under three
+ * quarters of its budget, so compaction (one memmove) runs rarely. The
+ * newest edit is always kept. Writer only.
+ */
+static void journal_compact(void) {
+    if (g_undo.bytes + g_redo.bytes <= g_journalBudget) {
+        return;
+    }
+    size_t target = g_journalBudget - g_journalBudget / 4;
+    size_t total = g_undo.bytes + g_redo.bytes;
+    int k = 0;
+    while (k < g_undo.size - 1 && total > target) {
+        Edit *e = &g_undo.edits[k++];
+        // A dropped split's nodes stay in the tree; a rebuild's old tree is garbage
+        if (e->type == EDIT_REBUILD) {
+            retire_tree(e->oldRoot);
+        }
+        total -= edit_cost(e);
+    }
+    es_drop_oldest(&g_undo, k);
+    if (total > target) {
+        discard_redo();
+    }
+}
+
+/* Record a new edit that has already been applied to g_root: push it on
+ * g_undo, drop the redo history, and compact the journal to its budget.
+ * Writer only.
+ */
+void journal_record(Edit e) {
+    es_push(&g_undo, e);
+    discard_redo();
+    journal_compact();
+    epoch_reclaim();
+}
+
+/* Bytes g_undo and g_redo may hold together (at least one edit is kept) */
+void journal_set_budget(size_t bytes) {
+    g_journalBudget = bytes;
+    journal_compact();
+}
+
+size_t journal_budget(void) {
+    return g_journalBudget;
+}
+
+/* Empty g_redo after a new edit. The undone edits can never be redone, so
+ * the nodes only they held are retired: session calls that are still
+ * walking them keep them until they return, then they go back to g_arena.
+ * Writer only.
+ */
+void discard_redo(void) {
+    for (int i = 0; i < g_redo.size; i++) {
+        Edit *e = &g_redo.edits[i];
+        if (e->type == EDIT_REBUILD) {
+            retire_tree(e->newRoot);
+        } else {
+            ai_forget_split(&g_index, e);
+            epoch_retire(e->newQuestion, &g_arena);
+            epoch_retire(e->newLeaf, &g_arena);
+        }
+    }
+    es_clear(&g_redo);
+    ai_compact(&g_index, g_root);
+}
+
+/* TODO 32: Implement undo_last_edit
+ * Undo the most recent tree modification
+ * 
+ * Steps:
+ * 1. Check if g_undo stack is empty, return 0 if so
+ * 2. Pop edit from g_undo
+ * 3. Restore the tree structure:
+ *    - If edit.parent is NULL:
+ *      - Set g_root = edit.oldLeaf
+ *    - Else if edit.wasYesChild:
+ *      - Set edit.parent->yes = edit.oldLeaf
+ *    - Else:
+ *      - Set edit.parent->no = edit.oldLeaf
+ * 4. Push edit to g_redo stack
+ * 5. Return 1
+ * 
+ * Note: We don't free newQuestion/newLeaf because they might be redone
+ */
+int undo_last_edit() {
+    // If there are no edits to undo, return 0
+    if (es_empty(&g_undo)) {
+        return 0;
+    }
+    // Pop the most recent edit from the undo stack
+    Edit curr = es_pop(&g_undo);
+    if (curr.type == EDIT_REBUILD) {
+        // Put the whole pre-optimization tree back
+        tree_publish(&g_root, curr.oldRoot);
+        ai_build(&g_index, g_root);
+        stats_recount(&g_stats, g_root);
+        es_push(&g_redo, curr);
+        wal_log_edit(&curr, 1);
+        return 1;
+    }
+    // Restore the tree to the state before the edit by reconnecting the
+    // parent's pointer (or the root) back to the old leaf node
+    if (curr.parent == NULL) {
+        // Edit changed the root; restore old leaf as root
+        tree_publish(&g_root, curr.oldLeaf);
+    } else if (curr.wasYesChild) {
+        // Parent's yes pointer should point back to the old leaf
+        tree_publish(&curr.parent->yes, curr.oldLeaf);
+    } else {
+        // Parent's no pointer should point back to the old leaf
+        tree_publish(&curr.parent->no, curr.oldLeaf);
+    }
+    // The split's question and animal no longer answer index queries
+    ai_set_split_live(&g_index, &curr, 0);
+    stats_unsplit(&g_stats, curr.depth);
+    // Push the undone edit onto the redo stack so it can be redone later
+    es_push(&g_redo, curr);
+    wal_log_edit(&curr, 1);
+    return 1;
+}
+
+/* Index a split being redone that the index no longer knows: a rebuild
+ * or its undo indexed the tree afresh while the split was undone. The
+ * edit's path leads to it; a split deeper than that is covered by
+ * indexing the whole tree again.
+ */
+static void edit_reindex(const Edit *e) {
+    if (e->depth > EDIT_PATH_MAX) {
+        ai_build(&g_index, g_root);
+        return;
+    }
+    FrameStack path;
+    fs_init(&path);
+    Node *node = g_root;
+    for (int i = 0; i < e->depth; i++) {
+        int yes = (e->path[i / 8] >> (i % 8)) & 1;
+        fs_push(&path, node, yes);
+        node = yes ? node->yes : node->no;
+    }
+    ai_learn(&g_index, path.frames, path.size, e->oldLeaf, e->newQuestion, e->newLeaf);
+    fs_free(&path);
+}
+
+/* TODO 33: Implement redo_last_edit
+ * Redo a previously undone edit
+ * 
+ * Steps:
+ * 1. Check if g_redo stack is empty, return 0 if so
+ * 2. Pop edit from g_redo
+ * 3. Reapply the tree modification:
+ *    - If edit.parent is NULL:
+ *      - Set g_root = edit.newQuestion
+ *    - Else if edit.wasYesChild:
+ *      - Set edit.parent->yes = edit.newQuestion
+ *    - Else:
+ *      - Set edit.parent->no = edit.newQuestion
+ * 4. Push edit back to g_undo stack
+ * 5. Return 1
+ */
+int redo_last_edit() {
+    // If there is nothing to redo, return failure
+    if (es_empty(&g_redo)) {
+        return 0;
+    }
+    // Pop the most recent undone edit
+    Edit curr = es_pop(&g_redo);
+    if (curr.type == EDIT_REBUILD) {
+        tree_publish(&g_root, curr.newRoot);
+        ai_build(&g_index, g_root);
+        stats_recount(&g_stats, g_root);
+        es_push(&g_undo, curr);
+        wal_log_edit(&curr, 0);
+        return 1;
+    }
+    // Re-apply the change: attach the new question node at the parent's spot
+    if (curr.parent == NULL) {
+        // The edit replaced the root, so restore newQuestion as root
+        tree_publish(&g_root, curr.newQuestion);
+    //Same cases logic as undo
+    } else if (curr.wasYesChild) { 
+        tree_publish(&curr.parent->yes, curr.newQuestion);
+    } else {
+        tree_publish(&curr.parent->no, curr.newQuestion);
+    }
+    if (!ai_set_split_live(&g_index, &curr, 1)) {
+        edit_reindex(&curr);
+    }
+    stats_split(&g_stats, curr.depth);
+    // Push the edit back onto the undo stack
+    es_push(&g_undo, curr);
+    wal_log_edit(&curr, 0);
+    return 1;
+}
@@ -16,8 +16,14 @@
 Node *g_root = NULL;
 
 /* Global undo/redo stacks */
-EditStack g_undo = {NULL, 0, 0};
-EditStack g_redo = {NULL, 0, 0};
+EditStack g_undo = {NULL, 0, 0, 0};
+EditStack g_redo = {NULL, 0, 0, 0};
 
 /* Global attribute index */
-Hash g_index = {NULL, 0, 0};
+AttrIndex g_index = {0};
+
+/* Arena owning the nodes of g_root */
+NodeArena g_arena = {NULL, NULL, 0, NULL, 0, NULL, NULL};
+
+/* Size and shape of g_root */
+TreeStats g_stats = {0, 0, 0, 0, NULL, 0};
@@ -2,6 +2,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/sched.h>
+#include <linux/seccomp.h>
 #include "lab5.h"
 
 /* Test Frame Stack */
@@ -56,9 +70,10 @@ void test_queue() {
     Node dummy2 = {0};
     Node dummy3 = {0};
     
-    q_enqueue(&q, &dummy1, 1);
-    q_enqueue(&q, &dummy2, 2);
-    q_enqueue(&q, &dummy3, 3);
+    assert(q_enqueue(&q, &dummy1, 1));
+    assert(q_enqueue(&q, &dummy2, 2));
+    assert(q_enqueue(&q, &dummy3, 3));
+    assert(!q_enqueue(NULL, &dummy1, 4));
     
     assert(q.size == 3);
     
@@ -77,10 +92,187 @@ void test_queue() {
     assert(q_empty(&q));
     assert(!q_dequeue(&q, &n, &id));
     
+    /* Wrap around the ring, then grow while wrapped */
+    int next_in = 0, next_out = 0;
+    for (int round = 0; round < 40; round++) {
+        q_enqueue(&q, &dummy1, next_in++);
+        q_enqueue(&q, &dummy2, next_in++);
+        assert(q_dequeue(&q, &n, &id) && id == next_out++);
+    }
+    assert(q.size == 40 && (q.capacity & (q.capacity - 1)) == 0);
+    while (q_dequeue(&q, &n, &id)) {
+        assert(id == next_out++);
+    }
+    assert(next_out == next_in);
+    
+    /* Clear keeps the buffer for reuse */
+    int cap = q.capacity;
+    q_enqueue(&q, &dummy3, 7);
+    q_clear(&q);
+    assert(q_empty(&q) && q.capacity == cap);
+    
     q_free(&q);
+    assert(q.items == NULL && q.capacity == 0);
     printf("  ✓ Queue tests passed\n");
 }
 
+/* Test Compressed Bitmap against a plain byte-per-id reference */
+void test_bitmap() {
+    printf("Testing Bitmap...\n");
+    
+    enum { N = 300000 };  /* spans five 65536-id containers */
+    uint8_t *ra = calloc(N, 1), *rb = calloc(N, 1);
+    Bitmap a, b, out;
+    bm_init(&a);
+    bm_init(&b);
+    bm_init(&out);
+    
+    /* a: sparse adds (array containers) plus a dense range (bitset) */
+    srand(5);
+    for (int i = 0; i < 3000; i++) {
+        uint32_t x = (uint32_t)(rand() % N);
+        assert(bm_add(&a, x));
+        ra[x] = 1;
+    }
+    assert(bm_add_range(&a, 70000, 140000));
+    memset(ra + 70000, 1, 70000);
+    /* b: a dense half that crosses containers, then single removals */
+    assert(bm_add_range(&b, 100000, 250000));
+    memset(rb + 100000, 1, 150000);
+    for (int i = 0; i < 20000; i++) {
+        uint32_t x = (uint32_t)(rand() % N);
+        bm_add(&b, x);
+        rb[x] = 1;
+        if (i % 3 == 0) {
+            bm_remove(&b, x);
+            rb[x] = 0;
+        }
+    }
+    
+    uint64_t ca = 0, cb = 0;
+    for (int i = 0; i < N; i++) {
+        assert(bm_contains(&a, (uint32_t)i) == ra[i]);
+        assert(bm_contains(&b, (uint32_t)i) == rb[i]);
+        ca += ra[i];
+        cb += rb[i];
+    }
+    assert(bm_cardinality(&a) == ca && bm_cardinality(&b) == cb);
+    
+    /* AND, ANDNOT and OR across every container pairing */
+    for (int op = 0; op < 3; op++) {
+        int ok = op == 0 ? bm_and(&out, &a, &b) : op == 1 ? bm_andnot(&out, &a, &b) : bm_or(&out, &a, &b);
+        assert(ok);
+        uint64_t expect = 0;
+        for (int i = 0; i < N; i++) {
+            int want = op == 0 ? (ra[i] && rb[i]) : op == 1 ? (ra[i] && !rb[i]) : (ra[i] || rb[i]);
+            assert(bm_contains(&out, (uint32_t)i) == want);
+            expect += want;
+        }
+        assert(bm_cardinality(&out) == expect);
+    }
+    
+    /* Listing comes out in increasing order */
+    uint32_t *vals = malloc(cb * sizeof(uint32_t));
+    assert(bm_to_array(&b, vals, cb) == cb);
+    for (uint64_t i = 1; i < cb; i++) {
+        assert(vals[i - 1] < vals[i]);
+    }
+    free(vals);
+    
+    /* Copy, then empty a container completely */
+    assert(bm_copy(&out, &a));
+    assert(bm_cardinality(&out) == ca);
+    bm_clear(&out);
+    assert(bm_add(&out, 7) && bm_remove(&out, 7));
+    assert(out.n == 0 && !bm_contains(&out, 7));
+    
+    bm_free(&a);
+    bm_free(&b);
+    bm_free(&out);
+    free(ra);
+    free(rb);
+    printf("  ✓ Bitmap tests passed\n");
+}
+
+/* Count query results and check that name is among them */
+static int query_has(const Bitmap *res, const char *name) {
+    uint32_t ids[16];
+    size_t n = bm_to_array(res, ids, 16);
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(ai_animal(&g_index, ids[i])->text, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Test Attribute Index */
+void test_index() {
+    printf("Testing Attribute Index...\n");
+    
+    Node *water = create_question_node("Does it live in water?");
+    Node *fins = create_question_node("Does it have fins?");
+    Node *meow = create_question_node("Does it meow?");
+    water->yes = fins;
+    water->no = meow;
+    fins->yes = create_animal_node("Fish");
+    fins->no = create_animal_node("Frog");
+    meow->yes = create_animal_node("Cat");
+    Node *dog = create_animal_node("Dog");
+    meow->no = dog;
+    
+    assert(ai_build(&g_index, water));
+    assert(g_index.nquestions == 3 && g_index.nanimals == 4);
+    
+    Bitmap res;
+    bm_init(&res);
+    /* Lookups go through canonical form, so spelling does not matter */
+    AttrTerm inWater[] = {{"does it LIVE in water", 1, 0}};
+    assert(ai_query(&g_index, inWater, 1, &res));
+    assert(bm_cardinality(&res) == 2 && query_has(&res, "Fish") && query_has(&res, "Frog"));
+    
+    AttrTerm noFins[] = {{"Does it have fins?", 1, 1}, {"Does it live in water?", 1, 0}};
+    assert(ai_query(&g_index, noFins, 2, &res));
+    assert(bm_cardinality(&res) == 1 && query_has(&res, "Frog"));
+    
+    AttrTerm unknown[] = {{"Does it fly?", 1, 0}};
+    assert(ai_query(&g_index, unknown, 1, &res));
+    assert(bm_cardinality(&res) == 0);
+    
+    /* Learn Cow below Dog: it inherits Dog's answers on the way down */
+    Node *bark = create_question_node("Does it bark?");
+    Node *cow = create_animal_node("Cow");
+    bark->yes = dog;
+    bark->no = cow;
+    meow->no = bark;
+    Frame path[] = {{water, 0}, {meow, 0}};
+    assert(ai_learn(&g_index, path, 2, dog, bark, cow));
+    
+    AttrTerm dry[] = {{"Does it live in water?", 0, 0}, {"Does it meow?", 0, 0}};
+    assert(ai_query(&g_index, dry, 2, &res));
+    assert(bm_cardinality(&res) == 2 && query_has(&res, "Dog") && query_has(&res, "Cow"));
+    AttrTerm quiet[] = {{"Does it bark?", 0, 0}};
+    assert(ai_query(&g_index, quiet, 1, &res));
+    assert(bm_cardinality(&res) == 1 && query_has(&res, "Cow"));
+    
+    /* Undo hides the split's question and animal, redo brings them back */
+    Edit e = {.type = EDIT_INSERT_SPLIT, .parent = meow, .wasYesChild = 0, .oldLeaf = dog,
+              .newQuestion = bark, .newLeaf = cow, .depth = 2};
+    ai_set_split_live(&g_index, &e, 0);
+    assert(ai_query(&g_index, dry, 2, &res));
+    assert(bm_cardinality(&res) == 1 && query_has(&res, "Dog"));
+    assert(ai_query(&g_index, quiet, 1, &res));
+    assert(bm_cardinality(&res) == 0);
+    ai_set_split_live(&g_index, &e, 1);
+    assert(ai_query(&g_index, quiet, 1, &res));
+    assert(bm_cardinality(&res) == 1 && query_has(&res, "Cow"));
+    
+    bm_free(&res);
+    ai_free(&g_index);
+    free_tree(water);
+    printf("  ✓ Attribute index tests passed\n");
+}
+
 /* Test Hash Table */
 void test_hash() {
     printf("Testing Hash Table...\n");
@@ -115,11 +307,170 @@ void test_hash() {
     
     assert(h.size > 2);
     
+    /* Growth well past the initial 7 buckets keeps every key reachable */
+    for (int i = 0; i < 5000; i++) {
+        char key[32];
+        sprintf(key, "does_it_have_trait_%d", i);
+        assert(h_put(&h, key, i));
+    }
+    assert(h.size == 52 + 5000);
+    assert(h.nslots * 7 >= h.size * 8);
+    for (int i = 0; i < 5000; i++) {
+        char key[32];
+        sprintf(key, "does_it_have_trait_%d", i);
+        assert(h_contains(&h, key, i));
+        assert(!h_contains(&h, key, i + 1));
+    }
+    assert(h_contains(&h, "meow", 3));
+    assert(!h_contains(&h, "does_it_have_trait_5000", 5000));
+    
     h_free(&h);
+    assert(h.nslots == 0 && h.size == 0);
+    
+    /* Seeded hash: deterministic, seed- and length-sensitive */
+    const char *q = "does_it_live_in_water_and_eat_fish_every_single_day";
+    size_t qlen = strlen(q);
+    assert(h_hash64(q, qlen, 1) == h_hash64(q, qlen, 1));
+    assert(h_hash64(q, qlen, 1) != h_hash64(q, qlen, 2));
+    uint64_t seen[64];
+    for (size_t len = 0; len < 53; len++) {
+        seen[len] = h_hash64(q, len, HASH_SEED);
+        for (size_t j = 0; j < len; j++) {
+            assert(seen[j] != seen[len]);
+        }
+    }
+    assert(h_hash(q) == (unsigned)h_hash64(q, qlen, HASH_SEED));
     printf("  ✓ Hash table tests passed\n");
 }
 
 /* Test Persistence */
+/* Same shape and texts, node for node */
+static int same_flat(const FlatTree *a, const FlatTree *b) {
+    if (a->count != b->count) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < a->count; i++) {
+        if (a->yes[i] != b->yes[i] || a->no[i] != b->no[i] ||
+            flat_is_question(a, i) != flat_is_question(b, i) ||
+            strcmp(flat_text(a, i), flat_text(b, i)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int tree_is(const FlatTree *expect) {
+    FlatTree ft;
+    assert(flat_from_tree(&ft, g_root));
+    int same = same_flat(&ft, expect);
+    flat_free(&ft);
+    return same;
+}
+
+static long file_size(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+/* From here on, starting a thread kills the process. clone3 is refused,
+ * so pthread_create falls back to clone, whose flags can be checked.
+ * Without seccomp nothing is enforced.
+ */
+static void forbid_threads(void) {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+#ifdef __NR_clone3
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_clone3, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+#endif
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_clone, 0, 3),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[0])),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, CLONE_THREAD, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog prog = {sizeof(filter) / sizeof(filter[0]), filter};
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ||
+        prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) != 0) {
+        perror("[forbid_threads] seccomp is not available");
+    }
+}
+
+/* run_jobs job: note the thread it ran on */
+static void *job_self(void *arg) {
+    *(pthread_t *)arg = pthread_self();
+    return NULL;
+}
+
+static char *read_bytes(const char *path, long *len) {
+    *len = file_size(path);
+    FILE *f = fopen(path, "rb");
+    char *bytes = malloc(*len);
+    assert(f != NULL && bytes != NULL && fread(bytes, 1, *len, f) == (size_t)*len);
+    fclose(f);
+    return bytes;
+}
+
+static void write_bytes(const char *path, const char *bytes, long len) {
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL && fwrite(bytes, 1, len, f) == (size_t)len);
+    fclose(f);
+}
+
+/* Write a VERSION 1 file of n records with the given flags and child ids */
+static void write_v1(const char *path, uint32_t n, const uint8_t *isq, const int32_t *yes,
+                     const int32_t *no) {
+    uint32_t header[3] = {0x41544C35, 1, n};
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL);
+    fwrite(header, 4, 3, f);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t len = 4;
+        fwrite(&isq[i], 1, 1, f);
+        fwrite(&len, 4, 1, f);
+        fwrite(isq[i] ? "Why?" : "Frog", 1, len, f);
+        fwrite(&yes[i], 4, 1, f);
+        fwrite(&no[i], 4, 1, f);
+    }
+    fclose(f);
+}
+
+/* Offset (and length) of the section of a given type in a VERSION 2 or 3
+ * image, 0 if it has none */
+static uint64_t section_at(const char *bytes, uint32_t type, uint64_t *len) {
+    uint32_t nsections;
+    memcpy(&nsections, bytes + 12, 4);
+    nsections &= 0xFFFF;  // the high half marks files with checksums
+    for (uint32_t i = 0; i < nsections; i++) {
+        uint32_t t;
+        memcpy(&t, bytes + 16 + 24 * i, 4);
+        if (t == type) {
+            uint64_t off;
+            memcpy(&off, bytes + 16 + 24 * i + 8, 8);
+            if (len != NULL) memcpy(len, bytes + 16 + 24 * i + 16, 8);
+            return off;
+        }
+    }
+    return 0;
+}
+
+/* Recompute the checksums of an edited VERSION 2 or 3 image, so a test
+ * reaches the checks behind them */
+static void reseal(char *bytes) {
+    uint64_t crcAt = section_at(bytes, 13, NULL);
+    uint32_t chunk;
+    memcpy(&chunk, bytes + crcAt, 4);
+    for (uint64_t at = 0, k = 0; at < crcAt; at += chunk, k++) {
+        uint64_t n = crcAt - at < chunk ? crcAt - at : chunk;
+        uint32_t crc = crc32c(0, bytes + at, n);
+        memcpy(bytes + crcAt + 8 + 4 * k, &crc, 4);
+    }
+}
+
 void test_persistence() {
     printf("Testing Persistence...\n");
     
@@ -129,6 +480,7 @@ void test_persistence() {
     root->no = create_question_node("Another question?");
     root->no->yes = create_animal_node("Dog");
     root->no->no = create_animal_node("Fish");
+    root->no->yes->visits = 7;
     
     /* Save original root */
     Node *saved_root = g_root;
@@ -146,6 +498,7 @@ void test_persistence() {
     assert(g_root->isQuestion);
     assert(strcmp(g_root->text, "Test question?") == 0);
     assert(strcmp(g_root->yes->text, "Cat") == 0);
+    assert(g_root->no->yes->visits == 7 && g_root->no->no->visits == 0);
     
     /* Round-trip test */
     assert(save_tree("test2.dat"));
@@ -163,8 +516,451 @@ void test_persistence() {
     fclose(f1);
     fclose(f2);
     
+    /* Saves go through test.dat.tmp and keep the versions they replace as
+     * generations; a failed save leaves the file as it was */
+    save_set_generations(2);
+    for (int i = 0; i < 3; i++) {
+        g_root->yes->visits = (unsigned)i;
+        assert(save_tree("test.dat"));
+    }
+    assert(access("test.dat.tmp", F_OK) != 0 && access("test.dat.3", F_OK) != 0);
+    assert(mkdir("test.dat.tmp", 0700) == 0);
+    g_root->yes->visits = 9;
+    assert(!save_tree("test.dat"));
+    rmdir("test.dat.tmp");
+    assert(load_tree("test.dat") && g_root->yes->visits == 2);
+    assert(load_tree("test.dat.2") && g_root->yes->visits == 0);
+    
+    /* A save whose rename fails leaves every generation where it was */
+    assert(rename("test.dat", "test.dat.keep") == 0 && mkdir("test.dat", 0700) == 0);
+    assert(!save_tree("test.dat"));
+    assert(rmdir("test.dat") == 0 && rename("test.dat.keep", "test.dat") == 0);
+    assert(access("test.dat.prev", F_OK) != 0);
+    assert(load_tree("test.dat.1") && g_root->yes->visits == 1);
+    assert(load_tree("test.dat.2") && g_root->yes->visits == 0);
+    
+    /* Rolling back puts an earlier save in its place at once and keeps
+     * the one it replaces as generation 1, so it can be rolled back too */
+    assert(rollback_tree("test.dat", 2));
+    assert(load_tree("test.dat") && g_root->yes->visits == 0);
+    assert(load_tree("test.dat.1") && g_root->yes->visits == 2);
+    assert(load_tree("test.dat.2") && g_root->yes->visits == 1);
+    assert(rollback_tree("test.dat", 1));
+    assert(load_tree("test.dat") && g_root->yes->visits == 2);
+    assert(load_tree("test.dat.1") && g_root->yes->visits == 0);
+    assert(!rollback_tree("test.dat", 3));
+    assert(load_tree("test.dat.2") && g_root->yes->visits == 1);
+    
+    /* The next save drops the oldest generation, not a newer one */
+    g_root->yes->visits = 5;
+    assert(save_tree("test.dat"));
+    assert(load_tree("test.dat.1") && g_root->yes->visits == 2);
+    assert(load_tree("test.dat.2") && g_root->yes->visits == 0);
+    assert(access("test.dat.3", F_OK) != 0);
+    remove("test.dat.1");
+    remove("test.dat.2");
+    save_set_generations(0);
+    
+    /* Larger, lopsided tree: the reloaded tree saves byte-for-byte the same */
+    free_tree(g_root);
+    g_root = create_question_node("Q0");
+    Node *tail = g_root;
+    for (int i = 1; i < 300; i++) {
+        char text[32];
+        sprintf(text, "A%d", i);
+        tail->yes = create_animal_node(text);
+        sprintf(text, "Q%d", i);
+        tail->no = (i == 299) ? create_animal_node(text) : create_question_node(text);
+        tail = tail->no;
+    }
+    assert(save_tree("test.dat"));
+    free_tree(g_root);
+    g_root = NULL;
+    assert(load_tree("test.dat"));
+    assert(count_nodes(g_root) == 599);
+    assert(check_integrity());
+    assert(g_stats.nodes == 599 && g_stats.leaves == 300 && g_stats.height == 299);
+    assert(save_tree("test2.dat"));
+    
+    f1 = fopen("test.dat", "rb");
+    f2 = fopen("test2.dat", "rb");
+    int c1, c2;
+    do {
+        c1 = fgetc(f1);
+        c2 = fgetc(f2);
+        assert(c1 == c2);
+    } while (c1 != EOF);
+    fclose(f1);
+    fclose(f2);
+    
+    /* The loaded tree's texts live in the map of test.dat. Saving a
+     * changed tree over that file, larger or shorter, must not touch them */
+    Node *mapped = g_root;
+    g_root = create_question_node("Does it shift the layout?");
+    g_root->yes = create_animal_node("Newt");
+    g_root->no = mapped;
+    assert(save_tree("test.dat"));
+    assert(strcmp(mapped->text, "Q0") == 0 && strcmp(mapped->no->no->yes->text, "A3") == 0);
+    assert(save_tree_v1("test.dat"));
+    assert(strcmp(mapped->text, "Q0") == 0 && strcmp(mapped->no->no->yes->text, "A3") == 0);
+    Node *wrapper = g_root;
+    g_root = mapped;
+    wrapper->no = NULL;
+    free_tree(wrapper);
+    assert(save_tree("test.dat") && load_tree("test.dat"));
+    assert(count_nodes(g_root) == 599 && strcmp(g_root->no->no->yes->text, "A3") == 0);
+    
+    /* Saves leave the attribute index out unless asked for it */
+    long plainLen;
+    char *plain = read_bytes("test.dat", &plainLen);
+    assert(section_at(plain, 6, NULL) == 0 && g_index.baseMem != NULL);
+    free(plain);
+    save_set_index(1);
+    assert(save_tree("test.dat") && load_tree("test.dat"));
+    save_set_index(0);
+    assert(file_size("test.dat") > plainLen);
+    
+    /* The attribute index comes back from the file, used in place */
+    Bitmap res;
+    bm_init(&res);
+    AttrTerm q5[] = {{"Q5", 1, 0}};
+    AttrTerm q0NotQ3[] = {{"Q0", 0, 0}, {"Q3", 1, 1}};
+    assert(g_index.baseMem == NULL && g_index.nbase == 299 && g_index.nanimals == 300);
+    assert(ai_query(&g_index, q5, 1, &res));
+    assert(bm_cardinality(&res) == 1);
+    uint32_t hit;
+    bm_to_array(&res, &hit, 1);
+    assert(strcmp(ai_animal(&g_index, hit)->text, "A6") == 0);
+    assert(ai_query(&g_index, q0NotQ3, 2, &res));
+    assert(bm_cardinality(&res) == 298);
+    
+    /* A mapped slot table without an empty slot would make probes run
+     * forever: it is not attached, and the index is rebuilt instead */
+    long imgLen;
+    char *img = read_bytes("test.dat", &imgLen);
+    uint64_t ix = section_at(img, 6, NULL);
+    uint32_t keySlots, one = 1;
+    memcpy(&keySlots, img + ix + 12, 4);
+    for (uint32_t i = 0; i < keySlots; i++) {
+        memcpy(img + ix + 24 + 16 * i + 8, &one, 4);
+    }
+    reseal(img);
+    write_bytes("test2.dat", img, imgLen);
+    free(img);
+    assert(load_tree("test2.dat") && g_index.baseMem != NULL);
+    assert(ai_query(&g_index, q0NotQ3, 2, &res));
+    assert(bm_cardinality(&res) == 298);
+    assert(ai_query(&g_index, q5, 1, &res) && bm_cardinality(&res) == 1);
+    
+    /* VERSION 1 files still load through the record reader */
+    assert(save_tree_v1("test2.dat"));
+    Node *before = g_root;
+    assert(load_tree("test2.dat"));
+    assert(g_root != before);
+    assert(count_nodes(g_root) == 599);
+    assert(check_integrity());
+    assert(strcmp(g_root->no->no->yes->text, "A3") == 0);
+    
+    /* ...and have their index rebuilt in bulk, with the same answers */
+    assert(g_index.baseMem != NULL && g_index.nbase == 299);
+    assert(ai_query(&g_index, q0NotQ3, 2, &res));
+    assert(bm_cardinality(&res) == 298);
+    bm_free(&res);
+    
+    /* Records that leave a question without both answers, loop back or
+     * share a child do not form a tree and are refused */
+    uint8_t isq[3] = {1, 0, 0};
+    int32_t yesIds[3] = {1, -1, -1}, noIds[3] = {-1, -1, -1};
+    before = g_root;
+    write_v1("test2.dat", 2, isq, yesIds, noIds);
+    assert(!load_tree("test2.dat"));
+    noIds[0] = 1;
+    write_v1("test2.dat", 2, isq, yesIds, noIds);
+    assert(!load_tree("test2.dat") && !verify_tree_file("test2.dat"));
+    isq[1] = 1;
+    noIds[0] = 2;
+    yesIds[1] = 0;
+    noIds[1] = 2;
+    write_v1("test2.dat", 3, isq, yesIds, noIds);
+    assert(!load_tree("test2.dat"));
+    assert(g_root == before);
+    
+    /* The same goes for VERSION 2 child arrays */
+    img = read_bytes("test.dat", &imgLen);
+    uint32_t self = 2;
+    memcpy(img + section_at(img, 1, NULL) + 4 * 2, &self, 4);
+    reseal(img);
+    write_bytes("test2.dat", img, imgLen);
+    free(img);
+    assert(!load_tree("test2.dat"));
+    assert(g_root == before);
+    
+    /* Trees built in code may still have such a question; counting
+     * them skips the missing child */
+    Node *half = create_question_node("Why?");
+    half->yes = create_animal_node("Frog");
+    TreeStats hs = {0};
+    assert(stats_recount(&hs, half) && hs.nodes == 2 && hs.questions == 1 && hs.leaves == 1);
+    stats_free(&hs);
+    free_tree(half);
+    
+    /* A truncated mapped file is rejected and the current tree kept */
+    f1 = fopen("test.dat", "rb");
+    fseek(f1, 0, SEEK_END);
+    long full = ftell(f1);
+    fseek(f1, 0, SEEK_SET);
+    char *bytes = malloc(full);
+    assert(fread(bytes, 1, full, f1) == (size_t)full);
+    fclose(f1);
+    f2 = fopen("test2.dat", "wb");
+    fwrite(bytes, 1, full - 16, f2);
+    fclose(f2);
+    before = g_root;
+    assert(!load_tree("test2.dat"));
+    assert(g_root == before);
+    
+    /* So is one with a single flipped bit, which the checksums catch;
+     * --verify finds it without loading anything */
+    assert(verify_tree_file("test.dat"));
+    bytes[full - 400] ^= 0x10;
+    f2 = fopen("test2.dat", "wb");
+    fwrite(bytes, 1, full, f2);
+    fclose(f2);
+    free(bytes);
+    assert(!verify_tree_file("test2.dat"));
+    assert(!load_tree("test2.dat"));
+    assert(g_root == before);
+    
+    /* Renaming the checksum section does not turn the checks off: the
+     * header says the file has one. Neither does a flipped bit in that
+     * mark; only a file without it is from before checksums */
+    FlatTree current;
+    assert(flat_from_tree(&current, g_root));
+    for (int v = 2; v <= 3; v++) {
+        assert(v == 2 ? save_tree("test2.dat") : save_tree_v3("test2.dat"));
+        long n;
+        char *img = read_bytes("test2.dat", &n);
+        uint32_t nsec, type = 0, renamed = 15;
+        memcpy(&nsec, img + 12, 4);
+        assert((nsec >> 16) != 0);
+        uint32_t k = 0;
+        for (; k < (nsec & 0xFFFF); k++) {
+            memcpy(&type, img + 16 + 24 * k, 4);
+            if (type == 13) break;
+        }
+        assert(type == 13);
+        memcpy(img + 16 + 24 * k, &renamed, 4);
+        write_bytes("test2.dat", img, n);
+        assert(!verify_tree_file("test2.dat"));
+        assert(!load_tree("test2.dat") && g_root == before);
+        img[15] ^= 0x02;
+        write_bytes("test2.dat", img, n);
+        assert(!verify_tree_file("test2.dat"));
+        assert(!load_tree("test2.dat") && g_root == before);
+        nsec &= 0xFFFF;
+        memcpy(img + 12, &nsec, 4);
+        write_bytes("test2.dat", img, n);
+        free(img);
+        assert(verify_tree_file("test2.dat"));
+        assert(load_tree("test2.dat") && tree_is(&current));
+        before = g_root;
+    }
+    flat_free(&current);
+    assert(save_tree_v1("test2.dat") && verify_tree_file("test2.dat"));
+    
+    /* Recorded answers are saved with VERSION 2 and 3 files; VERSION 1
+     * has no place for them */
+    for (int v = 1; v <= 3; v++) {
+        assert(g_answers.count == 0 && answers_add(&g_answers, "A3", "Is it striped?", 1));
+        assert(v == 1 ? save_tree_v1("test2.dat") : v == 2 ? save_tree("test2.dat")
+                                                           : save_tree_v3("test2.dat"));
+        assert(load_tree("test2.dat"));
+        assert(g_answers.count == (v == 1 ? 0 : 1));
+        if (v > 1) {
+            assert(strcmp(g_answers.answers[0].animal, "A3") == 0 && g_answers.answers[0].yes);
+            assert(strcmp(g_answers.answers[0].question, "Is it striped?") == 0);
+        }
+        answers_clear(&g_answers);
+    }
+    uint64_t packedLen;
+    assert(answers_add(&g_answers, "A3", "Is it striped?", 0));
+    char *packed = answers_pack(&g_answers, &packedLen);
+    assert(packed != NULL && !answers_unpack(&g_answers, packed, packedLen - 1));
+    assert(g_answers.count == 1 && answers_unpack(&g_answers, packed, packedLen));
+    assert(g_answers.count == 2 && strcmp(g_answers.answers[1].animal, "A3") == 0);
+    free(packed);
+    answers_clear(&g_answers);
+    
+    /* A background save writes the tree as it was when it started */
+    FlatTree expect;
+    assert(flat_from_tree(&expect, g_root));
+    assert(save_tree_start("test2.dat"));
+    assert(!save_tree_start("test2.dat"));
+    Node *yes = g_root->yes;
+    g_root->yes = g_root->no;
+    g_root->no = yes;
+    assert(save_tree_wait() == SAVE_DONE);
+    assert(save_tree_poll(NULL) == SAVE_IDLE);
+    assert(load_tree("test2.dat"));
+    assert(tree_is(&expect));
+    
+    /* save_set_format picks what save_tree writes, in the background too;
+     * VERSION 1 is only written by save_tree_v1 */
+    assert(!save_set_format(1) && !save_set_format(4) && save_format() == 2);
+    assert(save_set_format(3));
+    assert(save_tree_start("test2.dat") && save_tree_wait() == SAVE_DONE);
+    long savedLen;
+    char *saved = read_bytes("test2.dat", &savedLen);
+    uint32_t savedVersion;
+    memcpy(&savedVersion, saved + 4, 4);
+    assert(savedVersion == 3);
+    free(saved);
+    assert(save_set_format(2));
+    assert(load_tree("test2.dat"));
+    assert(tree_is(&expect));
+    flat_free(&expect);
+    
+    /* The saving child starts no threads: its jobs all run on it */
+    pthread_t ran[4];
+    job_set_serial(1);
+    assert(job_threads(1000) == 1);
+    run_jobs(job_self, ran, sizeof(pthread_t), 4);
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_equal(ran[i], pthread_self()));
+    }
+    job_set_serial(0);
+    
+    /* ... not even to hash and link a tree that is split into jobs: the
+     * child saving it is killed if it starts one */
+    NodeArena wideArena;
+    arena_init(&wideArena);
+    int wide = 1 << 17;
+    Node **row = malloc(wide * sizeof(Node *));
+    char label[48];
+    for (int i = 0; i < wide; i++) {
+        snprintf(label, sizeof(label), "Animal %d", i);
+        row[i] = arena_animal_node(&wideArena, label);
+    }
+    for (int n = wide; n > 1; n /= 2) {
+        for (int i = 0; i < n / 2; i++) {
+            snprintf(label, sizeof(label), "Is it in group %d of %d?", i, n);
+            Node *q = arena_question_node(&wideArena, label);
+            q->yes = row[2 * i];
+            q->no = row[2 * i + 1];
+            row[i] = q;
+        }
+    }
+    Node *small = g_root;
+    g_root = row[0];
+    free(row);
+    save_set_index(1);
+    pid_t child = fork();
+    if (child == 0) {
+        job_set_serial(1);
+        forbid_threads();
+        _exit(save_tree("test3.dat") ? 0 : 1);
+    }
+    int status;
+    assert(child > 0 && waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    save_set_index(0);
+    g_root = small;
+    arena_release(&wideArena);
+    remove("test3.dat");
+    
+    /* VERSION 3 implies children by BFS order and front-codes the texts,
+     * repeated ones by reference */
+    Node **level = malloc(1023 * sizeof(Node *));
+    char text[64];
+    for (int i = 1022; i >= 0; i--) {
+        if (i < 511) {
+            snprintf(text, sizeof(text), "Does it have trait number %d?", i % 37);
+            level[i] = create_question_node(text);
+            level[i]->yes = level[2 * i + 1];
+            level[i]->no = level[2 * i + 2];
+        } else {
+            snprintf(text, sizeof(text), "Animal number %d", i);
+            level[i] = create_animal_node(text);
+            level[i]->visits = (unsigned)i * 3;
+        }
+    }
+    free_tree(g_root);
+    arena_release(&g_arena);
+    g_root = level[0];
+    free(level);
+    assert(flat_from_tree(&expect, g_root));
+    assert(save_tree_v1("test.dat"));
+    long v1 = file_size("test.dat");
+    assert(save_tree_v3("test2.dat"));
+    long v3 = file_size("test2.dat");
+    assert(v3 * 5 <= v1);
+    assert(load_tree("test2.dat"));
+    assert(tree_is(&expect) && check_integrity());
+    assert(g_root->no->no->no->no->no->no->no->no->no->visits == 1022 * 3);
+    assert(g_stats.nodes == 1023);
+    flat_free(&expect);
+    
+    /* A truncated VERSION 3 file is rejected and the current tree kept */
+    f1 = fopen("test2.dat", "rb");
+    bytes = malloc(v3);
+    assert(fread(bytes, 1, v3, f1) == (size_t)v3);
+    fclose(f1);
+    f2 = fopen("test2.dat", "wb");
+    fwrite(bytes, 1, v3 - 8, f2);
+    fclose(f2);
+    free(bytes);
+    before = g_root;
+    assert(!load_tree("test2.dat"));
+    assert(g_root == before);
+    
+    /* Past 65536 nodes VERSION 3 files are cut into chunks that load on
+     * separate threads; texts repeat across chunk boundaries */
+    int questions = 70000, total = 2 * questions + 1;
+    level = malloc(total * sizeof(Node *));
+    for (int i = total - 1; i >= 0; i--) {
+        if (i < questions) {
+            snprintf(text, sizeof(text), "Does it have trait number %d?", i % 101);
+            level[i] = create_question_node(text);
+            level[i]->yes = level[2 * i + 1];
+            level[i]->no = level[2 * i + 2];
+        } else {
+            snprintf(text, sizeof(text), "Animal number %d", i);
+            level[i] = create_animal_node(text);
+            level[i]->visits = (unsigned)i;
+        }
+    }
+    free_tree(g_root);
+    arena_release(&g_arena);
+    g_root = level[0];
+    free(level);
+    assert(flat_from_tree(&expect, g_root));
+    assert(save_tree_v3("test2.dat"));
+    assert(load_tree("test2.dat"));
+    assert(tree_is(&expect) && check_integrity());
+    assert(g_stats.nodes == total);
+    flat_free(&expect);
+    
+    /* A chunk table that does not match the streams is rejected */
+    v3 = file_size("test2.dat");
+    f1 = fopen("test2.dat", "rb");
+    bytes = malloc(v3);
+    assert(fread(bytes, 1, v3, f1) == (size_t)v3);
+    fclose(f1);
+    uint64_t table = section_at(bytes, 12, NULL);
+    assert(table != 0);
+    bytes[table + 8 + 24] += 1;  // second chunk's question texts start a byte late
+    f2 = fopen("test2.dat", "wb");
+    fwrite(bytes, 1, v3, f2);
+    fclose(f2);
+    free(bytes);
+    before = g_root;
+    assert(!load_tree("test2.dat"));
+    assert(g_root == before);
+    
     /* Restore original root */
     free_tree(g_root);
+    arena_release(&g_arena);
+    ai_free(&g_index);
     g_root = saved_root;
     
     remove("test.dat");
@@ -173,6 +969,95 @@ void test_persistence() {
     printf("  ✓ Persistence tests passed\n");
 }
 
+/* Test Flat Tree */
+void test_flat() {
+    printf("Testing Flat Tree...\n");
+    
+    Node *root = create_question_node("Test question?");
+    root->yes = create_animal_node("Cat");
+    root->no = create_question_node("Another question?");
+    root->no->yes = create_animal_node("Dog");
+    root->no->no = create_animal_node("Fish");
+    
+    FlatTree ft;
+    assert(flat_from_tree(&ft, root));
+    assert(ft.count == 5);
+    assert(flat_is_question(&ft, 0) && !flat_is_question(&ft, 1));
+    assert(strcmp(flat_text(&ft, 0), "Test question?") == 0);
+    assert(flat_count_nodes(&ft, 0) == 5);
+    assert(flat_count_nodes(&ft, ft.no[0]) == 3);
+    assert(flat_check_integrity(&ft));
+    
+    /* Traversal: no, yes -> Dog; answers running out stop at a question */
+    uint8_t answers[2] = {0, 1};
+    assert(strcmp(flat_text(&ft, flat_traverse(&ft, answers, 2)), "Dog") == 0);
+    assert(flat_traverse(&ft, answers, 1) == ft.no[0]);
+    
+    /* Flat save produces a file load_tree accepts */
+    Node *saved = g_root;
+    g_root = NULL;
+    assert(flat_save_tree(&ft, "test.dat"));
+    assert(load_tree("test.dat"));
+    assert(count_nodes(g_root) == 5);
+    assert(strcmp(g_root->no->no->text, "Fish") == 0);
+    arena_release(&g_arena);
+    g_root = saved;
+    remove("test.dat");
+    
+    /* Question with a missing child */
+    ft.no[0] = FLAT_NIL;
+    assert(!flat_check_integrity(&ft));
+    flat_free(&ft);
+    free_tree(root);
+    
+    /* Large trees are flattened a subtree per thread; the numbering must
+     * still be plain BFS order, here on an uneven random tree */
+    int splits = 60000;
+    Node ***slots = malloc((splits + 1) * sizeof(Node **));
+    int nslots = 1;
+    root = create_animal_node("Animal 0");
+    slots[0] = &root;
+    srand(21);
+    char text[64];
+    for (int k = 1; k <= splits; k++) {
+        int r = rand() % nslots;
+        Node **slot = slots[r];
+        snprintf(text, sizeof(text), "Question %d?", k % 500);
+        Node *q = create_question_node(text);
+        q->yes = *slot;
+        snprintf(text, sizeof(text), "Animal %d", k);
+        q->no = create_animal_node(text);
+        q->no->visits = (unsigned)k;
+        *slot = q;
+        slots[r] = &q->yes;
+        slots[nslots++] = &q->no;
+    }
+    free(slots);
+    assert(flat_from_tree(&ft, root));
+    assert(ft.count == (uint32_t)(2 * splits + 1) && flat_check_integrity(&ft));
+    Queue q;
+    q_init(&q);
+    q_enqueue(&q, root, 0);
+    uint32_t next = 1;
+    Node *node;
+    int id;
+    while (q_dequeue(&q, &node, &id)) {
+        assert(strcmp(flat_text(&ft, (uint32_t)id), node->text) == 0);
+        assert(flat_is_question(&ft, (uint32_t)id) == node->isQuestion);
+        assert(ft.visits[id] == node->visits);
+        if (node->isQuestion) {
+            assert(ft.yes[id] == next && ft.no[id] == next + 1);
+            q_enqueue(&q, node->yes, (int)next++);
+            q_enqueue(&q, node->no, (int)next++);
+        }
+    }
+    q_free(&q);
+    assert(next == ft.count);
+    flat_free(&ft);
+    free_tree(root);
+    printf("  ✓ Flat tree tests passed\n");
+}
+
 /* Test Integrity Checker */
 void test_integrity() {
     printf("Testing Integrity Checker...\n");
@@ -218,6 +1103,37 @@ void test_canonicalize() {
     assert(strcmp(c3, "abc123") == 0);
     free(c3);
     
+    /* Long inputs take the 16-byte SIMD path; punctuation and bytes >= 0x80
+     * in the middle must hand over to the table without losing anything */
+    char out[128];
+    const char *longQ = "Does It Live In The Ocean And Have Many LEGS? (Octopus 8) \xc3\xa9t\xc3\xa9";
+    size_t n = canonicalize_into(longQ, strlen(longQ), out);
+    assert(strcmp(out, "does_it_live_in_the_ocean_and_have_many_legs_octopus_8_t") == 0);
+    assert(n == strlen(out));
+    
+    /* Every byte value agrees with the per-character rules */
+    char all[256], expect[256];
+    size_t k = 0;
+    for (int c = 1; c < 256; c++) {
+        all[c - 1] = (char)c;
+        if (c >= 'A' && c <= 'Z') expect[k++] = (char)(c + 32);
+        else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) expect[k++] = (char)c;
+        else if (c == ' ') expect[k++] = '_';
+    }
+    all[255] = '\0';
+    expect[k] = '\0';
+    assert(canonicalize_into(all, 255, out) == k);
+    assert(strcmp(out, expect) == 0);
+    
+    /* The scratch buffer is reused and grows for long input */
+    const char *t1 = canonicalize_tmp("Is it BIG?");
+    assert(strcmp(t1, "is_it_big") == 0);
+    char big[2000];
+    memset(big, 'X', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    const char *t2 = canonicalize_tmp(big);
+    assert(strlen(t2) == sizeof(big) - 1 && t2[0] == 'x');
+    
     printf("  ✓ Canonicalization tests passed\n");
 }
 
@@ -250,9 +1166,938 @@ void test_nodes() {
     
     free_tree(q);
     
+    /* Degenerate chains far deeper than the call stack would allow */
+    for (int side = 0; side < 2; side++) {
+        Node *root = create_animal_node("Bottom");
+        for (int i = 0; i < 300000; i++) {
+            Node *deeper = create_question_node("Is it deeper?");
+            Node *leaf = create_animal_node("Leaf");
+            deeper->yes = side ? root : leaf;
+            deeper->no = side ? leaf : root;
+            root = deeper;
+        }
+        assert(count_nodes(root) == 600001);
+        free_tree(root);
+    }
+    
+    /* A bushy subtree on both sides of a deep spine */
+    Node *mixed = create_question_node("Top?");
+    mixed->yes = create_question_node("Left?");
+    mixed->yes->yes = create_animal_node("A");
+    mixed->yes->no = create_animal_node("B");
+    mixed->no = create_question_node("Right?");
+    mixed->no->yes = create_animal_node("C");
+    mixed->no->no = create_question_node("Further?");
+    mixed->no->no->yes = create_animal_node("D");
+    mixed->no->no->no = create_animal_node("E");
+    assert(count_nodes(mixed) == 9);
+    free_tree(mixed);
+    
     printf("  ✓ Node tests passed\n");
 }
 
+/* Test Node Arena */
+void test_arena() {
+    printf("Testing Node Arena...\n");
+    
+    NodeArena a;
+    arena_init(&a);
+    
+    Node *q = arena_question_node(&a, "Does it swim?");
+    q->yes = arena_animal_node(&a, "Duck");
+    q->no = arena_animal_node(&a, "Cow");
+    assert(q->isQuestion == 1 && q->yes->isQuestion == 0);
+    assert(q->flags & NODE_ARENA);
+    assert(strcmp(q->text, "Does it swim?") == 0);
+    assert(strcmp(q->no->text, "Cow") == 0);
+    assert(count_nodes(q) == 3);
+    
+    /* Arena trees ignore free_tree; the arena owns them */
+    free_tree(q);
+    assert(strcmp(q->yes->text, "Duck") == 0);
+    
+    /* Fill several slabs and an oversized string */
+    for (int i = 0; i < 3 * ARENA_SLAB_NODES; i++) {
+        assert(arena_animal_node(&a, "Ant") != NULL);
+    }
+    char big[ARENA_TEXT_BLOCK];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    Node *b = arena_question_node(&a, big);
+    assert(strlen(b->text) == sizeof(big) - 1);
+    assert(a.nodes == 3 + 3 * ARENA_SLAB_NODES + 1);
+    
+    arena_release(&a);
+    assert(a.slabs == NULL && a.text == NULL && a.nodes == 0);
+    
+    printf("  ✓ Arena tests passed\n");
+}
+
+/* Test Tree Statistics */
+void test_stats() {
+    printf("Testing Tree Statistics...\n");
+    
+    TreeStats st = {0, 0, 0, 0, NULL, 0};
+    Node *root = create_question_node("Does it live in water?");
+    root->yes = create_animal_node("Fish");
+    root->no = create_animal_node("Dog");
+    assert(stats_recount(&st, root));
+    assert(st.nodes == 3 && st.leaves == 2 && st.questions == 1 && st.height == 1);
+    
+    /* Split Dog (depth 1), then the new leaf below it (depth 2) */
+    stats_split(&st, 1);
+    stats_split(&st, 2);
+    assert(st.nodes == 7 && st.leaves == 4 && st.questions == 3 && st.height == 3);
+    assert(st.leavesAt[1] == 1 && st.leavesAt[2] == 1 && st.leavesAt[3] == 2);
+    stats_unsplit(&st, 2);
+    assert(st.nodes == 5 && st.height == 2);
+    stats_unsplit(&st, 1);
+    assert(st.nodes == 3 && st.leaves == 2 && st.height == 1);
+    free_tree(root);
+    
+    /* A deep chain is recounted without recursion */
+    NodeArena arena;
+    arena_init(&arena);
+    root = arena_question_node(&arena, "Q");
+    Node *tail = root;
+    for (int i = 1; i < 200000; i++) {
+        tail->yes = arena_animal_node(&arena, "A");
+        tail->no = arena_question_node(&arena, "Q");
+        tail = tail->no;
+    }
+    tail->yes = arena_animal_node(&arena, "A");
+    tail->no = arena_animal_node(&arena, "B");
+    assert(stats_recount(&st, root));
+    assert(st.nodes == 400001 && st.questions == 200000 && st.height == 200000);
+    arena_release(&arena);
+    
+    assert(stats_recount(&st, NULL));
+    assert(st.nodes == 0 && st.height == 0);
+    stats_free(&st);
+    printf("  ✓ Tree statistics tests passed\n");
+}
+
+/* Play down the "no" side and teach a new animal at the bottom */
+static void teach_at_bottom(const char *animal, const char *question) {
+    Session s;
+    session_start(&s);
+    while (s.state == SESSION_ASK) {
+        session_answer(&s, 0);
+    }
+    session_answer(&s, 0);
+    assert(session_teach(&s, animal, question, 1, NULL));
+    session_end(&s);
+}
+
+/* Answer animal gave to question on its path in the tree at node (the
+ * deepest if asked twice): -1 if it was never asked, -2 if the animal is
+ * not below node */
+static int path_answer(Node *node, const char *animal, const char *question, int known) {
+    if (!node->isQuestion) {
+        return strcmp(node->text, animal) == 0 ? known : -2;
+    }
+    int asked = strcmp(node->text, question) == 0;
+    int ans = path_answer(node->yes, animal, question, asked ? 1 : known);
+    return ans != -2 ? ans : path_answer(node->no, animal, question, asked ? 0 : known);
+}
+
+/* Play a game on root answering as animal did in old, or as recorded for
+ * it in g_answers; the leaf reached, or NULL if a question came up it
+ * never answered */
+static Node *play_as(Node *root, Node *old, const char *animal) {
+    Node *node = root;
+    while (node->isQuestion) {
+        int ans = path_answer(old, animal, node->text, -1);
+        char *asked = canonicalize(node->text);
+        for (int i = g_answers.count - 1; ans < 0 && i >= 0; i--) {
+            char *key = canonicalize(g_answers.answers[i].question);
+            if (strcmp(g_answers.answers[i].animal, animal) == 0 && strcmp(key, asked) == 0) {
+                ans = g_answers.answers[i].yes;
+            }
+            free(key);
+        }
+        free(asked);
+        if (ans < 0) {
+            return NULL;
+        }
+        node = ans ? node->yes : node->no;
+    }
+    return node;
+}
+
+/* Test Tree Optimizer */
+void test_optimize() {
+    printf("Testing Tree Optimizer...\n");
+    
+    Node *saved_root = g_root;
+    es_init(&g_undo);
+    es_init(&g_redo);
+    
+    /* A chain whose most popular animal sits at the bottom */
+    Node *q1 = arena_question_node(&g_arena, "Does it bark?");
+    q1->yes = arena_animal_node(&g_arena, "Dog");
+    q1->no = arena_question_node(&g_arena, "Does it meow?");
+    q1->no->yes = arena_animal_node(&g_arena, "Cat");
+    q1->no->no = arena_question_node(&g_arena, "Does it moo?");
+    q1->no->no->yes = arena_animal_node(&g_arena, "Cow");
+    q1->no->no->no = arena_animal_node(&g_arena, "Fish");
+    q1->no->no->no->visits = 100;
+    g_root = q1;
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    assert(expected_questions(g_root) > 2.9);
+    
+    /* Only the question each was split off with tells Dog, Cat and Cow
+     * from Fish, so a rebuild that keeps every animal reachable still
+     * asks Fish all three: the tree is kept */
+    double before, after;
+    assert(!optimize_tree(&before, &after));
+    assert(before == after && g_root == q1 && g_undo.size == 0);
+    
+    /* Every animal still plays through to its own leaf after a rebuild */
+    const char *names[] = {"Dog", "Cat", "Cow", "Fish"};
+    Node *rebuilt = opt_rebuild(q1, &g_arena);
+    assert(rebuilt != NULL);
+    for (int i = 0; i < 4; i++) {
+        Node *leaf = play_as(rebuilt, q1, names[i]);
+        assert(leaf != NULL && strcmp(leaf->text, names[i]) == 0);
+    }
+    assert(play_as(rebuilt, q1, "Fish")->visits == 100);
+    
+    /* Installed, it is one undoable edit; nothing was lost or duplicated */
+    assert(install_tree(rebuilt));
+    assert(g_undo.size == 1 && g_undo.edits[0].type == EDIT_REBUILD);
+    assert(g_undo.edits[0].oldRoot == q1 && g_undo.edits[0].newRoot == g_root);
+    assert(check_integrity());
+    assert(count_nodes(g_root) == 7);
+    assert(g_stats.nodes == 7 && g_stats.leaves == 4);
+    for (int i = 0; i < 4; i++) {
+        Bitmap res;
+        bm_init(&res);
+        AttrTerm none[] = {{"Is it a question nobody asked?", 1, 1}};
+        assert(ai_query(&g_index, none, 1, &res));
+        int found = 0;
+        uint32_t ids[8];
+        int n = (int)bm_to_array(&res, ids, 8);
+        for (int k = 0; k < n; k++) {
+            found += strcmp(ai_animal(&g_index, ids[k])->text, names[i]) == 0;
+        }
+        assert(n == 4 && found == 1);
+        bm_free(&res);
+    }
+    
+    /* The old tree is untouched */
+    assert(strcmp(q1->no->no->no->text, "Fish") == 0);
+    assert(fabs(expected_questions(q1) - before) < 1e-9);
+    
+    /* A wording asked in both branches is one attribute and may be asked
+     * first instead; still every animal reaches its own leaf, and none
+     * gets there in fewer questions */
+    Node *swim = arena_question_node(&g_arena, "Does it swim?");
+    swim->yes = arena_question_node(&g_arena, "Is it big?");
+    swim->yes->yes = arena_animal_node(&g_arena, "Whale");
+    swim->yes->no = arena_animal_node(&g_arena, "Trout");
+    swim->no = arena_question_node(&g_arena, "Is it big?");
+    swim->no->yes = arena_animal_node(&g_arena, "Elephant");
+    swim->no->no = arena_question_node(&g_arena, "Does it bark?");
+    swim->no->no->yes = arena_animal_node(&g_arena, "Dog");
+    swim->no->no->no = arena_animal_node(&g_arena, "Mouse");
+    swim->no->no->no->visits = 50;
+    rebuilt = opt_rebuild(swim, &g_arena);
+    assert(rebuilt != NULL);
+    const char *five[] = {"Whale", "Trout", "Elephant", "Dog", "Mouse"};
+    for (int i = 0; i < 5; i++) {
+        Node *leaf = play_as(rebuilt, swim, five[i]);
+        assert(leaf != NULL && strcmp(leaf->text, five[i]) == 0);
+    }
+    assert(expected_questions(rebuilt) > expected_questions(swim) - 1e-9);
+    
+    /* The same chain with Cow popular: a lesson's question asked about the
+     * animals beside it is known for all of them, and can be asked first */
+    Node *bark = arena_question_node(&g_arena, "Does it bark?");
+    bark->yes = arena_animal_node(&g_arena, "Dog");
+    bark->no = arena_question_node(&g_arena, "Does it meow?");
+    bark->no->yes = arena_animal_node(&g_arena, "Cat");
+    bark->no->no = arena_question_node(&g_arena, "Does it moo?");
+    bark->no->no->yes = arena_animal_node(&g_arena, "Cow");
+    bark->no->no->no = arena_animal_node(&g_arena, "Fish");
+    bark->no->no->yes->visits = 100;
+    g_root = bark;
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    int undos = g_undo.size;
+    assert(!optimize_tree(&before, &after) && g_root == bark);
+    
+    /* "Does it moo?" was taught at the end of bark-no, meow-no: Cat and
+     * then Dog are the whole subtrees beside that path */
+    FrameStack path;
+    fs_init(&path);
+    fs_push(&path, bark, 0);
+    fs_push(&path, bark->no, 0);
+    Node *others[LEARN_ASK_MAX];
+    assert(learn_neighbours(&path, others, LEARN_ASK_MAX) == 2);
+    assert(strcmp(others[0]->text, "Cat") == 0 && strcmp(others[1]->text, "Dog") == 0);
+    assert(learn_neighbours(&path, others, 1) == 1);
+    fs_pop(&path);
+    assert(learn_neighbours(&path, others, LEARN_ASK_MAX) == 1);  // all of bark-no is too big
+    fs_free(&path);
+    
+    /* Recorded wordings match by canonical text, and a later answer wins */
+    assert(learn_answer("Cat", "Does it moo?", 1) && learn_answer("Cat", "Does it moo?", 0));
+    assert(learn_answer("Dog", "does it MOO", 0));
+    assert(optimize_tree(&before, &after));
+    assert(after < before - 1 && g_undo.size == undos + 1);
+    assert(strcmp(g_root->text, "Does it moo?") == 0 && strcmp(g_root->yes->text, "Cow") == 0);
+    const char *four[] = {"Dog", "Cat", "Cow", "Fish"};
+    for (int i = 0; i < 4; i++) {
+        Node *leaf = play_as(g_root, bark, four[i]);
+        assert(leaf != NULL && strcmp(leaf->text, four[i]) == 0);
+    }
+    assert(check_integrity() && g_stats.leaves == 4);
+    
+    /* Undoing the rebuild and redoing it indexes its trees afresh, without
+     * a lesson taught after it that was undone meanwhile; redoing that
+     * lesson indexes it again */
+    teach_at_bottom("Eel", "Is it long?");
+    assert(undo_last_edit() && undo_last_edit() && g_root == bark);
+    assert(redo_last_edit() && redo_last_edit() && g_redo.size == 0);
+    Bitmap res;
+    bm_init(&res);
+    AttrTerm longOnes[] = {{"Is it long?", 1, 0}, {"Does it moo?", 0, 0}};
+    assert(ai_query(&g_index, longOnes, 2, &res));
+    assert(bm_cardinality(&res) == 1 && query_has(&res, "Eel"));
+    bm_free(&res);
+    assert(check_integrity() && g_stats.leaves == 5);
+    
+    assert(undo_last_edit() && undo_last_edit() && g_root == bark);
+    answers_clear(&g_answers);
+    
+    /* A single leaf cannot be improved */
+    g_root = arena_animal_node(&g_arena, "Cat");
+    assert(!optimize_tree(&before, &after));
+    assert(before == after && g_undo.size == undos);
+    
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    ai_free(&g_index);
+    arena_release(&g_arena);
+    g_root = saved_root;
+    stats_recount(&g_stats, g_root);
+    
+    printf("  ✓ Tree optimizer tests passed\n");
+}
+
+/* Test Game Session */
+void test_session() {
+    printf("Testing Game Session...\n");
+    
+    Node *saved_root = g_root;
+    es_init(&g_undo);
+    es_init(&g_redo);
+    g_root = arena_question_node(&g_arena, "Does it live in water?");
+    g_root->yes = arena_animal_node(&g_arena, "Fish");
+    g_root->no = arena_animal_node(&g_arena, "Dog");
+    Node *dog = g_root->no;
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    
+    /* Wrong guess, then teach */
+    Session s;
+    session_start(&s);
+    assert(s.state == SESSION_ASK);
+    assert(strcmp(session_current_prompt(&s), "Does it live in water?") == 0);
+    assert(session_answer(&s, 0) == SESSION_GUESS);
+    assert(strcmp(session_current_prompt(&s), "Dog") == 0);
+    assert(!session_teach(&s, "Cat", "Does it meow?", 1, NULL));  // not yet
+    assert(session_answer(&s, 0) == SESSION_LEARN);
+    assert(session_current_prompt(&s) == NULL);
+    Edit e;
+    assert(session_teach(&s, "Cat", "Does it meow?", 1, &e));
+    assert(s.state == SESSION_OVER);
+    assert(!session_teach(&s, "Cat", "Does it meow?", 1, NULL));  // only once
+    session_end(&s);
+    
+    assert(e.type == EDIT_INSERT_SPLIT && e.parent == g_root && e.wasYesChild == 0);
+    assert(e.oldLeaf == dog && e.depth == 1 && g_root->no == e.newQuestion);
+    assert(strcmp(e.newQuestion->yes->text, "Cat") == 0 && e.newQuestion->no == dog);
+    assert(g_undo.size == 1 && g_undo.edits[0].newLeaf == e.newLeaf);
+    assert(g_stats.nodes == 5 && g_stats.height == 2);
+    assert(check_integrity());
+    
+    Bitmap res;
+    bm_init(&res);
+    AttrTerm meows[] = {{"does it meow", 1, 0}};
+    assert(ai_query(&g_index, meows, 1, &res));
+    uint32_t hit;
+    assert(bm_to_array(&res, &hit, 1) == 1);
+    assert(ai_animal(&g_index, hit) == e.newLeaf);
+    bm_free(&res);
+    
+    /* The new animal is found next time; answers after the end are ignored */
+    session_start(&s);
+    session_answer(&s, 0);
+    session_answer(&s, 1);
+    assert(s.state == SESSION_GUESS && s.node == e.newLeaf);
+    assert(session_answer(&s, 1) == SESSION_WON);
+    assert(session_answer(&s, 0) == SESSION_WON);
+    session_end(&s);
+    assert(g_root->visits == 2 && e.newQuestion->visits == 2);
+    assert(e.newLeaf->visits == 2 && dog->visits == 0);
+    
+    /* A tree that is a single leaf is split at the root */
+    g_root = arena_animal_node(&g_arena, "Cow");
+    session_start(&s);
+    assert(session_answer(&s, 0) == SESSION_LEARN);
+    assert(session_teach(&s, "Horse", "Can you ride it?", 1, &e));
+    session_end(&s);
+    assert(e.parent == NULL && e.wasYesChild == -1 && e.depth == 0);
+    assert(g_root == e.newQuestion && strcmp(g_root->yes->text, "Horse") == 0);
+    
+    /* No tree: nothing to ask */
+    g_root = NULL;
+    session_start(&s);
+    assert(s.state == SESSION_OVER && session_current_prompt(&s) == NULL);
+    session_end(&s);
+    
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    ai_free(&g_index);
+    arena_release(&g_arena);
+    g_root = saved_root;
+    stats_recount(&g_stats, g_root);
+    
+    printf("  ✓ Game session tests passed\n");
+}
+
+/* Test Epoch-Based Reclamation */
+void test_epoch() {
+    printf("Testing Epoch Reclamation...\n");
+    
+    Node *saved_root = g_root;
+    es_init(&g_undo);
+    es_init(&g_redo);
+    g_root = arena_question_node(&g_arena, "Does it live in water?");
+    g_root->yes = arena_animal_node(&g_arena, "Fish");
+    g_root->no = arena_animal_node(&g_arena, "Dog");
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    
+    /* Games parked on the split and on the other side hold no pin */
+    Session s, parked, fish;
+    session_start(&s);
+    session_answer(&s, 0);
+    session_answer(&s, 0);
+    Edit cat;
+    assert(session_teach(&s, "Cat", "Does it meow?", 1, &cat));
+    session_end(&s);
+    session_start(&parked);
+    session_answer(&parked, 0);
+    assert(parked.node == cat.newQuestion);
+    session_start(&fish);
+    assert(session_answer(&fish, 1) == SESSION_GUESS);
+    assert(undo_last_edit());
+    
+    /* A new lesson drops the undone split from g_redo; a reader still
+     * walking keeps it until it unpins
+     */
+    unsigned pin = epoch_pin();
+    session_start(&s);
+    session_answer(&s, 0);
+    session_answer(&s, 0);
+    assert(session_teach(&s, "Cow", "Does it moo?", 1, NULL));
+    session_end(&s);
+    assert(g_redo.size == 0 && epoch_pending() == 2);
+    for (int i = 0; i < 4; i++) {
+        epoch_reclaim();
+    }
+    assert(epoch_pending() == 2);
+    epoch_unpin(pin);
+    
+    /* Then the nodes are freed, parked games or not, and handed out again */
+    size_t live = g_arena.nodes;
+    for (int i = 0; i < 4 && epoch_pending() > 0; i++) {
+        epoch_reclaim();
+    }
+    assert(epoch_pending() == 0 && g_arena.nodes == live - 2);
+    Node *reused = arena_animal_node(&g_arena, "Horse");
+    assert(reused == cat.newLeaf || reused == cat.newQuestion);
+    assert(strcmp(reused->text, "Horse") == 0 && reused->yes == NULL && reused->visits == 0);
+    
+    /* The game parked on the freed question starts over; the other goes on */
+    assert(session_answer(&parked, 1) == SESSION_ASK);
+    assert(parked.path.size == 0 && parked.node == g_root);
+    assert(strcmp(session_current_prompt(&parked), "Does it live in water?") == 0);
+    assert(session_answer(&parked, 0) == SESSION_ASK);
+    assert(strcmp(session_current_prompt(&parked), "Does it moo?") == 0);
+    session_end(&parked);
+    assert(session_answer(&fish, 1) == SESSION_WON);
+    session_end(&fish);
+    
+    /* Forgotten ids no longer resolve to the freed nodes */
+    Bitmap res;
+    bm_init(&res);
+    AttrTerm meows[] = {{"does it meow", 1, 0}};
+    assert(ai_query(&g_index, meows, 1, &res) && bm_cardinality(&res) == 0);
+    bm_free(&res);
+    assert(check_integrity());
+    
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    ai_free(&g_index);
+    arena_release(&g_arena);
+    g_root = saved_root;
+    stats_recount(&g_stats, g_root);
+    
+    printf("  ✓ Epoch reclamation tests passed\n");
+}
+
+/* Test Edit Journal */
+void test_journal() {
+    printf("Testing Edit Journal...\n");
+    
+    Node *saved_root = g_root;
+    es_init(&g_undo);
+    es_init(&g_redo);
+    g_root = arena_question_node(&g_arena, "Does it bark?");
+    g_root->yes = arena_animal_node(&g_arena, "Dog");
+    g_root->no = arena_animal_node(&g_arena, "Fish");
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    
+    /* Costs are tracked through push, pop and clear */
+    Edit split = {0};
+    size_t cost = edit_cost(&split);
+    assert(cost == sizeof(Edit) + 2 * sizeof(Node));
+    
+    /* The journal stays within its budget, oldest edits going first */
+    journal_set_budget(10 * cost);
+    char name[32], question[64];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "Animal %03d", i);
+        snprintf(question, sizeof(question), "Is it animal number %03d?", i);
+        teach_at_bottom(name, question);
+        assert(g_undo.bytes + g_redo.bytes <= journal_budget());
+    }
+    assert(g_undo.size >= 7 && g_undo.size <= 10);
+    assert(g_undo.bytes == (size_t)g_undo.size * cost);
+    assert(strcmp(g_undo.edits[g_undo.size - 1].newLeaf->text, "Animal 099") == 0);
+    assert(g_stats.nodes == 203);
+    int kept = g_undo.size;
+    for (int i = 0; i < kept; i++) {
+        assert(undo_last_edit());
+    }
+    assert(!undo_last_edit());
+    assert(g_stats.nodes == 203 - 2 * kept && g_redo.bytes == (size_t)kept * cost);
+    assert(check_integrity());
+    
+    /* Teaching and undoing for ever reuses the same nodes and strings */
+    size_t nodes = 0, used = 0;
+    for (int i = 0; i < 2000; i++) {
+        snprintf(name, sizeof(name), "Churn %04d", i);
+        snprintf(question, sizeof(question), "Is it churn number %04d?", i);
+        teach_at_bottom(name, question);
+        assert(undo_last_edit());
+        if (i == 10) {
+            nodes = g_arena.nodes;
+            used = g_arena.text->used;
+        }
+    }
+    assert(g_arena.nodes <= nodes + 4 && g_arena.text->used <= used + 128);
+    
+    /* A compacted rebuild retires the tree it replaced */
+    journal_set_budget(JOURNAL_BUDGET_DEFAULT);
+    assert(install_tree(opt_rebuild(g_root, &g_arena)));
+    Node *before = g_undo.edits[g_undo.size - 1].oldRoot;
+    int oldNodes = count_nodes(before);
+    for (int i = 0; i < 4; i++) {
+        epoch_reclaim();
+    }
+    assert(epoch_pending() == 0);
+    size_t live = g_arena.nodes;
+    journal_set_budget(cost);
+    assert(g_undo.size == 1 && g_undo.edits[0].type == EDIT_REBUILD);
+    teach_at_bottom("Whale", "Is it huge?");
+    assert(g_undo.size == 1 && g_undo.edits[0].type == EDIT_INSERT_SPLIT);
+    for (int i = 0; i < 4; i++) {
+        epoch_reclaim();
+    }
+    assert(epoch_pending() == 0 && g_arena.nodes == live + 2 - oldNodes);
+    assert(check_integrity());
+    
+    journal_set_budget(JOURNAL_BUDGET_DEFAULT);
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    ai_free(&g_index);
+    arena_release(&g_arena);
+    g_root = saved_root;
+    stats_recount(&g_stats, g_root);
+    
+    printf("  ✓ Edit journal tests passed\n");
+}
+
+/* Test Write-Ahead Log */
+void test_wal() {
+    printf("Testing Write-Ahead Log...\n");
+    
+    /* CRC-32C check value, and the same CRC however the input is split */
+    assert(crc32c(0, "123456789", 9) == 0xE3069283);
+    uint8_t noise[1000];
+    for (int i = 0; i < 1000; i++) noise[i] = (uint8_t)(i * 131 + (i >> 3));
+    uint32_t whole = crc32c(0, noise, sizeof(noise)), pieces = 0;
+    for (int i = 0; i < 1000; i += 1 + i % 13) {
+        pieces = crc32c(pieces, noise + i, (size_t)(1 + i % 13 < 1000 - i ? 1 + i % 13 : 1000 - i));
+    }
+    assert(pieces == whole);
+    
+    Node *saved_root = g_root;
+    es_init(&g_undo);
+    es_init(&g_redo);
+    g_root = arena_question_node(&g_arena, "Does it bark?");
+    g_root->yes = arena_animal_node(&g_arena, "Dog");
+    g_root->no = arena_animal_node(&g_arena, "Fish");
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    remove("test_wal.dat");
+    remove("test_wal.dat.wal");
+    
+    /* Opening writes the snapshot and an empty log */
+    assert(wal_open("test_wal.dat"));
+    assert(wal_checkpoint_wait());
+    assert(g_treeTag.tag != 0 && wal_size() == 16);
+    long snapshot = file_size("test_wal.dat");
+    
+    /* Lessons, undos and redos are small records; the snapshot is untouched */
+    teach_at_bottom("Shark", "Is it dangerous?");
+    Session s;
+    session_start(&s);
+    session_answer(&s, 1);
+    session_answer(&s, 0);
+    assert(session_teach(&s, "Wolf", "Is it wild?", 1, NULL));
+    session_end(&s);
+    teach_at_bottom("Eel", "Is it long?");
+    assert(undo_last_edit());
+    assert(undo_last_edit());
+    assert(redo_last_edit());
+    assert(undo_last_edit());
+    assert(learn_answer("Dog", "Is it wild?", 0));
+    assert(wal_size() < 16 + 8 * 64);
+    assert(wal_sync());
+    assert(file_size("test_wal.dat.wal") == (long)wal_size());
+    assert(file_size("test_wal.dat") == snapshot);
+    
+    /* Loading the snapshot replays the log, undo history included */
+    FlatTree expect;
+    assert(flat_from_tree(&expect, g_root));
+    int undos = g_undo.size, redos = g_redo.size;
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect) && check_integrity());
+    assert(g_undo.size == undos && g_redo.size == redos);
+    assert(g_stats.nodes == (int)expect.count);
+    assert(g_answers.count == 1 && strcmp(g_answers.answers[0].animal, "Dog") == 0);
+    assert(strcmp(g_answers.answers[0].question, "Is it wild?") == 0 && !g_answers.answers[0].yes);
+    
+    /* A torn record at the end is ignored, and cut off on reopening */
+    long logged = file_size("test_wal.dat.wal");
+    FILE *f = fopen("test_wal.dat.wal", "ab");
+    fwrite("\x20\0\0\0torn", 1, 8, f);
+    fclose(f);
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect));
+    assert(wal_open("test_wal.dat"));
+    assert(file_size("test_wal.dat.wal") == logged && wal_size() == (uint64_t)logged);
+    assert(file_size("test_wal.dat") == snapshot);
+    teach_at_bottom("Squid", "Does it have tentacles?");
+    flat_free(&expect);
+    assert(flat_from_tree(&expect, g_root));
+    assert(wal_sync());
+    
+    /* A checkpoint folds the log into a new snapshot */
+    f = fopen("test_wal.dat.wal", "rb");
+    long stale = file_size("test_wal.dat.wal");
+    char *old = malloc(stale);
+    assert(fread(old, 1, stale, f) == (size_t)stale);
+    fclose(f);
+    SnapshotTag tag = g_treeTag;
+    assert(wal_checkpoint());
+    assert(g_treeTag.tag != tag.tag && g_treeTag.baseLen == (uint64_t)stale);
+    assert(wal_size() == 16 && file_size("test_wal.dat.wal") == 16);
+    
+    /* A crash before the switch to the new log loses nothing: the old log
+     * is replayed from where the snapshot was taken */
+    teach_at_bottom("Crab", "Does it have claws?");
+    assert(wal_sync());
+    long tail = file_size("test_wal.dat.wal") - 16;
+    old = realloc(old, stale + tail);
+    f = fopen("test_wal.dat.wal", "rb");
+    fseek(f, 16, SEEK_SET);
+    assert(fread(old + stale, 1, tail, f) == (size_t)tail);
+    fclose(f);
+    f = fopen("test_wal.dat.wal", "wb");
+    fwrite(old, 1, stale + tail, f);
+    fclose(f);
+    flat_free(&expect);
+    assert(flat_from_tree(&expect, g_root));
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect) && g_undo.size == 1);
+    
+    /* Play goes on while a checkpoint is written in the background */
+    assert(wal_open("test_wal.dat"));
+    assert(wal_checkpoint_start());
+    teach_at_bottom("Octopus", "Does it have eight arms?");
+    int percent;
+    SaveState st;
+    while ((st = wal_checkpoint_poll(&percent)) == SAVE_RUNNING) {
+        assert(percent >= 0 && percent <= 100);
+        usleep(1000);
+    }
+    assert(st == SAVE_DONE && percent == 100);
+    assert(wal_checkpoint_poll(NULL) == SAVE_IDLE);
+    assert(wal_size() > 16);
+    flat_free(&expect);
+    assert(flat_from_tree(&expect, g_root));
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect));
+    
+    /* A log from an earlier generation no longer applies */
+    assert(wal_open("test_wal.dat"));
+    assert(wal_checkpoint());
+    assert(load_tree("test_wal.dat"));
+    f = fopen("test_wal.dat.wal", "wb");
+    fwrite(old, 1, stale + tail, f);
+    fclose(f);
+    free(old);
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect));
+    
+    /* Saving syncs the log and leaves the snapshot alone until the log
+     * outgrows it, then folds it in the background */
+    assert(wal_open("test_wal.dat") && wal_checkpoint_wait());
+    snapshot = file_size("test_wal.dat");
+    teach_at_bottom("Seal", "Does it clap?");
+    assert(wal_save());
+    assert(file_size("test_wal.dat") == snapshot);
+    assert(file_size("test_wal.dat.wal") == (long)wal_size());
+    assert(wal_checkpoint_poll(NULL) == SAVE_IDLE);
+    while (wal_size() < 16 + (64 << 10)) {
+        assert(undo_last_edit() && redo_last_edit());
+    }
+    assert(wal_save());
+    st = wal_checkpoint_poll(NULL);
+    assert(st == SAVE_RUNNING || st == SAVE_DONE);
+    assert(wal_checkpoint_wait() && wal_size() == 16);
+    flat_free(&expect);
+    assert(flat_from_tree(&expect, g_root));
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect));
+    
+    /* An optimizer rebuild marks the log and checkpoints in the
+     * background; saving waits for that snapshot */
+    assert(wal_open("test_wal.dat") && wal_checkpoint_wait());
+    long snapLen, logLen;
+    char *snap = read_bytes("test_wal.dat", &snapLen);
+    teach_at_bottom("Ray", "Is it flat?");
+    assert(wal_sync());
+    char *log = read_bytes("test_wal.dat.wal", &logLen);
+    assert(logLen > 16);
+    flat_free(&expect);
+    assert(flat_from_tree(&expect, g_root));
+    assert(install_tree(opt_rebuild(g_root, &g_arena)));
+    assert(wal_save() && wal_size() == 16);
+    FlatTree rebuilt;
+    assert(flat_from_tree(&rebuilt, g_root));
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&rebuilt));
+    
+    /* ... also when an earlier checkpoint was still being written */
+    assert(wal_open("test_wal.dat"));
+    assert(wal_checkpoint_start());
+    assert(install_tree(opt_rebuild(g_root, &g_arena)));
+    assert(wal_checkpoint_wait() && wal_size() == 16);
+    flat_free(&rebuilt);
+    assert(flat_from_tree(&rebuilt, g_root));
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&rebuilt));
+    flat_free(&rebuilt);
+    
+    /* A crash before the rebuild's snapshot is written loses the rebuild:
+     * replay stops at the mark, and reopening cuts it and the rest off */
+    char mark[14] = {0};
+    uint32_t markLen = 6;
+    mark[8] = 4;  // WAL_REBUILD
+    uint32_t markCrc = crc32c(0, mark + 8, markLen);
+    memcpy(mark, &markLen, 4);
+    memcpy(mark + 4, &markCrc, 4);
+    char *crashed = malloc(logLen + sizeof(mark) + logLen - 16);
+    memcpy(crashed, log, logLen);
+    memcpy(crashed + logLen, mark, sizeof(mark));
+    memcpy(crashed + logLen + sizeof(mark), log + 16, logLen - 16);  // a lesson after it
+    write_bytes("test_wal.dat", snap, snapLen);
+    write_bytes("test_wal.dat.wal", crashed, logLen + sizeof(mark) + logLen - 16);
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect));
+    assert(wal_open("test_wal.dat") && file_size("test_wal.dat.wal") == logLen);
+    free(snap);
+    free(log);
+    free(crashed);
+    
+    /* A VERSION 3 snapshot carries the tag just as well */
+    assert(save_set_format(3) && wal_checkpoint());
+    teach_at_bottom("Newt", "Is it an amphibian?");
+    assert(wal_sync());
+    flat_free(&expect);
+    assert(flat_from_tree(&expect, g_root));
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect) && g_undo.size == 1);
+    assert(save_set_format(2));
+    
+    /* The answer went from the log into every snapshot since, once */
+    assert(g_answers.count == 1 && strcmp(g_answers.answers[0].animal, "Dog") == 0);
+
+    /* Undo and redo log the path their edit kept, or search for it when
+     * the split was deeper than EDIT_PATH_MAX */
+    assert(wal_open("test_wal.dat"));
+    for (int i = 0; g_undo.size == 0 || g_undo.edits[g_undo.size - 1].depth <= EDIT_PATH_MAX; i++) {
+        char animal[32], question[48];
+        snprintf(animal, sizeof(animal), "Deep %d", i);
+        snprintf(question, sizeof(question), "Is it deep number %d?", i);
+        teach_at_bottom(animal, question);
+    }
+    assert(g_undo.edits[g_undo.size - 3].depth < EDIT_PATH_MAX);
+    for (int i = 0; i < 3; i++) {
+        assert(undo_last_edit());
+    }
+    assert(redo_last_edit() && redo_last_edit());
+    flat_free(&expect);
+    assert(flat_from_tree(&expect, g_root));
+    undos = g_undo.size;
+    assert(load_tree("test_wal.dat"));
+    assert(tree_is(&expect) && g_undo.size == undos && g_redo.size == 1);
+
+    wal_close();
+    flat_free(&expect);
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    ai_free(&g_index);
+    free_tree(g_root);
+    arena_release(&g_arena);
+    g_root = saved_root;
+    stats_recount(&g_stats, g_root);
+    remove("test_wal.dat");
+    remove("test_wal.dat.wal");
+    
+    printf("  ✓ Write-ahead log tests passed\n");
+}
+
+/* Connect a blocking client to the test server */
+static int server_connect(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+/* Send one request line and return the server's reply line */
+static const char *server_say(int fd, const char *request) {
+    static char line[256];
+    if (request != NULL) {
+        assert(write(fd, request, strlen(request)) == (ssize_t)strlen(request));
+    }
+    size_t len = 0;
+    while (len < sizeof(line) - 1 && read(fd, line + len, 1) == 1 && line[len] != '\n') {
+        len++;
+    }
+    line[len] = '\0';
+    return line;
+}
+
+/* Test Game Server */
+void test_server() {
+    printf("Testing Game Server...\n");
+    
+    const char *path = "test_server.sock";
+    Node *saved_root = g_root;
+    es_init(&g_undo);
+    es_init(&g_redo);
+    g_root = arena_question_node(&g_arena, "Does it live in water?");
+    g_root->yes = arena_animal_node(&g_arena, "Fish");
+    g_root->no = arena_animal_node(&g_arena, "Dog");
+    ai_build(&g_index, g_root);
+    stats_recount(&g_stats, g_root);
+    
+    assert(server_start(path, 2));
+    int a = server_connect(path);
+    int b = server_connect(path);
+    
+    /* Two games in flight at once */
+    assert(strcmp(server_say(a, NULL), "ASK Does it live in water?") == 0);
+    assert(strcmp(server_say(b, NULL), "ASK Does it live in water?") == 0);
+    assert(strcmp(server_say(a, "n\n"), "GUESS Dog") == 0);
+    assert(strcmp(server_say(b, "n\n"), "GUESS Dog") == 0);
+    assert(strcmp(server_say(a, "n\n"), "LEARN") == 0);
+    assert(strcmp(server_say(b, "n\n"), "LEARN") == 0);
+    assert(strcmp(server_say(b, "hello\n"), "ERR unknown request") == 0);
+    
+    /* a teaches first; b's leaf has moved, so its lesson is refused */
+    assert(strcmp(server_say(a, "TEACH y\tCat\tDoes it meow?\n"), "OVER") == 0);
+    assert(strcmp(server_say(b, "TEACH y\tCow\tDoes it moo?\n"), "ERR cannot teach now") == 0);
+    assert(strcmp(server_say(b, "TEACH y Cow\n"), "ERR usage: TEACH y|n<TAB>animal<TAB>question") == 0);
+    assert(g_stats.nodes == 5 && g_undo.size == 1);
+    
+    /* Several requests in one write are answered in order */
+    assert(strcmp(server_say(b, "NEW\nn\ny\n"), "ASK Does it live in water?") == 0);
+    assert(strcmp(server_say(b, NULL), "ASK Does it meow?") == 0);
+    assert(strcmp(server_say(b, NULL), "GUESS Cat") == 0);
+    assert(strcmp(server_say(b, "y\n"), "WON") == 0);
+    
+    assert(strcmp(server_say(a, "UNDO\n"), "OK") == 0);
+    assert(strcmp(server_say(a, "UNDO\n"), "ERR nothing to undo") == 0);
+    assert(g_stats.nodes == 3 && g_root->no->isQuestion == 0);
+    assert(strcmp(server_say(a, "REDO\n"), "OK") == 0);
+    assert(strcmp(g_root->no->text, "Does it meow?") == 0);
+    assert(check_integrity());
+    
+    /* b idles on the split while a undoes it and teaches over it; the
+     * writer frees the split without waiting for b or another lesson
+     */
+    assert(strcmp(server_say(b, "NEW\nn\n"), "ASK Does it live in water?") == 0);
+    assert(strcmp(server_say(b, NULL), "ASK Does it meow?") == 0);
+    assert(strcmp(server_say(a, "UNDO\n"), "OK") == 0);
+    assert(strcmp(server_say(a, "NEW\nn\n"), "ASK Does it live in water?") == 0);
+    assert(strcmp(server_say(a, NULL), "GUESS Dog") == 0);
+    assert(strcmp(server_say(a, "n\n"), "LEARN") == 0);
+    assert(strcmp(server_say(a, "TEACH y\tCow\tDoes it moo?\n"), "OVER") == 0);
+    for (int i = 0; i < 200 && epoch_pending() > 0; i++) {
+        usleep(10000);
+    }
+    assert(epoch_pending() == 0);
+    assert(strcmp(server_say(b, "y\n"), "ASK Does it live in water?") == 0);
+    assert(strcmp(server_say(b, "n\n"), "ASK Does it moo?") == 0);
+    
+    /* QUIT closes the connection */
+    server_say(a, "QUIT\n");
+    char c;
+    assert(read(a, &c, 1) == 0);
+    close(a);
+    assert(server_sessions() == 1);
+    
+    server_stop();
+    assert(read(b, &c, 1) == 0);
+    close(b);
+    assert(access(path, F_OK) != 0);
+    
+    free_edit_stack(&g_undo);
+    free_edit_stack(&g_redo);
+    ai_free(&g_index);
+    arena_release(&g_arena);
+    g_root = saved_root;
+    stats_recount(&g_stats, g_root);
+    
+    printf("  ✓ Game server tests passed\n");
+}
+
 /* Test Edit Stack */
 void test_edit_stack() {
     printf("Testing Edit Stack...\n");
@@ -298,15 +2143,28 @@ void test_edit_stack() {
 
 int main() {
     printf("\n=== Running Unit Tests ===\n\n");
+    // Only test_persistence keeps earlier versions of the files it saves
+    save_set_generations(0);
     
     test_nodes();
+    test_arena();
     test_stack();
     test_edit_stack();
     test_queue();
     test_canonicalize();
     test_hash();
+    test_bitmap();
+    test_index();
     test_persistence();
     test_integrity();
+    test_stats();
+    test_optimize();
+    test_session();
+    test_epoch();
+    test_journal();
+    test_server();
+    test_wal();
+    test_flat();
     
     printf("\n=== All Tests Passed! ===\n\n");
     printf("Great job! Your implementations are working correctly.\n");
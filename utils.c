@@ -33,14 +33,14 @@ int check_integrity() {
         return 1;
     }
 
-    // Allocate and initialize a Queue for BFS
-    Queue *q = malloc(sizeof(Queue));
+    // Initialize a Queue for BFS
+    Queue queue;
+    Queue *q = &queue;
     q_init(q);
 
     int id = 0; // id values enqueued are unused by integrity logic but required by Queue API
-    q_enqueue(q, g_root, id); // start BFS from root
-
-    int valid = 1; // assume valid until a rule violation is found
+    // start BFS from root; a tree we cannot walk is not reported as valid
+    int valid = q_enqueue(q, g_root, id);
     Node *dequeueNode;
     int dequeueId;
 
@@ -55,8 +55,11 @@ int check_integrity() {
                 break;
             } else {
                 // Enqueue both children for further checking
-                q_enqueue(q, dequeueNode->yes, ++id);
-                q_enqueue(q, dequeueNode->no, ++id);
+                if (!q_enqueue(q, dequeueNode->yes, ++id) ||
+                    !q_enqueue(q, dequeueNode->no, ++id)) {
+                    valid = 0; // out of memory: the check is incomplete
+                    break;
+                }
             }
         } else {
             // Leaf nodes must not have children
@@ -69,12 +72,148 @@ int check_integrity() {
 
     // Clean up queue resources
     q_free(q);
-    free(q);
-    q = NULL;
 
     return valid;
 }
 
+/* ---- tree statistics ---- */
+
+/* Make room for leaves at depth d. Returns 1 on success. */
+static int stats_reserve(TreeStats *s, int d) {
+    if (d < s->depthCap) {
+        return 1;
+    }
+    int newCap = s->depthCap ? s->depthCap : 64;
+    while (newCap <= d) {
+        newCap *= 2;
+    }
+    int *grown = realloc(s->leavesAt, newCap * sizeof(int));
+    if (grown == NULL) {
+        return 0;
+    }
+    memset(grown + s->depthCap, 0, (newCap - s->depthCap) * sizeof(int));
+    s->leavesAt = grown;
+    s->depthCap = newCap;
+    return 1;
+}
+
+/* Record one leaf at depth */
+static int stats_leaf(TreeStats *s, int depth) {
+    if (!stats_reserve(s, depth)) {
+        return 0;
+    }
+    s->leaves++;
+    s->leavesAt[depth]++;
+    if (depth > s->height) {
+        s->height = depth;
+    }
+    return 1;
+}
+
+/* Recompute s from scratch with an explicit (node, depth) stack, so
+ * arbitrarily deep trees do not touch the C stack.
+ * Returns 1 on success, 0 on allocation failure (s is then zeroed).
+ */
+int stats_recount(TreeStats *s, Node *root) {
+    typedef struct {
+        Node *node;
+        int depth;
+    } StatFrame;
+
+    s->nodes = s->leaves = s->questions = s->height = 0;
+    if (s->leavesAt != NULL) {
+        memset(s->leavesAt, 0, s->depthCap * sizeof(int));
+    }
+    if (root == NULL) {
+        return 1;
+    }
+    int cap = 64, top = 0;
+    StatFrame *stack = malloc(cap * sizeof(StatFrame));
+    if (stack == NULL) {
+        return 0;
+    }
+    stack[top++] = (StatFrame){root, 0};
+    while (top > 0) {
+        StatFrame f = stack[--top];
+        s->nodes++;
+        if (!f.node->isQuestion) {
+            if (!stats_leaf(s, f.depth)) {
+                goto recount_error;
+            }
+            continue;
+        }
+        s->questions++;
+        if (top + 2 > cap) {
+            cap *= 2;
+            StatFrame *grown = realloc(stack, cap * sizeof(StatFrame));
+            if (grown == NULL) {
+                goto recount_error;
+            }
+            stack = grown;
+        }
+        // Leaf children are counted on the spot so chains keep the stack tiny;
+        // a question loaded with a child missing has just the other one
+        Node *kids[2] = {f.node->no, f.node->yes};
+        for (int k = 0; k < 2; k++) {
+            if (kids[k] == NULL) {
+                continue;
+            }
+            if (kids[k]->isQuestion) {
+                stack[top++] = (StatFrame){kids[k], f.depth + 1};
+            } else {
+                s->nodes++;
+                if (!stats_leaf(s, f.depth + 1)) {
+                    goto recount_error;
+                }
+            }
+        }
+    }
+    free(stack);
+    return 1;
+
+recount_error:
+    free(stack);
+    stats_free(s);
+    return 0;
+}
+
+/* A leaf at depth became a question with two leaves below it */
+void stats_split(TreeStats *s, int depth) {
+    if (!stats_reserve(s, depth + 1)) {
+        return;
+    }
+    s->nodes += 2;
+    s->questions++;
+    s->leaves++;
+    s->leavesAt[depth]--;
+    s->leavesAt[depth + 1] += 2;
+    if (depth + 1 > s->height) {
+        s->height = depth + 1;
+    }
+}
+
+/* Revert stats_split: the question at depth is a leaf again */
+void stats_unsplit(TreeStats *s, int depth) {
+    if (depth + 1 >= s->depthCap) {
+        return;
+    }
+    s->nodes -= 2;
+    s->questions--;
+    s->leaves--;
+    s->leavesAt[depth]++;
+    s->leavesAt[depth + 1] -= 2;
+    // The deepest level may have emptied; each level is popped at most
+    // once per split that pushed it, so this is amortized O(1)
+    while (s->height > 0 && s->leavesAt[s->height] == 0) {
+        s->height--;
+    }
+}
+
+void stats_free(TreeStats *s) {
+    free(s->leavesAt);
+    memset(s, 0, sizeof(*s));
+}
+
 typedef struct PathNode {
     Node *treeNode;
     struct PathNode *parent;
@@ -32,32 +32,66 @@ void add_display_line(const char *text, int indent, int isQuestion) {
     line_count++;
 }
 
+/* Pre-order listing of the subtree at node, yes branch before no branch.
+ * Uses an explicit stack instead of recursion so very deep trees cannot
+ * overflow the call stack; the indentation of a line is the caller's
+ * prefix plus two spaces per level below node.
+ */
 void build_tree_display(Node *node, int depth, const char *prefix, int isYesBranch) {
     if (node == NULL) return;
-    
-    char line[256];
-    char branch[64];
-    
-    if (depth == 0) {
-        snprintf(line, sizeof(line), "ROOT: %s", node->text);
-    } else {
-        snprintf(branch, sizeof(branch), "%s", isYesBranch ? "[YES]" : "[NO]");
-        snprintf(line, sizeof(line), "%s%s %s", prefix, branch, node->text);
+
+    typedef struct DisplayFrame {
+        Node *node;
+        int depth;
+        int isYes;
+    } DisplayFrame;
+
+    int cap = 64, top = 0;
+    DisplayFrame *stack = malloc(cap * sizeof(DisplayFrame));
+    if (stack == NULL) {
+        perror("[build_tree_display] Failed to allocate stack");
+        return;
     }
-    
-    add_display_line(line, depth, node->isQuestion);
-    
-    if (node->isQuestion) {
-        char new_prefix[256];
-        snprintf(new_prefix, sizeof(new_prefix), "%s  ", prefix);
-        
-        if (node->yes) {
-            build_tree_display(node->yes, depth + 1, new_prefix, 1);
+    stack[top++] = (DisplayFrame){node, depth, isYesBranch};
+
+    char line[256];
+    while (top > 0) {
+        DisplayFrame f = stack[--top];
+
+        if (f.depth == 0) {
+            snprintf(line, sizeof(line), "ROOT: %s", f.node->text);
+        } else {
+            long pad = 2L * (f.depth - depth);
+            if (pad > (long)sizeof(line) - 1) {
+                pad = sizeof(line) - 1;
+            }
+            snprintf(line, sizeof(line), "%s%*s%s %s", prefix, (int)pad, "",
+                     f.isYes ? "[YES]" : "[NO]", f.node->text);
+        }
+
+        add_display_line(line, f.depth, f.node->isQuestion);
+
+        if (!f.node->isQuestion) {
+            continue;
+        }
+        if (top + 2 > cap) {
+            cap *= 2;
+            DisplayFrame *grown = realloc(stack, cap * sizeof(DisplayFrame));
+            if (grown == NULL) {
+                perror("[build_tree_display] Failed to grow stack");
+                break;
+            }
+            stack = grown;
+        }
+        // Push no first so the yes branch is listed first
+        if (f.node->no) {
+            stack[top++] = (DisplayFrame){f.node->no, f.depth + 1, 0};
         }
-        if (node->no) {
-            build_tree_display(node->no, depth + 1, new_prefix, 0);
+        if (f.node->yes) {
+            stack[top++] = (DisplayFrame){f.node->yes, f.depth + 1, 1};
         }
     }
+    free(stack);
 }
 
 void draw_tree() {
@@ -0,0 +1,948 @@
+#define _GNU_SOURCE  /* fdatasync, O_CLOEXEC */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lab5.h"
+
+extern Node *g_root;
+extern EditStack g_undo;
+extern EditStack g_redo;
+extern AttrIndex g_index;
+extern NodeArena g_arena;
+
+/* ========== Write-Ahead Log ==========
+ *
+ * <snapshot>.wal holds the edits made since <snapshot> was written:
+ *
+ *   header  "ATL5WAL1", uint64_t tag (the snapshot's SEC_TAG)
+ *   record  uint32_t length, uint32_t crc32c, then length bytes:
+ *           uint8_t type, uint32_t depth, (depth + 7) / 8 bytes of
+ *           answers from the root (bit i = answer at depth i), then
+ *     WAL_SPLIT    uint8_t newYes, uint32_t len + animal, uint32_t len + question
+ *     WAL_UNSPLIT  uint8_t keepYes
+ *     WAL_ANSWER   uint8_t yes, uint32_t len + animal, uint32_t len + question
+ *                  (depth 0: an answer for g_answers, not a tree change)
+ *     WAL_REBUILD  uint8_t 0 (depth 0: the tree was replaced; see below)
+ *
+ * A split names the leaf it replaced and an unsplit the question it
+ * removed, both by their position, so records replay onto the snapshot
+ * whatever undo history the writing process had. A torn or corrupt tail
+ * ends replay and is cut off when the log is reopened.
+ *
+ * A checkpoint writes the snapshot in a forked child while play goes on,
+ * appending to the old log. The snapshot's SnapshotTag names the old log
+ * and the offset it was taken at; once it is on disk, the records after
+ * that offset move to a new log under the snapshot's own tag. A crash at
+ * any point leaves a snapshot and a log that replay can match up; any
+ * other log is left over from an earlier checkpoint and ignored.
+ *
+ * A rebuild (or its undo or redo) replaces the whole tree, so only a
+ * snapshot can hold it. It logs WAL_REBUILD and starts a checkpoint.
+ * Replay stops at the marker, because the records after it were made on a
+ * tree that the snapshot does not hold. Until a snapshot taken after the
+ * marker is on disk, a crash loses the rebuild and what followed, but
+ * never applies it to the wrong tree. wal_save and wal_close wait for
+ * that snapshot.
+ *
+ * Records are appended to a buffer on the writer thread; a flusher thread
+ * writes and fdatasyncs whatever has accumulated since its last sync, so
+ * one sync commits a whole group of edits.
+ */
+
+#define WAL_MAGIC "ATL5WAL1"
+#define WAL_HEADER 16
+#define WAL_CHECKPOINT_BYTES ((uint64_t)64 << 20)   /* fold the log past this */
+#define WAL_COMPACT_SHARE 4                         /* wal_save folds past 1/4 of */
+#define WAL_COMPACT_MIN ((uint64_t)64 << 10)        /* the snapshot, and this */
+#define WAL_MAX_RECORD (1u << 20)
+
+enum { WAL_SPLIT = 1, WAL_UNSPLIT = 2, WAL_ANSWER = 3, WAL_REBUILD = 4 };
+
+static struct {
+    int fd;
+    char *snapshot;
+    char *logPath;
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;      /* records waiting, or stop */
+    pthread_cond_t done;      /* durable advanced */
+    char *buf;                /* appended but not yet written */
+    size_t used;
+    size_t cap;
+    uint64_t appended;        /* bytes ever appended / made durable */
+    uint64_t durable;
+    uint64_t logBytes;        /* current size of the log file */
+    uint64_t logTag;          /* tag in the log's header */
+    uint64_t snapshotBytes;   /* size of the snapshot the log applies to */
+    int checkpointing;        /* a background snapshot is being written */
+    SnapshotTag pending;      /* ... with this tag */
+    int folding;              /* ... taken after a WAL_REBUILD */
+    int rebuilt;              /* a WAL_REBUILD no checkpoint started since holds */
+    SaveState result;         /* of the last checkpoint, until polled */
+    int percent;
+    int failed;
+    int stop;
+    int replaying;            /* applying the log: do not log again */
+} wal = {.fd = -1};
+
+/* ---- CRC-32C ---- */
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+static int crcHardware;  /* the CPU has the SSE4.2 crc32 instruction */
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (0x82F63B78 & -(c & 1));  // Castagnoli, reflected
+        }
+        crcTable[i] = c;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crcHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+/* The crc32 instruction computes the same CRC-32C, eight bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    for (; len > 0; p++, len--) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+/* CRC-32C of len bytes, continuing from crc (start with 0). Uses the
+ * SSE4.2 instruction when the CPU has it, a lookup table otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crcOnce, crc_init);
+    const uint8_t *p = data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crcHardware) {
+        return ~crc32c_sse42(crc, p, len);
+    }
+#endif
+    for (size_t i = 0; i < len; i++) {
+        crc = crcTable[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* ---- group commit ---- */
+
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+/* Write and sync everything appended, one group at a time */
+static void *wal_flusher(void *arg) {
+    (void)arg;
+    char *spare = NULL;
+    size_t spareCap = 0;
+    pthread_mutex_lock(&wal.lock);
+    for (;;) {
+        while (wal.used == 0 && !wal.stop) {
+            pthread_cond_wait(&wal.wake, &wal.lock);
+        }
+        if (wal.used == 0) {
+            break;
+        }
+        // Records appended while this group syncs form the next group
+        char *group = wal.buf;
+        size_t groupCap = wal.cap;
+        size_t len = wal.used;
+        uint64_t target = wal.appended;
+        wal.buf = spare;
+        wal.cap = spareCap;
+        wal.used = 0;
+        int fd = wal.fd;
+        pthread_mutex_unlock(&wal.lock);
+
+        int ok = write_all(fd, group, len) && fdatasync(fd) == 0;
+
+        pthread_mutex_lock(&wal.lock);
+        spare = group;
+        spareCap = groupCap;
+        if (!ok) {
+            perror("[wal] Failed to write the log");
+            wal.failed = 1;
+        }
+        wal.durable = target;
+        pthread_cond_broadcast(&wal.done);
+    }
+    pthread_mutex_unlock(&wal.lock);
+    free(spare);
+    return NULL;
+}
+
+/* Wait until every record appended so far is on disk. Returns 1 unless a
+ * write failed.
+ */
+int wal_sync(void) {
+    if (wal.fd < 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&wal.lock);
+    uint64_t target = wal.appended;
+    pthread_cond_signal(&wal.wake);
+    while (wal.durable < target) {
+        pthread_cond_wait(&wal.done, &wal.lock);
+    }
+    int ok = !wal.failed;
+    pthread_mutex_unlock(&wal.lock);
+    return ok;
+}
+
+/* ---- records ---- */
+
+/* Set answer bit i of a growable bit array of *cap bytes */
+static int set_bit(uint8_t **bits, size_t *cap, int i, int yes) {
+    if ((size_t)i / 8 >= *cap) {
+        size_t grown = *cap * 2;
+        uint8_t *p = realloc(*bits, grown);
+        if (p == NULL) return 0;
+        memset(p + *cap, 0, grown - *cap);
+        *bits = p;
+        *cap = grown;
+    }
+    if (yes) {
+        (*bits)[i / 8] |= (uint8_t)(1u << (i % 8));
+    } else {
+        (*bits)[i / 8] &= (uint8_t)~(1u << (i % 8));
+    }
+    return 1;
+}
+
+/* Path from the root to the yes/no slot of parent (NULL: the root slot),
+ * as answer bits in *bits (freed by the caller). Nodes do not know their
+ * parents, so parent is found by a depth-first search that keeps the
+ * answers to the node it is on; only undo and redo of a split deeper than
+ * EDIT_PATH_MAX need it. Returns the
+ * depth, or -1 if parent is not in the tree.
+ */
+static int wal_slot_path(Node *parent, int side, uint8_t **bits) {
+    typedef struct { Node *node; int depth; int answer; } Step;
+    size_t bitCap = 8;
+    int cap = 64, top = 0, found = -1;
+    *bits = calloc(bitCap, 1);
+    Step *stack = malloc(cap * sizeof(Step));
+    if (*bits == NULL || stack == NULL) {
+        goto path_done;
+    }
+    if (parent == NULL) {
+        found = 0;
+        goto path_done;
+    }
+    if (g_root != NULL) {
+        stack[top++] = (Step){g_root, 0, 0};
+    }
+    while (top > 0) {
+        Step s = stack[--top];
+        // Preorder: bits below s.depth still hold the way to s.node
+        if (s.depth > 0 && !set_bit(bits, &bitCap, s.depth - 1, s.answer)) {
+            break;
+        }
+        if (s.node == parent) {
+            if (set_bit(bits, &bitCap, s.depth, side)) {
+                found = s.depth + 1;
+            }
+            break;
+        }
+        if (!s.node->isQuestion) {
+            continue;
+        }
+        if (top + 2 > cap) {
+            cap *= 2;
+            Step *grown = realloc(stack, cap * sizeof(Step));
+            if (grown == NULL) break;
+            stack = grown;
+        }
+        stack[top++] = (Step){s.node->no, s.depth + 1, 0};
+        stack[top++] = (Step){s.node->yes, s.depth + 1, 1};
+    }
+path_done:
+    free(stack);
+    return found;
+}
+
+static void wal_checkpoint_check(int block);
+
+/* Append one record. When the log has grown past WAL_CHECKPOINT_BYTES it
+ * is folded into a new snapshot in the background.
+ */
+static void wal_append(int type, const uint8_t *bits, uint32_t depth, uint8_t flag,
+                       const char *animal, const char *question) {
+    uint32_t pathLen = (depth + 7) / 8;
+    uint32_t alen = animal ? (uint32_t)strlen(animal) : 0;
+    uint32_t qlen = question ? (uint32_t)strlen(question) : 0;
+    int texts = type == WAL_SPLIT || type == WAL_ANSWER;
+    size_t body = 1 + 4 + pathLen + 1 + (texts ? 8 + alen + qlen : 0);
+    if (body > WAL_MAX_RECORD) {
+        wal_checkpoint();  // too big to log: fold instead
+        return;
+    }
+    char *rec = malloc(8 + body);
+    if (rec == NULL) {
+        wal_checkpoint();
+        return;
+    }
+    char *p = rec + 8;
+    *p++ = (char)type;
+    memcpy(p, &depth, 4);
+    p += 4;
+    if (pathLen > 0) {
+        memcpy(p, bits, pathLen);
+        p += pathLen;
+    }
+    *p++ = (char)flag;
+    if (texts) {
+        memcpy(p, &alen, 4);
+        memcpy(p + 4, animal, alen);
+        p += 4 + alen;
+        memcpy(p, &qlen, 4);
+        memcpy(p + 4, question, qlen);
+    }
+    uint32_t len32 = (uint32_t)body;
+    uint32_t crc = crc32c(0, rec + 8, body);
+    memcpy(rec, &len32, 4);
+    memcpy(rec + 4, &crc, 4);
+
+    pthread_mutex_lock(&wal.lock);
+    if (wal.used + 8 + body > wal.cap) {
+        size_t cap = wal.cap ? wal.cap : 4096;
+        while (cap < wal.used + 8 + body) cap *= 2;
+        char *grown = realloc(wal.buf, cap);
+        if (grown == NULL) {
+            pthread_mutex_unlock(&wal.lock);
+            free(rec);
+            wal_checkpoint();
+            return;
+        }
+        wal.buf = grown;
+        wal.cap = cap;
+    }
+    memcpy(wal.buf + wal.used, rec, 8 + body);
+    wal.used += 8 + body;
+    wal.appended += 8 + body;
+    wal.logBytes += 8 + body;
+    pthread_cond_signal(&wal.wake);
+    uint64_t size = wal.logBytes;
+    pthread_mutex_unlock(&wal.lock);
+    free(rec);
+
+    wal_checkpoint_check(0);
+    if (size > WAL_CHECKPOINT_BYTES) {
+        wal_checkpoint_start();
+    }
+}
+
+static int wal_active(void) {
+    return wal.fd >= 0 && !wal.replaying;
+}
+
+/* A lesson split the leaf at the end of path (depth answered questions) */
+void wal_log_split(const Frame *path, int depth, int newYes, const char *animal,
+                   const char *question) {
+    if (!wal_active()) {
+        return;
+    }
+    uint8_t *bits = calloc((size_t)(depth + 7) / 8 + 1, 1);
+    if (bits == NULL) {
+        wal_checkpoint();
+        return;
+    }
+    for (int i = 0; i < depth; i++) {
+        bits[i / 8] |= (uint8_t)((path[i].answeredYes ? 1 : 0) << (i % 8));
+    }
+    wal_append(WAL_SPLIT, bits, (uint32_t)depth, (uint8_t)(newYes != 0), animal, question);
+    free(bits);
+}
+
+/* Undo (undone != 0) or redo of edit e, already applied to g_root */
+void wal_log_edit(const Edit *e, int undone) {
+    if (!wal_active()) {
+        return;
+    }
+    if (e->type == EDIT_REBUILD) {
+        wal_log_rebuild();  // a whole new tree: the snapshot is the record
+        return;
+    }
+    // The edit keeps the path the lesson took unless it was too deep
+    uint8_t *bits = NULL;
+    const uint8_t *path = e->path;
+    int depth = e->depth;
+    if (depth > EDIT_PATH_MAX) {
+        depth = wal_slot_path(e->parent, e->wasYesChild, &bits);
+        path = bits;
+    }
+    if (depth < 0) {
+        free(bits);
+        wal_checkpoint();
+        return;
+    }
+    int newYes = e->newQuestion->yes == e->newLeaf;
+    if (undone) {
+        wal_append(WAL_UNSPLIT, path, (uint32_t)depth, (uint8_t)!newYes, NULL, NULL);
+    } else {
+        wal_append(WAL_SPLIT, path, (uint32_t)depth, (uint8_t)newYes,
+                   e->newLeaf->text, e->newQuestion->text);
+    }
+    free(bits);
+}
+
+/* An optimizer rebuild replaced the whole tree: mark the log and fold it
+ * into a snapshot in the background
+ */
+void wal_log_rebuild(void) {
+    if (!wal_active()) {
+        return;
+    }
+    wal.rebuilt = 1;
+    wal_append(WAL_REBUILD, NULL, 0, 0, NULL, NULL);
+    wal_checkpoint_start();  // or, if one is running, once it is done
+}
+
+/* An answer was recorded in g_answers (see learn_answer) */
+void wal_log_answer(const char *animal, const char *question, int yes) {
+    if (wal_active()) {
+        wal_append(WAL_ANSWER, NULL, 0, (uint8_t)(yes != 0), animal, question);
+    }
+}
+
+/* ---- replay ---- */
+
+/* Walk depth answers from the root. path receives the questions passed;
+ * returns the node reached, or NULL if the walk leaves the tree.
+ */
+static Node *wal_walk(const uint8_t *bits, uint32_t depth, FrameStack *path) {
+    Node *node = g_root;
+    for (uint32_t i = 0; i < depth && node != NULL; i++) {
+        if (!node->isQuestion) {
+            return NULL;
+        }
+        int yes = (bits[i / 8] >> (i % 8)) & 1;
+        fs_push(path, node, yes);
+        node = yes ? node->yes : node->no;
+    }
+    return node;
+}
+
+/* Copy out the animal and question that end a record at [p, end). Both
+ * are set, NULL where missing; returns 1 if both were read.
+ */
+static int wal_strings(const char *p, const char *end, char **animal, char **question) {
+    uint32_t alen, qlen;
+    *animal = *question = NULL;
+    if (end - p < 4) return 0;
+    memcpy(&alen, p, 4);
+    if ((uint32_t)(end - p - 4) < alen + 4) return 0;
+    *animal = strndup(p + 4, alen);
+    p += 4 + alen;
+    memcpy(&qlen, p, 4);
+    *question = (uint32_t)(end - p - 4) >= qlen ? strndup(p + 4, qlen) : NULL;
+    return *animal != NULL && *question != NULL;
+}
+
+/* Apply one record to g_root. Returns 0 if it does not fit the tree. */
+static int wal_apply(const char *rec, uint32_t len) {
+    uint32_t depth;
+    if (len < 6) return 0;
+    int type = (uint8_t)rec[0];
+    memcpy(&depth, rec + 1, 4);
+    uint32_t pathLen = (depth + 7) / 8;
+    if (pathLen > len - 6) return 0;
+    const uint8_t *bits = (const uint8_t *)rec + 5;
+    const char *p = rec + 5 + pathLen;
+    const char *end = rec + len;
+    int flag = (uint8_t)*p++;
+
+    FrameStack path;
+    fs_init(&path);
+    Node *node = wal_walk(bits, depth, &path);
+    int ok = 0;
+    Frame top = {NULL, -1};
+    if (path.size > 0) {
+        top = path.frames[path.size - 1];
+    }
+
+    if (type == WAL_ANSWER && depth == 0) {
+        char *animal, *question;
+        if (wal_strings(p, end, &animal, &question)) {
+            ok = learn_answer(animal, question, flag);
+        }
+        free(animal);
+        free(question);
+    } else if (type == WAL_SPLIT && node != NULL && !node->isQuestion) {
+        char *animal, *question;
+        if (wal_strings(p, end, &animal, &question)) {
+            // A redo of the last undo puts the same nodes back
+            const Edit *r = g_redo.size > 0 ? &g_redo.edits[g_redo.size - 1] : NULL;
+            if (r != NULL && r->type == EDIT_INSERT_SPLIT && r->oldLeaf == node &&
+                r->parent == top.node && (r->newQuestion->yes == r->newLeaf) == flag &&
+                strcmp(r->newLeaf->text, animal) == 0 &&
+                strcmp(r->newQuestion->text, question) == 0) {
+                ok = redo_last_edit();
+            } else {
+                ok = learn_split(&path, node, animal, question, flag, NULL);
+            }
+        }
+        free(animal);
+        free(question);
+    } else if (type == WAL_UNSPLIT && node != NULL && node->isQuestion) {
+        Node *keep = flag ? node->yes : node->no;
+        Node *gone = flag ? node->no : node->yes;
+        const Edit *u = g_undo.size > 0 ? &g_undo.edits[g_undo.size - 1] : NULL;
+        if (u != NULL && u->type == EDIT_INSERT_SPLIT && u->newQuestion == node) {
+            ok = undo_last_edit();
+        } else if (!keep->isQuestion && !gone->isQuestion) {
+            // The split predates the snapshot, so no undo record is left for it
+            discard_redo();
+            if (top.node == NULL) {
+                tree_publish(&g_root, keep);
+            } else {
+                tree_publish(top.answeredYes ? &top.node->yes : &top.node->no, keep);
+            }
+            epoch_retire(node, &g_arena);
+            epoch_retire(gone, &g_arena);
+            ai_build(&g_index, g_root);
+            stats_recount(&g_stats, g_root);
+            ok = 1;
+        }
+    }
+    fs_free(&path);
+    return ok;
+}
+
+char *path_with(const char *path, const char *suffix) {
+    size_t n = strlen(path), m = strlen(suffix);
+    char *s = malloc(n + m + 1);
+    if (s != NULL) {
+        memcpy(s, path, n);
+        memcpy(s + n, suffix, m + 1);
+    }
+    return s;
+}
+
+/* Length of the valid prefix of a log image: every complete record with a
+ * matching checksum from where the snapshot tagged tag left off. Records
+ * are applied as they are checked if apply is nonzero. Returns 0 if the
+ * log does not belong to the snapshot.
+ */
+static size_t wal_scan(const char *img, size_t len, const SnapshotTag *tag, int apply,
+                       int *applied) {
+    uint64_t fileTag;
+    if (len < WAL_HEADER || memcmp(img, WAL_MAGIC, 8) != 0) {
+        return 0;
+    }
+    memcpy(&fileTag, img + 8, 8);
+    size_t pos;
+    if (tag->tag != 0 && fileTag == tag->tag) {
+        pos = WAL_HEADER;
+    } else if (tag->base != 0 && fileTag == tag->base &&
+               tag->baseLen >= WAL_HEADER && tag->baseLen <= len) {
+        pos = (size_t)tag->baseLen;  // the checkpoint finished, the log switch did not
+    } else {
+        return 0;
+    }
+    while (len - pos >= 8) {
+        uint32_t rlen, crc;
+        memcpy(&rlen, img + pos, 4);
+        memcpy(&crc, img + pos + 4, 4);
+        if (rlen > WAL_MAX_RECORD || rlen > len - pos - 8 ||
+            crc32c(0, img + pos + 8, rlen) != crc) {
+            break;  // torn or corrupt tail
+        }
+        if (rlen > 0 && (uint8_t)img[pos + 8] == WAL_REBUILD) {
+            // The rest was logged against a tree no snapshot holds
+            if (apply) {
+                fprintf(stderr, "[wal_replay] A rebuild at offset %zu was never saved\n", pos);
+            }
+            break;
+        }
+        if (apply) {
+            if (!wal_apply(img + pos + 8, rlen)) {
+                fprintf(stderr, "[wal_replay] Record at offset %zu does not fit the tree\n", pos);
+                break;
+            }
+            (*applied)++;
+        }
+        pos += 8 + rlen;
+    }
+    return pos;
+}
+
+/* Read a whole file; NULL if it does not exist or cannot be read */
+static char *read_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    char *img = NULL;
+    if (fstat(fd, &st) == 0 && (img = malloc((size_t)st.st_size + 1)) != NULL) {
+        size_t got = 0;
+        while (got < (size_t)st.st_size) {
+            ssize_t n = read(fd, img + got, (size_t)st.st_size - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        *len = got;
+    }
+    close(fd);
+    return img;
+}
+
+/* Apply <snapshot>.wal to the tree just loaded from snapshot. A missing
+ * log, or one written against another snapshot, applies nothing. Returns
+ * the number of records applied.
+ */
+int wal_replay(const char *snapshot) {
+    char *logPath = path_with(snapshot, ".wal");
+    size_t len = 0;
+    char *img = logPath != NULL ? read_file(logPath, &len) : NULL;
+    int applied = 0;
+    if (img != NULL) {
+        wal.replaying = 1;
+        wal_scan(img, len, &g_treeTag, 1, &applied);
+        wal.replaying = 0;
+    }
+    free(img);
+    free(logPath);
+    return applied;
+}
+
+/* ---- lifetime ---- */
+
+/* Write a new log for tag holding tail, at logPath (via a temporary file) */
+static int wal_create(const char *logPath, uint64_t tag, const char *tail, size_t tailLen) {
+    char *tmp = path_with(logPath, ".tmp");
+    if (tmp == NULL) {
+        return 0;
+    }
+    char header[WAL_HEADER];
+    memcpy(header, WAL_MAGIC, 8);
+    memcpy(header + 8, &tag, 8);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && write_all(fd, header, WAL_HEADER) &&
+             write_all(fd, tail, tailLen) && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    ok = ok && rename(tmp, logPath) == 0 && fsync_parent(logPath);
+    if (!ok) {
+        perror("[wal] Failed to create the log");
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+static uint64_t file_bytes(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+static uint64_t new_tag(void) {
+    static uint64_t counter;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t x = (uint64_t)ts.tv_sec * 1000000007ull ^ (uint64_t)ts.tv_nsec ^
+                 ((uint64_t)getpid() << 32) ^ ++counter;
+    // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x ? x : 1;
+}
+
+/* The pending snapshot is on disk: move the records logged since it was
+ * taken into a new log under its tag.
+ */
+static int wal_switch(void) {
+    wal_sync();
+    uint64_t from = wal.pending.baseLen;
+    size_t tailLen = (size_t)(wal.logBytes - from);
+    char *tail = malloc(tailLen + 1);
+    int fd = open(wal.logPath, O_RDONLY | O_CLOEXEC);
+    int ok = tail != NULL && fd >= 0 &&
+             pread(fd, tail, tailLen, (off_t)from) == (ssize_t)tailLen;
+    if (fd >= 0) close(fd);
+    ok = ok && wal_create(wal.logPath, wal.pending.tag, tail, tailLen);
+    free(tail);
+    fd = ok ? open(wal.logPath, O_WRONLY | O_APPEND | O_CLOEXEC) : -1;
+    if (fd < 0) {
+        // The old log still matches the new snapshot from its offset on
+        perror("[wal_checkpoint] Failed to start a new log");
+        return 0;
+    }
+    pthread_mutex_lock(&wal.lock);
+    close(wal.fd);
+    wal.fd = fd;
+    wal.logBytes = WAL_HEADER + tailLen;
+    wal.logTag = wal.pending.tag;
+    pthread_mutex_unlock(&wal.lock);
+    g_treeTag = wal.pending;
+    wal.snapshotBytes = file_bytes(wal.snapshot);
+    return 1;
+}
+
+/* Finish a checkpoint whose child has exited (or wait for it if block) */
+static void wal_checkpoint_check(int block) {
+    if (!wal.checkpointing) {
+        return;
+    }
+    SaveState st = block ? save_tree_wait() : save_tree_poll(&wal.percent);
+    if (st == SAVE_RUNNING) {
+        return;
+    }
+    wal.checkpointing = 0;
+    if (st == SAVE_DONE && !wal_switch()) {
+        st = SAVE_FAILED;
+    } else if (st != SAVE_DONE) {
+        fprintf(stderr, "[wal_checkpoint] Failed to write %s\n", wal.snapshot);
+        st = SAVE_FAILED;
+    }
+    wal.result = st;
+    if (st == SAVE_FAILED) {
+        wal.rebuilt |= wal.folding;
+    } else if (wal.rebuilt) {
+        // A rebuild logged while this snapshot was written needs its own
+        wal_checkpoint_start();
+    }
+    wal.folding = wal.checkpointing && wal.folding;
+}
+
+/* Start folding the log into a new snapshot in the background (see
+ * save_tree_start); edits go on being logged meanwhile. Writer only.
+ * Returns 1 if a checkpoint is now running.
+ */
+int wal_checkpoint_start(void) {
+    if (wal.fd < 0 || g_root == NULL) {
+        return 0;
+    }
+    if (wal.checkpointing) {
+        return 1;
+    }
+    wal_sync();
+    SnapshotTag current = g_treeTag;
+    SnapshotTag next = {new_tag(), wal.logTag, wal.logBytes};
+    // The child saves the tree under its new tag
+    g_treeTag = next;
+    int started = save_tree_start(wal.snapshot);
+    g_treeTag = current;
+    if (!started) {
+        return 0;
+    }
+    wal.pending = next;
+    wal.folding = wal.rebuilt;
+    wal.rebuilt = 0;
+    wal.checkpointing = 1;
+    wal.percent = 0;
+    wal.result = SAVE_IDLE;
+    return 1;
+}
+
+/* Progress of the background checkpoint: SAVE_RUNNING with *percent (if
+ * not NULL) of the snapshot written, then SAVE_DONE or SAVE_FAILED once,
+ * then SAVE_IDLE. Writer only.
+ */
+SaveState wal_checkpoint_poll(int *percent) {
+    wal_checkpoint_check(0);
+    SaveState st = wal.checkpointing ? SAVE_RUNNING : wal.result;
+    if (percent != NULL) {
+        *percent = st == SAVE_RUNNING ? wal.percent : st == SAVE_DONE ? 100 : 0;
+    }
+    if (st != SAVE_RUNNING) {
+        wal.result = SAVE_IDLE;
+    }
+    return st;
+}
+
+/* Wait for a running checkpoint, and for the one it starts if a rebuild
+ * was logged meanwhile. Returns 0 if it failed.
+ */
+int wal_checkpoint_wait(void) {
+    while (wal.checkpointing) {
+        wal_checkpoint_check(1);
+    }
+    SaveState st = wal.result;
+    wal.result = SAVE_IDLE;
+    return st != SAVE_FAILED;
+}
+
+/* Fold the log into a new snapshot of g_root and wait until it is on
+ * disk. Writer only. Returns 1 on success.
+ */
+int wal_checkpoint(void) {
+    if (wal.fd < 0) {
+        return 0;
+    }
+    wal_checkpoint_wait();  // it was started before the latest edits
+    return wal_checkpoint_start() && wal_checkpoint_wait();
+}
+
+/* Wait until every rebuild logged is in a snapshot on disk, since the log
+ * cannot replay one. Returns 1 on success.
+ */
+static int wal_fold_rebuilds(void) {
+    if (!wal.rebuilt && !wal.folding) {
+        return 1;
+    }
+    wal_checkpoint_wait();
+    return !wal.rebuilt || wal_checkpoint();
+}
+
+/* Save the edits made since the last save without rewriting the snapshot.
+ * The log already holds exactly the nodes each lesson, undo and redo
+ * changed, so this is at most one fdatasync (plus waiting for the
+ * snapshot of a rebuild that is still being written). Once the log passes
+ * a quarter of the snapshot it is folded into a new one in the background,
+ * which bounds the disk it takes and the replay on load. Writer only.
+ * Returns 1 when every edit logged so far is on disk.
+ */
+int wal_save(void) {
+    if (wal.fd < 0) {
+        return 0;
+    }
+    int ok = wal_sync() && wal_fold_rebuilds();
+    wal_checkpoint_check(0);
+    uint64_t logged = wal_size() - WAL_HEADER;
+    if (ok && logged > WAL_COMPACT_MIN && logged > wal.snapshotBytes / WAL_COMPACT_SHARE) {
+        wal_checkpoint_start();
+    }
+    return ok;
+}
+
+/* Start logging edits of g_root against snapshot. If snapshot is the file
+ * g_root was loaded from and its log matches, appending continues after
+ * the last valid record; otherwise a new log is started and a checkpoint
+ * writes snapshot in the background. Returns 1 on success.
+ */
+int wal_open(const char *snapshot) {
+    if (wal.fd >= 0) {
+        wal_close();
+    }
+    wal.snapshot = strdup(snapshot);
+    wal.logPath = path_with(snapshot, ".wal");
+    if (wal.snapshot == NULL || wal.logPath == NULL) {
+        goto open_error;
+    }
+    size_t len = 0, valid = 0;
+    int fresh = 0;
+    char *img = read_file(wal.logPath, &len);
+    if (img != NULL) {
+        valid = wal_scan(img, len, &g_treeTag, 0, NULL);
+        if (valid > 0) {
+            memcpy(&wal.logTag, img + 8, 8);
+        }
+    }
+    free(img);
+    if (valid == 0) {
+        // No usable log: it only counts once the snapshot is written
+        if (g_root == NULL || !wal_create(wal.logPath, 0, NULL, 0)) {
+            goto open_error;
+        }
+        wal.logTag = 0;
+        valid = WAL_HEADER;
+        fresh = 1;
+    } else if (truncate(wal.logPath, (off_t)valid) != 0) {
+        goto open_error;  // cut off a torn tail
+    }
+    wal.fd = open(wal.logPath, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (wal.fd < 0) {
+        goto open_error;
+    }
+    pthread_mutex_init(&wal.lock, NULL);
+    pthread_cond_init(&wal.wake, NULL);
+    pthread_cond_init(&wal.done, NULL);
+    wal.used = 0;
+    wal.appended = wal.durable = 0;
+    wal.logBytes = valid;
+    wal.snapshotBytes = fresh ? 0 : file_bytes(wal.snapshot);
+    wal.failed = 0;
+    wal.stop = 0;
+    if (pthread_create(&wal.flusher, NULL, wal_flusher, NULL) != 0) {
+        close(wal.fd);
+        wal.fd = -1;
+        goto open_error;
+    }
+    wal.checkpointing = 0;
+    wal.folding = wal.rebuilt = 0;
+    wal.result = SAVE_IDLE;
+    if (fresh && !wal_checkpoint_start()) {
+        wal_close();
+        return 0;
+    }
+    return 1;
+
+open_error:
+    perror("[wal_open] Could not open the log");
+    free(wal.snapshot);
+    free(wal.logPath);
+    wal.snapshot = wal.logPath = NULL;
+    return 0;
+}
+
+/* Flush outstanding records, finish a running checkpoint and stop
+ * logging
+ */
+void wal_close(void) {
+    if (wal.fd < 0) {
+        return;
+    }
+    wal_fold_rebuilds();
+    wal_checkpoint_wait();
+    wal_sync();
+    pthread_mutex_lock(&wal.lock);
+    wal.stop = 1;
+    pthread_cond_signal(&wal.wake);
+    pthread_mutex_unlock(&wal.lock);
+    pthread_join(wal.flusher, NULL);
+    close(wal.fd);
+    wal.fd = -1;
+    free(wal.buf);
+    wal.buf = NULL;
+    wal.cap = wal.used = 0;
+    free(wal.snapshot);
+    free(wal.logPath);
+    wal.snapshot = wal.logPath = NULL;
+    pthread_mutex_destroy(&wal.lock);
+    pthread_cond_destroy(&wal.wake);
+    pthread_cond_destroy(&wal.done);
+}
+
+/* Size of the open log in bytes (0 when not logging) */
+uint64_t wal_size(void) {
+    if (wal.fd < 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&wal.lock);
+    uint64_t n = wal.logBytes;
+    pthread_mutex_unlock(&wal.lock);
+    return n;
+}